@@ -0,0 +1,345 @@
+#include "stdafx.h"
+#include "AnalysisServer.h"
+#include "Uci.h"
+#include <sstream>
+
+#pragma comment(lib, "Ws2_32.lib")
+
+namespace
+{
+	// Lines longer than this, with no newline, are a client gone wrong
+	const size_t MaxLineLength = 1 << 16;
+}
+
+AnalysisServer::AnalysisServer(AnalysisPool& pool)
+	: m_pool(pool)
+	, m_listener(INVALID_SOCKET)
+	, m_stopping(false)
+{
+}
+
+bool AnalysisServer::Run(unsigned short port)
+{
+	WSADATA data;
+	if (::WSAStartup(MAKEWORD(2, 2), &data) != 0)
+	{
+		return false;
+	}
+
+	m_listener = ::socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+	sockaddr_in address = {};
+	address.sin_family = AF_INET;
+	address.sin_port = htons(port);
+	address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	if (m_listener == INVALID_SOCKET
+		|| ::bind(m_listener, reinterpret_cast<sockaddr*>(&address), sizeof(address)) == SOCKET_ERROR
+		|| ::listen(m_listener, SOMAXCONN) == SOCKET_ERROR)
+	{
+		if (m_listener != INVALID_SOCKET)
+		{
+			::closesocket(m_listener);
+		}
+		::WSACleanup();
+		return false;
+	}
+
+	for (;;)
+	{
+		const SOCKET client = ::accept(m_listener, nullptr, nullptr);
+		if (client == INVALID_SOCKET)
+		{
+			// Closed by "shutdown", or something that won't get better
+			break;
+		}
+
+		auto connection = std::make_shared<Connection>(client);
+		std::lock_guard<std::mutex> lock(m_connectionLock);
+
+		// Clients come and go, so tidy up after the ones that have gone
+		for (size_t i = 0; i < m_connections.size();)
+		{
+			if (m_connections[i]->Finished)
+			{
+				m_threads[i].join();
+				::closesocket(m_connections[i]->Socket);
+				m_connections.erase(m_connections.begin() + i);
+				m_threads.erase(m_threads.begin() + i);
+			}
+			else
+			{
+				++i;
+			}
+		}
+
+		m_connections.push_back(connection);
+		m_threads.push_back(std::thread([this, connection] { Serve(connection); }));
+	}
+
+	// Wake the connections still reading so their threads finish
+	Stop();
+	{
+		std::lock_guard<std::mutex> lock(m_connectionLock);
+		for (auto& connection : m_connections)
+		{
+			::shutdown(connection->Socket, SD_BOTH);
+		}
+	}
+	for (auto& thread : m_threads)
+	{
+		thread.join();
+	}
+
+	// Results still to come have nowhere to go
+	m_pool.WaitUntilIdle();
+	for (auto& connection : m_connections)
+	{
+		::closesocket(connection->Socket);
+	}
+	::WSACleanup();
+	return true;
+}
+
+void AnalysisServer::Stop()
+{
+	if (!m_stopping.exchange(true))
+	{
+		::closesocket(m_listener);
+	}
+}
+
+void AnalysisServer::Serve(std::shared_ptr<Connection> connection)
+{
+	std::string buffer;
+	char chunk[4096];
+	bool quit = false;
+
+	// The header of an "analyze" request while its positions are read
+	std::string analyze;
+	std::vector<std::string> fens;
+
+	while (!quit)
+	{
+		const int received = ::recv(connection->Socket, chunk, sizeof(chunk), 0);
+		if (received <= 0)
+		{
+			break;
+		}
+		buffer.append(chunk, received);
+
+		size_t start = 0;
+		for (size_t end; !quit && (end = buffer.find('\n', start)) != std::string::npos; start = end + 1)
+		{
+			auto line = buffer.substr(start, end - start);
+			if (!line.empty() && line.back() == '\r')
+			{
+				line.pop_back();
+			}
+
+			if (!analyze.empty())
+			{
+				if (line == "end")
+				{
+					std::istringstream args(analyze);
+					Analyze(connection, args, fens);
+					analyze.clear();
+					fens.clear();
+				}
+				else if (!line.empty())
+				{
+					fens.push_back(line);
+				}
+				continue;
+			}
+
+			std::istringstream args(line);
+			std::string command;
+			args >> command;
+			if (command == "analyze")
+			{
+				analyze = line;
+			}
+			else if (command == "cancel")
+			{
+				std::string id;
+				args >> id;
+				std::lock_guard<std::mutex> lock(connection->RequestLock);
+				auto found = connection->Requests.find(id);
+				if (found != connection->Requests.end())
+				{
+					m_pool.Cancel(found->second);
+				}
+			}
+			else if (command == "status")
+			{
+				Send(*connection, "status workers " + std::to_string(m_pool.WorkerCount()) + " queued " + std::to_string(m_pool.Queued()));
+			}
+			else if (command == "quit")
+			{
+				quit = true;
+			}
+			else if (command == "shutdown")
+			{
+				quit = true;
+				Stop();
+			}
+			else if (!command.empty())
+			{
+				Send(*connection, "error unknown command " + command);
+			}
+		}
+		buffer.erase(0, start);
+
+		if (buffer.size() > MaxLineLength)
+		{
+			Send(*connection, "error line too long");
+			break;
+		}
+	}
+
+	// Nobody is left to read the results
+	connection->Closed = true;
+	std::lock_guard<std::mutex> lock(connection->RequestLock);
+	for (auto& request : connection->Requests)
+	{
+		m_pool.Cancel(request.second);
+	}
+	::shutdown(connection->Socket, SD_BOTH);
+	connection->Finished = true;
+}
+
+// analyze <id> [depth n] [nodes n] [movetime ms] [multipv n] [priority n] [table shared|private]
+void AnalysisServer::Analyze(std::shared_ptr<Connection> connection, std::istringstream& args, const std::vector<std::string>& fens)
+{
+	std::string command, id, token;
+	args >> command >> id;
+	if (id.empty())
+	{
+		Send(*connection, "error analyze needs an id");
+		return;
+	}
+
+	AnalysisRequest request;
+	while (args >> token)
+	{
+		std::string value;
+		if (!(args >> value))
+		{
+			Send(*connection, "error " + id + " " + token + " needs a value");
+			return;
+		}
+
+		if (token == "depth") request.Limits.Depth = atoi(value.c_str());
+		else if (token == "nodes") request.Limits.Nodes = strtoull(value.c_str(), nullptr, 10);
+		else if (token == "movetime") request.Limits.MoveTime = strtoul(value.c_str(), nullptr, 10);
+		else if (token == "multipv")
+		{
+			const int lines = atoi(value.c_str());
+			request.MultiPv = lines > MaxMultiPv ? MaxMultiPv : lines;
+		}
+		else if (token == "priority") request.Priority = atoi(value.c_str());
+		else if (token == "table" && (value == "shared" || value == "private"))
+		{
+			request.SharedTable = value == "shared";
+		}
+		else
+		{
+			Send(*connection, "error " + id + " unknown option " + token + " " + value);
+			return;
+		}
+	}
+
+	for (auto& fen : fens)
+	{
+		try
+		{
+			request.Positions.push_back(BoardState::FromFen(fen.c_str()));
+		}
+		catch (...)
+		{
+			Send(*connection, "error " + id + " can't read " + fen);
+			return;
+		}
+	}
+
+	// The callbacks hold on to the connection, as results can arrive after
+	// it has gone
+	auto positions = std::make_shared<std::vector<BoardState>>(request.Positions);
+	std::lock_guard<std::mutex> lock(connection->RequestLock);
+	if (connection->Requests.count(id))
+	{
+		Send(*connection, "error " + id + " is already running");
+		return;
+	}
+
+	Send(*connection, "accepted " + id + " " + std::to_string(fens.size()));
+	if (fens.empty())
+	{
+		Send(*connection, "done " + id);
+		return;
+	}
+
+	const int multiPv = request.MultiPv;
+	connection->Requests[id] = m_pool.Submit(request, [connection, id, positions, multiPv](const AnalysisResult& result)
+	{
+		const auto& board = (*positions)[result.Index];
+		if (multiPv > 1)
+		{
+			for (auto& line : result.Lines)
+			{
+				std::ostringstream text;
+				text << "line " << id << " " << result.Index
+					<< " multipv " << line.MultiPv
+					<< " depth " << line.Depth
+					<< " score " << UciEngine::ScoreToString(board, line.Score)
+					<< " pv " << UciEngine::LineToString(board, line.Pv);
+				Send(*connection, text.str());
+			}
+		}
+		SendResult(*connection, id, board, result);
+
+		if (result.Last)
+		{
+			Send(*connection, "done " + id);
+			std::lock_guard<std::mutex> lock(connection->RequestLock);
+			connection->Requests.erase(id);
+		}
+	});
+}
+
+void AnalysisServer::SendResult(Connection& connection, const std::string& id, const BoardState& board, const AnalysisResult& result)
+{
+	std::ostringstream text;
+	text << "result " << id << " " << result.Index
+		<< " bestmove " << UciEngine::MoveToString(board, result.BestMove)
+		<< " score " << UciEngine::ScoreToString(board, result.Score)
+		<< " depth " << (result.Lines.empty() ? 0 : result.Lines[0].Depth)
+		<< " nodes " << result.Nodes
+		<< " time " << result.Time;
+	if (result.Cancelled)
+	{
+		text << " cancelled";
+	}
+	text << " pv " << UciEngine::LineToString(board, result.Lines.empty() ? std::vector<ChessMove>() : result.Lines[0].Pv);
+	Send(connection, text.str());
+}
+
+void AnalysisServer::Send(Connection& connection, const std::string& line)
+{
+	if (connection.Closed)
+	{
+		return;
+	}
+
+	std::lock_guard<std::mutex> lock(connection.SendLock);
+	const auto text = line + "\n";
+	for (size_t sent = 0; sent < text.size();)
+	{
+		const int count = ::send(connection.Socket, text.data() + sent, static_cast<int>(text.size() - sent), 0);
+		if (count <= 0)
+		{
+			connection.Closed = true;
+			return;
+		}
+		sent += count;
+	}
+}
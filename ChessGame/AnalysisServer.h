@@ -0,0 +1,77 @@
+#pragma once
+
+#include "AnalysisPool.h"
+#include <atomic>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+// Serves analysis over TCP on the loopback address, so a long-running
+// engine can take positions from many clients without a process for each.
+// Every connection's requests go to the same AnalysisPool.  The protocol is
+// lines of text, and replies for different requests may be interleaved:
+//
+//   analyze <id> [depth n] [nodes n] [movetime ms] [multipv n] [priority n] [table shared|private]
+//   <fen>
+//   ...
+//   end
+//       Queues the positions, each searched with the limits given, ahead
+//       of requests with a lower priority (0 by default).  The id
+//       is the client's, and is used in the replies:
+//
+//       accepted <id> <positions>
+//       line <id> <index> multipv <k> depth <d> score cp|mate <x> pv <moves>   (with multipv > 1)
+//       result <id> <index> bestmove <move> score cp|mate <x> depth <d> nodes <n> time <ms> [cancelled] pv <moves>
+//       done <id>
+//
+//   cancel <id>     stop the request's searches, its results still follow
+//   status          reply "status workers <n> queued <positions>"
+//   quit            close this connection, cancelling what it asked for
+//   shutdown        stop the server
+//
+// Anything that can't be read gets "error <message>".
+class AnalysisServer
+{
+public:
+	explicit AnalysisServer(AnalysisPool& pool);
+
+	// Listens on 127.0.0.1 until a client sends "shutdown".  False if the
+	// port can't be listened on.
+	bool Run(unsigned short port);
+
+private:
+	struct Connection
+	{
+		Connection(SOCKET socket)
+			: Socket(socket)
+			, Closed(false)
+			, Finished(false)
+		{}
+
+		SOCKET Socket;
+		std::mutex SendLock;
+		std::atomic<bool> Closed;		// nothing more is sent
+		std::atomic<bool> Finished;		// its thread is done with it
+
+		// Client's ids to the pool's, for requests still running
+		std::mutex RequestLock;
+		std::map<std::string, int> Requests;
+	};
+
+	void Serve(std::shared_ptr<Connection> connection);
+	void Analyze(std::shared_ptr<Connection> connection, std::istringstream& args, const std::vector<std::string>& fens);
+	static void SendResult(Connection& connection, const std::string& id, const BoardState& board, const AnalysisResult& result);
+	static void Send(Connection& connection, const std::string& line);
+	void Stop();
+
+	AnalysisPool& m_pool;
+	SOCKET m_listener;
+	std::atomic<bool> m_stopping;
+
+	std::mutex m_connectionLock;
+	std::vector<std::shared_ptr<Connection>> m_connections;
+	std::vector<std::thread> m_threads;
+};
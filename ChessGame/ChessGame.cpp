@@ -2,12 +2,833 @@
 //
 
 #include "stdafx.h"
+#include "AnalysisServer.h"
+#include "Evaluation.h"
 #include "GameAi.h"
+#include "NnueTrainer.h"
+#include "OpeningBook.h"
+#include "Perft.h"
+#include "SearchScheduler.h"
+#include "SelfPlay.h"
+#include "Tablebase.h"
+#include "TaskPool.h"
+#include "Tuner.h"
+#include "TablebaseGenerator.h"
+#include "Uci.h"
+#include <atomic>
+#include <fstream>
+#include <sstream>
+#include <string>
 
+std::string Narrow(const _TCHAR* str)
+{
+	std::basic_string<_TCHAR> wide(str);
+	return std::string(wide.begin(), wide.end());
+}
 
-int _tmain(int argc, _TCHAR* argv[])
+// ChessGame makebook <games.pgn> <book.bin> [plies]
+int MakeBook(int argc, _TCHAR* argv[])
+{
+	if (argc < 4)
+	{
+		wprintf(L"usage: ChessGame makebook <games.pgn> <book.bin> [plies]\n");
+		return 1;
+	}
+
+	OpeningBookBuilder builder(argc > 4 ? _ttoi(argv[4]) : 24);
+
+	std::ifstream pgn(Narrow(argv[2]));
+	if (!pgn)
+	{
+		wprintf(L"Can't open %s\n", argv[2]);
+		return 1;
+	}
+	builder.AddPgn(pgn);
+
+	if (!builder.Write(Narrow(argv[3]).c_str()))
+	{
+		wprintf(L"Can't write %s\n", argv[3]);
+		return 1;
+	}
+
+	wprintf(L"games:%d positions:%d\n", builder.GameCount(), static_cast<int>(builder.PositionCount()));
+	return 0;
+}
+
+// ChessGame gentb <directory> [material...]
+// Smaller tables are loaded from the directory as they're written, so list
+// them before the tables that need them.
+int GenerateTablebases(int argc, _TCHAR* argv[])
+{
+	if (argc < 3)
+	{
+		wprintf(L"usage: ChessGame gentb <directory> [material...]\n");
+		return 1;
+	}
+
+	const auto directory = Narrow(argv[2]);
+
+	std::vector<std::string> names;
+	for (int i = 3; i < argc; ++i)
+	{
+		names.push_back(Narrow(argv[i]));
+	}
+	if (names.empty())
+	{
+		names = { "KQvK", "KRvK", "KPvK", "KBNvK" };
+	}
+
+	for (auto& name : names)
+	{
+		Tablebases smaller;
+		smaller.Init(directory);
+
+		DWORD start = ::GetTickCount();
+
+		TablebaseGenerator generator(name, &smaller);
+		if (!generator.Generate() || !generator.Write(directory))
+		{
+			wprintf(L"%S: failed, are the smaller tables there?\n", name.c_str());
+			return 1;
+		}
+
+		wprintf(L"%S: win:%d draw:%d loss:%d longest:%d time:%f\n",
+			name.c_str(),
+			static_cast<int>(generator.CountEntries(Wdl::Win)),
+			static_cast<int>(generator.CountEntries(Wdl::Draw)),
+			static_cast<int>(generator.CountEntries(Wdl::Loss)),
+			generator.LongestMate(),
+			(::GetTickCount() - start) / 1000.);
+	}
+	return 0;
+}
+
+// ChessGame selfplay <positions.bin> [-games n] [-threads n] [-depth n] [-nodes n]
+//                    [-random plies] [-seed n] [-tb directory] [-compress]
+int RunSelfPlay(int argc, _TCHAR* argv[])
+{
+	if (argc < 3)
+	{
+		wprintf(L"usage: ChessGame selfplay <positions.bin> [-games n] [-threads n] [-depth n] [-nodes n] [-random plies] [-seed n] [-tb directory] [-compress]\n");
+		return 1;
+	}
+
+	SelfPlayOptions options;
+	Tablebases tablebases;
+	auto compression = TrainingCompression::None;
+	for (int i = 3; i < argc; i += 2)
+	{
+		const auto name = Narrow(argv[i]);
+		if (name == "-compress")
+		{
+			compression = TrainingCompression::Block;
+			--i;
+			continue;
+		}
+		if (i + 1 == argc)
+		{
+			wprintf(L"%S needs a value\n", name.c_str());
+			return 1;
+		}
+		const auto value = Narrow(argv[i + 1]);
+		if (name == "-games") options.Games = atoi(value.c_str());
+		else if (name == "-threads") options.Threads = atoi(value.c_str());
+		else if (name == "-depth") options.Depth = atoi(value.c_str());
+		else if (name == "-nodes") options.Nodes = strtoull(value.c_str(), nullptr, 10);
+		else if (name == "-random") options.RandomPlies = atoi(value.c_str());
+		else if (name == "-seed") options.Seed = static_cast<unsigned>(atoi(value.c_str()));
+		else if (name == "-tb")
+		{
+			tablebases.Init(value);
+			options.EndgameTables = &tablebases;
+		}
+		else
+		{
+			wprintf(L"Unknown option %S\n", name.c_str());
+			return 1;
+		}
+	}
+
+	std::ofstream output(Narrow(argv[2]), std::ios::binary);
+	if (!output)
+	{
+		wprintf(L"Can't write %s\n", argv[2]);
+		return 1;
+	}
+
+	DWORD start = ::GetTickCount();
+
+	TrainingWriter writer(output, 4096, compression);
+	SelfPlay selfPlay(options);
+	const auto stats = selfPlay.Run(writer);
+
+	const double seconds = (::GetTickCount() - start) / 1000.;
+	wprintf(L"games:%d white:%d draw:%d black:%d adjudicated:%d positions:%llu time:%f positions/hour:%.0f\n",
+		stats.Games, stats.WhiteWins, stats.Draws, stats.BlackWins, stats.Adjudicated,
+		stats.Positions, seconds, seconds > 0 ? stats.Positions * 3600. / seconds : 0.);
+	return writer.Flush() ? 0 : 1;
+}
+
+// ChessGame shuffle <in.bin> <out.bin> [seed] [-compress]
+// ChessGame shard <in.bin> <count> <prefix> [seed] [-compress]
+// Either kind of file can be read, output is plain unless -compress is given.
+int RunTrainingTool(int argc, _TCHAR* argv[])
+{
+	const bool shard = _tcscmp(argv[1], _T("shard")) == 0;
+	const int required = shard ? 5 : 4;
+	if (argc < required)
+	{
+		wprintf(shard
+			? L"usage: ChessGame shard <in.bin> <count> <prefix> [seed] [-compress]\n"
+			: L"usage: ChessGame shuffle <in.bin> <out.bin> [seed] [-compress]\n");
+		return 1;
+	}
+
+	unsigned seed = 1;
+	auto compression = TrainingCompression::None;
+	for (int i = required; i < argc; ++i)
+	{
+		if (_tcscmp(argv[i], _T("-compress")) == 0)
+		{
+			compression = TrainingCompression::Block;
+		}
+		else
+		{
+			seed = static_cast<unsigned>(_ttoi(argv[i]));
+		}
+	}
+
+	const auto input = Narrow(argv[2]);
+	bool ok;
+	if (shard)
+	{
+		std::vector<std::string> outputs;
+		for (int i = 0; i < _ttoi(argv[3]); ++i)
+		{
+			outputs.push_back(Narrow(argv[4]) + std::to_string(i) + ".bin");
+		}
+		ok = ShardTrainingFile(input.c_str(), outputs, seed, compression);
+	}
+	else
+	{
+		ok = ShuffleTrainingFile(input.c_str(), Narrow(argv[3]).c_str(), seed, 1 << 24, compression);
+	}
+
+	if (!ok)
+	{
+		wprintf(L"%s failed\n", argv[1]);
+		return 1;
+	}
+	return 0;
+}
+
+// ChessGame tune <positions.bin> <weights.txt> [-epochs n] [-threads n] [-batch n] [-rate r]
+//                [-k k] [-lambda l] [-positions n] [-weights start.txt]
+int RunTuner(int argc, _TCHAR* argv[])
+{
+	if (argc < 4)
+	{
+		wprintf(L"usage: ChessGame tune <positions.bin> <weights.txt> [-epochs n] [-threads n] [-batch n] [-rate r] [-k k] [-lambda l] [-positions n] [-weights start.txt]\n");
+		return 1;
+	}
+
+	TunerOptions options;
+	EvalWeights weights;
+	for (int i = 4; i < argc; i += 2)
+	{
+		const auto name = Narrow(argv[i]);
+		if (i + 1 == argc)
+		{
+			wprintf(L"%S needs a value\n", name.c_str());
+			return 1;
+		}
+		const auto value = Narrow(argv[i + 1]);
+		if (name == "-epochs") options.Epochs = atoi(value.c_str());
+		else if (name == "-threads") options.Threads = atoi(value.c_str());
+		else if (name == "-batch")
+		{
+			options.BatchSize = atoi(value.c_str());
+			if (options.BatchSize <= 0)
+			{
+				wprintf(L"-batch needs a number of positions above 0\n");
+				return 1;
+			}
+		}
+		else if (name == "-rate") options.LearningRate = atof(value.c_str());
+		else if (name == "-k") options.Scale = atof(value.c_str());
+		else if (name == "-lambda") options.ResultWeight = atof(value.c_str());
+		else if (name == "-positions") options.MaxPositions = strtoull(value.c_str(), nullptr, 10);
+		else if (name == "-weights")
+		{
+			if (!weights.Load(value.c_str()))
+			{
+				wprintf(L"Can't load %S\n", value.c_str());
+				return 1;
+			}
+		}
+		else
+		{
+			wprintf(L"Unknown option %S\n", name.c_str());
+			return 1;
+		}
+	}
+
+	const auto input = Narrow(argv[2]);
+	const auto output = Narrow(argv[3]);
+	DWORD start = ::GetTickCount();
+
+	// Save as we go, so a long run can be stopped without losing it all
+	TexelTuner tuner(options);
+	tuner.SetProgressCallback([&](const TunerProgress& progress)
+	{
+		wprintf(L"epoch:%d positions:%llu error:%.6f k:%.2f time:%f\n",
+			progress.Epoch, progress.Positions, progress.Error, progress.Scale, (::GetTickCount() - start) / 1000.);
+		weights.Save(output.c_str());
+	});
+
+	if (!tuner.Tune(input.c_str(), weights))
+	{
+		wprintf(L"Can't read positions from %s\n", argv[2]);
+		return 1;
+	}
+	return weights.Save(output.c_str()) ? 0 : 1;
+}
+
+// ChessGame train <positions.bin> <network.nnue> [-epochs n] [-threads n] [-batch n] [-rate r]
+//                 [-k k] [-lambda l] [-positions n] [-size accumulator,hidden1,hidden2]
+//                 [-network start.nnue] [-validate positions.bin] [-seed n]
+int RunTrainer(int argc, _TCHAR* argv[])
+{
+	if (argc < 4)
+	{
+		wprintf(L"usage: ChessGame train <positions.bin> <network.nnue> [-epochs n] [-threads n] [-batch n] [-rate r] [-k k] [-lambda l] [-positions n] [-size accumulator,hidden1,hidden2] [-network start.nnue] [-validate positions.bin] [-seed n]\n");
+		return 1;
+	}
+
+	NnueTrainerOptions options;
+	std::string start;
+	std::string validation;
+	for (int i = 4; i < argc; i += 2)
+	{
+		const auto name = Narrow(argv[i]);
+		if (i + 1 == argc)
+		{
+			wprintf(L"%S needs a value\n", name.c_str());
+			return 1;
+		}
+		const auto value = Narrow(argv[i + 1]);
+		if (name == "-epochs") options.Epochs = atoi(value.c_str());
+		else if (name == "-threads") options.Threads = atoi(value.c_str());
+		else if (name == "-batch")
+		{
+			options.BatchSize = atoi(value.c_str());
+			if (options.BatchSize <= 0)
+			{
+				wprintf(L"-batch needs a number of positions above 0\n");
+				return 1;
+			}
+		}
+		else if (name == "-rate") options.LearningRate = atof(value.c_str());
+		else if (name == "-k") options.Scale = atof(value.c_str());
+		else if (name == "-lambda") options.ResultWeight = atof(value.c_str());
+		else if (name == "-positions") options.MaxPositions = strtoull(value.c_str(), nullptr, 10);
+		else if (name == "-seed") options.Seed = static_cast<unsigned>(atoi(value.c_str()));
+		else if (name == "-network") start = value;
+		else if (name == "-validate") validation = value;
+		else if (name == "-size")
+		{
+			char* end = nullptr;
+			options.AccumulatorSize = strtol(value.c_str(), &end, 10);
+			options.Hidden1Size = *end == ',' ? strtol(end + 1, &end, 10) : 0;
+			options.Hidden2Size = *end == ',' ? strtol(end + 1, &end, 10) : 0;
+			if (*end != 0
+				|| options.AccumulatorSize <= 0 || options.AccumulatorSize > 1024 || options.AccumulatorSize % 16 != 0
+				|| options.Hidden1Size <= 0 || options.Hidden1Size > 256 || options.Hidden1Size % 32 != 0
+				|| options.Hidden2Size <= 0 || options.Hidden2Size > 256 || options.Hidden2Size % 32 != 0)
+			{
+				wprintf(L"-size needs an accumulator size that's a multiple of 16 up to 1024, and hidden sizes that are multiples of 32 up to 256\n");
+				return 1;
+			}
+		}
+		else
+		{
+			wprintf(L"Unknown option %S\n", name.c_str());
+			return 1;
+		}
+	}
+
+	NnueTrainer trainer(options);
+	if (!start.empty())
+	{
+		NnueParameters parameters;
+		if (!parameters.Load(start.c_str()))
+		{
+			wprintf(L"Can't load %S\n", start.c_str());
+			return 1;
+		}
+		trainer.Initialize(parameters);
+	}
+
+	const auto input = Narrow(argv[2]);
+	const auto output = Narrow(argv[3]);
+	DWORD begin = ::GetTickCount();
+
+	// Saved after every epoch, so a long run can be stopped without losing it all
+	bool saved = true;
+	trainer.SetProgressCallback([&](const NnueTrainerProgress& progress)
+	{
+		const double seconds = (::GetTickCount() - begin) / 1000.;
+		wprintf(L"epoch:%d positions:%llu loss:%.6f", progress.Epoch, progress.Positions, progress.Loss);
+		if (!validation.empty())
+		{
+			wprintf(L" validation:%.6f", trainer.Loss(validation.c_str()));
+		}
+		wprintf(L" time:%f positions/second:%.0f\n", seconds, seconds > 0 ? progress.Positions * progress.Epoch / seconds : 0.);
+		saved = trainer.Quantize().Save(output.c_str());
+	});
+
+	if (!trainer.Train(input.c_str()))
+	{
+		wprintf(L"Can't read positions from %s\n", argv[2]);
+		return 1;
+	}
+	if (!saved)
+	{
+		wprintf(L"Can't write %s\n", argv[3]);
+		return 1;
+	}
+	return 0;
+}
+
+// ChessGame evalbench <positions.bin> [-weights weights.txt]
+// Scores the file one position at a time and then as an EvalBatch
+int RunEvalBench(int argc, _TCHAR* argv[])
 {
+	if (argc < 3 || (argc != 3 && argc != 5))
+	{
+		wprintf(L"usage: ChessGame evalbench <positions.bin> [-weights weights.txt]\n");
+		return 1;
+	}
 
+	EvalWeights weights;
+	if (argc == 5)
+	{
+		const auto path = Narrow(argv[4]);
+		if (Narrow(argv[3]) != "-weights" || !weights.Load(path.c_str()))
+		{
+			wprintf(L"Can't load weights from %S\n", path.c_str());
+			return 1;
+		}
+	}
+
+	std::ifstream file(Narrow(argv[2]), std::ios::binary);
+	TrainingStreamReader reader(file);
+	std::vector<BoardState> boards;
+	std::vector<int> moveCounts;
+	TrainingPosition position;
+	DWORD start = ::GetTickCount();
+	while (reader.Read(position))
+	{
+		boards.push_back(position.ToBoard());
+		moveCounts.push_back(static_cast<int>(boards.back().ValidMoves().size()));
+	}
+	if (boards.empty())
+	{
+		wprintf(L"No positions in %s\n", argv[2]);
+		return 1;
+	}
+	wprintf(L"positions:%u read and moves counted in %f\n", static_cast<unsigned>(boards.size()), (::GetTickCount() - start) / 1000.);
+
+	// Enough passes that the timer's resolution doesn't matter
+	const int passes = static_cast<int>(20000000 / boards.size()) + 1;
+	long long check = 0;
+	start = ::GetTickCount();
+	for (int pass = 0; pass < passes; ++pass)
+	{
+		for (size_t i = 0; i < boards.size(); ++i)
+		{
+			check += weights.Evaluate(boards[i], moveCounts[i]);
+		}
+	}
+	const double single = (::GetTickCount() - start) / 1000.;
+
+	EvalBatch batch;
+	std::vector<int> scores;
+	long long batchCheck = 0;
+	start = ::GetTickCount();
+	for (size_t i = 0; i < boards.size(); ++i)
+	{
+		batch.Add(boards[i], moveCounts[i]);
+	}
+	const double fill = (::GetTickCount() - start) / 1000.;
+	start = ::GetTickCount();
+	for (int pass = 0; pass < passes; ++pass)
+	{
+		batch.Evaluate(weights, scores);
+		for (auto score : scores)
+		{
+			batchCheck += score;
+		}
+	}
+	const double batched = (::GetTickCount() - start) / 1000.;
+
+	const double total = static_cast<double>(boards.size()) * passes;
+	wprintf(L"one at a time: %f positions/second\n", single > 0 ? total / single : 0.);
+	wprintf(L"batch (%S): %f positions/second, %f to fill\n", EvalBatch::SimdName(), batched > 0 ? total / batched : 0., fill);
+	wprintf(L"speedup: %.2fx\n", batched > 0 ? single / batched : 0.);
+	if (check != batchCheck)
+	{
+		wprintf(L"Scores differ!\n");
+		return 1;
+	}
+	return 0;
+}
+
+// Positions searched by bench, perft, fleet and hashbench
+const char* BenchFens[] = {
+	"rnbqkbnr/pppppppp/8/8/8/8/PPPPPPPP/RNBQKBNR w KQkq - 0 1",
+	"r3k2r/p1ppqpb1/bn2pnp1/3PN3/1p2P3/2N2Q1p/PPPBBPPP/R3K2R w KQkq - 0 1",
+	"r1bqkb1r/pppp1ppp/2n2n2/4p3/2B1P3/5N2/PPPP1PPP/RNBQK2R w KQkq - 4 4",
+	"r2q1rk1/pp2bppp/2n1pn2/3p4/3P4/2NBPN2/PP3PPP/R2Q1RK1 w - - 0 10",
+	"8/2p5/3p4/KP5r/1R3p1k/8/4P1P1/8 w - - 0 1",
+	"6k1/5ppp/8/8/8/8/5PPP/3R2K1 w - - 0 1",
+};
+
+// ChessGame bench [-depth n] [-threads n] [-split n] [-hash mb] [-off null,lmr,futility,rfp,ext,prefetch]
+// Searches a fixed set of positions, for comparing node counts and speed
+// between builds and search options.  With -split, the root's moves are
+// split across 1, 2, 4... task pool workers up to n.  Only the root is
+// split, so the speedup is bounded by the largest root move's subtree.
+int RunBench(int argc, _TCHAR* argv[])
+{
+	SearchLimits limits;
+	limits.Depth = 6;
+	SearchOptions options;
+	int threads = 1;
+	int split = 0;
+	int hash = 16;
+	for (int i = 2; i < argc; i += 2)
+	{
+		const auto name = Narrow(argv[i]);
+		if (i + 1 == argc)
+		{
+			wprintf(L"%S needs a value\n", name.c_str());
+			return 1;
+		}
+		const auto value = Narrow(argv[i + 1]);
+		if (name == "-depth") limits.Depth = atoi(value.c_str());
+		else if (name == "-threads") threads = atoi(value.c_str());
+		else if (name == "-split") split = atoi(value.c_str());
+		else if (name == "-hash") hash = atoi(value.c_str());
+		else if (name == "-off")
+		{
+			std::istringstream list(value);
+			std::string technique;
+			while (std::getline(list, technique, ','))
+			{
+				if (technique == "null") options.NullMove = false;
+				else if (technique == "lmr") options.LateMoveReductions = false;
+				else if (technique == "futility") options.Futility = false;
+				else if (technique == "rfp") options.ReverseFutility = false;
+				else if (technique == "ext") options.CheckExtensions = false;
+				else if (technique == "prefetch") options.Prefetch = false;
+				else
+				{
+					wprintf(L"Unknown technique %S\n", technique.c_str());
+					return 1;
+				}
+			}
+		}
+		else
+		{
+			wprintf(L"Unknown option %S\n", name.c_str());
+			return 1;
+		}
+	}
+
+	// Returns the time taken
+	auto run = [&](TaskPool* pool) -> DWORD
+	{
+		unsigned long long totalNodes = 0;
+		DWORD totalTime = 0;
+		for (auto fen : BenchFens)
+		{
+			GameAi ai;
+			ai.SetHashSize(hash < 1 ? 1 : hash);
+			ai.SetThreads(threads);
+			ai.SetTaskPool(pool);
+			ai.SetSearchOptions(options);
+			if (fen == BenchFens[0])
+			{
+				const auto& table = ai.GetTable();
+				wprintf(L"hash %u MB in %S pages of %u kB\n", static_cast<unsigned>(table.SizeInMegabytes()), table.PageKind(), static_cast<unsigned>(table.PageSize() / 1024));
+			}
+			const auto board = BoardState::FromFen(fen);
+			DWORD start = ::GetTickCount();
+			int score = 0;
+			const auto move = ai.DecideMove(board, PositionHistory(), limits, &score);
+			const DWORD time = ::GetTickCount() - start;
+			wprintf(L"%S: %S score:%d nodes:%llu time:%f\n", fen, (move.From.ToString() + move.To.ToString()).c_str(), score, ai.GetNodes(), time / 1000.);
+			totalNodes += ai.GetNodes();
+			totalTime += time;
+		}
+		wprintf(L"nodes:%llu time:%f nodes/second:%.0f\n", totalNodes, totalTime / 1000., totalTime ? totalNodes * 1000. / totalTime : 0.);
+		return totalTime;
+	};
+
+	if (split <= 0)
+	{
+		run(nullptr);
+		return 0;
+	}
+
+	// The root's moves split across 1, 2, 4... workers, against the first
+	wprintf(L"split: root moves only, each searched below the root by one worker\n");
+	DWORD baseline = 0;
+	for (int workers = 1; workers <= split; workers *= 2)
+	{
+		TaskPool pool(workers);
+		wprintf(L"split workers:%d\n", workers);
+		const DWORD time = run(&pool);
+		if (workers == 1)
+		{
+			baseline = time;
+		}
+		wprintf(L"split workers:%d speedup:%.2f\n", workers, time ? static_cast<double>(baseline) / time : 0.);
+	}
+	return 0;
+}
+
+// ChessGame hashbench [-hash mb] [-probes n]
+// Times table probes at random, as the search makes them: the bucket is
+// prefetched when the move is made, then the check test the search does
+// first runs while it loads.  Compared with the same probes made cold, the
+// difference is the memory latency prefetching hides.
+int RunHashBench(int argc, _TCHAR* argv[])
+{
+	int hash = 1024;
+	int probes = 2000000;
+	for (int i = 2; i < argc; i += 2)
+	{
+		const auto name = Narrow(argv[i]);
+		if (i + 1 == argc)
+		{
+			wprintf(L"%S needs a value\n", name.c_str());
+			return 1;
+		}
+		const auto value = Narrow(argv[i + 1]);
+		if (name == "-hash") hash = atoi(value.c_str());
+		else if (name == "-probes") probes = atoi(value.c_str());
+		else
+		{
+			wprintf(L"Unknown option %S\n", name.c_str());
+			return 1;
+		}
+	}
+
+	TranspositionTable table(hash < 1 ? 1 : hash);
+	wprintf(L"hash %u MB in %S pages of %u kB\n", static_cast<unsigned>(table.SizeInMegabytes()), table.PageKind(), static_cast<unsigned>(table.PageSize() / 1024));
+
+	const auto board = BoardState::FromFen(BenchFens[1]);
+	auto run = [&](bool prefetch) -> DWORD
+	{
+		std::mt19937_64 random(1);
+		int found = 0;
+		int checks = 0;
+		const DWORD start = ::GetTickCount();
+		for (int i = 0; i < probes; ++i)
+		{
+			const PositionKey key = random();
+			if (prefetch)
+			{
+				table.Prefetch(key);
+			}
+			checks += board.IsCheck();
+
+			TableEntry entry;
+			if (table.Probe(key, &entry))
+			{
+				++found;
+			}
+			else
+			{
+				table.Store(key, i, 1, Bound::Exact, InvalidChessMove);
+			}
+		}
+		const DWORD time = ::GetTickCount() - start;
+		wprintf(L"prefetch:%S probes:%d found:%d checks:%d time:%f ns/probe:%.1f\n",
+			prefetch ? "on" : "off", probes, found, checks, time / 1000., probes ? time * 1e6 / probes : 0.);
+		return time;
+	};
+
+	// Each run with a table emptied first, so both do the same work
+	table.Clear();
+	const DWORD cold = run(false);
+	table.Clear();
+	const DWORD warm = run(true);
+	wprintf(L"saved ns/probe:%.1f\n", probes ? (static_cast<double>(cold) - warm) * 1e6 / probes : 0.);
+	return 0;
+}
+
+// ChessGame perft <depth> [-threads n] [-fen f]
+// Counts the positions depth moves on, on 1, 2, 4... threads up to
+// -threads, with the time and speedup for each
+int RunPerft(int argc, _TCHAR* argv[])
+{
+	if (argc < 3)
+	{
+		wprintf(L"usage: ChessGame perft <depth> [-threads n] [-fen f]\n");
+		return 1;
+	}
+
+	const int depth = _ttoi(argv[2]);
+	int maxThreads = static_cast<int>(std::thread::hardware_concurrency());
+	auto board = BoardState::FromFen(BenchFens[0]);
+	for (int i = 3; i < argc; i += 2)
+	{
+		const auto name = Narrow(argv[i]);
+		if (i + 1 == argc)
+		{
+			wprintf(L"%S needs a value\n", name.c_str());
+			return 1;
+		}
+		const auto value = Narrow(argv[i + 1]);
+		if (name == "-threads") maxThreads = atoi(value.c_str());
+		else if (name == "-fen") board = BoardState::FromFen(value.c_str());
+		else
+		{
+			wprintf(L"Unknown option %S\n", name.c_str());
+			return 1;
+		}
+	}
+
+	DWORD start = ::GetTickCount();
+	const auto expected = Perft(board, depth);
+	const DWORD serial = ::GetTickCount() - start;
+	wprintf(L"serial nodes:%llu time:%f\n", expected, serial / 1000.);
+
+	for (int threads = 1; threads <= (maxThreads < 1 ? 1 : maxThreads); threads *= 2)
+	{
+		TaskPool pool(threads);
+		start = ::GetTickCount();
+		const auto nodes = ParallelPerft(pool, board, depth);
+		const DWORD time = ::GetTickCount() - start;
+		wprintf(L"threads:%d nodes:%llu time:%f speedup:%.2f%S\n",
+			threads, nodes, time / 1000., time ? static_cast<double>(serial) / time : 0., nodes == expected ? "" : " MISMATCH");
+	}
+	return 0;
+}
+
+// ChessGame fleet [-tasks n] [-threads n] [-depth n]
+// Runs many independent searches of the bench positions on a
+// SearchScheduler, with 1, 2, 4... threads up to -threads, to show how the
+// number of searches finished each second grows with the threads.
+int RunFleet(int argc, _TCHAR* argv[])
+{
+	int tasks = 48;
+	int maxThreads = static_cast<int>(std::thread::hardware_concurrency());
+	SearchLimits limits;
+	limits.Depth = 4;
+	for (int i = 2; i < argc; i += 2)
+	{
+		const auto name = Narrow(argv[i]);
+		if (i + 1 == argc)
+		{
+			wprintf(L"%S needs a value\n", name.c_str());
+			return 1;
+		}
+		const auto value = Narrow(argv[i + 1]);
+		if (name == "-tasks") tasks = atoi(value.c_str());
+		else if (name == "-threads") maxThreads = atoi(value.c_str());
+		else if (name == "-depth") limits.Depth = atoi(value.c_str());
+		else
+		{
+			wprintf(L"Unknown option %S\n", name.c_str());
+			return 1;
+		}
+	}
+
+	// Past the cores, threads only take turns, so the speedup can't grow
+	wprintf(L"cores:%u\n", std::thread::hardware_concurrency());
+
+	const int fenCount = sizeof(BenchFens) / sizeof(BenchFens[0]);
+	double baseline = 0;
+	for (int threads = 1; threads <= (maxThreads < 1 ? 1 : maxThreads); threads *= 2)
+	{
+		SearchScheduler scheduler(threads, 4);
+		std::atomic<unsigned long long> nodes(0);
+
+		const DWORD start = ::GetTickCount();
+		for (int i = 0; i < tasks; ++i)
+		{
+			SearchTask task;
+			task.Board = BoardState::FromFen(BenchFens[i % fenCount]);
+			task.Limits = limits;
+			task.Finished = [&](const SearchResult& result)
+			{
+				nodes += result.Nodes;
+			};
+			scheduler.Submit(task);
+		}
+		scheduler.WaitUntilIdle();
+		const DWORD time = ::GetTickCount() - start;
+
+		const double rate = tasks * 1000. / (time ? time : 1);
+		if (threads == 1)
+		{
+			baseline = rate;
+		}
+		wprintf(L"threads:%d searches:%d nodes:%llu time:%f searches/second:%.1f speedup:%.2f\n",
+			threads, tasks, nodes.load(), time / 1000., rate, baseline ? rate / baseline : 0.);
+	}
+	return 0;
+}
+
+// ChessGame serve [-port n] [-workers n] [-hash mb] [-workerhash mb]
+// Analyses positions for clients on this machine until one of them sends
+// "shutdown"; see AnalysisServer for the protocol.
+int RunServer(int argc, _TCHAR* argv[])
+{
+	int port = 7400;
+	int workers = 0;
+	int hash = 256;
+	int workerHash = 16;
+	for (int i = 2; i < argc; i += 2)
+	{
+		const auto name = Narrow(argv[i]);
+		if (i + 1 == argc)
+		{
+			wprintf(L"%S needs a value\n", name.c_str());
+			return 1;
+		}
+		const auto value = Narrow(argv[i + 1]);
+		if (name == "-port") port = atoi(value.c_str());
+		else if (name == "-workers") workers = atoi(value.c_str());
+		else if (name == "-hash") hash = atoi(value.c_str());
+		else if (name == "-workerhash") workerHash = atoi(value.c_str());
+		else
+		{
+			wprintf(L"Unknown option %S\n", name.c_str());
+			return 1;
+		}
+	}
+
+	AnalysisPool pool(workers, hash < 1 ? 1 : hash, workerHash < 1 ? 1 : workerHash);
+	wprintf(L"listening on 127.0.0.1:%d with %d workers\n", port, pool.WorkerCount());
+	fflush(stdout);
+
+	AnalysisServer server(pool);
+	if (!server.Run(static_cast<unsigned short>(port)))
+	{
+		wprintf(L"Can't listen on port %d\n", port);
+		return 1;
+	}
+	return 0;
+}
+
+// ChessGame perf
+int PerfProbe()
+{
     // Right now just using this to get insight into perf
 	BoardState b;
 	GameAi ai;
@@ -18,11 +839,76 @@ int _tmain(int argc, _TCHAR* argv[])
 
 	DWORD total = ::GetTickCount() - start;
 	wprintf(L"scores:%d canmove:%d\n", g_boardScoreCalls, g_canMoveCalls);
+	wprintf(L"evalcache hits:%llu misses:%llu\n", ai.GetEvalCacheHits(), ai.GetEvalCacheMisses());
 	wprintf(L"Time %f\n", total / 1000.);
 
-	
-	
-	
+	// Searched again, with the arenas already grown, to show the search
+	// needs nothing more from the heap
+	const auto heapBefore = ai.GetArenaHeapAllocations();
+	wprintf(L"arena bytes:%llu heap blocks:%llu\n", ai.GetArenaBytes(), heapBefore);
+	ai.DecideMoveImpl(b, 3, nullptr);
+	wprintf(L"again arena bytes:%llu new heap blocks:%llu\n", ai.GetArenaBytes(), ai.GetArenaHeapAllocations() - heapBefore);
+
 	return 0;
 }
 
+int _tmain(int argc, _TCHAR* argv[])
+{
+	if (argc > 1 && _tcscmp(argv[1], _T("makebook")) == 0)
+	{
+		return MakeBook(argc, argv);
+	}
+	if (argc > 1 && _tcscmp(argv[1], _T("gentb")) == 0)
+	{
+		return GenerateTablebases(argc, argv);
+	}
+	if (argc > 1 && _tcscmp(argv[1], _T("selfplay")) == 0)
+	{
+		return RunSelfPlay(argc, argv);
+	}
+	if (argc > 1 && (_tcscmp(argv[1], _T("shuffle")) == 0 || _tcscmp(argv[1], _T("shard")) == 0))
+	{
+		return RunTrainingTool(argc, argv);
+	}
+	if (argc > 1 && _tcscmp(argv[1], _T("tune")) == 0)
+	{
+		return RunTuner(argc, argv);
+	}
+	if (argc > 1 && _tcscmp(argv[1], _T("train")) == 0)
+	{
+		return RunTrainer(argc, argv);
+	}
+	if (argc > 1 && _tcscmp(argv[1], _T("evalbench")) == 0)
+	{
+		return RunEvalBench(argc, argv);
+	}
+	if (argc > 1 && _tcscmp(argv[1], _T("bench")) == 0)
+	{
+		return RunBench(argc, argv);
+	}
+	if (argc > 1 && _tcscmp(argv[1], _T("hashbench")) == 0)
+	{
+		return RunHashBench(argc, argv);
+	}
+	if (argc > 1 && _tcscmp(argv[1], _T("perft")) == 0)
+	{
+		return RunPerft(argc, argv);
+	}
+	if (argc > 1 && _tcscmp(argv[1], _T("fleet")) == 0)
+	{
+		return RunFleet(argc, argv);
+	}
+	if (argc > 1 && _tcscmp(argv[1], _T("serve")) == 0)
+	{
+		return RunServer(argc, argv);
+	}
+	if (argc > 1 && _tcscmp(argv[1], _T("perf")) == 0)
+	{
+		return PerfProbe();
+	}
+
+	// GUIs start the engine without arguments and talk UCI over stdin/stdout
+	UciEngine engine(std::cin, std::cout);
+	return engine.Run();
+}
+
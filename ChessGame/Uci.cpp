@@ -0,0 +1,378 @@
+#include "stdafx.h"
+#include "Uci.h"
+
+namespace
+{
+	const int DefaultHash = 16;
+	const int MaxHash = 1024;
+	const int MaxThreads = 64;
+}
+
+UciEngine::UciEngine(std::istream& input, std::ostream& output)
+	: m_input(input)
+	, m_output(output)
+{
+	m_ai.SetHashSize(DefaultHash);
+	m_ai.SetInfoCallback([this](const SearchInfo& info)
+	{
+		SendInfo(info);
+	});
+	m_ai.SetFinishedCallback([this](ChessMove move)
+	{
+		// Suggest the reply we expect, so the GUI can have us ponder on it
+		std::string line = "bestmove " + MoveToString(m_searchBoard, move);
+		const auto ponder = m_ai.GetPonderMove();
+		if (move.IsValid() && ponder.IsValid())
+		{
+			auto next = m_searchBoard;
+			next.Move(move.From, move.To, true);
+			line += " ponder " + MoveToString(next, ponder);
+		}
+		Send(line);
+	});
+
+	m_history.Push(m_board.Key());
+}
+
+int UciEngine::Run()
+{
+	std::string line;
+	while (std::getline(m_input, line))
+	{
+		std::istringstream args(line);
+		std::string command;
+		args >> command;
+
+		if (command == "uci")
+		{
+			Send("id name ChessLearner");
+			Send("id author ChessLearner developers");
+			Send("option name Hash type spin default " + std::to_string(DefaultHash) + " min 1 max " + std::to_string(MaxHash));
+			Send("option name Threads type spin default 1 min 1 max " + std::to_string(MaxThreads));
+			Send("option name Ponder type check default false");
+			Send("option name MultiPV type spin default 1 min 1 max " + std::to_string(MaxMultiPv));
+			Send("option name EvalWeights type string default <empty>");
+			Send("option name EvalFile type string default <empty>");
+			Send("option name NullMove type check default true");
+			Send("option name LateMoveReductions type check default true");
+			Send("option name Futility type check default true");
+			Send("option name ReverseFutility type check default true");
+			Send("option name CheckExtensions type check default true");
+			Send("option name Prefetch type check default true");
+			Send("uciok");
+		}
+		else if (command == "isready")
+		{
+			Send("readyok");
+		}
+		else if (command == "ucinewgame")
+		{
+			StopSearch();
+			m_ai.ClearHash();
+		}
+		else if (command == "setoption")
+		{
+			StopSearch();
+			SetOption(args);
+		}
+		else if (command == "position")
+		{
+			Position(args);
+		}
+		else if (command == "go")
+		{
+			Go(args);
+		}
+		else if (command == "stop")
+		{
+			// bestmove is sent by the search thread as it finishes
+			m_ai.Stop();
+		}
+		else if (command == "ponderhit")
+		{
+			// The search goes on with everything it has found so far, now on the clock
+			m_ai.PonderHit();
+		}
+		else if (command == "quit")
+		{
+			break;
+		}
+		else if (!command.empty())
+		{
+			Send("info string unknown command " + command);
+		}
+	}
+
+	StopSearch();
+	return 0;
+}
+
+void UciEngine::StopSearch()
+{
+	if (m_ai.IsSearching())
+	{
+		m_ai.Stop();
+		m_ai.WaitUntilFinished();
+	}
+}
+
+// position [startpos | fen <fen>] [moves <move>...]
+void UciEngine::Position(std::istringstream& args)
+{
+	std::string token;
+	args >> token;
+
+	if (token == "startpos")
+	{
+		m_board = BoardState();
+		args >> token;
+	}
+	else if (token == "fen")
+	{
+		std::string fen;
+		while (args >> token && token != "moves")
+		{
+			fen += token + " ";
+		}
+		try
+		{
+			m_board = BoardState::FromFen(fen.c_str());
+		}
+		catch (const char* error)
+		{
+			Send(std::string("info string ") + error);
+			return;
+		}
+	}
+	else
+	{
+		return;
+	}
+
+	m_history.Clear();
+	m_history.Push(m_board.Key());
+
+	if (token != "moves")
+	{
+		return;
+	}
+
+	while (args >> token)
+	{
+		auto move = ParseMove(m_board, token);
+		if (!move.IsValid())
+		{
+			Send("info string illegal move " + token);
+			return;
+		}
+		m_board.Move(move.From, move.To, true);
+		m_history.Push(m_board.Key());
+	}
+}
+
+// go [wtime <ms>] [btime <ms>] [winc <ms>] [binc <ms>] [movestogo <n>]
+//    [depth <plies>] [movetime <ms>] [infinite] [ponder]
+void UciEngine::Go(std::istringstream& args)
+{
+	SearchLimits limits;
+
+	std::string token;
+	while (args >> token)
+	{
+		if (token == "wtime") args >> limits.Time[static_cast<int>(SideType::White)];
+		else if (token == "btime") args >> limits.Time[static_cast<int>(SideType::Black)];
+		else if (token == "winc") args >> limits.Increment[static_cast<int>(SideType::White)];
+		else if (token == "binc") args >> limits.Increment[static_cast<int>(SideType::Black)];
+		else if (token == "movestogo") args >> limits.MovesToGo;
+		else if (token == "depth") args >> limits.Depth;
+		else if (token == "movetime") args >> limits.MoveTime;
+		else if (token == "infinite") limits.Infinite = true;
+		else if (token == "ponder") limits.Ponder = true;
+	}
+
+	StopSearch();
+	m_searchBoard = m_board;
+	m_ai.StartSearch(m_board, m_history, limits);
+}
+
+// setoption name <id> [value <x>]
+void UciEngine::SetOption(std::istringstream& args)
+{
+	std::string token, name, value;
+	args >> token;
+	while (args >> token && token != "value")
+	{
+		name += name.empty() ? token : " " + token;
+	}
+	std::getline(args >> std::ws, value);
+
+	if (name == "Hash")
+	{
+		const int megabytes = atoi(value.c_str());
+		m_ai.SetHashSize(megabytes < 1 ? 1 : megabytes > MaxHash ? MaxHash : megabytes);
+		const auto& table = m_ai.GetTable();
+		Send("info string hash " + std::to_string(table.SizeInMegabytes()) + " MB in " + table.PageKind()
+			+ " pages of " + std::to_string(table.PageSize() / 1024) + " kB");
+	}
+	else if (name == "Threads")
+	{
+		const int threads = atoi(value.c_str());
+		m_ai.SetThreads(threads > MaxThreads ? MaxThreads : threads);
+	}
+	else if (name == "MultiPV")
+	{
+		const int lines = atoi(value.c_str());
+		m_ai.SetMultiPv(lines > MaxMultiPv ? MaxMultiPv : lines);
+	}
+	else if (name == "EvalWeights")
+	{
+		// Weights written by "ChessGame tune", or the defaults again if empty
+		EvalWeights weights;
+		if (!value.empty() && value != "<empty>" && !weights.Load(value.c_str()))
+		{
+			Send("info string can't load " + value);
+			return;
+		}
+		m_ai.SetEvalWeights(weights);
+	}
+	else if (name == "EvalFile")
+	{
+		// A network replaces the weights until it's set back to empty
+		if (value.empty() || value == "<empty>")
+		{
+			m_ai.SetNetwork(nullptr);
+		}
+		else if (m_network.Load(value.c_str()))
+		{
+			m_ai.SetNetwork(&m_network);
+			Send("info string using network " + value + " with " + NnueNetwork::SimdName());
+		}
+		else
+		{
+			m_ai.SetNetwork(nullptr);
+			Send("info string can't load " + value);
+		}
+	}
+	else if (name == "NullMove" || name == "LateMoveReductions" || name == "Futility"
+		|| name == "ReverseFutility" || name == "CheckExtensions" || name == "Prefetch")
+	{
+		auto options = m_ai.GetSearchOptions();
+		const bool on = value == "true";
+		if (name == "NullMove") options.NullMove = on;
+		else if (name == "LateMoveReductions") options.LateMoveReductions = on;
+		else if (name == "Futility") options.Futility = on;
+		else if (name == "ReverseFutility") options.ReverseFutility = on;
+		else if (name == "CheckExtensions") options.CheckExtensions = on;
+		else options.Prefetch = on;
+		m_ai.SetSearchOptions(options);
+	}
+	else if (name == "Ponder")
+	{
+		// Nothing to set up, the GUI decides when to send "go ponder"
+	}
+	else
+	{
+		Send("info string unknown option " + name);
+	}
+}
+
+void UciEngine::Send(const std::string& line)
+{
+	std::lock_guard<std::mutex> lock(m_outputLock);
+	m_output << line << std::endl;
+}
+
+void UciEngine::SendInfo(const SearchInfo& info)
+{
+	std::ostringstream line;
+	line << "info depth " << info.Depth;
+	if (m_ai.GetMultiPv() > 1)
+	{
+		line << " multipv " << info.MultiPv;
+	}
+	line << " score " << ScoreToString(m_searchBoard, info.Score);
+
+	const DWORD time = info.Time ? info.Time : 1;
+	line << " nodes " << info.Nodes
+		<< " nps " << info.Nodes * 1000 / time
+		<< " time " << info.Time
+		<< " hashfull " << info.Hashfull
+		<< " pv " << LineToString(m_searchBoard, info.Pv.empty() ? std::vector<ChessMove>(1, info.BestMove) : info.Pv);
+
+	Send(line.str());
+}
+
+std::string UciEngine::ScoreToString(const BoardState& board, int whiteScore)
+{
+	// UCI scores are for the side to move, in centipawns or moves to mate
+	const int score = board.NextSide() == SideType::White ? whiteScore : -whiteScore;
+	if (score >= MateScore - MaxSearchDepth)
+	{
+		return "mate " + std::to_string((MateScore - score + 1) / 2);
+	}
+	if (score <= -(MateScore - MaxSearchDepth))
+	{
+		return "mate -" + std::to_string((MateScore + score + 1) / 2);
+	}
+	return "cp " + std::to_string(score / 10);
+}
+
+std::string UciEngine::LineToString(const BoardState& board, const std::vector<ChessMove>& line)
+{
+	// Each move is written for the position it's played in, for promotions
+	std::string text;
+	auto position = board;
+	for (auto move : line)
+	{
+		text += (text.empty() ? "" : " ") + MoveToString(position, move);
+		position.Move(move.From, move.To, true);
+	}
+	return text;
+}
+
+std::string UciEngine::MoveToString(const BoardState& board, ChessMove move)
+{
+	if (!move.IsValid())
+	{
+		return "0000";
+	}
+
+	auto text = move.From.ToString() + move.To.ToString();
+
+	// Pawns always become queens, but UCI wants it spelled out
+	if (board.Get(move.From).Type == PieceType::Pawn && move.To.Y() == GetHomeRow(OtherSide(board.NextSide())))
+	{
+		text += 'q';
+	}
+	return text;
+}
+
+ChessMove UciEngine::ParseMove(const BoardState& board, const std::string& move)
+{
+	if (move.size() < 4
+		|| move[0] < 'a' || move[0] > 'h' || move[1] < '1' || move[1] > '8'
+		|| move[2] < 'a' || move[2] > 'h' || move[3] < '1' || move[3] > '8')
+	{
+		return InvalidChessMove;
+	}
+
+	const BoardLocation from(move.substr(0, 2).c_str());
+	const BoardLocation to(move.substr(2, 2).c_str());
+
+	// Pawns only become queens here, so anything else would leave our board
+	// different from the GUI's.  The letter is optional, but only on a promotion.
+	const bool promotes = board.Get(from).Type == PieceType::Pawn && to.Y() == GetHomeRow(OtherSide(board.NextSide()));
+	if (move.size() > 5 || (move.size() == 5 && (!promotes || move[4] != 'q')))
+	{
+		return InvalidChessMove;
+	}
+
+	for (auto m : board.ValidMoves())
+	{
+		if (m.From == from && m.To == to)
+		{
+			return m;
+		}
+	}
+	return InvalidChessMove;
+}
@@ -0,0 +1,52 @@
+#pragma once
+
+#include "GameAi.h"
+#include <mutex>
+#include <sstream>
+#include <string>
+
+// Universal Chess Interface front end, so the engine can be run under a GUI
+// or a tournament manager.  Commands are read on the calling thread while
+// the search runs on GameAi's worker thread, which writes the info and
+// bestmove lines itself, so "stop" is acted on straight away.
+class UciEngine
+{
+public:
+	UciEngine(std::istream& input, std::ostream& output);
+
+	// Until "quit" or the end of the input
+	int Run();
+
+	// Long algebraic notation, e.g. "e2e4" or "e7e8q".  Promotions are only
+	// to a queen: a move like "e7e8n" doesn't parse.
+	static std::string MoveToString(const BoardState& board, ChessMove move);
+	static ChessMove ParseMove(const BoardState& board, const std::string& move);
+
+	// A score from White's side as UCI gives it, for the side to move:
+	// "cp <centipawns>" or "mate <moves>"
+	static std::string ScoreToString(const BoardState& board, int whiteScore);
+
+	// Moves played out from the board, separated by spaces
+	static std::string LineToString(const BoardState& board, const std::vector<ChessMove>& line);
+
+private:
+	void Position(std::istringstream& args);
+	void Go(std::istringstream& args);
+	void SetOption(std::istringstream& args);
+	void StopSearch();
+
+	void Send(const std::string& line);
+	void SendInfo(const SearchInfo& info);
+
+	std::istream& m_input;
+	std::ostream& m_output;
+	std::mutex m_outputLock;
+
+	NnueNetwork m_network;	// before m_ai, which may still be searching with it
+	GameAi m_ai;
+	BoardState m_board;
+	PositionHistory m_history;
+
+	// The position searched, the board may change before the search reports
+	BoardState m_searchBoard;
+};
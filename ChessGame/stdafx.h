@@ -7,6 +7,10 @@
 
 #include "targetver.h"
 
+// Before anything brings in Windows.h, which would include the older winsock.h
+#include <winsock2.h>
+#include <ws2tcpip.h>
+
 #include <stdio.h>
 #include <tchar.h>
 #include <cstring>
@@ -0,0 +1,90 @@
+#include "stdafx.h"
+#include "AnalysisPool.h"
+
+AnalysisPool::AnalysisPool(int workers, size_t sharedMegabytes, size_t privateMegabytes)
+	: m_sharedTable(sharedMegabytes)
+	, m_nextRequest(0)
+	, m_scheduler(workers, privateMegabytes)
+{
+}
+
+int AnalysisPool::Submit(const AnalysisRequest& request, ResultCallback callback)
+{
+	auto batch = std::make_shared<Batch>();
+	batch->Callback = callback;
+	batch->Remaining = static_cast<int>(request.Positions.size());
+
+	// Held while the positions are queued, so none can be reported before
+	// the batch knows all its tasks
+	std::lock_guard<std::mutex> lock(m_lock);
+	const int id = ++m_nextRequest;
+	if (request.Positions.empty())
+	{
+		return id;
+	}
+	m_batches[id] = batch;
+
+	// Each request ages the shared table once, however many positions it has
+	if (request.SharedTable)
+	{
+		m_sharedTable.NewSearch();
+	}
+
+	for (int i = 0; i < batch->Remaining; ++i)
+	{
+		SearchTask task;
+		task.Board = request.Positions[i];
+		task.Limits = request.Limits;
+		task.Priority = request.Priority;
+		task.MultiPv = request.MultiPv;
+		task.SharedTable = request.SharedTable ? &m_sharedTable : nullptr;
+
+		Batch* raw = batch.get();
+		task.Finished = [this, id, raw, i](const SearchResult& result)
+		{
+			Finished(id, *raw, i, result);
+		};
+		batch->Tasks.push_back(m_scheduler.Submit(task));
+	}
+	return id;
+}
+
+void AnalysisPool::Cancel(int request)
+{
+	std::lock_guard<std::mutex> lock(m_lock);
+	auto found = m_batches.find(request);
+	if (found != m_batches.end())
+	{
+		for (auto task : found->second->Tasks)
+		{
+			m_scheduler.Cancel(task);
+		}
+	}
+}
+
+void AnalysisPool::Finished(int id, Batch& batch, int index, const SearchResult& result)
+{
+	AnalysisResult analysis;
+	static_cast<SearchResult&>(analysis) = result;
+	analysis.Request = id;
+	analysis.Index = index;
+
+	// Results are counted off and reported together, one at a time for
+	// each request, so the last one reported is the one marked Last.  The
+	// batch is kept until then.
+	std::shared_ptr<Batch> keep;
+	std::lock_guard<std::mutex> callbackLock(batch.CallbackLock);
+	{
+		std::lock_guard<std::mutex> lock(m_lock);
+		analysis.Last = --batch.Remaining == 0;
+		if (analysis.Last)
+		{
+			keep = m_batches[id];
+			m_batches.erase(id);
+		}
+	}
+	if (batch.Callback)
+	{
+		batch.Callback(analysis);
+	}
+}
@@ -0,0 +1,104 @@
+#pragma once
+
+#include "SearchScheduler.h"
+#include <functional>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+// A batch of positions to analyse with the same limits
+struct AnalysisRequest
+{
+	AnalysisRequest()
+		: MultiPv(1)
+		, Priority(0)
+		, SharedTable(true)
+	{}
+
+	std::vector<BoardState> Positions;
+	SearchLimits Limits;	// per position; searches with no limits at all are given a depth
+	int MultiPv;			// lines to find for each position
+	int Priority;			// as SearchTask's, for every position
+
+	// Search with the table every worker shares, so positions from the same
+	// game help each other, or with the worker's own, cleared first, so the
+	// results don't depend on what else was searched
+	bool SharedTable;
+};
+
+// One position's analysis, from the worker that searched it
+struct AnalysisResult : SearchResult
+{
+	AnalysisResult()
+		: Request(0)
+		, Index(0)
+		, Last(false)
+	{}
+
+	int Request;			// as returned by AnalysisPool::Submit()
+	int Index;				// the position's place in the request
+	bool Last;				// no more results will follow for the request
+};
+
+// Searches the positions of many requests at once on a SearchScheduler.
+// Each position is a task of its own, queued behind those of earlier
+// requests at the same priority, and each result is handed to the
+// request's callback as soon as its position is done, on that worker's
+// thread.
+class AnalysisPool
+{
+public:
+	// Workers: 0 for one per core.  Each worker gets a table of its own of
+	// privateMegabytes, and they all share one of sharedMegabytes.
+	AnalysisPool(int workers, size_t sharedMegabytes, size_t privateMegabytes);
+
+	AnalysisPool(const AnalysisPool&) = delete;
+	AnalysisPool& operator=(const AnalysisPool&) = delete;
+
+	typedef std::function<void(const AnalysisResult&)> ResultCallback;
+
+	// Returns the request's id.  The callback is called once for each
+	// position, possibly at the same time from several workers.
+	int Submit(const AnalysisRequest& request, ResultCallback callback);
+
+	// Positions not yet started are reported as cancelled without being
+	// searched, and those being searched stop with the best move so far
+	void Cancel(int request);
+
+	// Blocks until every position submitted so far has been reported
+	void WaitUntilIdle()
+	{
+		m_scheduler.WaitUntilIdle();
+	}
+
+	int WorkerCount() const
+	{
+		return m_scheduler.ThreadCount();
+	}
+
+	// Positions waiting for a worker
+	size_t Queued() const
+	{
+		return m_scheduler.Queued();
+	}
+
+private:
+	struct Batch
+	{
+		ResultCallback Callback;
+		std::vector<int> Tasks;		// the scheduler's, by position
+		int Remaining;				// positions not yet reported
+		std::mutex CallbackLock;
+	};
+
+	void Finished(int id, Batch& batch, int index, const SearchResult& result);
+
+	TranspositionTable m_sharedTable;
+
+	std::mutex m_lock;
+	std::map<int, std::shared_ptr<Batch>> m_batches;
+	int m_nextRequest;
+
+	SearchScheduler m_scheduler;	// last, so its searches stop before the rest goes
+};
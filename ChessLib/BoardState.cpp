@@ -1,16 +1,56 @@
 #include "stdafx.h"
 #include "BoardState.h"
+#include "Geometry.h"
+#include <random>
+#include <algorithm>
 
 extern const BoardLocation InvalidBoardLocation(64);
 extern const ChessMove InvalidChessMove({ InvalidBoardLocation, InvalidBoardLocation });
 
-extern int g_canMoveCalls = 0;
-extern int g_boardScoreCalls = 0;
+extern thread_local int g_canMoveCalls = 0;
+extern thread_local int g_boardScoreCalls = 0;
+
+namespace
+{
+	// Random numbers for Zobrist hashing.  Seeded with a constant so keys are
+	// stable from run to run.
+	struct ZobristTable
+	{
+		ZobristTable()
+		{
+			std::mt19937_64 generator(0x5eed);
+			for (int p = 0; p < 16; ++p)
+			{
+				for (int sq = 0; sq < 64; ++sq)
+				{
+					// Empty squares (either side) never contribute to the key
+					const bool empty = static_cast<PieceType>(p & 0x7) == PieceType::Empty;
+					Pieces[p][sq] = empty ? 0 : generator();
+				}
+			}
+			for (auto& k : PieceMoved) k = generator();
+			for (auto& k : EnPassantCol) k = generator();
+			BlackToMove = generator();
+		}
+
+		PositionKey Pieces[16][64];
+		PositionKey PieceMoved[6];
+		PositionKey EnPassantCol[8];
+		PositionKey BlackToMove;
+	};
+
+	const ZobristTable g_zobrist;
+}
 
 BoardState::BoardState(const char* board, SideType nextMove)
 	: m_nextMoveSide(nextMove)
 	, m_enPassantCol(-1)
+	, m_halfmoveClock(0)
+	, m_key(0)
+	, m_pawnKey(0)
 {
+	memset(m_board, 0, sizeof(m_board));
+
 	for (int y = 0; y < 8; ++y)
 	{
 		for (int x = 0; x < 8; ++x)
@@ -21,6 +61,20 @@ BoardState::BoardState(const char* board, SideType nextMove)
 		}		
 	}
 	InitializeKingPositions();
+	InitializeKey();
+}
+
+BoardState BoardState::FromPacked(const unsigned char* packedBoard, SideType nextMove, byte castlingState, int enPassantColumn, int halfmoveClock)
+{
+	BoardState board;
+	memcpy(board.m_board, packedBoard, sizeof(board.m_board));
+	board.m_nextMoveSide = nextMove;
+	board.m_hasPieceMoved = std::bitset<6>(castlingState);
+	board.m_enPassantCol = enPassantColumn >= 0 && enPassantColumn < 8 ? static_cast<byte>(enPassantColumn) : -1;
+	board.m_halfmoveClock = static_cast<byte>(halfmoveClock);
+	board.InitializeKingPositions();
+	board.InitializeKey();
+	return board;
 }
 
 void BoardState::InitializeKingPositions()
@@ -40,6 +94,44 @@ void BoardState::InitializeKingPositions()
 }
 
 
+void BoardState::InitializeKey()
+{
+	m_key = StateKey();
+	m_pawnKey = 0;
+	for (auto loc : *this)
+	{
+		const auto p = Get(loc);
+		m_key ^= PieceKey(p, loc.Raw());
+		if (p.Type == PieceType::Pawn)
+		{
+			m_pawnKey ^= PieceKey(p, loc.Raw());
+		}
+	}
+}
+
+PositionKey BoardState::PieceKey(Piece p, byte location)
+{
+	return g_zobrist.Pieces[p.RawValue & 0xf][location];
+}
+
+PositionKey BoardState::StateKey() const
+{
+	PositionKey key = 0;
+	if (m_nextMoveSide == SideType::Black)
+	{
+		key ^= g_zobrist.BlackToMove;
+	}
+	for (int i = 0; i < 6; ++i)
+	{
+		if (m_hasPieceMoved.test(i)) key ^= g_zobrist.PieceMoved[i];
+	}
+	if (m_enPassantCol < 8)
+	{
+		key ^= g_zobrist.EnPassantCol[m_enPassantCol];
+	}
+	return key;
+}
+
 
 PieceType GetPieceType(const char ch)
 {
@@ -87,51 +179,79 @@ int GetEnPassantRow(SideType side)
 
 BoardState::MoveCollection BoardState::ValidMoves() const
 {
-	MoveCollection collection;
-	const static int pawnDirection[] = { -1, 1 };
+	ChessMove moves[MaxMoves];
+	const int count = ValidMoves(moves);
+	return MoveCollection(moves, moves + count);
+}
+
+int BoardState::ValidMoves(ChessMove* moves) const
+{
+	return m_nextMoveSide == SideType::White ? ValidMoves<SideType::White>(moves) : ValidMoves<SideType::Black>(moves);
+}
+
+template <SideType Side>
+int BoardState::ValidMoves(ChessMove* moves) const
+{
+	assert(Side == NextSide());
+	int count = 0;
+	auto add = [&](BoardLocation from, BoardLocation to)
+	{
+		moves[count].From = from;
+		moves[count].To = to;
+		moves[count].PromotionPiece = PieceType::Empty;
+		++count;
+	};
 
 	for (auto from : *this)
 	{
 		auto fromPiece = Get(from);		
-		if (fromPiece.Type != PieceType::Empty && fromPiece.Side == m_nextMoveSide)
+		if (fromPiece.Type != PieceType::Empty && fromPiece.Side == Side)
 		{
 			switch (fromPiece.Type)
 			{
 			case (int)PieceType::Pawn:
 				{
-					const int dir = pawnDirection[static_cast<int>(m_nextMoveSide)];
+					const int dir = SideTraits<Side>::PawnDirection;
 					const int x = from.X();
 					const int y = from.Y();
 					BoardLocation to(x, y + dir, true);
-					if (to.IsValid() && CanMove(from, to)) collection.push_back({ from, to });
+					if (to.IsValid() && CanMove<Side>(from, to)) add(from, to);
 
 					to = BoardLocation(x, y + dir + dir, true);
-					if (to.IsValid() && CanMove(from, to)) collection.push_back({ from, to });
+					if (to.IsValid() && CanMove<Side>(from, to)) add(from, to);
 
 					to = BoardLocation(x - 1, y + dir, true);
-					if (to.IsValid() && CanMove(from, to)) collection.push_back({ from, to });
+					if (to.IsValid() && CanMove<Side>(from, to)) add(from, to);
 
 					to = BoardLocation(x + 1, y + dir, true);
-					if (to.IsValid() && CanMove(from, to)) collection.push_back({ from, to });
+					if (to.IsValid() && CanMove<Side>(from, to)) add(from, to);
 					break;
 				}
 			default:
 				for (auto to : *this)
 				{
-					if (CanMove(from, to))
+					if (CanMove<Side>(from, to))
 					{
-						collection.push_back({ from, to });
+						add(from, to);
 					}
 				}
 			}						
 		}
 	}
-	return collection;
+	assert(count <= MaxMoves);
+	return count;
 }
 
 
 bool BoardState::CanMove(BoardLocation from, BoardLocation to) const
 {
+	return m_nextMoveSide == SideType::White ? CanMove<SideType::White>(from, to) : CanMove<SideType::Black>(from, to);
+}
+
+template <SideType Side>
+bool BoardState::CanMove(BoardLocation from, BoardLocation to) const
+{
+	typedef SideTraits<Side> Traits;
 	++g_canMoveCalls;
 
 	auto fromPiece = Get(from);
@@ -141,39 +261,23 @@ bool BoardState::CanMove(BoardLocation from, BoardLocation to) const
 	if (fromPiece.Type == PieceType::Empty) return false;
 
 	// It's not your turn
-	if (fromPiece.Side != m_nextMoveSide) return false;
+	if (fromPiece.Side != Side) return false;
 
 	// Can't capture own piece (also covers moving to same square)
 	if (toPiece.Type != PieceType::Empty && toPiece.Side == fromPiece.Side) return false;
 
-	const int xdist = abs(to.X() - from.X());
-	const int ydist = abs(to.Y() - from.Y());
+	const SquareSet target = SquareSet(1) << to.Raw();
 
 	if (fromPiece.Type == PieceType::Pawn)
 	{
-		int direction = (m_nextMoveSide == SideType::White) ? -1 : 1;
-		int startRow = (m_nextMoveSide == SideType::White) ? 6 : 1;
-
-		// Move correct direction
-		if (Sign(to.Y() - from.Y()) != direction) return false;
-
-		// Max 2 squares
-		if (ydist > 2) return false;
-
-		// 2 squares only ok from start position
-		if (ydist == 2 && from.Y() != startRow) return false;
-
 		// Capture
 		if (from.X() != to.X())
 		{
-			// Must be one square left or right
-			if (abs(from.X() - to.X()) != 1) return false;
-
-			// Must be one square in correct direction
-			if (ydist != 1) return false;
+			// Must be one square diagonally in correct direction
+			if (!(Geometry::PawnAttacks[static_cast<int>(Side)][from.Raw()] & target)) return false;
 
 			// en passant?
-			if (to.X() == m_enPassantCol && to.Y() == GetEnPassantRow(m_nextMoveSide))
+			if (to.X() == m_enPassantCol && to.Y() == Traits::EnPassantRow)
 			{
 				// that's en passant
 			}
@@ -185,46 +289,48 @@ bool BoardState::CanMove(BoardLocation from, BoardLocation to) const
 		}
 		else
 		{
+			// One square in correct direction, or 2 from start position
+			const int step = to.Y() - from.Y();
+			if (step != Traits::PawnDirection &&
+				(step != 2 * Traits::PawnDirection || from.Y() != Traits::PawnStartRow)) return false;
+
 			// non-diagonal movements can't capture
 			if (toPiece.Type != PieceType::Empty) return false;
-		}
 
-		// Ensure unobstructed for 2-square moves
-		if (IsObstructed(from, to)) return false;
+			// Ensure unobstructed for 2-square moves
+			if (IsObstructed(from, to)) return false;
+		}
 	}
 	else if (fromPiece.Type == PieceType::Bishop)
 	{
-		if (xdist != ydist) return false;
+		if (!(Geometry::BishopRays[from.Raw()] & target)) return false;
 		if (IsObstructed(from, to)) return false;
 	}
 	else if (fromPiece.Type == PieceType::Knight)
 	{
-		if (xdist + ydist != 3) return false;
-		if (xdist == 0 || ydist == 0) return false;
+		if (!(Geometry::KnightTargets[from.Raw()] & target)) return false;
 	}
 	else if (fromPiece.Type == PieceType::Rook)
 	{
-		if (xdist != 0 && ydist != 0) return false;
+		if (!(Geometry::RookRays[from.Raw()] & target)) return false;
 		if (IsObstructed(from, to)) return false;
 	}
 	else if (fromPiece.Type == PieceType::Queen)
 	{
-		const bool movingLikeRook = xdist == 0 || ydist == 0;
-		const bool movingLikeBishop = xdist == ydist;
-		if (!movingLikeBishop && !movingLikeRook) return false;
+		if (!((Geometry::RookRays[from.Raw()] | Geometry::BishopRays[from.Raw()]) & target)) return false;
 		if (IsObstructed(from, to)) return false;
 	}
 	else if (fromPiece.Type == PieceType::King)
 	{
 		// castling!  hacky, should this be done differently?
-		if (GetHomeRow(m_nextMoveSide) == from.Y() &&
-			ydist == 0 && from.X() == 4 && (to.X() == 2 || to.X() == 6))
+		if (Traits::HomeRow == from.Y() &&
+			to.Y() == from.Y() && from.X() == 4 && (to.X() == 2 || to.X() == 6))
 		{
-			if (!CanCastle(from, to)) return false;
+			if (!CanCastle<Side>(from, to)) return false;
 		}
 		else
 		{
-			if (xdist > 1 || ydist > 1) return false;
+			if (!(Geometry::KingTargets[from.Raw()] & target)) return false;
 		}
 	}
 	else
@@ -238,8 +344,8 @@ bool BoardState::CanMove(BoardLocation from, BoardLocation to) const
 	if (toPiece.Type != PieceType::King)
 	{
 		auto newState = *this;
-		newState.Move(from, to, true);
-		if (newState.CanTakeKing())
+		newState.MakeMove<Side>(from, to);
+		if (newState.CanTakeKing<Traits::Other>())
 		{
 			// If move is allowed, king can be taken
 			return false;
@@ -249,16 +355,32 @@ bool BoardState::CanMove(BoardLocation from, BoardLocation to) const
 	return true;
 }
 
+bool BoardState::IsObstructed(BoardLocation from, BoardLocation to) const
+{
+	const int step = Geometry::Step[from.Raw()][to.Raw()];
+	if (step == 0)
+	{
+		return false;
+	}
+	for (int square = from.Raw() + step; square != to.Raw(); square += step)
+	{
+		if (Get(static_cast<byte>(square)).Type != PieceType::Empty)
+		{
+			return true;
+		}
+	}
+	return false;
+}
 
+template <SideType Side>
 bool BoardState::CanCastle(BoardLocation from, BoardLocation to) const
 {
-	if (IsCheck())
+	if (IsCheck<Side>())
 	{
 		return false;
 	}
 
-	// Some math to avoid branching.  
-	const auto offset = static_cast<int>(m_nextMoveSide)* 3;
+	const auto offset = SideTraits<Side>::CastlingOffset;
 	if (m_hasPieceMoved.test(offset))
 	{
 		return false;
@@ -277,7 +399,7 @@ bool BoardState::CanCastle(BoardLocation from, BoardLocation to) const
 	{
 		rookLocation = BoardLocation(0, from.Y());
 	}	
-	if (Get(rookLocation) != Piece(PieceType::Rook, m_nextMoveSide))
+	if (Get(rookLocation) != Piece(PieceType::Rook, Side))
 	{
 		return false;
 	}
@@ -290,7 +412,7 @@ bool BoardState::CanCastle(BoardLocation from, BoardLocation to) const
 
 	// Can't castle through check
 	auto intermediate = BoardLocation((from.X() + to.X()) / 2, from.Y());
-	if (!CanMove(from, intermediate))
+	if (!CanMove<Side>(from, intermediate))
 	{
 		return false;
 	}
@@ -301,8 +423,28 @@ bool BoardState::CanCastle(BoardLocation from, BoardLocation to) const
 
 bool BoardState::MoveImpl(BoardLocation from, BoardLocation to, MoveCallback callback)
 {
+	return m_nextMoveSide == SideType::White ? MoveImpl<SideType::White>(from, to, callback) : MoveImpl<SideType::Black>(from, to, callback);
+}
+
+template <SideType Side>
+bool BoardState::MoveImpl(BoardLocation from, BoardLocation to, MoveCallback callback)
+{
+	typedef SideTraits<Side> Traits;
 	auto movingPiece = Get(from);
 
+	// Take the side/castling/en passant state out of the key, it's added back once updated
+	m_key ^= StateKey();
+
+	// Captures and pawn moves can't be undone, so earlier positions can't come back
+	if (movingPiece.Type == PieceType::Pawn || Get(to).Type != PieceType::Empty)
+	{
+		m_halfmoveClock = 0;
+	}
+	else if (m_halfmoveClock < 255)
+	{
+		++m_halfmoveClock;
+	}
+
 	if (Get(from).Type == PieceType::King)
 	{
 		if (from.X() + 2 == to.X())
@@ -326,6 +468,16 @@ bool BoardState::MoveImpl(BoardLocation from, BoardLocation to, MoveCallback cal
 
 	MovePiece(from, to, callback);
 
+	// Pawns reaching the far side always become queens
+	if (movingPiece.Type == PieceType::Pawn && to.Y() == Traits::PromotionRow)
+	{
+		Set(to, Piece(PieceType::Queen, Side));
+		if (callback)
+		{
+			callback(InvalidBoardLocation, to);
+		}
+	}
+
 	// Update state
 
 	if (movingPiece.Type == PieceType::Pawn && abs(from.Y() - to.Y()) == 2)
@@ -339,34 +491,40 @@ bool BoardState::MoveImpl(BoardLocation from, BoardLocation to, MoveCallback cal
 
 	if (movingPiece.Type == PieceType::King)
 	{
-		const int sideOffset = static_cast<int>(m_nextMoveSide)* 3;
-		m_hasPieceMoved.set(sideOffset);
+		m_hasPieceMoved.set(Traits::CastlingOffset);
 
-		m_kingPosition[static_cast<int>(m_nextMoveSide)] = to;
+		m_kingPosition[static_cast<int>(Side)] = to;
 	}
 
-	if (movingPiece.Type == PieceType::Rook && from.Y() == GetHomeRow(m_nextMoveSide))
+	if (movingPiece.Type == PieceType::Rook && from.Y() == Traits::HomeRow)
 	{
 		if (from.X() == 0 || from.X() == 7)
 		{
 			// Rook moving from starting pos, make sure to remember it moved
-			const int sideOffset = static_cast<int>(m_nextMoveSide)* 3;
-			m_hasPieceMoved.set(sideOffset + 1 + (from.X() / 7));
+			m_hasPieceMoved.set(Traits::CastlingOffset + 1 + (from.X() / 7));
 		}
 	}
 
-	this->m_nextMoveSide = m_nextMoveSide == SideType::White ? SideType::Black : SideType::White;
+	this->m_nextMoveSide = Traits::Other;
+
+	m_key ^= StateKey();
 
 	return true;
 }
 
+bool BoardState::CanTakeKing() const
+{
+	return m_nextMoveSide == SideType::White ? CanTakeKing<SideType::White>() : CanTakeKing<SideType::Black>();
+}
+
+template <SideType Side>
 bool BoardState::CanTakeKing() const
 {	
-	BoardLocation kingLoc(m_kingPosition[static_cast<int>(OtherSide(m_nextMoveSide))]);
+	BoardLocation kingLoc(m_kingPosition[static_cast<int>(SideTraits<Side>::Other)]);
 
 	for (auto from : *this)
 	{
-		if (CanMove(from, kingLoc))
+		if (CanMove<Side>(from, kingLoc))
 		{
 			return true;
 		}
@@ -374,7 +532,36 @@ bool BoardState::CanTakeKing() const
 	return false;
 }
 
+// Called from the search, which fixes the side to move when compiling
+template int BoardState::ValidMoves<SideType::White>(ChessMove* moves) const;
+template int BoardState::ValidMoves<SideType::Black>(ChessMove* moves) const;
+template bool BoardState::CanTakeKing<SideType::White>() const;
+template bool BoardState::CanTakeKing<SideType::Black>() const;
+template bool BoardState::MoveImpl<SideType::White>(BoardLocation from, BoardLocation to, MoveCallback callback);
+template bool BoardState::MoveImpl<SideType::Black>(BoardLocation from, BoardLocation to, MoveCallback callback);
+
 SideType OtherSide(SideType side)
 {
 	return static_cast<SideType>((static_cast<byte>(side)+1) % 2);
 }
+
+int PositionHistory::CountRepetitions(const BoardState& board) const
+{
+	assert(!m_keys.empty() && m_keys.back() == board.Key());
+
+	// Only positions since the last capture or pawn move can match, and only
+	// every other one has the same side to move.
+	const int size = static_cast<int>(m_keys.size());
+	const int limit = std::min(board.HalfmoveClock(), size - 1);
+	const auto key = board.Key();
+
+	int count = 0;
+	for (int back = 2; back <= limit; back += 2)
+	{
+		if (m_keys[size - 1 - back] == key)
+		{
+			++count;
+		}
+	}
+	return count;
+}
@@ -5,10 +5,16 @@
 #include <vector>
 #include <bitset>
 
-extern int g_canMoveCalls;
-extern int g_boardScoreCalls;
+// Counted by each thread for itself: every move generated and every
+// evaluation bumps one, so searches on several cores mustn't share them
+extern thread_local int g_canMoveCalls;
+extern thread_local int g_boardScoreCalls;
 
 typedef unsigned char byte;
+typedef unsigned long long PositionKey;
+
+// A bit per square, 1 << BoardLocation::Raw()
+typedef unsigned long long SquareSet;
 
 enum class PieceType : byte
 {
@@ -106,7 +112,7 @@ public:
 
 	BoardLocation(int x, int y, bool check=false)
 	{
-		if (check && (x < 0 || x > 7 || y < 0 || y > 8))
+		if (check && (x < 0 || x > 7 || y < 0 || y > 7))
 		{
 			m_sq = 64;
 		}
@@ -169,9 +175,12 @@ public:
 		return !(*this == other);
 	}
 
+	// Algebraic name of the square, e.g. "e4"
 	std::string ToString() const
 	{
-		return "xx";
+		if (!IsValid()) return "-";
+		const char name[] = { static_cast<char>('a' + X()), static_cast<char>('8' - Y()), 0 };
+		return name;
 	}
 
 private:
@@ -208,6 +217,36 @@ int GetHomeRow(SideType side);
 int GetEnPassantRow(SideType side);
 SideType OtherSide(SideType side);
 
+// What differs between the sides, fixed when compiling, so move generation
+// and the search templated on the side to move need no branches or lookups
+// for it.  Rows count down from Black's side of the board.
+template <SideType Side>
+struct SideTraits;
+
+template <>
+struct SideTraits<SideType::White>
+{
+	static constexpr SideType Other = SideType::Black;
+	static constexpr int PawnDirection = -1;
+	static constexpr int PawnStartRow = 6;
+	static constexpr int HomeRow = 7;
+	static constexpr int PromotionRow = 0;
+	static constexpr int EnPassantRow = 2;		// where the side's pawns land capturing en passant
+	static constexpr int CastlingOffset = 0;	// of the side's bits in m_hasPieceMoved
+};
+
+template <>
+struct SideTraits<SideType::Black>
+{
+	static constexpr SideType Other = SideType::White;
+	static constexpr int PawnDirection = 1;
+	static constexpr int PawnStartRow = 1;
+	static constexpr int HomeRow = 0;
+	static constexpr int PromotionRow = 7;
+	static constexpr int EnPassantRow = 5;
+	static constexpr int CastlingOffset = 3;
+};
+
 
 // Encapsulate one chess move
 class ChessMove
@@ -232,6 +271,9 @@ public:
 	BoardState()
 		: m_nextMoveSide(SideType::White)
 		, m_enPassantCol(-1)
+		, m_halfmoveClock(0)
+		, m_key(0)
+		, m_pawnKey(0)
 	{
 		static_assert(static_cast<int>(PieceType::King) < (1 << 3), "Ensure PieceType can fit in 3 bits");
 
@@ -259,10 +301,15 @@ public:
 		}
 
 		InitializeKingPositions();
+		InitializeKey();
 	}
 
 	BoardState(const char* board, SideType nextMove);	
 
+	// Forsyth-Edwards notation, the move number is accepted but not kept
+	static BoardState FromFen(const char* fen);
+	std::string ToFen() const;
+
 #ifdef ENABLE_PRINT
 	void Print() const
 	{
@@ -300,26 +347,16 @@ public:
 		return (0 < x) - (x < 0);
 	}
 
-	bool IsObstructed(BoardLocation from, BoardLocation to) const
-	{
-		int dx = Sign(to.X() - from.X());
-		int dy = Sign(to.Y() - from.Y());
+	// Whether any square between the two is taken.  False unless they're on
+	// one rank, file or diagonal.
+	bool IsObstructed(BoardLocation from, BoardLocation to) const;
 
-		for (
-			auto it = BoardLocation(from.X() + dx, from.Y() + dy);
-			it != to;
-			it = BoardLocation(it.X() + dx, it.Y() + dy))
-		{
-			if (Get(it).Type != PieceType::Empty)
-			{
-				return true;
-			}
-		}
-		return false;
-	}
+	bool CanMove(BoardLocation from, BoardLocation to) const;
 
-	inline bool CanMove(BoardLocation from, BoardLocation to) const;
-	bool CanCastle(BoardLocation from, BoardLocation to) const;
+	// For Side to move, whether or not it's Side's turn, so one side's
+	// attacks can be tested with the other to move
+	template <SideType Side>
+	bool CanMove(BoardLocation from, BoardLocation to) const;
 
 	typedef std::function<void(BoardLocation, BoardLocation)> MoveCallback;
 
@@ -338,20 +375,34 @@ public:
 		return MoveImpl(from, to, callback);
 	}
 
+	// A move known to be valid, by Side, which is to move.  The search
+	// makes its moves with this, having fixed the side when compiling.
+	template <SideType Side>
+	void MakeMove(BoardLocation from, BoardLocation to)
+	{
+		MoveImpl<Side>(from, to);
+	}
+
 	bool MovePgn(const char* pgn);
+	ChessMove ParsePgnMove(const char* pgn) const;
 
 	bool CanTakeKing() const;
+
+	// Side could take the other side's king
+	template <SideType Side>
+	bool CanTakeKing() const;
 	
 	bool IsCheck() const
 	{
-		// This is check if the opponent could take the king if she had another free move
-		auto temp = *this;
-		temp.m_nextMoveSide = OtherSide(temp.m_nextMoveSide);
-		if (temp.CanTakeKing())
-		{
-			return true;
-		}
-		return false;
+		return m_nextMoveSide == SideType::White ? IsCheck<SideType::White>() : IsCheck<SideType::Black>();
+	}
+
+	// Side's king is in check: the opponent could take it if she had
+	// another free move
+	template <SideType Side>
+	bool IsCheck() const
+	{
+		return CanTakeKing<SideTraits<Side>::Other>();
 	}
 
 	bool IsCheckmate() const
@@ -428,15 +479,108 @@ public:
 	typedef std::vector<ChessMove> MoveCollection;
 	MoveCollection ValidMoves() const;
 
+	// Room enough for the moves of any position
+	static const int MaxMoves = 256;
+
+	// Writes the moves to a buffer of at least MaxMoves, for callers that
+	// keep their own memory, and returns how many there are
+	int ValidMoves(ChessMove* moves) const;
+
+	// The same with Side, which must be the side to move, fixed when compiling
+	template <SideType Side>
+	int ValidMoves(ChessMove* moves) const;
+
 	SideType NextSide() const
 	{
 		return m_nextMoveSide;
 	}
 
+	// Zobrist key of the position, kept up to date incrementally as pieces move
+	PositionKey Key() const
+	{
+		return m_key;
+	}
+
+	// Zobrist key of just the pawns, for caching pawn structure scores
+	PositionKey PawnKey() const
+	{
+		return m_pawnKey;
+	}
+
+	// Number of half-moves since the last capture or pawn move
+	int HalfmoveClock() const
+	{
+		return m_halfmoveClock;
+	}
+
+	// True while neither the king nor the given rook has moved off its starting square
+	bool HasCastlingRight(SideType side, bool kingSide) const
+	{
+		const int offset = static_cast<int>(side) * 3;
+		const BoardLocation rookLocation(kingSide ? 7 : 0, GetHomeRow(side));
+		return !m_hasPieceMoved.test(offset)
+			&& !m_hasPieceMoved.test(offset + (kingSide ? 2 : 1))
+			&& Get(BoardLocation(4, GetHomeRow(side))) == Piece(PieceType::King, side)
+			&& Get(rookLocation) == Piece(PieceType::Rook, side);
+	}
+
+	BoardLocation KingLocation(SideType side) const
+	{
+		return m_kingPosition[static_cast<int>(side)];
+	}
+
+	// The board as stored, a nibble per square, for saving positions compactly
+	const unsigned char* PackedBoard() const
+	{
+		return m_board;
+	}
+
+	// Which kings and rooks have moved, a bit each in the order listed by m_hasPieceMoved
+	byte CastlingState() const
+	{
+		return static_cast<byte>(m_hasPieceMoved.to_ulong());
+	}
+
+	static BoardState FromPacked(const unsigned char* packedBoard, SideType nextMove, byte castlingState, int enPassantColumn, int halfmoveClock);
+
+	// For positions set up mid-game, where the kings and rooks may have moved already
+	void RemoveCastlingRights()
+	{
+		m_key ^= StateKey();
+		m_hasPieceMoved.set();
+		m_key ^= StateKey();
+	}
+
+	// Passes the move to the other side without moving anything, as the
+	// search does for null-move pruning
+	void MakeNullMove()
+	{
+		m_key ^= StateKey();
+		m_nextMoveSide = OtherSide(m_nextMoveSide);
+		m_enPassantCol = static_cast<byte>(-1);
+		m_key ^= StateKey();
+	}
+
+	int EnPassantColumn() const
+	{
+		return m_enPassantCol < 8 ? m_enPassantCol : -1;
+	}
+
+	bool IsFiftyMoveDraw() const
+	{
+		return m_halfmoveClock >= 100 && !IsCheckmate();
+	}
+
 protected:
 
 	bool MoveImpl(BoardLocation from, BoardLocation to, MoveCallback callback = nullptr);
 
+	template <SideType Side>
+	bool MoveImpl(BoardLocation from, BoardLocation to, MoveCallback callback = nullptr);
+
+	template <SideType Side>
+	bool CanCastle(BoardLocation from, BoardLocation to) const;
+
 	void MovePiece(BoardLocation from, BoardLocation to, MoveCallback callback)
 	{
 		if (callback)
@@ -466,12 +610,21 @@ protected:
 		const byte mask = 0xf << adjustment;
 		const byte maskedValue = (p.RawValue << adjustment) & mask;
 
+		const auto old = Get(loc);
+		m_key ^= PieceKey(old, location) ^ PieceKey(p, location);
+		if (old.Type == PieceType::Pawn) m_pawnKey ^= PieceKey(old, location);
+		if (p.Type == PieceType::Pawn) m_pawnKey ^= PieceKey(p, location);
+
 		m_board[location / 2] = maskedValue | (m_board[location / 2] & ~mask);
 
 		assert(Get(loc) == p);
 	}
 
 	void InitializeKingPositions();
+	void InitializeKey();
+
+	static PositionKey PieceKey(Piece p, byte location);
+	PositionKey StateKey() const;
 
 	// We can fit the board into 32 bytes, each square takes a nibble
 	unsigned char m_board[32];
@@ -488,7 +641,71 @@ protected:
 
 	SideType m_nextMoveSide : 1;
 	byte m_enPassantCol;
+	byte m_halfmoveClock;
 	BoardLocation m_kingPosition[2];
+	PositionKey m_key;
+	PositionKey m_pawnKey;
+};
+
+
+// Keys of every position reached so far, oldest first.  The game pushes one
+// after each move, and the search pushes and pops on top of that as it walks
+// the tree, so repetitions are found across the game/search boundary.
+class PositionHistory
+{
+public:
+	void Push(PositionKey key)
+	{
+		m_keys.push_back(key);
+	}
+
+	void Pop()
+	{
+		m_keys.pop_back();
+	}
+
+	PositionKey Top() const
+	{
+		return m_keys.back();
+	}
+
+	bool Empty() const
+	{
+		return m_keys.empty();
+	}
+
+	size_t Size() const
+	{
+		return m_keys.size();
+	}
+
+	void Clear()
+	{
+		m_keys.clear();
+	}
+
+	// Makes room for count keys in all, so pushing up to there never allocates
+	void Reserve(size_t count)
+	{
+		m_keys.reserve(count);
+	}
+
+	// How many times the current position (the top of the history) occurred before
+	int CountRepetitions(const BoardState& board) const;
+
+	// Two-fold is enough inside the search: if the position can repeat once it can repeat again
+	bool IsRepetition(const BoardState& board) const
+	{
+		return CountRepetitions(board) >= 1;
+	}
+
+	bool IsThreefoldRepetition(const BoardState& board) const
+	{
+		return CountRepetitions(board) >= 2;
+	}
+
+private:
+	std::vector<PositionKey> m_keys;
 };
 
 
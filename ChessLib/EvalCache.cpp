@@ -0,0 +1,28 @@
+#include "stdafx.h"
+#include "EvalCache.h"
+#include <algorithm>
+
+EvalCache::EvalCache(size_t megabytes)
+	: m_mask(0)
+{
+	Resize(megabytes);
+}
+
+void EvalCache::Resize(size_t megabytes)
+{
+	// Round down to a power of two so a mask picks the slot
+	const size_t bytes = (megabytes ? megabytes : 1) * 1024 * 1024;
+	size_t slots = 1;
+	while (slots * 2 * sizeof(Slot) <= bytes)
+	{
+		slots *= 2;
+	}
+
+	m_slots.assign(slots, Slot());
+	m_mask = slots - 1;
+}
+
+void EvalCache::Clear()
+{
+	std::fill(m_slots.begin(), m_slots.end(), Slot());
+}
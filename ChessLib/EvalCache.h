@@ -0,0 +1,60 @@
+#pragma once
+
+#include "BoardState.h"
+
+// Static evaluations keyed by Zobrist key, so a leaf seen again (in a later
+// iteration, or through a transposition the TranspositionTable has since
+// dropped) costs a probe instead of generating moves and evaluating.
+//
+// Shared by all the search threads without locking, in the same way as
+// TranspositionTable: each slot stores its key XORed with its data, so a
+// slot torn by two threads writing at once is just a miss.  Slots are
+// always replaced.
+class EvalCache
+{
+public:
+	explicit EvalCache(size_t megabytes = 2);
+
+	EvalCache(const EvalCache&) = delete;
+	EvalCache& operator=(const EvalCache&) = delete;
+
+	// Drops everything stored so far
+	void Resize(size_t megabytes);
+	void Clear();
+
+	bool Probe(PositionKey key, int* score) const
+	{
+		const auto& slot = m_slots[key & m_mask];
+		const auto data = slot.Data;
+		if ((slot.KeyXorData ^ data) != key || data == 0)
+		{
+			return false;
+		}
+		*score = static_cast<int>(static_cast<unsigned>(data));
+		return true;
+	}
+
+	void Store(PositionKey key, int score)
+	{
+		// The flag keeps a score of 0 from looking like an empty slot
+		const unsigned long long data = static_cast<unsigned>(score) | (1ull << 32);
+		auto& slot = m_slots[key & m_mask];
+		slot.KeyXorData = key ^ data;
+		slot.Data = data;
+	}
+
+	size_t SizeInMegabytes() const
+	{
+		return m_slots.size() * sizeof(Slot) / (1024 * 1024);
+	}
+
+private:
+	struct Slot
+	{
+		unsigned long long KeyXorData;
+		unsigned long long Data;
+	};
+
+	std::vector<Slot> m_slots;
+	size_t m_mask;
+};
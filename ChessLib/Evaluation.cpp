@@ -0,0 +1,522 @@
+#include "stdafx.h"
+#include "Evaluation.h"
+#include <algorithm>
+#include <fstream>
+#include <sstream>
+
+// Chosen when compiling, as for NnueNetwork
+#if defined(__AVX2__)
+#define EVAL_AVX2
+#include <immintrin.h>
+#elif defined(__SSE4_1__) || defined(__AVX__)
+#define EVAL_SSE41
+#include <smmintrin.h>
+#endif
+
+namespace
+{
+	const char* PieceNames[] = { "Pawn", "Bishop", "Knight", "Rook", "Queen", "King" };
+
+	// Black's pieces use the square mirrored onto White's side of the board
+	int PieceSquareIndex(Piece piece, BoardLocation loc)
+	{
+		const int square = piece.Side == SideType::White ? loc.Raw() : loc.Raw() ^ 56;
+		return EvalWeights::PieceSquare + (static_cast<int>(piece.Type) - 1) * 64 + square;
+	}
+
+	// Positions a vector holds; EvalBatch keeps room for a whole number of them
+	const size_t BatchLanes = 16;
+
+	// What a piece on a square adds to White's score, by the square's nibble
+	typedef int SquareTable[64][16];
+
+	void FillSquareTable(const EvalWeights& weights, SquareTable& table)
+	{
+		const static int multiplier[] = { 1, -1 };
+		for (int square = 0; square < 64; ++square)
+		{
+			for (int nibble = 0; nibble < 16; ++nibble)
+			{
+				const auto type = static_cast<PieceType>(nibble & 7);
+				if (type == PieceType::Empty || type == PieceType::Invalid)
+				{
+					table[square][nibble] = 0;
+					continue;
+				}
+
+				const Piece p(static_cast<byte>(nibble));
+				int score = weights[PieceSquareIndex(p, BoardLocation(static_cast<byte>(square)))];
+				score += type == PieceType::King ? EvalWeights::KingValue : weights[EvalWeights::Material + static_cast<int>(type) - 1];
+				table[square][nibble] = score * multiplier[static_cast<int>(p.Side)];
+			}
+		}
+	}
+}
+
+EvalWeights::EvalWeights()
+	: m_weights(Count, 0)
+{
+	const static int scores[] = { 1000, 3000, 3000, 5000, 9000 };
+	for (int i = 0; i < 5; ++i)
+	{
+		m_weights[Material + i] = scores[i];
+	}
+	m_weights[Mobility] = 1;
+
+	const static int passed[] = { 50, 100, 200, 350, 600, 1000 };
+	for (int i = 0; i < 6; ++i)
+	{
+		m_weights[PassedPawn + i] = passed[i];
+	}
+	m_weights[DoubledPawn] = -150;
+	m_weights[IsolatedPawn] = -100;
+}
+
+int EvalWeights::Evaluate(const BoardState& board, int moveCount, PawnTable* pawns) const
+{
+	const static int multiplier[] = { 1, -1 };
+	int total = 0;
+
+	for (auto loc : board)
+	{
+		const auto p = board.Get(loc);
+		if (p.Type == PieceType::Empty)
+		{
+			continue;
+		}
+
+		int score = m_weights[PieceSquareIndex(p, loc)];
+		score += p.Type == PieceType::King ? KingValue : m_weights[Material + static_cast<int>(p.Type) - 1];
+		total += score * multiplier[static_cast<int>(p.Side)];
+	}
+
+	total += m_weights[Mobility] * moveCount * multiplier[static_cast<int>(board.NextSide())];
+	total += pawns ? pawns->Probe(*this, board).Score : EvaluatePawns(board);
+	return total;
+}
+
+int EvalWeights::EvaluatePawns(const BoardState& board) const
+{
+	return PawnStructure(board).Score(*this);
+}
+
+void EvalWeights::GetFeatures(const BoardState& board, int moveCount, std::vector<Feature>& features)
+{
+	const static short multiplier[] = { 1, -1 };
+
+	// Material is a count per type, so it's summed up before it's added
+	short material[5] = {};
+	features.clear();
+
+	for (auto loc : board)
+	{
+		const auto p = board.Get(loc);
+		if (p.Type == PieceType::Empty)
+		{
+			continue;
+		}
+
+		const Feature square = { static_cast<unsigned short>(PieceSquareIndex(p, loc)), multiplier[static_cast<int>(p.Side)] };
+		features.push_back(square);
+		if (p.Type != PieceType::King)
+		{
+			material[static_cast<int>(p.Type) - 1] += multiplier[static_cast<int>(p.Side)];
+		}
+	}
+
+	for (int i = 0; i < 5; ++i)
+	{
+		if (material[i] != 0)
+		{
+			const Feature count = { static_cast<unsigned short>(Material + i), material[i] };
+			features.push_back(count);
+		}
+	}
+
+	const PawnStructure pawns(board);
+	for (int i = 0; i < PawnTerms; ++i)
+	{
+		if (pawns.Counts[i] != 0)
+		{
+			const Feature count = { static_cast<unsigned short>(PassedPawn + i), static_cast<short>(pawns.Counts[i]) };
+			features.push_back(count);
+		}
+	}
+
+	if (moveCount != 0)
+	{
+		const Feature mobility = { static_cast<unsigned short>(Mobility), static_cast<short>(moveCount * multiplier[static_cast<int>(board.NextSide())]) };
+		features.push_back(mobility);
+	}
+}
+
+std::string EvalWeights::Name(int index)
+{
+	if (index >= Material && index < Mobility)
+	{
+		return std::string("Material.") + PieceNames[index - Material];
+	}
+	if (index == Mobility)
+	{
+		return "Mobility";
+	}
+	if (index >= PieceSquare && index < PassedPawn)
+	{
+		const int offset = index - PieceSquare;
+		return std::string("PieceSquare.") + PieceNames[offset / 64] + "." + BoardLocation(static_cast<byte>(offset % 64)).ToString();
+	}
+	if (index >= PassedPawn && index < DoubledPawn)
+	{
+		return std::string("PassedPawn.Rank") + static_cast<char>('2' + index - PassedPawn);
+	}
+	if (index == DoubledPawn)
+	{
+		return "DoubledPawn";
+	}
+	if (index == IsolatedPawn)
+	{
+		return "IsolatedPawn";
+	}
+	return std::string();
+}
+
+bool EvalWeights::Load(const char* path)
+{
+	std::ifstream input(path);
+	if (!input)
+	{
+		return false;
+	}
+
+	std::vector<std::string> names;
+	for (int i = 0; i < Count; ++i)
+	{
+		names.push_back(Name(i));
+	}
+
+	std::string line;
+	while (std::getline(input, line))
+	{
+		std::istringstream fields(line);
+		std::string name;
+		int value;
+		if (!(fields >> name) || name[0] == '#')
+		{
+			continue;
+		}
+		if (!(fields >> value))
+		{
+			return false;
+		}
+
+		const auto it = std::find(names.begin(), names.end(), name);
+		if (it == names.end())
+		{
+			return false;
+		}
+		m_weights[it - names.begin()] = value;
+	}
+	return true;
+}
+
+bool EvalWeights::Save(const char* path) const
+{
+	std::ofstream output(path);
+	for (int i = 0; i < Count; ++i)
+	{
+		output << Name(i) << " " << m_weights[i] << "\n";
+	}
+	return !output.fail();
+}
+
+PawnStructure::PawnStructure(const BoardState& board)
+{
+	for (auto& count : Counts) count = 0;
+	Passed[0] = Passed[1] = 0;
+
+	// For each side and file, a bit per row with one of its pawns on
+	byte rows[2][10] = {};
+	for (auto loc : board)
+	{
+		const auto p = board.Get(loc);
+		if (p.Type == PieceType::Pawn)
+		{
+			rows[static_cast<int>(p.Side)][loc.X() + 1] |= 1 << loc.Y();
+		}
+	}
+
+	const static int multiplier[] = { 1, -1 };
+	for (int side = 0; side < 2; ++side)
+	{
+		for (int x = 0; x < 8; ++x)
+		{
+			const int own = rows[side][x + 1];
+			if (own == 0)
+			{
+				continue;
+			}
+
+			int count = 0;
+			for (int bits = own; bits != 0; bits &= bits - 1)
+			{
+				++count;
+			}
+			Counts[EvalWeights::DoubledPawn - EvalWeights::PassedPawn] += (count - 1) * multiplier[side];
+			if ((rows[side][x] | rows[side][x + 2]) == 0)
+			{
+				Counts[EvalWeights::IsolatedPawn - EvalWeights::PassedPawn] += count * multiplier[side];
+			}
+
+			// Passed when no enemy pawn is ahead of it on its file or the ones next to it.
+			// White's pawns head for row 0, Black's for row 7.
+			const int enemy = rows[1 - side][x] | rows[1 - side][x + 1] | rows[1 - side][x + 2];
+			for (int y = 0; y < 8; ++y)
+			{
+				if ((own & (1 << y)) == 0)
+				{
+					continue;
+				}
+				const int ahead = side == 0 ? (1 << y) - 1 : 0xff & ~((2 << y) - 1);
+				const int rank = side == 0 ? 7 - y : y;
+				if ((enemy & ahead) == 0 && rank >= 1 && rank <= 6)
+				{
+					Counts[rank - 1] += multiplier[side];
+					Passed[side] |= 1ull << BoardLocation(x, y).Raw();
+				}
+			}
+		}
+	}
+}
+
+int PawnStructure::Score(const EvalWeights& weights) const
+{
+	int total = 0;
+	for (int i = 0; i < EvalWeights::PawnTerms; ++i)
+	{
+		total += weights[EvalWeights::PassedPawn + i] * Counts[i];
+	}
+	return total;
+}
+
+PawnTable::PawnTable(size_t entries)
+	: m_mask(0)
+	, m_hits(0)
+	, m_misses(0)
+{
+	size_t size = 1;
+	while (size * 2 <= entries)
+	{
+		size *= 2;
+	}
+	m_entries.resize(size);
+	m_mask = size - 1;
+	Clear();
+}
+
+void PawnTable::Clear()
+{
+	// Key 0 is no pawns at all, which scores nothing, so empty entries are right as they are
+	const Entry empty = { 0, 0, { 0, 0 } };
+	std::fill(m_entries.begin(), m_entries.end(), empty);
+	m_hits = 0;
+	m_misses = 0;
+}
+
+const PawnTable::Entry& PawnTable::Probe(const EvalWeights& weights, const BoardState& board)
+{
+	const auto key = board.PawnKey();
+	auto& entry = m_entries[key & m_mask];
+	if (entry.Key == key)
+	{
+		++m_hits;
+		return entry;
+	}
+
+	++m_misses;
+	const PawnStructure pawns(board);
+	entry.Key = key;
+	entry.Score = pawns.Score(weights);
+	entry.Passed[0] = pawns.Passed[0];
+	entry.Passed[1] = pawns.Passed[1];
+	return entry;
+}
+
+EvalBatch::EvalBatch()
+	: m_size(0)
+	, m_stride(0)
+{
+}
+
+void EvalBatch::Clear()
+{
+	m_size = 0;
+	std::fill(m_squares.begin(), m_squares.end(), static_cast<byte>(0));
+	std::fill(m_terms.begin(), m_terms.end(), 0);
+}
+
+void EvalBatch::Add(const BoardState& board)
+{
+	Add(board, static_cast<int>(board.ValidMoves().size()));
+}
+
+void EvalBatch::Add(const BoardState& board, int moveCount)
+{
+	if (m_size == m_stride)
+	{
+		Grow();
+	}
+
+	const auto packed = board.PackedBoard();
+	for (int square = 0; square < 64; ++square)
+	{
+		m_squares[square * m_stride + m_size] = (packed[square / 2] >> ((square % 2) * 4)) & 0xf;
+	}
+	m_terms[m_size] = board.NextSide() == SideType::White ? moveCount : -moveCount;
+	const PawnStructure pawns(board);
+	for (int term = 1; term < TermCount; ++term)
+	{
+		m_terms[term * m_stride + m_size] = pawns.Counts[term - 1];
+	}
+	++m_size;
+}
+
+// Doubles the room, moving each row to its new place.  The rows are padded
+// with empty squares and zero counts, which score nothing.
+void EvalBatch::Grow()
+{
+	const size_t stride = m_stride == 0 ? BatchLanes * 4 : m_stride * 2;
+	std::vector<byte> squares(64 * stride, 0);
+	for (int square = 0; square < 64; ++square)
+	{
+		std::copy(m_squares.begin() + square * m_stride, m_squares.begin() + square * m_stride + m_size, squares.begin() + square * stride);
+	}
+	std::vector<int> terms(TermCount * stride, 0);
+	for (int term = 0; term < TermCount; ++term)
+	{
+		std::copy(m_terms.begin() + term * m_stride, m_terms.begin() + term * m_stride + m_size, terms.begin() + term * stride);
+	}
+	m_squares.swap(squares);
+	m_terms.swap(terms);
+	m_stride = stride;
+}
+
+void EvalBatch::Evaluate(const EvalWeights& weights, std::vector<int>& scores) const
+{
+	SquareTable table;
+	FillSquareTable(weights, table);
+	int termWeights[TermCount];
+	termWeights[0] = weights[EvalWeights::Mobility];
+	for (int term = 1; term < TermCount; ++term)
+	{
+		termWeights[term] = weights[EvalWeights::PassedPawn + term - 1];
+	}
+
+	// Worked out for every lane, padding included, then cut back
+	scores.resize(m_stride);
+
+#if defined(EVAL_AVX2)
+	// Eight positions a time.  A square's sixteen weights fill two registers,
+	// White's pieces then Black's; each position's nibble picks from both and
+	// its side bit chooses between them.
+	for (size_t i = 0; i < m_stride; i += 8)
+	{
+		__m256i total = _mm256_setzero_si256();
+		for (int term = 0; term < TermCount; ++term)
+		{
+			const __m256i counts = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(&m_terms[term * m_stride + i]));
+			total = _mm256_add_epi32(total, _mm256_mullo_epi32(_mm256_set1_epi32(termWeights[term]), counts));
+		}
+		for (int square = 0; square < 64; ++square)
+		{
+			const __m256i nibbles = _mm256_cvtepu8_epi32(_mm_loadl_epi64(reinterpret_cast<const __m128i*>(&m_squares[square * m_stride + i])));
+			const __m256i white = _mm256_permutevar8x32_epi32(_mm256_loadu_si256(reinterpret_cast<const __m256i*>(&table[square][0])), nibbles);
+			const __m256i black = _mm256_permutevar8x32_epi32(_mm256_loadu_si256(reinterpret_cast<const __m256i*>(&table[square][8])), nibbles);
+			const __m256 side = _mm256_castsi256_ps(_mm256_slli_epi32(nibbles, 28));
+			const __m256i score = _mm256_castps_si256(_mm256_blendv_ps(_mm256_castsi256_ps(white), _mm256_castsi256_ps(black), side));
+			total = _mm256_add_epi32(total, score);
+		}
+		_mm256_storeu_si256(reinterpret_cast<__m256i*>(&scores[i]), total);
+	}
+#elif defined(EVAL_SSE41)
+	// Sixteen positions a time.  A byte shuffle looks up sixteen nibbles at
+	// once, so the table is split into four planes, one per byte of the
+	// weights, which are put back together into four vectors of scores.
+	std::vector<byte> planes(64 * 4 * 16);
+	for (int square = 0; square < 64; ++square)
+	{
+		for (int nibble = 0; nibble < 16; ++nibble)
+		{
+			const unsigned value = static_cast<unsigned>(table[square][nibble]);
+			for (int plane = 0; plane < 4; ++plane)
+			{
+				planes[(square * 4 + plane) * 16 + nibble] = static_cast<byte>(value >> (plane * 8));
+			}
+		}
+	}
+
+	for (size_t i = 0; i < m_stride; i += 16)
+	{
+		__m128i total[4];
+		for (int k = 0; k < 4; ++k)
+		{
+			total[k] = _mm_setzero_si128();
+			for (int term = 0; term < TermCount; ++term)
+			{
+				const __m128i counts = _mm_loadu_si128(reinterpret_cast<const __m128i*>(&m_terms[term * m_stride + i + k * 4]));
+				total[k] = _mm_add_epi32(total[k], _mm_mullo_epi32(_mm_set1_epi32(termWeights[term]), counts));
+			}
+		}
+
+		for (int square = 0; square < 64; ++square)
+		{
+			const __m128i nibbles = _mm_loadu_si128(reinterpret_cast<const __m128i*>(&m_squares[square * m_stride + i]));
+			const __m128i* plane = reinterpret_cast<const __m128i*>(&planes[square * 4 * 16]);
+			const __m128i b0 = _mm_shuffle_epi8(_mm_loadu_si128(plane), nibbles);
+			const __m128i b1 = _mm_shuffle_epi8(_mm_loadu_si128(plane + 1), nibbles);
+			const __m128i b2 = _mm_shuffle_epi8(_mm_loadu_si128(plane + 2), nibbles);
+			const __m128i b3 = _mm_shuffle_epi8(_mm_loadu_si128(plane + 3), nibbles);
+
+			const __m128i low01 = _mm_unpacklo_epi8(b0, b1);
+			const __m128i high01 = _mm_unpackhi_epi8(b0, b1);
+			const __m128i low23 = _mm_unpacklo_epi8(b2, b3);
+			const __m128i high23 = _mm_unpackhi_epi8(b2, b3);
+			total[0] = _mm_add_epi32(total[0], _mm_unpacklo_epi16(low01, low23));
+			total[1] = _mm_add_epi32(total[1], _mm_unpackhi_epi16(low01, low23));
+			total[2] = _mm_add_epi32(total[2], _mm_unpacklo_epi16(high01, high23));
+			total[3] = _mm_add_epi32(total[3], _mm_unpackhi_epi16(high01, high23));
+		}
+
+		for (int k = 0; k < 4; ++k)
+		{
+			_mm_storeu_si128(reinterpret_cast<__m128i*>(&scores[i + k * 4]), total[k]);
+		}
+	}
+#else
+	for (size_t i = 0; i < m_stride; ++i)
+	{
+		int total = 0;
+		for (int term = 0; term < TermCount; ++term)
+		{
+			total += termWeights[term] * m_terms[term * m_stride + i];
+		}
+		for (int square = 0; square < 64; ++square)
+		{
+			total += table[square][m_squares[square * m_stride + i]];
+		}
+		scores[i] = total;
+	}
+#endif
+
+	scores.resize(m_size);
+}
+
+const char* EvalBatch::SimdName()
+{
+#if defined(EVAL_AVX2)
+	return "AVX2";
+#elif defined(EVAL_SSE41)
+	return "SSE4.1";
+#else
+	return "scalar";
+#endif
+}
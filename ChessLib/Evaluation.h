@@ -0,0 +1,184 @@
+#pragma once
+
+#include "BoardState.h"
+#include <string>
+#include <vector>
+
+class PawnTable;
+
+// The evaluation's parameters as one vector of weights.  A position's score
+// is linear in them: each weight times how often its feature occurs, White's
+// count less Black's.  That's what lets the tuner fit them to game results.
+//
+// The defaults are the engine's original material values and a point per
+// legal move, with the piece-square weights all zero, and pawn structure
+// terms of the usual sizes.
+class EvalWeights
+{
+public:
+	// Where each group of weights starts
+	enum
+	{
+		Material = 0,							// pawn to queen, by PieceType - 1
+		Mobility = Material + 5,				// per legal move of the side to move
+		PieceSquare = Mobility + 1,				// [PieceType - 1][square], squares from White's side
+		PassedPawn = PieceSquare + 6 * 64,		// by rank from the pawn's side, second to seventh
+		DoubledPawn = PassedPawn + 6,			// per pawn behind another on its file
+		IsolatedPawn = DoubledPawn + 1,			// per pawn with none of its side's on the files next to it
+		Count = IsolatedPawn + 1
+	};
+
+	// The pawn structure weights, which PawnTable caches the score of
+	static const int PawnTerms = Count - PassedPawn;
+
+	// Both sides always have one, so it isn't tuned
+	static const int KingValue = 100000;
+
+	// One non-zero feature of a position
+	struct Feature
+	{
+		unsigned short Index;
+		short Value;
+	};
+
+	EvalWeights();
+
+	// From White's side.  moveCount is the number of legal moves for the
+	// side to move, which the caller usually has already.  The pawn structure
+	// is looked up in pawns if there's a table, otherwise worked out afresh.
+	int Evaluate(const BoardState& board, int moveCount, PawnTable* pawns = nullptr) const;
+
+	// Just the pawn structure part of Evaluate()
+	int EvaluatePawns(const BoardState& board) const;
+
+	// The features Evaluate() multiplies by the weights, so that
+	// Evaluate() == the sum of weight[Index] * Value, less the kings
+	static void GetFeatures(const BoardState& board, int moveCount, std::vector<Feature>& features);
+
+	int& operator[](int index)
+	{
+		return m_weights[index];
+	}
+
+	int operator[](int index) const
+	{
+		return m_weights[index];
+	}
+
+	int Size() const
+	{
+		return Count;
+	}
+
+	// e.g. "Material.Knight", "PieceSquare.Pawn.e4" or "PassedPawn.Rank6"
+	static std::string Name(int index);
+
+	// Text files of "name value" lines.  Weights a file doesn't mention keep
+	// their value; false if it can't be read or has a name we don't know.
+	bool Load(const char* path);
+	bool Save(const char* path) const;
+
+private:
+	std::vector<int> m_weights;
+};
+
+// What a position's pawns are worth, and which of them are passed
+struct PawnStructure
+{
+	PawnStructure()
+	{
+		for (auto& count : Counts) count = 0;
+		Passed[0] = Passed[1] = 0;
+	}
+
+	// Found by looking at every pawn; slow next to PawnTable::Probe()
+	explicit PawnStructure(const BoardState& board);
+
+	// From White's side
+	int Score(const EvalWeights& weights) const;
+
+	int Counts[EvalWeights::PawnTerms];		// of each pawn feature, White's less Black's
+	unsigned long long Passed[2];			// by side, a bit per square (BoardLocation::Raw())
+};
+
+// A small cache of pawn structure scores, keyed by BoardState::PawnKey().
+// Pawns move far less often than pieces, so nearly every leaf finds its
+// pawns here.  Each search thread keeps one, so there's no locking.
+class PawnTable
+{
+public:
+	struct Entry
+	{
+		PositionKey Key;
+		int Score;								// from White's side
+		unsigned long long Passed[2];
+	};
+
+	// entries is rounded down to a power of two
+	explicit PawnTable(size_t entries = 1 << 13);
+
+	// The entry for the board's pawns, worked out and stored on a miss.  The
+	// scores are only valid for one set of weights: Clear() when they change.
+	const Entry& Probe(const EvalWeights& weights, const BoardState& board);
+
+	void Clear();
+
+	unsigned long long Hits() const
+	{
+		return m_hits;
+	}
+
+	unsigned long long Misses() const
+	{
+		return m_misses;
+	}
+
+private:
+	std::vector<Entry> m_entries;
+	size_t m_mask;
+	unsigned long long m_hits;
+	unsigned long long m_misses;
+};
+
+// Many positions evaluated at once, for scoring datasets.  The positions are
+// kept a square at a time (structure of arrays): for each square, the piece
+// on it in every position, as BoardState's nibbles.  That way the weights for
+// a square are looked up for a run of positions with a few vector
+// instructions, rather than walking each board in turn.  The mobility and
+// pawn structure counts are kept per position too, and weighted the same way.
+//
+// The scores are the same as EvalWeights::Evaluate() gives.
+class EvalBatch
+{
+public:
+	EvalBatch();
+
+	void Clear();
+
+	// moveCount as for EvalWeights::Evaluate()
+	void Add(const BoardState& board, int moveCount);
+
+	// Counts the legal moves itself
+	void Add(const BoardState& board);
+
+	size_t Size() const
+	{
+		return m_size;
+	}
+
+	// One score per position, from White's side, in the order they were added
+	void Evaluate(const EvalWeights& weights, std::vector<int>& scores) const;
+
+	// The instruction set Evaluate() was built for, e.g. "AVX2"
+	static const char* SimdName();
+
+private:
+	void Grow();
+
+	size_t m_size;
+	size_t m_stride;				// room for positions, a whole number of vectors
+	std::vector<byte> m_squares;	// [square][position]
+	// Legal moves (negative with Black to move), then PawnStructure's counts
+	static const int TermCount = 1 + EvalWeights::PawnTerms;
+	std::vector<int> m_terms;		// [term][position]
+};
@@ -0,0 +1,136 @@
+#include "stdafx.h"
+#include "BoardState.h"
+#include <algorithm>
+#include <sstream>
+
+BoardState BoardState::FromFen(const char* fen)
+{
+	std::istringstream stream(fen);
+	std::string placement, side, castling, enPassant;
+	int halfmoveClock = 0;
+
+	stream >> placement >> side;
+	if (placement.empty() || side.empty())
+	{
+		throw "Incomplete FEN";
+	}
+	if (!(stream >> castling)) castling = "-";
+	if (!(stream >> enPassant)) enPassant = "-";
+	if (!(stream >> halfmoveClock)) halfmoveClock = 0;
+
+	// Expand the ranks into the 64 square layout the board constructor wants
+	std::string squares;
+	for (auto c : placement)
+	{
+		if (c == '/')
+		{
+			if (squares.size() % 8 != 0) throw "Bad FEN rank";
+		}
+		else if (c >= '1' && c <= '8')
+		{
+			squares.append(c - '0', ' ');
+		}
+		else if (GetPieceType(c) != PieceType::Empty)
+		{
+			squares.push_back(c);
+		}
+		else
+		{
+			throw "Bad FEN piece";
+		}
+	}
+	if (squares.size() != 64)
+	{
+		throw "Bad FEN board";
+	}
+
+	if (side != "w" && side != "b")
+	{
+		throw "Bad FEN side";
+	}
+
+	BoardState board(squares.c_str(), side == "w" ? SideType::White : SideType::Black);
+
+	// A missing right is the same as the king or that rook having moved
+	board.m_hasPieceMoved.set();
+	for (auto c : castling)
+	{
+		switch (c)
+		{
+		case 'K': board.m_hasPieceMoved.reset(0); board.m_hasPieceMoved.reset(2); break;
+		case 'Q': board.m_hasPieceMoved.reset(0); board.m_hasPieceMoved.reset(1); break;
+		case 'k': board.m_hasPieceMoved.reset(3); board.m_hasPieceMoved.reset(5); break;
+		case 'q': board.m_hasPieceMoved.reset(3); board.m_hasPieceMoved.reset(4); break;
+		case '-': break;
+		default: throw "Bad FEN castling";
+		}
+	}
+
+	if (enPassant != "-")
+	{
+		if (enPassant.size() != 2 || enPassant[0] < 'a' || enPassant[0] > 'h')
+		{
+			throw "Bad FEN en passant";
+		}
+		board.m_enPassantCol = enPassant[0] - 'a';
+	}
+
+	board.m_halfmoveClock = static_cast<byte>(std::min(std::max(halfmoveClock, 0), 255));
+
+	board.InitializeKey();
+	return board;
+}
+
+std::string BoardState::ToFen() const
+{
+	std::string fen;
+	for (int y = 0; y < 8; ++y)
+	{
+		int empty = 0;
+		for (int x = 0; x < 8; ++x)
+		{
+			auto p = Get(x, y);
+			if (p.Type == PieceType::Empty)
+			{
+				++empty;
+				continue;
+			}
+			if (empty)
+			{
+				fen.push_back(static_cast<char>('0' + empty));
+				empty = 0;
+			}
+			fen.push_back(p.GetCharWithSide());
+		}
+		if (empty)
+		{
+			fen.push_back(static_cast<char>('0' + empty));
+		}
+		if (y < 7)
+		{
+			fen.push_back('/');
+		}
+	}
+
+	fen += m_nextMoveSide == SideType::White ? " w " : " b ";
+
+	std::string castling;
+	if (HasCastlingRight(SideType::White, true)) castling.push_back('K');
+	if (HasCastlingRight(SideType::White, false)) castling.push_back('Q');
+	if (HasCastlingRight(SideType::Black, true)) castling.push_back('k');
+	if (HasCastlingRight(SideType::Black, false)) castling.push_back('q');
+	fen += castling.empty() ? "-" : castling;
+
+	// The square behind the pawn that just moved two
+	if (EnPassantColumn() >= 0)
+	{
+		fen += " " + BoardLocation(EnPassantColumn(), GetEnPassantRow(m_nextMoveSide)).ToString();
+	}
+	else
+	{
+		fen += " -";
+	}
+
+	fen += " " + std::to_string(m_halfmoveClock) + " 1";
+	return fen;
+}
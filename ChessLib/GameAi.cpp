@@ -1,135 +1,1300 @@
 #include "stdafx.h"
 #include "GameAi.h"
+#include "OpeningBook.h"
+#include "Tablebase.h"
+#include "TaskPool.h"
 #include <algorithm>
+#include <cstdlib>
+#include <iterator>
 #include <Windows.h>
-#include <random>
 
-std::default_random_engine g_randomGenerator;
+// Tablebase wins score below a checkmate on the board but above any material,
+// less a little per ply so the quickest mate is preferred
+const int TablebaseWinScore = 100000000;
+
+namespace
+{
+	const int Infinity = 2000000000;
+
+	// Forced wins are stored relative to the node rather than the root, so
+	// the same entry is right wherever in the tree the position turns up
+	int ToTableScore(int score, int ply)
+	{
+		if (score >= WinThreshold) return score + ply;
+		if (score <= -WinThreshold) return score - ply;
+		return score;
+	}
+
+	int FromTableScore(int score, int ply)
+	{
+		if (score >= WinThreshold) return score - ply;
+		if (score <= -WinThreshold) return score + ply;
+		return score;
+	}
+
+	// How far from the leaves each kind of pruning is tried, and the margins
+	// it allows, in the evaluation's units (1000 to a pawn)
+	const int ReverseFutilityDepth = 3;
+	const int ReverseFutilityMargin = 1200;
+	const int FutilityDepth = 2;
+	const int FutilityMargin = 1500;
+
+	// Null-move cutoffs are checked with a real search from this depth on
+	const int NullMoveVerifyDepth = 8;
+
+	// Moves before this one in the order aren't reduced
+	const int LateMoveIndex = 3;
+
+	// QuietHistory scores stay within plus or minus this
+	const int HistoryMax = 16384;
+
+	// Half the width of the first window tried around the last iteration's
+	// score, and the depth from which there's a score worth trusting
+	const int AspirationWindow = 300;
+	const int AspirationDepth = 4;
+
+	// The clock and node limits are looked at once every this many nodes of
+	// a thread, as totalling the threads' nodes every time costs too much.
+	// A power of two.
+	const int LimitCheckInterval = 1024;
+
+	bool SameMove(const ChessMove& a, const ChessMove& b)
+	{
+		return a.From == b.From && a.To == b.To;
+	}
+
+	// Not a capture or a promotion, by Side
+	template <SideType Side>
+	bool IsQuiet(const BoardState& board, const ChessMove& m)
+	{
+		if (board.Get(m.To).Type != PieceType::Empty)
+		{
+			return false;
+		}
+		// En passant captures onto an empty square
+		return board.Get(m.From).Type != PieceType::Pawn
+			|| (m.From.X() == m.To.X() && m.To.Y() != SideTraits<Side>::PromotionRow);
+	}
+
+	// Pieces other than pawns and the king, without which passing could be
+	// the best move there is
+	bool HasPieces(const BoardState& board, SideType side)
+	{
+		for (auto loc : board)
+		{
+			const auto p = board.Get(loc);
+			if (p.Side == side && p.Type != PieceType::Empty && p.Type != PieceType::Pawn && p.Type != PieceType::King)
+			{
+				return true;
+			}
+		}
+		return false;
+	}
+
+	// Moves towards bonus, slowing down as it nears HistoryMax so old
+	// successes fade as new ones come in
+	void UpdateHistory(int (&history)[64][64], const ChessMove& m, int bonus)
+	{
+		int& value = history[m.From.Raw()][m.To.Raw()];
+		value += bonus - value * std::abs(bonus) / HistoryMax;
+	}
+
+	// Best move from the table first, then captures of the most valuable
+	// pieces, then quiet moves by how often they've caused cutoffs.  Sorted
+	// by insertion on keys worked out once a move, which keeps moves with
+	// the same key in the order they were generated and needs no memory but
+	// the keys'.
+	void OrderMoves(const BoardState& board, const MoveList& moves, ChessMove first, const int (*history)[64], SearchArena& arena)
+	{
+		auto orderKey = [&](const ChessMove& m)
+		{
+			if (first.IsValid() && m.From == first.From && m.To == first.To)
+			{
+				return 4 * HistoryMax;
+			}
+			const auto captured = board.Get(m.To).Type;
+			if (captured != PieceType::Empty)
+			{
+				return 2 * HistoryMax + static_cast<int>(captured);
+			}
+			return history ? history[m.From.Raw()][m.To.Raw()] : 0;
+		};
+
+		ArenaScope scope(arena);
+		int* keys = arena.AllocateUninitialized<int>(moves.size());
+		for (size_t i = 0; i < moves.size(); ++i)
+		{
+			keys[i] = orderKey(moves[i]);
+		}
+		for (size_t i = 1; i < moves.size(); ++i)
+		{
+			const auto move = moves[i];
+			const int key = keys[i];
+			size_t j = i;
+			for (; j > 0 && keys[j - 1] < key; --j)
+			{
+				moves[j] = moves[j - 1];
+				keys[j] = keys[j - 1];
+			}
+			moves[j] = move;
+			keys[j] = key;
+		}
+	}
+}
 
 GameAi::GameAi()
-	: m_bestMove(InvalidChessMove)
-	, m_startTime(0)
+	: m_startTime(0)
+	, m_clockStart(0)
+	, m_elapsedTime(0)
+	, m_softLimit(0)
+	, m_hardLimit(0)
+	, m_bestMove(InvalidChessMove)
+	, m_bestScore(0)
+	, m_lineCount(0)
+	, m_book(nullptr)
+	, m_tablebases(nullptr)
+	, m_tablebaseProbeDepth(0)
+	, m_sharedTable(nullptr)
+	, m_cancel(nullptr)
+	, m_network(nullptr)
+	, m_threadCount(1)
+	, m_multiPv(1)
+	, m_taskPool(nullptr)
+	, m_stop(false)
+	, m_pondering(false)
 	, m_finishedEvent(INVALID_HANDLE_VALUE)
 {
-	//g_randomGenerator.seed(::GetTickCount());
-	g_randomGenerator.seed(0);
+	//m_random.seed(::GetTickCount());
+	m_random.seed(0);
 }
 
 
 GameAi::~GameAi()
 {
-	::CloseHandle(m_finishedEvent);
+	if (m_finishedEvent != INVALID_HANDLE_VALUE)
+	{
+		// The worker thread uses this object until it's done
+		Stop();
+		WaitUntilFinished();
+		::CloseHandle(m_finishedEvent);
+	}
 }
 
 int GameAi::GetBoardScore(const BoardState& board)
 {
-	++g_boardScoreCalls;
-	int total = 0;
-
-	const static int scores[] = { 0, 1000, 3000, 3000, 5000, 9000, 100000 };
-	const static int multiplier[] = { 1, -1 };	
+	const static int multiplier[] = { 1, -1 };
 
-	if (board.IsCheckmate())
+	// Only positions with moves are cached, so a hit can't be mate
+	int score = 0;
+	if (m_evalCache.Probe(board.Key(), &score))
 	{
-		return 1000000000 * multiplier[static_cast<int>(OtherSide(board.NextSide()))];
+		return score;
 	}
 
-	for (auto it : board)
+	const auto moves = board.ValidMoves();
+	if (moves.empty() && board.IsCheck())
 	{
-		auto p = board.Get(it);		
-		const int score = scores[static_cast<int>(p.Type)] * multiplier[static_cast<int>(p.Side)];
-		total += score;
+		return MateScore * multiplier[static_cast<int>(OtherSide(board.NextSide()))];
 	}
 
-	int possibleMoves = board.ValidMoves().size();
-	total += possibleMoves * multiplier[static_cast<int>(board.NextSide())];
+	score = m_network ? m_network->Evaluate(board) : Evaluate(board, moves.size());
+	if (!moves.empty())
+	{
+		m_evalCache.Store(board.Key(), score);
+	}
+	return score;
+}
 
-	return total;
+// From White's side, with the weights the search was given
+int GameAi::Evaluate(const BoardState& board, int moveCount, PawnTable* pawns)
+{
+	++g_boardScoreCalls;
+	return m_weights.Evaluate(board, moveCount, pawns);
 }
 
 
+void GameAi::StartDecideMove(const BoardState& board, const PositionHistory& history)
+{
+	SearchLimits limits;
+	limits.Depth = 3;
+	StartSearch(board, history, limits);
+}
+
 void GameAi::StartDecideMove(const BoardState& board)
 {
+	StartDecideMove(board, m_history);
+}
+
+void GameAi::StartSearch(const BoardState& board, const PositionHistory& history, const SearchLimits& limits)
+{
+	if (m_finishedEvent == INVALID_HANDLE_VALUE)
+	{
+		m_finishedEvent = ::CreateEvent(nullptr, TRUE, FALSE, nullptr);
+	}
+	else
+	{
+		Stop();
+		WaitUntilFinished();
+		::ResetEvent(m_finishedEvent);
+	}
+
+	PrepareSearch(board, history, limits);
+
 	DWORD threadId;
+	auto newThread = ::CreateThread(nullptr, 0, &GameAi::WorkerThreadStatic, this, 0, &threadId);
+	::CloseHandle(newThread);
+}
+
+ChessMove GameAi::DecideMove(const BoardState& board, const PositionHistory& history, const SearchLimits& limits, int* score)
+{
+	PrepareSearch(board, history, limits);
+
+	int bestScore = 0;
+	m_bestMove = IterativeDeepening(&bestScore);
+	m_bestScore = bestScore;
+	m_elapsedTime = ::GetTickCount() - m_startTime;
+
+	if (score)
+	{
+		*score = bestScore;
+	}
+	return m_bestMove;
+}
+
+void GameAi::PrepareSearch(const BoardState& board, const PositionHistory& history, const SearchLimits& limits)
+{
+	m_rootBoard = board;
+	m_history = history;
+	m_limits = limits;
+	m_bestMove = InvalidChessMove;
+	m_bestScore = 0;
+	m_pv.clear();
+	m_lineCount = 0;
+	m_stop = false;
+	m_pondering = limits.Ponder;
 
 	m_startTime = ::GetTickCount();
+	m_clockStart = m_startTime;
+	SetTimeLimits();
+}
 
-	m_board = &board;
+// Aim to spend an even share of the clock on each move.  No new iteration
+// starts past the soft limit, as it would likely take several times longer
+// than the last one; the hard limit aborts the search outright.
+void GameAi::SetTimeLimits()
+{
+	m_softLimit = 0;
+	m_hardLimit = 0;
 
-	m_finishedEvent = ::CreateEvent(nullptr, FALSE, FALSE, nullptr);
+	const int side = static_cast<int>(m_rootBoard.NextSide());
+	if (m_limits.MoveTime)
+	{
+		m_softLimit = m_limits.MoveTime;
+		m_hardLimit = m_limits.MoveTime;
+	}
+	else if (m_limits.Time[side])
+	{
+		const DWORD left = m_limits.Time[side];
+		const DWORD moves = m_limits.MovesToGo ? m_limits.MovesToGo : 30;
+		const DWORD target = left / moves + m_limits.Increment[side] * 3 / 4;
 
-	auto newThread = ::CreateThread(nullptr, 0, &GameAi::WorkerThreadStatic, this, 0, &threadId);
-	::CloseHandle(newThread);
+		m_softLimit = target / 2;
+		m_hardLimit = target * 3 < left / 2 ? target * 3 : left / 2;
+		if (m_hardLimit == 0)
+		{
+			m_hardLimit = 1;
+		}
+	}
+}
+
+bool GameAi::IsSoftLimitReached() const
+{
+	return m_softLimit && !m_pondering && ::GetTickCount() - m_clockStart >= m_softLimit;
+}
+
+bool GameAi::ShouldStop(SearchThread& thread)
+{
+	if (m_cancel && *m_cancel)
+	{
+		m_stop = true;
+	}
+	if (!m_stop && (thread.IsMain || thread.IsSplit) && !m_pondering && (thread.Nodes & (LimitCheckInterval - 1)) == 0)
+	{
+		if ((m_hardLimit && ::GetTickCount() - m_clockStart >= m_hardLimit)
+			|| (m_limits.Nodes && GetNodes() >= m_limits.Nodes))
+		{
+			m_stop = true;
+		}
+	}
+	return m_stop;
+}
+
+unsigned long long GameAi::GetNodes() const
+{
+	unsigned long long nodes = 0;
+	for (auto& thread : m_threads)
+	{
+		nodes += thread->Nodes;
+	}
+	for (auto& thread : m_splitThreads)
+	{
+		nodes += thread->Nodes;
+	}
+	return nodes;
+}
+
+unsigned long long GameAi::GetArenaBytes() const
+{
+	unsigned long long bytes = 0;
+	for (auto& thread : m_threads)
+	{
+		bytes += thread->Arena.BytesAllocated();
+	}
+	for (auto& thread : m_splitThreads)
+	{
+		bytes += thread->Arena.BytesAllocated();
+	}
+	return bytes;
+}
+
+unsigned long long GameAi::GetArenaHeapAllocations() const
+{
+	unsigned long long allocations = 0;
+	for (auto& arena : m_arenas)
+	{
+		allocations += arena->HeapAllocations();
+	}
+	return allocations;
+}
+
+// The arena for a search thread, emptied for the new search
+SearchArena& GameAi::ThreadArena(size_t index)
+{
+	while (m_arenas.size() <= index)
+	{
+		m_arenas.push_back(std::make_unique<SearchArena>());
+	}
+	m_arenas[index]->Reset();
+	return *m_arenas[index];
+}
+
+unsigned long long GameAi::GetEvalCacheHits() const
+{
+	unsigned long long hits = 0;
+	for (auto& thread : m_threads)
+	{
+		hits += thread->EvalCacheHits;
+	}
+	for (auto& thread : m_splitThreads)
+	{
+		hits += thread->EvalCacheHits;
+	}
+	return hits;
+}
+
+unsigned long long GameAi::GetEvalCacheMisses() const
+{
+	unsigned long long misses = 0;
+	for (auto& thread : m_threads)
+	{
+		misses += thread->EvalCacheMisses;
+	}
+	for (auto& thread : m_splitThreads)
+	{
+		misses += thread->EvalCacheMisses;
+	}
+	return misses;
+}
+
+ChessMove GameAi::GetPonderMove() const
+{
+	if (!m_bestMove.IsValid())
+	{
+		return InvalidChessMove;
+	}
+
+	auto next = m_rootBoard;
+	next.Move(m_bestMove.From, m_bestMove.To, true);
+
+	// The line's second move if it goes through our move, else the table's
+	TableEntry entry;
+	if (m_pv.size() >= 2 && SameMove(m_pv[0], m_bestMove))
+	{
+		entry.Move = m_pv[1];
+	}
+	else if (!Table().Probe(next.Key(), &entry) || !entry.Move.IsValid())
+	{
+		return InvalidChessMove;
+	}
+
+	for (auto m : next.ValidMoves())
+	{
+		if (m.From == entry.Move.From && m.To == entry.Move.To)
+		{
+			return m;
+		}
+	}
+	return InvalidChessMove;
 }
 
 DWORD WINAPI GameAi::WorkerThread()
 {
-	auto move = DecideMoveImpl(*m_board, 2, nullptr);
+	auto move = InvalidChessMove;
+	int score = 0;
+
+	// Searches that run until told to stop have nothing to gain from a quick answer
+	if (!m_limits.Infinite && !m_limits.Ponder)
+	{
+		if (m_book)
+		{
+			move = m_book->ChooseMove(m_rootBoard, OpeningBook::Selection::Weighted, m_random);
+		}
+		if (!move.IsValid() && m_tablebases)
+		{
+			move = m_tablebases->ProbeRoot(m_rootBoard);
+		}
+	}
+	if (!move.IsValid())
+	{
+		move = IterativeDeepening(&score);
+	}
+
 	m_bestMove = move;
+	m_bestScore = score;
 	m_elapsedTime = ::GetTickCount() - m_startTime;
-	SetEvent(m_finishedEvent);
+
+	if (m_finishedCallback)
+	{
+		m_finishedCallback(move);
+	}
+	::SetEvent(m_finishedEvent);
+	return 0;
+}
+
+ChessMove GameAi::IterativeDeepening(int* score)
+{
+	if (!m_sharedTable)
+	{
+		m_table.NewSearch();
+	}
+
+	PrepareThreads(m_threadCount);
+	for (auto& thread : m_threads)
+	{
+		thread->History = m_history;
+		if (m_history.Empty() || m_history.Top() != m_rootBoard.Key())
+		{
+			thread->History.Push(m_rootBoard.Key());
+		}
+
+		// Room for a key at every ply the search can reach, so the search
+		// itself never grows it
+		thread->History.Reserve(thread->History.Size() + MaxSearchDepth + 1);
+	}
+
+	m_helpers.clear();
+	for (size_t i = 1; i < m_threads.size(); ++i)
+	{
+		DWORD threadId;
+		m_helpers.push_back(::CreateThread(nullptr, 0, &GameAi::HelperThreadStatic, m_threads[i].get(), 0, &threadId));
+	}
+
+	const int sign = m_rootBoard.NextSide() == SideType::White ? 1 : -1;
+	const int maxDepth = m_limits.Depth ? m_limits.Depth : MaxSearchDepth;
+
+	// With MultiPV each iteration searches the root once per line, leaving
+	// out the moves of the lines before.  The table and move history carry
+	// over from one line to the next, so later lines cost far less than a
+	// search of their own.
+	ChessMove moves[BoardState::MaxMoves];
+	const int rootMoves = m_rootBoard.ValidMoves(moves);
+	const int lineCount = m_multiPv < rootMoves ? m_multiPv : rootMoves > 0 ? rootMoves : 1;
+
+	auto& main = *m_threads[0];
+	auto best = InvalidChessMove;
+	int bestScore = 0;
+	for (int depth = 1; depth <= maxDepth; ++depth)
+	{
+		m_excluded.clear();
+		for (int k = 0; k < lineCount && !m_stop; ++k)
+		{
+			const bool previous = k < static_cast<int>(m_lineCount);
+			if (previous)
+			{
+				main.PreviousPv = m_lines[k].Pv;
+			}
+			else
+			{
+				main.PreviousPv.clear();
+			}
+
+			int lineScore = 0;
+			const auto move = AspirationSearch(main, depth, previous ? sign * m_lines[k].Score : 0, previous && depth >= AspirationDepth, m_excluded, &lineScore);
+
+			// An unfinished iteration only counts if it's all we have.  No move
+			// at all means the game is over, and the score says how.
+			if (m_stop || !move.IsValid())
+			{
+				if (k == 0 && (!m_stop || !best.IsValid()))
+				{
+					best = move;
+					bestScore = lineScore;
+					if (!m_stop)
+					{
+						m_bestScore = sign * lineScore;
+					}
+				}
+				break;
+			}
+			m_excluded.push_back(move);
+
+			// Filled in where it's kept, so the lines' buffers are reused
+			if (m_lines.size() <= static_cast<size_t>(k))
+			{
+				m_lines.push_back(SearchInfo());
+			}
+			auto& info = m_lines[k];
+			info.Depth = depth;
+			info.MultiPv = k + 1;
+			info.Score = sign * lineScore;
+			info.Nodes = GetNodes();
+			info.Time = ::GetTickCount() - m_startTime;
+			info.Hashfull = Table().Hashfull();
+			info.BestMove = move;
+			RootLine(main, depth, &info.Pv);
+			if (!previous)
+			{
+				m_lineCount = k + 1;
+			}
+
+			if (k == 0)
+			{
+				best = move;
+				bestScore = lineScore;
+				m_bestScore = info.Score;
+				m_pv = info.Pv;
+			}
+
+			if (m_infoCallback)
+			{
+				m_infoCallback(info);
+			}
+		}
+		if (m_stop)
+		{
+			break;
+		}
+
+		// Nothing left to find once there are no moves or a forced win is seen,
+		// unless there are other lines to fill in
+		const bool forced = bestScore >= WinThreshold || bestScore <= -WinThreshold;
+		if (!best.IsValid() || (forced && lineCount == 1) || IsSoftLimitReached())
+		{
+			break;
+		}
+	}
+
+	// Searches that run until told to stop don't answer early, even when
+	// there's nothing left to search
+	while ((m_limits.Infinite || m_pondering) && !m_stop)
+	{
+		::Sleep(1);
+	}
+
+	m_stop = true;
+	if (!m_helpers.empty())
+	{
+		::WaitForMultipleObjects(static_cast<DWORD>(m_helpers.size()), m_helpers.data(), TRUE, INFINITE);
+		for (auto helper : m_helpers)
+		{
+			::CloseHandle(helper);
+		}
+	}
+
+	// Stopped before any move was looked at
+	if (!best.IsValid() && rootMoves > 0)
+	{
+		best = moves[0];
+	}
+
+	*score = sign * bestScore;
+	return best;
+}
+
+// Helpers deepen on their own, half of them a ply ahead, so the threads
+// spread out over the tree instead of all searching the same nodes
+DWORD WINAPI GameAi::HelperThread(SearchThread& thread)
+{
+	const int maxDepth = m_limits.Depth ? m_limits.Depth : MaxSearchDepth;
+	const int index = static_cast<int>(std::find_if(m_threads.begin(), m_threads.end(),
+		[&](const std::unique_ptr<SearchThread>& t) { return t.get() == &thread; }) - m_threads.begin());
+
+	for (int depth = 1 + index % 2; depth <= maxDepth && !m_stop; ++depth)
+	{
+		int score;
+		SearchRoot(thread, m_rootBoard, depth, -Infinity, Infinity, &score);
+		if (!m_stop)
+		{
+			RootLine(thread, depth, &thread.PreviousPv);
+		}
+	}
 	return 0;
 }
 
 ChessMove GameAi::DecideMoveImpl(const BoardState& board, int depth, int* scoreAfterMove)
 {
-	const auto& moves = board.ValidMoves();
-	if (moves.size() == 0)
+	m_stop = false;
+	m_pondering = false;
+	m_limits = SearchLimits();
+	m_hardLimit = 0;
+	if (!m_sharedTable)
+	{
+		m_table.NewSearch();
+	}
+
+	// Kept with the others so GetNodes() and the cache counts see it
+	PrepareThreads(1);
+	auto& thread = *m_threads[0];
+	thread.History = m_history;
+	if (thread.History.Empty() || thread.History.Top() != board.Key())
+	{
+		thread.History.Push(board.Key());
+	}
+	thread.History.Reserve(thread.History.Size() + MaxSearchDepth + 1);
+
+	// Depth 0 looks at each move and scores the positions they lead to
+	int score = 0;
+	m_rootBoard = board;
+	auto move = SearchRoot(thread, board, depth + 1, -Infinity, Infinity, &score);
+	m_bestMove = move;
+	RootLine(thread, depth + 1, &m_pv);
+	if (move.IsValid() && scoreAfterMove)
+	{
+		*scoreAfterMove = board.NextSide() == SideType::White ? score : -score;
+	}
+	return move;
+}
+
+// The one place the side to move is looked at: from here down the search is
+// compiled for each side, and each node knows which side it's for
+ChessMove GameAi::SearchRoot(SearchThread& thread, const BoardState& board, int depth, int alpha, int beta, int* score, const std::vector<ChessMove>* excluded)
+{
+	return board.NextSide() == SideType::White
+		? SearchRoot<SideType::White>(thread, board, depth, alpha, beta, score, excluded)
+		: SearchRoot<SideType::Black>(thread, board, depth, alpha, beta, score, excluded);
+}
+
+template <SideType Side>
+ChessMove GameAi::SearchRoot(SearchThread& thread, const BoardState& board, int depth, int alpha, int beta, int* score, const std::vector<ChessMove>* excluded)
+{
+	thread.PvLength[0] = 0;
+	ArenaScope scope(thread.Arena);
+	const auto moves = MoveList::Generate<Side>(thread.Arena, board);
+	if (moves.empty())
 	{
 		return InvalidChessMove;
 	}
+	++thread.Nodes;
 
-	std::vector<int> scores;
+	if (m_network)
+	{
+		thread.Network.Reset(m_network, MaxSearchDepth + 1);
+		thread.Network.Set(0, board);
+	}
 
-	int max = -2000000000;
-	int min = 2000000000;
+	// The last iteration's best line is searched first, then the table's move
+	const auto pvMove = thread.PreviousPv.empty() ? InvalidChessMove : thread.PreviousPv[0];
+	TableEntry entry;
+	const auto tableMove = Table().Probe(board.Key(), &entry) ? entry.Move : InvalidChessMove;
+	OrderMoves(board, moves, pvMove.IsValid() ? pvMove : tableMove, thread.QuietHistory[static_cast<int>(Side)], thread.Arena);
 
-	for (auto m : moves)
+	// Each move is searched with a window just below the best so far, so
+	// moves that tie with it get exact scores and can be picked at random.
+	// A score of beta or more ends the search early: the caller widens the
+	// window and searches again.
+	int best = -Infinity;
+	ChessMove* tied = thread.Arena.AllocateUninitialized<ChessMove>(moves.size());
+	int tiedCount = 0;
+	auto isExcluded = [&](const ChessMove& m)
 	{
+		return excluded && std::find_if(excluded->begin(), excluded->end(), [&](const ChessMove& e) { return SameMove(e, m); }) != excluded->end();
+	};
+
+	// Folds in a move's score, in move order, with the line that followed
+	// it if it was searched by another thread.  True once beta is reached.
+	auto consider = [&](const ChessMove& m, int moveScore, const std::vector<ChessMove>* line) -> bool
+	{
+		if (moveScore > best)
+		{
+			best = moveScore;
+			tiedCount = 0;
+			if (moveScore > alpha && line)
+			{
+				thread.Pv[0][0] = m;
+				std::copy(line->begin(), line->end(), &thread.Pv[0][1]);
+				thread.PvLength[0] = 1 + static_cast<int>(line->size());
+			}
+			else if (moveScore > alpha)
+			{
+				UpdatePv(thread, 0, m);
+			}
+		}
+		if (moveScore == best)
+		{
+			tied[tiedCount++] = m;
+		}
+		return best >= beta;
+	};
+
+	// With a task pool, the first move sets the window for the rest, which
+	// are then searched at once
+	const bool split = m_taskPool && thread.IsMain && depth > 1;
+	for (size_t i = 0; i < moves.size(); ++i)
+	{
+		const auto m = moves[i];
+		if (isExcluded(m))
+		{
+			continue;
+		}
+
+		if (split && tiedCount > 0)
+		{
+			std::vector<ChessMove> rest;
+			std::copy_if(moves.begin() + i, moves.end(), std::back_inserter(rest), [&](const ChessMove& r) { return !isExcluded(r); });
+			for (auto& result : SearchRootSplit<Side>(thread, board, rest, depth, alpha, beta, best))
+			{
+				if (result.Finished && consider(result.Move, result.Score, &result.Line))
+				{
+					break;
+				}
+			}
+			break;
+		}
+
 		auto temp = board;
-		temp.Move(m.From, m.To);
-		int score = 0;
+		temp.MakeMove<Side>(m.From, m.To);
+		PrefetchTable(temp);
+
+		const int low = best - 1 > alpha ? best - 1 : alpha;
+		thread.FollowPv = pvMove.IsValid() && SameMove(m, pvMove);
+		thread.History.Push(temp.Key());
+		const int moveScore = -Search<SideTraits<Side>::Other>(thread, temp, depth - 1, -beta, -low, 1);
+		thread.History.Pop();
+		thread.FollowPv = false;
 
-		if (depth == 0)
+		if (m_stop || consider(m, moveScore, nullptr))
 		{
-			score = GetBoardScore(temp);
+			break;
+		}
+	}
+
+	if (tiedCount == 0)
+	{
+		return InvalidChessMove;
+	}
+
+	// Only the main thread's choice gets played, the others needn't share the generator
+	int choice = 0;
+	if (thread.IsMain)
+	{
+		std::uniform_int_distribution<int> distribution(0, tiedCount - 1);
+		choice = distribution(m_random);
+	}
+
+	// The line found is for the first of the tied moves
+	if (thread.PvLength[0] == 0 || !SameMove(thread.Pv[0][0], tied[choice]))
+	{
+		thread.Pv[0][0] = tied[choice];
+		thread.PvLength[0] = 1;
+	}
+
+	// With moves left out, the best of the rest isn't the position's score
+	if (!m_stop && (!excluded || excluded->empty()))
+	{
+		const Bound bound = best >= beta ? Bound::Lower : best <= alpha ? Bound::Upper : Bound::Exact;
+		Table().Store(board.Key(), ToTableScore(best, 0), depth, bound, tied[choice]);
+	}
+
+	*score = best;
+	return tied[choice];
+}
+
+// The threads for a new search: count searching the tree, the first the
+// main one, and one for each of the pool's workers, for the root moves
+// they're given.  They're kept from the last search when there are as many,
+// so a search takes nothing from the heap for them.
+void GameAi::PrepareThreads(size_t count)
+{
+	const size_t splitCount = m_taskPool ? m_taskPool->ThreadCount() : 0;
+	if (m_threads.size() != count || m_splitThreads.size() != splitCount)
+	{
+		// The split threads' arenas follow the others'
+		m_threads.clear();
+		m_splitThreads.clear();
+		for (size_t i = 0; i < count; ++i)
+		{
+			m_threads.push_back(std::make_unique<SearchThread>(this, ThreadArena(i), i == 0));
+		}
+		for (size_t i = 0; i < splitCount; ++i)
+		{
+			m_splitThreads.push_back(std::make_unique<SearchThread>(this, ThreadArena(count + i), false, true));
+		}
+	}
+
+	for (auto& thread : m_threads)
+	{
+		thread->Reset();
+	}
+	for (auto& thread : m_splitThreads)
+	{
+		thread->Reset();
+		if (m_network)
+		{
+			thread->Network.Reset(m_network, MaxSearchDepth + 1);
+		}
+	}
+}
+
+// The root moves after the first, searched at once on the task pool.  Each
+// starts with a window just below the best score so far, as it would one
+// after the other, though a move that finishes early can't narrow the
+// windows of those already under way.  A move that fails low against a
+// better score found by a later move may look best until that move is
+// folded in, which the caller does in order.
+template <SideType Side>
+std::vector<GameAi::SplitResult> GameAi::SearchRootSplit(const SearchThread& thread, const BoardState& board, const std::vector<ChessMove>& moves, int depth, int alpha, int beta, int best)
+{
+	std::vector<SplitResult> results(moves.size());
+	std::atomic<int> bestSoFar(best);
+
+	TaskGroup group(*m_taskPool);
+	for (size_t i = 0; i < moves.size(); ++i)
+	{
+		group.Spawn(-1, [&, i](int worker)
+		{
+			auto& result = results[i];
+			result.Move = moves[i];
+			result.Score = -Infinity;
+			result.Finished = false;
+			if (m_stop)
+			{
+				return;
+			}
+
+			auto& split = *m_splitThreads[worker];
+			auto temp = board;
+			temp.MakeMove<Side>(moves[i].From, moves[i].To);
+			PrefetchTable(temp);
+			if (m_network)
+			{
+				split.Network.Set(0, board);
+			}
+			split.History = thread.History;
+			split.History.Reserve(thread.History.Size() + MaxSearchDepth + 1);
+			split.History.Push(temp.Key());
+
+			const int current = bestSoFar;
+			const int low = current - 1 > alpha ? current - 1 : alpha;
+			result.Score = -Search<SideTraits<Side>::Other>(split, temp, depth - 1, -beta, -low, 1);
+			if (m_stop)
+			{
+				return;
+			}
+			result.Finished = true;
+			if (split.PvLength[1] > 1)
+			{
+				result.Line.assign(&split.Pv[1][1], &split.Pv[1][0] + split.PvLength[1]);
+			}
+
+			int seen = bestSoFar;
+			while (result.Score > seen && !bestSoFar.compare_exchange_weak(seen, result.Score))
+			{
+			}
+		});
+	}
+	group.Wait(-1);
+	return results;
+}
+
+// Searches the root with a narrow window around the last score, if there's
+// one to go on.  When the score falls outside the window, that side is
+// widened, further each time, and the root searched again.
+ChessMove GameAi::AspirationSearch(SearchThread& thread, int depth, int lastScore, bool useLastScore, const std::vector<ChessMove>& excluded, int* score)
+{
+	int alpha = -Infinity;
+	int beta = Infinity;
+	int delta = AspirationWindow;
+	if (useLastScore && lastScore > -WinThreshold && lastScore < WinThreshold)
+	{
+		alpha = lastScore - delta;
+		beta = lastScore + delta;
+	}
+
+	for (;;)
+	{
+		const auto move = SearchRoot(thread, m_rootBoard, depth, alpha, beta, score, &excluded);
+		if (m_stop || !move.IsValid() || (*score > alpha && *score < beta))
+		{
+			return move;
+		}
+
+		delta *= 2;
+		if (*score <= alpha)
+		{
+			alpha = *score - delta < -WinThreshold ? -Infinity : *score - delta;
 		}
 		else
 		{
-			if (!DecideMoveImpl(temp, depth - 1, &score).IsValid())
+			beta = *score + delta > WinThreshold ? Infinity : *score + delta;
+		}
+	}
+}
+
+// The root's line from the triangular array, carried on with the table's
+// moves where the search cut it short, up to depth moves
+void GameAi::RootLine(const SearchThread& thread, int depth, std::vector<ChessMove>* line) const
+{
+	line->assign(thread.Pv[0], thread.Pv[0] + thread.PvLength[0]);
+	if (depth > MaxSearchDepth + 1)
+	{
+		depth = MaxSearchDepth + 1;
+	}
+
+	auto board = m_rootBoard;
+	PositionKey seen[MaxSearchDepth + 2];
+	size_t seenCount = 0;
+	seen[seenCount++] = board.Key();
+	for (size_t i = 0; i < static_cast<size_t>(depth); ++i)
+	{
+		auto move = InvalidChessMove;
+		TableEntry entry;
+		if (i < line->size())
+		{
+			move = (*line)[i];
+		}
+		else if (Table().Probe(board.Key(), &entry))
+		{
+			move = entry.Move;
+		}
+		if (!move.IsValid())
+		{
+			break;
+		}
+
+		// The table's moves are checked, they may be from another position with the same index
+		ChessMove moves[BoardState::MaxMoves];
+		const int count = board.ValidMoves(moves);
+		if (std::find_if(moves, moves + count, [&](const ChessMove& m) { return SameMove(m, move); }) == moves + count)
+		{
+			line->resize(i);
+			break;
+		}
+		board.Move(move.From, move.To, true);
+		if (i >= line->size())
+		{
+			// Stop before going round in circles
+			if (std::find(seen, seen + seenCount, board.Key()) != seen + seenCount)
 			{
-				score = GetBoardScore(temp);
+				break;
 			}
+			line->push_back(move);
 		}
+		seen[seenCount++] = board.Key();
+	}
+}
 
-		if (score > max) max = score;
-		if (score < min) min = score;
+// Puts m ahead of the line found below it, as the best line from ply
+void GameAi::UpdatePv(SearchThread& thread, int ply, const ChessMove& m)
+{
+	thread.Pv[ply][ply] = m;
+	const int childLength = thread.PvLength[ply + 1] > ply + 1 ? thread.PvLength[ply + 1] : ply + 1;
+	for (int i = ply + 1; i < childLength; ++i)
+	{
+		thread.Pv[ply][i] = thread.Pv[ply + 1][i];
+	}
+	thread.PvLength[ply] = childLength;
+}
 
-		scores.push_back(score);
+// From Side's point of view, Side being to move, through the cache
+template <SideType Side>
+int GameAi::StaticEvaluate(SearchThread& thread, const BoardState& board, int moveCount, int ply)
+{
+	int whiteScore = 0;
+	if (m_evalCache.Probe(board.Key(), &whiteScore))
+	{
+		++thread.EvalCacheHits;
+	}
+	else
+	{
+		++thread.EvalCacheMisses;
+		whiteScore = m_network ? thread.Network.Evaluate(ply) : Evaluate(board, moveCount, &thread.Pawns);
+		m_evalCache.Store(board.Key(), whiteScore);
 	}
+	return Side == SideType::White ? whiteScore : -whiteScore;
+}
 
-	int best = (board.NextSide() == SideType::White ? max : min);
+template <SideType Side>
+int GameAi::Search(SearchThread& thread, const BoardState& board, int depth, int alpha, int beta, int ply, bool allowNull)
+{
+	typedef SideTraits<Side> Traits;
+	thread.PvLength[ply] = ply;
+	if (ShouldStop(thread))
+	{
+		return 0;
+	}
+	++thread.Nodes;
+	if (m_network)
+	{
+		thread.Network.Set(ply, board);
+	}
 
-	int count = std::count(scores.begin(), scores.end(), best);
+	if (thread.History.IsRepetition(board) || board.IsFiftyMoveDraw())
+	{
+		return 0;
+	}
 
-	std::uniform_int_distribution<int> distribution(0, count-1);
-	int choice = distribution(g_randomGenerator);
+	int tablebaseScore = 0;
+	if (depth >= m_tablebaseProbeDepth && ProbeTablebases(board, ply, &tablebaseScore))
+	{
+		// Exact result, nothing left to search
+		return tablebaseScore;
+	}
 
-	for (unsigned i = 0; i < scores.size(); ++i)
+	// A check is searched a ply deeper, so the way out of it isn't left to the
+	// evaluation.  Past MaxSearchDepth plies everything is a leaf.
+	const bool inCheck = (depth > 0 || m_options.CheckExtensions) && board.IsCheck<Side>();
+	if (inCheck && m_options.CheckExtensions)
 	{
-		if (scores[i] == best)
+		++depth;
+	}
+	if (ply >= MaxSearchDepth)
+	{
+		depth = 0;
+	}
+
+	TableEntry entry;
+	auto tableMove = InvalidChessMove;
+	if (Table().Probe(board.Key(), &entry))
+	{
+		tableMove = entry.Move;
+		if (entry.Depth >= depth)
 		{
-			if (choice == 0)
+			const int tableScore = FromTableScore(entry.Score, ply);
+			if (entry.Type == Bound::Exact
+				|| (entry.Type == Bound::Lower && tableScore >= beta)
+				|| (entry.Type == Bound::Upper && tableScore <= alpha))
 			{
-				if (scoreAfterMove) *scoreAfterMove = best;
-				return moves[i];
+				return tableScore;
 			}
-			choice--;
 		}
 	}
 
-	throw "We shouldn't get here";
-	return moves[0];
+	// A cached evaluation saves generating the moves as well: only positions
+	// that have some are stored
+	int whiteScore = 0;
+	if (depth <= 0 && m_evalCache.Probe(board.Key(), &whiteScore))
+	{
+		++thread.EvalCacheHits;
+		return Side == SideType::White ? whiteScore : -whiteScore;
+	}
+
+	// The node's moves and the rest of its scratch memory come from the
+	// thread's arena, and go back to it when the node returns
+	ArenaScope scope(thread.Arena);
+	const auto moves = MoveList::Generate<Side>(thread.Arena, board);
+	if (moves.empty())
+	{
+		return board.IsCheck<Side>() ? -(MateScore - ply) : 0;
+	}
+
+	// Leaves aren't stored in the table, where they'd overwrite a deeper
+	// result for the same position; the evaluation cache keeps their scores
+	if (depth <= 0)
+	{
+		return StaticEvaluate<Side>(thread, board, moves.size(), ply);
+	}
+
+	// Along the last iteration's line, its move goes first.  Only the first
+	// move searched here can still be on it.
+	auto pvMove = InvalidChessMove;
+	if (thread.FollowPv && ply < static_cast<int>(thread.PreviousPv.size()))
+	{
+		pvMove = thread.PreviousPv[ply];
+	}
+	thread.FollowPv = false;
+
+	// Pruning is only safe away from the principal variation, out of check,
+	// and with no forced win at stake
+	const bool pvNode = beta - alpha > 1;
+	const bool canPrune = !pvNode && !inCheck && std::abs(beta) < WinThreshold && std::abs(alpha) < WinThreshold;
+	const int staticScore = canPrune ? StaticEvaluate<Side>(thread, board, moves.size(), ply) : 0;
+
+	if (canPrune && m_options.ReverseFutility && depth <= ReverseFutilityDepth
+		&& staticScore - ReverseFutilityMargin * depth >= beta)
+	{
+		return staticScore - ReverseFutilityMargin * depth;
+	}
+
+	// If passing still leaves us above beta, a real move will too.  That's
+	// not so in zugzwang, where every move makes things worse: passing is
+	// never tried with only pawns left, and deep searches check the cutoff
+	// with a reduced search of the real moves.
+	if (canPrune && allowNull && m_options.NullMove && depth >= 2 && staticScore >= beta && HasPieces(board, Side))
+	{
+		auto temp = board;
+		temp.MakeNullMove();
+		PrefetchTable(temp);
+		const int reduction = depth >= 7 ? 3 : 2;
+
+		thread.History.Push(temp.Key());
+		int score = -Search<Traits::Other>(thread, temp, depth - 1 - reduction, -beta, -beta + 1, ply + 1, false);
+		thread.History.Pop();
+
+		if (score >= beta && !m_stop && depth >= NullMoveVerifyDepth)
+		{
+			score = Search<Side>(thread, board, depth - 1 - reduction, beta - 1, beta, ply, false);
+		}
+		if (m_stop)
+		{
+			return 0;
+		}
+		if (score >= beta)
+		{
+			// A pass can't prove a mate
+			return score >= WinThreshold ? beta : score;
+		}
+	}
+
+	const int side = static_cast<int>(Side);
+	OrderMoves(board, moves, pvMove.IsValid() ? pvMove : tableMove, thread.QuietHistory[side], thread.Arena);
+
+	const bool futile = canPrune && m_options.Futility && depth <= FutilityDepth
+		&& staticScore + FutilityMargin * depth <= alpha;
+
+	const int originalAlpha = alpha;
+	int best = -Infinity;
+	auto bestMove = InvalidChessMove;
+	ChessMove* quietsTried = thread.Arena.AllocateUninitialized<ChessMove>(moves.size());
+	int quietCount = 0;
+	int index = 0;
+	for (auto m : moves)
+	{
+		auto temp = board;
+		temp.MakeMove<Side>(m.From, m.To);
+		PrefetchTable(temp);
+
+		// Quiet moves after the first are the ones pruned or reduced, unless they give check
+		const bool quiet = IsQuiet<Side>(board, m);
+		const bool late = quiet && index > 0 && !inCheck;
+		const bool reducible = late && m_options.LateMoveReductions && depth >= 3 && index >= LateMoveIndex;
+		const bool givesCheck = (late && (futile || reducible)) ? temp.IsCheck<Traits::Other>() : false;
+		++index;
+
+		if (late && futile && !givesCheck)
+		{
+			continue;
+		}
+
+		// Reduced more the later the move comes and the less often it's been
+		// good before; a reduced move that turns out well is searched again
+		int reduction = 0;
+		if (reducible && !givesCheck)
+		{
+			reduction = index > 8 ? 2 : 1;
+			const int history = thread.QuietHistory[side][m.From.Raw()][m.To.Raw()];
+			if (history > HistoryMax / 4)
+			{
+				--reduction;
+			}
+			else if (history < 0)
+			{
+				++reduction;
+			}
+			if (reduction > depth - 2)
+			{
+				reduction = depth - 2;
+			}
+		}
+
+		thread.FollowPv = pvMove.IsValid() && SameMove(m, pvMove);
+		thread.History.Push(temp.Key());
+		int score = 0;
+		if (reduction > 0)
+		{
+			score = -Search<Traits::Other>(thread, temp, depth - 1 - reduction, -alpha - 1, -alpha, ply + 1);
+			if (score > alpha && !m_stop)
+			{
+				score = -Search<Traits::Other>(thread, temp, depth - 1, -beta, -alpha, ply + 1);
+			}
+		}
+		else
+		{
+			score = -Search<Traits::Other>(thread, temp, depth - 1, -beta, -alpha, ply + 1);
+		}
+		thread.History.Pop();
+		thread.FollowPv = false;
+
+		if (m_stop)
+		{
+			return 0;
+		}
+
+		if (score > best)
+		{
+			best = score;
+			bestMove = m;
+			if (score > alpha)
+			{
+				alpha = score;
+				UpdatePv(thread, ply, m);
+				if (alpha >= beta)
+				{
+					if (quiet)
+					{
+						UpdateHistory(thread.QuietHistory[side], m, depth * depth);
+						for (int i = 0; i < quietCount; ++i)
+						{
+							UpdateHistory(thread.QuietHistory[side], quietsTried[i], -depth * depth);
+						}
+					}
+					break;
+				}
+			}
+		}
+
+		if (quiet)
+		{
+			quietsTried[quietCount++] = m;
+		}
+	}
+
+	const Bound bound = best >= beta ? Bound::Lower : best > originalAlpha ? Bound::Exact : Bound::Upper;
+	Table().Store(board.Key(), ToTableScore(best, ply), depth, bound, bestMove);
+	return best;
+}
+
+bool GameAi::ProbeTablebases(const BoardState& board, int ply, int* score) const
+{
+	if (!m_tablebases)
+	{
+		return false;
+	}
+
+	int distance = 0;
+	const auto result = m_tablebases->Probe(board, &distance);
+	if (result == Wdl::Unknown)
+	{
+		return false;
+	}
+
+	// Table results are for the side to move, like the search's scores
+	switch (result)
+	{
+	case Wdl::Win: *score = TablebaseWinScore - distance - ply; break;
+	case Wdl::Loss: *score = -(TablebaseWinScore - distance - ply); break;
+	default: *score = 0; break;
+	}
+	return true;
 }
 
 DWORD WINAPI GameAi::WorkerThreadStatic(_In_  LPVOID lpParameter)
@@ -137,4 +1302,10 @@ DWORD WINAPI GameAi::WorkerThreadStatic(_In_  LPVOID lpParameter)
 	auto pThis = reinterpret_cast<GameAi*>(lpParameter);
 	return pThis->WorkerThread();
 
-}
\ No newline at end of file
+}
+
+DWORD WINAPI GameAi::HelperThreadStatic(_In_  LPVOID lpParameter)
+{
+	auto thread = reinterpret_cast<SearchThread*>(lpParameter);
+	return thread->Owner->HelperThread(*thread);
+}
@@ -1,7 +1,103 @@
 #pragma once
 
 #include "boardstate.h"
+#include "EvalCache.h"
+#include "Evaluation.h"
+#include "Nnue.h"
+#include "SearchArena.h"
+#include "TranspositionTable.h"
 #include <windows.h>
+#include <atomic>
+#include <functional>
+#include <memory>
+#include <random>
+
+class OpeningBook;
+class Tablebases;
+class TaskPool;
+
+// Checkmate on the board, less a point per ply so the quickest mate wins out
+const int MateScore = 1000000000;
+
+// Scores past this are forced wins (mates or tablebase wins), not material
+const int WinThreshold = 90000000;
+
+const int MaxSearchDepth = 64;
+
+// The most lines a front end offers to find with SetMultiPv()
+const int MaxMultiPv = 256;
+
+// What a search is allowed to use, zero meaning no limit.  With no limits at
+// all the search deepens until it finds a mate or reaches MaxSearchDepth.
+struct SearchLimits
+{
+	SearchLimits()
+		: Depth(0)
+		, Nodes(0)
+		, MoveTime(0)
+		, MovesToGo(0)
+		, Infinite(false)
+		, Ponder(false)
+	{
+		Time[0] = Time[1] = 0;
+		Increment[0] = Increment[1] = 0;
+	}
+
+	int Depth;				// plies
+	unsigned long long Nodes;	// checked every 1024 nodes, so a few more may be searched
+	DWORD MoveTime;			// milliseconds for this move
+	DWORD Time[2];			// clock left for each side, in milliseconds
+	DWORD Increment[2];
+	int MovesToGo;			// until the next time control, 0 for the rest of the game
+	bool Infinite;			// keep searching until Stop()
+	bool Ponder;			// like Infinite until PonderHit() starts the clock
+};
+
+// The selective parts of the search, and prefetching.  Each can be
+// switched off to measure what it's worth in nodes, speed and strength; all
+// are on by default.
+struct SearchOptions
+{
+	SearchOptions()
+		: NullMove(true)
+		, LateMoveReductions(true)
+		, Futility(true)
+		, ReverseFutility(true)
+		, CheckExtensions(true)
+		, Prefetch(true)
+	{}
+
+	bool NullMove;				// let the opponent move twice, and prune if we're still above beta
+	bool LateMoveReductions;	// search quiet moves late in the order less deeply, by their history
+	bool Futility;				// near the leaves, skip quiet moves that can't bring the score up to alpha
+	bool ReverseFutility;		// near the leaves, prune when the evaluation is well above beta
+	bool CheckExtensions;		// search a ply deeper when in check
+	bool Prefetch;				// start loading the child's table bucket as soon as a move is made
+};
+
+// Reported after each iteration of the search completes, or with MultiPV
+// after each line of each iteration
+struct SearchInfo
+{
+	SearchInfo()
+		: Depth(0)
+		, MultiPv(1)
+		, Score(0)
+		, Nodes(0)
+		, Time(0)
+		, Hashfull(0)
+		, BestMove(InvalidChessMove)
+	{}
+
+	int Depth;
+	int MultiPv;			// which line this is, from 1 for the best
+	int Score;				// from White's side, like GetBoardScore
+	unsigned long long Nodes;
+	DWORD Time;				// milliseconds since the search started
+	int Hashfull;			// permille of the transposition table in use
+	ChessMove BestMove;
+	std::vector<ChessMove> Pv;	// the line the search expects, starting with BestMove
+};
 
 class GameAi
 {
@@ -9,7 +105,176 @@ public:
 	GameAi();
 	~GameAi();
 
+	GameAi(const GameAi&) = delete;
+	GameAi& operator=(const GameAi&) = delete;
+
+	// Fixed depth search, as used by the desktop game
 	void StartDecideMove(const BoardState& board);
+	void StartDecideMove(const BoardState& board, const PositionHistory& history);
+
+	// Iterative deepening search on a worker thread, so the caller stays free
+	// to Stop() it.  A search that's still running is stopped first.
+	void StartSearch(const BoardState& board, const PositionHistory& history, const SearchLimits& limits);
+
+	// The same search run on the calling thread, for callers with threads of
+	// their own.  Only searches: the opening book and tablebases aren't asked.
+	ChessMove DecideMove(const BoardState& board, const PositionHistory& history, const SearchLimits& limits, int* score);
+
+	// Ends the search early, the best move found so far is played
+	void Stop()
+	{
+		m_stop = true;
+	}
+
+	// The move we pondered on was played: the clock starts now
+	void PonderHit()
+	{
+		m_clockStart = ::GetTickCount();
+		m_pondering = false;
+	}
+
+	typedef std::function<void(const SearchInfo&)> InfoCallback;
+	typedef std::function<void(ChessMove)> FinishedCallback;
+
+	// Both are called on the search thread
+	void SetInfoCallback(InfoCallback callback)
+	{
+		m_infoCallback = callback;
+	}
+
+	void SetFinishedCallback(FinishedCallback callback)
+	{
+		m_finishedCallback = callback;
+	}
+
+	// Only while no search is running
+	void SetHashSize(size_t megabytes)
+	{
+		m_table.Resize(megabytes);
+	}
+
+	// The table searches use, shared or not, for its size and the pages
+	// it's in
+	const TranspositionTable& GetTable() const
+	{
+		return Table();
+	}
+
+	// Only this object's own table, not a shared one
+	void ClearHash()
+	{
+		m_table.Clear();
+		m_evalCache.Clear();
+	}
+
+	// Searches with a table owned elsewhere, which any number of GameAi
+	// objects may be searching at once, or with this one's own again for
+	// nullptr.  The owner calls NewSearch() on it.
+	void SetSharedTable(TranspositionTable* table)
+	{
+		m_sharedTable = table;
+	}
+
+	// A flag owned by the caller that stops the search once it's set.
+	// Unlike Stop(), it counts even if it's set before the search starts.
+	void SetCancelFlag(const std::atomic<bool>* cancel)
+	{
+		m_cancel = cancel;
+	}
+
+	// Only while no search is running
+	void SetEvalCacheSize(size_t megabytes)
+	{
+		m_evalCache.Resize(megabytes);
+	}
+
+	// Extra threads search the same tree, sharing what they find through the
+	// transposition table
+	void SetThreads(int threads)
+	{
+		m_threadCount = threads < 1 ? 1 : threads;
+	}
+
+	// Once the root's first move has been searched, the rest are searched
+	// at once as tasks on the pool, each worker with search state of its
+	// own.  Only the root is split: below it each move is searched by one
+	// worker, however idle the others, unlike ParallelPerft, which splits
+	// deeper too.  Not a pool this search itself runs on, as it waits for
+	// them.  Only while no search is running.
+	void SetTaskPool(TaskPool* pool)
+	{
+		m_taskPool = pool;
+	}
+
+	// How many of the best root moves to find lines for, each reported as
+	// it completes.  The move played is the best line's.
+	void SetMultiPv(int lines)
+	{
+		m_multiPv = lines < 1 ? 1 : lines;
+	}
+
+	int GetMultiPv() const
+	{
+		return m_multiPv;
+	}
+
+	// Used to break ties between equally good moves
+	void SetRandomSeed(unsigned seed)
+	{
+		m_random.seed(seed);
+	}
+
+	// Book moves are played straight away, without a search.  The book is
+	// only read, so one can be shared between several GameAi objects.
+	void SetOpeningBook(const OpeningBook* book)
+	{
+		m_book = book;
+	}
+
+	// Endgame tables, shared like the book.  Inside the search they're only
+	// probed with at least probeDepth plies left, to keep file access down.
+	void SetTablebases(const Tablebases* tablebases, int probeDepth = 0)
+	{
+		m_tablebases = tablebases;
+		m_tablebaseProbeDepth = probeDepth;
+	}
+
+	// A network to evaluate with instead of the weights, or nullptr to go
+	// back to them.  Only read, so it can be shared like the book.
+	void SetNetwork(const NnueNetwork* network)
+	{
+		m_network = network;
+		m_evalCache.Clear();
+	}
+
+	// Only while no search is running
+	void SetEvalWeights(const EvalWeights& weights)
+	{
+		m_weights = weights;
+		m_evalCache.Clear();
+	}
+
+	const EvalWeights& GetEvalWeights() const
+	{
+		return m_weights;
+	}
+
+	// Only while no search is running
+	void SetSearchOptions(const SearchOptions& options)
+	{
+		m_options = options;
+	}
+
+	const SearchOptions& GetSearchOptions() const
+	{
+		return m_options;
+	}
+
+	// Positions played so far in the game, used to score repetitions as draws
+	void SetHistory(const PositionHistory& history)
+	{
+		m_history = history;
+	}
 
 	int GetBoardScore(const BoardState& board);
 
@@ -18,6 +283,11 @@ public:
 		return ::WaitForSingleObjectEx(m_finishedEvent, 0, TRUE) == WAIT_OBJECT_0;
 	}
 
+	bool IsSearching() const
+	{
+		return m_finishedEvent != INVALID_HANDLE_VALUE && !IsFinished();
+	}
+
 	void WaitUntilFinished() const
 	{
 		::WaitForSingleObjectEx(m_finishedEvent, INFINITE, TRUE);
@@ -28,23 +298,214 @@ public:
 		return m_bestMove;
 	}
 
+	// The reply we expect to our move, to ponder on: the table's best move in
+	// the position after it.  Invalid if the search didn't get that far.
+	ChessMove GetPonderMove() const;
+
+	// The line expected from the root, as of the last completed iteration
+	std::vector<ChessMove> GetPrincipalVariation() const
+	{
+		return m_pv;
+	}
+
+	// The lines of the last completed iteration, best first, one per
+	// SetMultiPv() line.  Lines that the search stopped before reaching at
+	// its last depth are from the depth before.
+	std::vector<SearchInfo> GetLines() const
+	{
+		return std::vector<SearchInfo>(m_lines.begin(), m_lines.begin() + m_lineCount);
+	}
+
+	// From White's side, of the last completed iteration
+	int GetScore() const
+	{
+		return m_bestScore;
+	}
+
 	DWORD GetElapsedTime() const
 	{
 		return m_elapsedTime;
 	}
 
+	unsigned long long GetNodes() const;
+
+	// Leaves of the current or last search whose evaluation was found in
+	// the cache, and those that had to be worked out
+	unsigned long long GetEvalCacheHits() const;
+	unsigned long long GetEvalCacheMisses() const;
+
+	// Scratch memory the threads of the current or last search took from
+	// their arenas, counting memory used over again as often as it was.
+	// Every node allocates, so this grows with the nodes searched.
+	unsigned long long GetArenaBytes() const;
+
+	// Blocks the arenas have taken from the heap, over all searches so far.
+	// Once the arenas are big enough this stays the same from one search to
+	// the next.  The threads, lines and the root's other bookkeeping are kept
+	// too, so a search like the last takes nothing from the heap at all.
+	// Splitting the root on a task pool is the exception: the tasks handed
+	// to the pool are the pool's to allocate.
+	unsigned long long GetArenaHeapAllocations() const;
+
 	ChessMove DecideMoveImpl(const BoardState& board, int depth, int* scoreAfterMove);
 
 private:
+	// What each thread searching the tree keeps to itself
+	struct SearchThread
+	{
+		SearchThread(GameAi* owner, SearchArena& arena, bool isMain, bool isSplit = false)
+			: Owner(owner)
+			, Arena(arena)
+			, IsMain(isMain)
+			, IsSplit(isSplit)
+			, Nodes(0)
+			, EvalCacheHits(0)
+			, EvalCacheMisses(0)
+			, FollowPv(false)
+		{
+			memset(QuietHistory, 0, sizeof(QuietHistory));
+			memset(PvLength, 0, sizeof(PvLength));
+		}
+
+		// For a new search.  The thread is kept from one search to the next,
+		// so its tables and buffers are reused rather than taken again.
+		void Reset()
+		{
+			Arena.Reset();
+			Pawns.Clear();
+			Nodes = 0;
+			EvalCacheHits = 0;
+			EvalCacheMisses = 0;
+			memset(QuietHistory, 0, sizeof(QuietHistory));
+			memset(PvLength, 0, sizeof(PvLength));
+			PreviousPv.clear();
+			FollowPv = false;
+		}
+
+		GameAi* Owner;
+		SearchArena& Arena;		// move lists and the like, one of m_arenas
+		bool IsMain;
+		bool IsSplit;		// searches root moves for the main thread, on the task pool
+		PositionHistory History;
+		NnueStack Network;
+		PawnTable Pawns;
+		std::atomic<unsigned long long> Nodes;
+		std::atomic<unsigned long long> EvalCacheHits;
+		std::atomic<unsigned long long> EvalCacheMisses;
+
+		// How often each quiet move, by side, from and to, has caused a cutoff
+		// lately.  Orders the quiet moves and decides how much they're reduced.
+		int QuietHistory[2][64][64];
+
+		// Triangular array of the best line found from each ply: Pv[ply]
+		// holds the moves from ply up to PvLength[ply]
+		ChessMove Pv[MaxSearchDepth + 2][MaxSearchDepth + 2];
+		int PvLength[MaxSearchDepth + 2];
+
+		// The last iteration's line, searched first while the search is still on it
+		std::vector<ChessMove> PreviousPv;
+		bool FollowPv;
+	};
+
 	DWORD m_startTime;
+	std::atomic<DWORD> m_clockStart;
 	DWORD m_elapsedTime;
+	DWORD m_softLimit;
+	DWORD m_hardLimit;
 	ChessMove m_bestMove;
-	const BoardState* m_board;
+	int m_bestScore;
+	std::vector<ChessMove> m_pv;
+	std::vector<SearchInfo> m_lines;	// only the first m_lineCount are this search's, the rest are kept for their buffers
+	size_t m_lineCount;
+	std::vector<ChessMove> m_excluded;	// the root moves of the lines before, with MultiPV
+	BoardState m_rootBoard;
+	SearchLimits m_limits;
+	PositionHistory m_history;
+	const OpeningBook* m_book;
+	const Tablebases* m_tablebases;
+	int m_tablebaseProbeDepth;
+	TranspositionTable m_table;
+	TranspositionTable* m_sharedTable;
+	const std::atomic<bool>* m_cancel;
+	EvalCache m_evalCache;
+	EvalWeights m_weights;
+	SearchOptions m_options;
+	const NnueNetwork* m_network;
+	int m_threadCount;
+	int m_multiPv;
+	std::vector<std::unique_ptr<SearchThread>> m_threads;
+	std::vector<HANDLE> m_helpers;
+	TaskPool* m_taskPool;
+	std::vector<std::unique_ptr<SearchThread>> m_splitThreads;	// one per pool worker
+
+	// Kept from one search to the next, so their blocks are reused: the
+	// main and helper threads' first, then the split threads'
+	std::vector<std::unique_ptr<SearchArena>> m_arenas;
+	std::atomic<bool> m_stop;
+	std::atomic<bool> m_pondering;
+	std::default_random_engine m_random;
+	InfoCallback m_infoCallback;
+	FinishedCallback m_finishedCallback;
+
+	TranspositionTable& Table()
+	{
+		return m_sharedTable ? *m_sharedTable : m_table;
+	}
+
+	const TranspositionTable& Table() const
+	{
+		return m_sharedTable ? *m_sharedTable : m_table;
+	}
+
+	// Called with a child as soon as the move to it is made
+	void PrefetchTable(const BoardState& child) const
+	{
+		if (m_options.Prefetch)
+		{
+			Table().Prefetch(child.Key());
+		}
+	}
+
+	int Evaluate(const BoardState& board, int moveCount, PawnTable* pawns = nullptr);
+	SearchArena& ThreadArena(size_t index);
+	template <SideType Side>
+	int StaticEvaluate(SearchThread& thread, const BoardState& board, int moveCount, int ply);
+	bool ProbeTablebases(const BoardState& board, int ply, int* score) const;
+	void RootLine(const SearchThread& thread, int depth, std::vector<ChessMove>* line) const;
+	static void UpdatePv(SearchThread& thread, int ply, const ChessMove& m);
+
+	// Negamax scores, from the side to move's point of view.  Below the
+	// root the side to move is fixed when compiling, as Side.
+	ChessMove SearchRoot(SearchThread& thread, const BoardState& board, int depth, int alpha, int beta, int* score, const std::vector<ChessMove>* excluded = nullptr);
+	template <SideType Side>
+	ChessMove SearchRoot(SearchThread& thread, const BoardState& board, int depth, int alpha, int beta, int* score, const std::vector<ChessMove>* excluded);
+	ChessMove AspirationSearch(SearchThread& thread, int depth, int lastScore, bool useLastScore, const std::vector<ChessMove>& excluded, int* score);
+	template <SideType Side>
+	int Search(SearchThread& thread, const BoardState& board, int depth, int alpha, int beta, int ply, bool allowNull = true);
+	ChessMove IterativeDeepening(int* score);
+	bool ShouldStop(SearchThread& thread);
+
+	// A root move searched on the task pool, with the line that followed it
+	struct SplitResult
+	{
+		ChessMove Move;
+		int Score;
+		bool Finished;		// the search wasn't stopped part way
+		std::vector<ChessMove> Line;
+	};
+
+	void PrepareThreads(size_t count);
+	template <SideType Side>
+	std::vector<SplitResult> SearchRootSplit(const SearchThread& thread, const BoardState& board, const std::vector<ChessMove>& moves, int depth, int alpha, int beta, int best);
+	bool IsSoftLimitReached() const;
+	void PrepareSearch(const BoardState& board, const PositionHistory& history, const SearchLimits& limits);
+	void SetTimeLimits();
 
 	HANDLE m_finishedEvent;
 
-	
+
 	static DWORD WINAPI WorkerThreadStatic(_In_  LPVOID lpParameter);
 	DWORD WINAPI WorkerThread();
+	static DWORD WINAPI HelperThreadStatic(_In_  LPVOID lpParameter);
+	DWORD WINAPI HelperThread(SearchThread& thread);
 };
-
@@ -0,0 +1,238 @@
+#pragma once
+
+#include "BoardState.h"
+#include <cstddef>
+#include <utility>
+
+// What the squares of an empty board are to each other: where a knight or
+// king on one can go, which squares a pawn attacks, what lies between two
+// squares and how far apart they are.  Move generation and attack tests
+// used to work these out with Sign() and abs() on every call; here they're
+// worked out once, by the compiler, so the hot path only looks them up and
+// a program that never uses a table never pays for it.
+//
+// Squares are raw BoardLocation numbers, 0 being a8 and 63 h1.  Sets of
+// squares are SquareSets, with the bit for square n at 1 << n.
+//
+// Only for .cpp files: the tables have internal linkage, so one is built
+// into each that uses it.
+namespace Geometry
+{
+	// An array usable in constant expressions.  Tables of two squares are
+	// tables of tables, indexed by the first then the second.
+	template <class T, size_t N>
+	struct Table
+	{
+		T Entries[N];
+
+		constexpr const T& operator[](size_t index) const
+		{
+			return Entries[index];
+		}
+	};
+
+	typedef Table<Table<SquareSet, 64>, 64> SquarePairs;
+
+	namespace Detail
+	{
+		// C++11 constexpr functions are a single return statement, so loops
+		// over squares are written as recursion
+
+		constexpr int X(int square) { return square % 8; }
+		constexpr int Y(int square) { return square / 8; }
+		constexpr int Abs(int value) { return value < 0 ? -value : value; }
+		constexpr int Sign(int value) { return (0 < value) - (value < 0); }
+		constexpr int Max(int a, int b) { return a < b ? b : a; }
+
+		constexpr bool OnBoard(int x, int y)
+		{
+			return x >= 0 && x < 8 && y >= 0 && y < 8;
+		}
+
+		// Nothing for a square off the board, so steps off the edge drop out
+		constexpr SquareSet Bit(int x, int y)
+		{
+			return OnBoard(x, y) ? SquareSet(1) << (x + y * 8) : 0;
+		}
+
+		constexpr int Count(SquareSet squares)
+		{
+			return squares ? 1 + Count(squares & (squares - 1)) : 0;
+		}
+
+		// From (x, y) on in steps of (dx, dy), to the edge of the board
+		constexpr SquareSet Walk(int x, int y, int dx, int dy)
+		{
+			return OnBoard(x, y) ? Bit(x, y) | Walk(x + dx, y + dy, dx, dy) : 0;
+		}
+
+		// Or up to but not including stop, which must be on the way
+		constexpr SquareSet WalkTo(int x, int y, int dx, int dy, int stop)
+		{
+			return x + y * 8 == stop ? 0 : Bit(x, y) | WalkTo(x + dx, y + dy, dx, dy, stop);
+		}
+
+		// On one rank, file or diagonal
+		constexpr bool Aligned(int a, int b)
+		{
+			return a != b
+				&& (X(a) == X(b) || Y(a) == Y(b) || Abs(X(b) - X(a)) == Abs(Y(b) - Y(a)));
+		}
+
+		struct KnightTargetsOf
+		{
+			typedef SquareSet Type;
+			static constexpr SquareSet Of(int square)
+			{
+				return Bit(X(square) + 1, Y(square) + 2) | Bit(X(square) + 2, Y(square) + 1)
+					| Bit(X(square) + 2, Y(square) - 1) | Bit(X(square) + 1, Y(square) - 2)
+					| Bit(X(square) - 1, Y(square) - 2) | Bit(X(square) - 2, Y(square) - 1)
+					| Bit(X(square) - 2, Y(square) + 1) | Bit(X(square) - 1, Y(square) + 2);
+			}
+		};
+
+		struct KingTargetsOf
+		{
+			typedef SquareSet Type;
+			static constexpr SquareSet Of(int square)
+			{
+				return Bit(X(square) + 1, Y(square)) | Bit(X(square) + 1, Y(square) + 1)
+					| Bit(X(square), Y(square) + 1) | Bit(X(square) - 1, Y(square) + 1)
+					| Bit(X(square) - 1, Y(square)) | Bit(X(square) - 1, Y(square) - 1)
+					| Bit(X(square), Y(square) - 1) | Bit(X(square) + 1, Y(square) - 1);
+			}
+		};
+
+		struct RookRaysOf
+		{
+			typedef SquareSet Type;
+			static constexpr SquareSet Of(int square)
+			{
+				return Walk(X(square) + 1, Y(square), 1, 0) | Walk(X(square) - 1, Y(square), -1, 0)
+					| Walk(X(square), Y(square) + 1, 0, 1) | Walk(X(square), Y(square) - 1, 0, -1);
+			}
+		};
+
+		struct BishopRaysOf
+		{
+			typedef SquareSet Type;
+			static constexpr SquareSet Of(int square)
+			{
+				return Walk(X(square) + 1, Y(square) + 1, 1, 1) | Walk(X(square) - 1, Y(square) + 1, -1, 1)
+					| Walk(X(square) - 1, Y(square) - 1, -1, -1) | Walk(X(square) + 1, Y(square) - 1, 1, -1);
+			}
+		};
+
+		// By side, white's pawns going up the board towards a8
+		struct PawnAttacksOf
+		{
+			typedef SquareSet Type;
+			static constexpr SquareSet Of(int side, int square)
+			{
+				return Bit(X(square) - 1, Y(square) + (side == 0 ? -1 : 1))
+					| Bit(X(square) + 1, Y(square) + (side == 0 ? -1 : 1));
+			}
+		};
+
+		// Not including either end.  Nothing unless they're aligned.
+		struct BetweenOf
+		{
+			typedef SquareSet Type;
+			static constexpr SquareSet Of(int a, int b)
+			{
+				return Aligned(a, b)
+					? WalkTo(X(a) + Sign(X(b) - X(a)), Y(a) + Sign(Y(b) - Y(a)),
+						Sign(X(b) - X(a)), Sign(Y(b) - Y(a)), b)
+					: 0;
+			}
+		};
+
+		// Added to a square's number to go one square towards the other along
+		// their line.  0 unless they're aligned.
+		struct StepOf
+		{
+			typedef signed char Type;
+			static constexpr signed char Of(int a, int b)
+			{
+				return static_cast<signed char>(Aligned(a, b) ? Sign(X(b) - X(a)) + Sign(Y(b) - Y(a)) * 8 : 0);
+			}
+		};
+
+		// In king moves
+		struct DistanceOf
+		{
+			typedef byte Type;
+			static constexpr byte Of(int a, int b)
+			{
+				return static_cast<byte>(Max(Abs(X(b) - X(a)), Abs(Y(b) - Y(a))));
+			}
+		};
+
+		template <class Generator, size_t... Index>
+		constexpr Table<typename Generator::Type, sizeof...(Index)> Generate(std::index_sequence<Index...>)
+		{
+			return {{ Generator::Of(Index)... }};
+		}
+
+		template <class Generator, size_t First, size_t... Second>
+		constexpr Table<typename Generator::Type, sizeof...(Second)> GenerateRow(std::index_sequence<Second...>)
+		{
+			return {{ Generator::Of(First, Second)... }};
+		}
+
+		template <class Generator, size_t... First>
+		constexpr Table<Table<typename Generator::Type, 64>, sizeof...(First)> GeneratePairs(std::index_sequence<First...>)
+		{
+			return {{ GenerateRow<Generator, First>(std::make_index_sequence<64>())... }};
+		}
+
+		// For checking the tables: squares in the first count entries
+		template <size_t N>
+		constexpr int Total(const Table<SquareSet, N>& table, size_t count)
+		{
+			return count ? Count(table[count - 1]) + Total(table, count - 1) : 0;
+		}
+
+		template <size_t N>
+		constexpr int Total(const Table<Table<SquareSet, 64>, N>& table, size_t count)
+		{
+			return count ? Total(table[count - 1], 64) + Total(table, count - 1) : 0;
+		}
+	}
+
+	// Indexed by square
+	constexpr Table<SquareSet, 64> KnightTargets = Detail::Generate<Detail::KnightTargetsOf>(std::make_index_sequence<64>());
+	constexpr Table<SquareSet, 64> KingTargets = Detail::Generate<Detail::KingTargetsOf>(std::make_index_sequence<64>());
+	constexpr Table<SquareSet, 64> RookRays = Detail::Generate<Detail::RookRaysOf>(std::make_index_sequence<64>());
+	constexpr Table<SquareSet, 64> BishopRays = Detail::Generate<Detail::BishopRaysOf>(std::make_index_sequence<64>());
+
+	// Indexed by the side of the pawn, then its square
+	constexpr Table<Table<SquareSet, 64>, 2> PawnAttacks = Detail::GeneratePairs<Detail::PawnAttacksOf>(std::make_index_sequence<2>());
+
+	// Indexed by both squares, either way round
+	constexpr SquarePairs Between = Detail::GeneratePairs<Detail::BetweenOf>(std::make_index_sequence<64>());
+	constexpr Table<Table<signed char, 64>, 64> Step = Detail::GeneratePairs<Detail::StepOf>(std::make_index_sequence<64>());
+	constexpr Table<Table<byte, 64>, 64> Distance = Detail::GeneratePairs<Detail::DistanceOf>(std::make_index_sequence<64>());
+
+	// a8 is 0, h8 7, a1 56 and h1 63
+	static_assert(Detail::Count(KnightTargets[0]) == 2 && Detail::Count(KnightTargets[27]) == 8, "Knight targets from a corner and the centre");
+	static_assert(Detail::Total(KnightTargets, 64) == 336, "Knight moves on an empty board");
+	static_assert(Detail::Count(KingTargets[63]) == 3 && Detail::Count(KingTargets[36]) == 8, "King targets from a corner and the centre");
+	static_assert(Detail::Total(KingTargets, 64) == 420, "King moves on an empty board");
+	static_assert(Detail::Total(RookRays, 64) == 64 * 14, "A rook sees 14 squares from anywhere");
+	static_assert(Detail::Total(BishopRays, 64) == 560, "Bishop moves on an empty board");
+
+	static_assert(PawnAttacks[0][52] == (Detail::Bit(3, 5) | Detail::Bit(5, 5)), "White's pawn on e2 attacks d3 and f3");
+	static_assert(PawnAttacks[1][8] == Detail::Bit(1, 2), "Black's pawn on a7 attacks b6");
+	static_assert(PawnAttacks[0][4] == 0 && PawnAttacks[1][60] == 0, "No pawn attacks off the board");
+	static_assert(Detail::Total(PawnAttacks[0], 64) == 98 && Detail::Total(PawnAttacks[1], 64) == 98, "Pawn attacks the same for both sides");
+
+	static_assert(Detail::Count(Between[56][7]) == 6 && Between[56][7] == Between[7][56], "Between a1 and h8");
+	static_assert(Between[60][63] == (Detail::Bit(5, 7) | Detail::Bit(6, 7)), "Between e1 and h1");
+	static_assert(Between[0][1] == 0 && Between[0][17] == 0 && Between[0][0] == 0, "Nothing between neighbours, a knight's move or a square and itself");
+	static_assert(Detail::Total(Between, 64) == 2 * 1288, "Squares between every ordered pair");
+
+	static_assert(Step[56][7] == -7 && Step[7][56] == 7 && Step[60][4] == -8 && Step[0][63] == 9 && Step[0][17] == 0, "Steps along diagonals and files");
+
+	static_assert(Distance[56][7] == 7 && Distance[27][28] == 1 && Distance[0][17] == 2 && Distance[9][9] == 0, "King distances");
+}
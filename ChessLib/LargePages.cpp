@@ -0,0 +1,237 @@
+#include "stdafx.h"
+#include "LargePages.h"
+#include <thread>
+#include <utility>
+#include <vector>
+
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <fstream>
+#include <string>
+#include <sys/mman.h>
+#include <unistd.h>
+#endif
+
+namespace
+{
+	// Smaller than this is zeroed by the calling thread alone, as starting
+	// threads would cost more than they save
+	const size_t ParallelZeroBytes = 64 * 1024 * 1024;
+
+#ifdef _WIN32
+	// Large pages can't be paged out, so a process must hold the privilege
+	// to lock memory, and switch it on, before it can have any
+	bool EnableLockMemoryPrivilege()
+	{
+		HANDLE token;
+		if (!::OpenProcessToken(::GetCurrentProcess(), TOKEN_ADJUST_PRIVILEGES | TOKEN_QUERY, &token))
+		{
+			return false;
+		}
+
+		TOKEN_PRIVILEGES privileges = {};
+		privileges.PrivilegeCount = 1;
+		privileges.Privileges[0].Attributes = SE_PRIVILEGE_ENABLED;
+
+		// Succeeds without the privilege being held, saying so only in the last error
+		const bool enabled = ::LookupPrivilegeValue(nullptr, SE_LOCK_MEMORY_NAME, &privileges.Privileges[0].Luid)
+			&& ::AdjustTokenPrivileges(token, FALSE, &privileges, 0, nullptr, nullptr)
+			&& ::GetLastError() == ERROR_SUCCESS;
+		::CloseHandle(token);
+		return enabled;
+	}
+#else
+	const size_t HugePageSize = 2 * 1024 * 1024;
+
+	// Set to "always" or "madvise", in which case the madvise() below counts
+	bool TransparentHugePagesEnabled()
+	{
+		std::ifstream file("/sys/kernel/mm/transparent_hugepage/enabled");
+		std::string setting;
+		std::getline(file, setting);
+		return setting.find("[always]") != std::string::npos || setting.find("[madvise]") != std::string::npos;
+	}
+#endif
+}
+
+LargePageBuffer::LargePageBuffer()
+	: m_data(nullptr)
+	, m_size(0)
+	, m_mappedSize(0)
+	, m_pageSize(0)
+	, m_kind("normal")
+{
+}
+
+LargePageBuffer::~LargePageBuffer()
+{
+	Free();
+}
+
+bool LargePageBuffer::Allocate(size_t bytes, int threads)
+{
+	// Mapped apart and swapped in, so failing leaves the old memory alone
+	LargePageBuffer fresh;
+	if (!fresh.Map(bytes))
+	{
+		return false;
+	}
+	fresh.Zero(threads);
+	Swap(fresh);
+	return true;
+}
+
+void LargePageBuffer::Swap(LargePageBuffer& other)
+{
+	std::swap(m_data, other.m_data);
+	std::swap(m_size, other.m_size);
+	std::swap(m_mappedSize, other.m_mappedSize);
+	std::swap(m_pageSize, other.m_pageSize);
+	std::swap(m_kind, other.m_kind);
+}
+
+#ifdef _WIN32
+
+bool LargePageBuffer::Map(size_t bytes)
+{
+	const size_t largePage = ::GetLargePageMinimum();
+	if (largePage && EnableLockMemoryPrivilege())
+	{
+		const size_t rounded = (bytes + largePage - 1) / largePage * largePage;
+		m_data = ::VirtualAlloc(nullptr, rounded, MEM_RESERVE | MEM_COMMIT | MEM_LARGE_PAGES, PAGE_READWRITE);
+		if (m_data)
+		{
+			m_mappedSize = rounded;
+			m_pageSize = largePage;
+			m_kind = "huge";
+		}
+	}
+
+	if (!m_data)
+	{
+		m_data = ::VirtualAlloc(nullptr, bytes, MEM_RESERVE | MEM_COMMIT, PAGE_READWRITE);
+		if (!m_data)
+		{
+			return false;
+		}
+		SYSTEM_INFO info;
+		::GetSystemInfo(&info);
+		m_mappedSize = bytes;
+		m_pageSize = info.dwPageSize;
+		m_kind = "normal";
+	}
+
+	m_size = bytes;
+	return true;
+}
+
+void LargePageBuffer::Free()
+{
+	if (m_data)
+	{
+		::VirtualFree(m_data, 0, MEM_RELEASE);
+	}
+	m_data = nullptr;
+	m_size = 0;
+	m_mappedSize = 0;
+}
+
+#else
+
+bool LargePageBuffer::Map(size_t bytes)
+{
+	const size_t rounded = (bytes + HugePageSize - 1) / HugePageSize * HugePageSize;
+	void* data = ::mmap(nullptr, rounded, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+	if (data != MAP_FAILED)
+	{
+		m_data = data;
+		m_mappedSize = rounded;
+		m_pageSize = HugePageSize;
+		m_kind = "huge";
+	}
+	else
+	{
+		// Transparent huge pages only back whole aligned 2MB ranges, so a
+		// page more is mapped and the ends either side of the aligned part
+		// given back
+		data = ::mmap(nullptr, rounded + HugePageSize, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+		if (data == MAP_FAILED)
+		{
+			return false;
+		}
+		const auto start = reinterpret_cast<size_t>(data);
+		const auto aligned = (start + HugePageSize - 1) / HugePageSize * HugePageSize;
+		if (aligned > start)
+		{
+			::munmap(data, aligned - start);
+		}
+		if (start + HugePageSize > aligned)
+		{
+			::munmap(reinterpret_cast<void*>(aligned + rounded), start + HugePageSize - aligned);
+		}
+		m_data = reinterpret_cast<void*>(aligned);
+		m_mappedSize = rounded;
+
+		if (::madvise(m_data, rounded, MADV_HUGEPAGE) == 0 && TransparentHugePagesEnabled())
+		{
+			m_pageSize = HugePageSize;
+			m_kind = "transparent huge";
+		}
+		else
+		{
+			m_pageSize = static_cast<size_t>(::sysconf(_SC_PAGESIZE));
+			m_kind = "normal";
+		}
+	}
+
+	m_size = bytes;
+	return true;
+}
+
+void LargePageBuffer::Free()
+{
+	if (m_data)
+	{
+		::munmap(m_data, m_mappedSize);
+	}
+	m_data = nullptr;
+	m_size = 0;
+	m_mappedSize = 0;
+}
+
+#endif
+
+// Each thread zeroes a contiguous share, on whole pages so no page is
+// first touched by two threads
+void LargePageBuffer::Zero(int threads)
+{
+	if (!m_data)
+	{
+		return;
+	}
+
+	if (threads <= 0)
+	{
+		threads = static_cast<int>(std::thread::hardware_concurrency());
+	}
+	if (threads <= 1 || m_size < ParallelZeroBytes)
+	{
+		memset(m_data, 0, m_size);
+		return;
+	}
+
+	const size_t pages = (m_size + m_pageSize - 1) / m_pageSize;
+	const size_t share = (pages + threads - 1) / threads * m_pageSize;
+	std::vector<std::thread> zeroing;
+	for (size_t start = 0; start < m_size; start += share)
+	{
+		const size_t length = m_size - start < share ? m_size - start : share;
+		char* memory = static_cast<char*>(m_data) + start;
+		zeroing.push_back(std::thread([memory, length] { memset(memory, 0, length); }));
+	}
+	for (auto& thread : zeroing)
+	{
+		thread.join();
+	}
+}
@@ -0,0 +1,73 @@
+#pragma once
+
+#include <cstddef>
+
+// Zeroed memory for a big table probed at random, like the transposition
+// table, backed by large pages where the OS will give them.  With 4kB pages
+// a table of gigabytes needs far more TLB entries than the CPU has, so
+// nearly every probe walks the page tables as well as missing the cache;
+// 2MB pages cut that by 512 times.
+//
+// On Windows large pages need the "Lock pages in memory" privilege, and
+// are asked for with VirtualAlloc.  On Linux explicit huge pages are tried
+// first (MAP_HUGETLB, from the pool set up in /proc/sys/vm/nr_hugepages),
+// then transparent huge pages through madvise().  Failing those the memory
+// comes in normal pages.
+//
+// The memory is zeroed by several threads, each writing its own share, so
+// on a NUMA machine the pages are spread over the nodes the threads ran
+// on rather than all put on the node of the thread that allocated them.
+class LargePageBuffer
+{
+public:
+	LargePageBuffer();
+	~LargePageBuffer();
+
+	LargePageBuffer(const LargePageBuffer&) = delete;
+	LargePageBuffer& operator=(const LargePageBuffer&) = delete;
+
+	// Replaces the memory held before.  Threads: how many zero the memory, 0
+	// for one per core.  False if there isn't the memory at all, in which
+	// case the old memory is kept; so for a moment both are held.
+	bool Allocate(size_t bytes, int threads = 0);
+	void Free();
+
+	void Swap(LargePageBuffer& other);
+
+	// Back to zero, with the same threads as Allocate()
+	void Zero(int threads = 0);
+
+	void* Data() const
+	{
+		return m_data;
+	}
+
+	size_t Size() const
+	{
+		return m_size;
+	}
+
+	// Of the pages in effect, in bytes.  Transparent huge pages are only
+	// counted if the system has them switched on, and even then the kernel
+	// may not have found the memory for all of them.
+	size_t PageSize() const
+	{
+		return m_pageSize;
+	}
+
+	// "huge", "transparent huge" or "normal"
+	const char* PageKind() const
+	{
+		return m_kind;
+	}
+
+private:
+	// Maps the memory for an empty buffer, without zeroing it
+	bool Map(size_t bytes);
+
+	void* m_data;
+	size_t m_size;
+	size_t m_mappedSize;	// rounded up to whole pages
+	size_t m_pageSize;
+	const char* m_kind;
+};
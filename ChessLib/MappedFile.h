@@ -0,0 +1,45 @@
+#pragma once
+
+#include <cstddef>
+
+// Read-only view of a whole file mapped into memory.  The OS shares the pages
+// between every mapping of the same file, so one MappedFile can be read from
+// any number of threads without copying it into the heap.
+class MappedFile
+{
+public:
+	MappedFile();
+	~MappedFile();
+
+	bool Open(const char* path);
+	void Close();
+
+	bool IsOpen() const
+	{
+		return m_data != nullptr;
+	}
+
+	const unsigned char* Data() const
+	{
+		return m_data;
+	}
+
+	size_t Size() const
+	{
+		return m_size;
+	}
+
+private:
+	MappedFile(const MappedFile&) = delete;
+	MappedFile& operator=(const MappedFile&) = delete;
+
+	const unsigned char* m_data;
+	size_t m_size;
+
+#ifdef _WIN32
+	void* m_file;
+	void* m_mapping;
+#else
+	int m_file;
+#endif
+};
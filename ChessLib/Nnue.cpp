@@ -0,0 +1,469 @@
+#include "stdafx.h"
+#include "Nnue.h"
+#include "GameAi.h"
+#include <fstream>
+
+// Chosen when compiling: MSVC has no switch for SSE4.1 alone, but /arch:AVX implies it
+#if defined(__AVX2__)
+#define NNUE_AVX2
+#include <immintrin.h>
+#elif defined(__SSE4_1__) || defined(__AVX__)
+#define NNUE_SSE41
+#include <smmintrin.h>
+#endif
+
+namespace
+{
+	const char NetworkMagic[4] = { 'C', 'L', 'N', 'N' };
+	const unsigned NetworkVersion = 1;
+
+	struct NetworkFileHeader
+	{
+		char Magic[4];
+		unsigned Version;
+		unsigned Inputs;
+		unsigned AccumulatorSize;
+		unsigned Hidden1Size;
+		unsigned Hidden2Size;
+	};
+
+	// Big enough for any network we'd want, so evaluating needs no allocation
+	const int MaxAccumulatorSize = 1024;
+	const int MaxHiddenSize = 256;
+
+	bool IsFeature(Piece piece)
+	{
+		return piece.Type != PieceType::Empty && piece.Type != PieceType::King;
+	}
+
+	template <typename T>
+	bool Read(std::istream& input, std::vector<T>& values)
+	{
+		return !!input.read(reinterpret_cast<char*>(values.data()), values.size() * sizeof(T));
+	}
+
+	template <typename T>
+	void Write(std::ostream& output, const std::vector<T>& values)
+	{
+		output.write(reinterpret_cast<const char*>(values.data()), values.size() * sizeof(T));
+	}
+
+	void AddRow(short* values, const short* row, int size)
+	{
+#if defined(NNUE_AVX2)
+		for (int i = 0; i < size; i += 16)
+		{
+			auto v = reinterpret_cast<__m256i*>(values + i);
+			_mm256_storeu_si256(v, _mm256_add_epi16(_mm256_loadu_si256(v), _mm256_loadu_si256(reinterpret_cast<const __m256i*>(row + i))));
+		}
+#elif defined(NNUE_SSE41)
+		for (int i = 0; i < size; i += 8)
+		{
+			auto v = reinterpret_cast<__m128i*>(values + i);
+			_mm_storeu_si128(v, _mm_add_epi16(_mm_loadu_si128(v), _mm_loadu_si128(reinterpret_cast<const __m128i*>(row + i))));
+		}
+#else
+		for (int i = 0; i < size; ++i)
+		{
+			values[i] += row[i];
+		}
+#endif
+	}
+
+	void SubtractRow(short* values, const short* row, int size)
+	{
+#if defined(NNUE_AVX2)
+		for (int i = 0; i < size; i += 16)
+		{
+			auto v = reinterpret_cast<__m256i*>(values + i);
+			_mm256_storeu_si256(v, _mm256_sub_epi16(_mm256_loadu_si256(v), _mm256_loadu_si256(reinterpret_cast<const __m256i*>(row + i))));
+		}
+#elif defined(NNUE_SSE41)
+		for (int i = 0; i < size; i += 8)
+		{
+			auto v = reinterpret_cast<__m128i*>(values + i);
+			_mm_storeu_si128(v, _mm_sub_epi16(_mm_loadu_si128(v), _mm_loadu_si128(reinterpret_cast<const __m128i*>(row + i))));
+		}
+#else
+		for (int i = 0; i < size; ++i)
+		{
+			values[i] -= row[i];
+		}
+#endif
+	}
+
+	// Clamps the accumulator to 0..127
+	void ClipAccumulator(const short* values, int size, unsigned char* output)
+	{
+#if defined(NNUE_AVX2)
+		const __m256i zero = _mm256_setzero_si256();
+		int i = 0;
+		for (; i + 32 <= size; i += 32)
+		{
+			const __m256i a = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(values + i));
+			const __m256i b = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(values + i + 16));
+			// Packing works within each 128 bit lane, the permute puts them back in order
+			const __m256i packed = _mm256_permute4x64_epi64(_mm256_max_epi8(_mm256_packs_epi16(a, b), zero), 0xd8);
+			_mm256_storeu_si256(reinterpret_cast<__m256i*>(output + i), packed);
+		}
+
+		// Sizes are multiples of 16, so an odd one leaves 16 values over
+		if (i < size)
+		{
+			const __m128i a = _mm_loadu_si128(reinterpret_cast<const __m128i*>(values + i));
+			const __m128i b = _mm_loadu_si128(reinterpret_cast<const __m128i*>(values + i + 8));
+			_mm_storeu_si128(reinterpret_cast<__m128i*>(output + i), _mm_max_epi8(_mm_packs_epi16(a, b), _mm256_castsi256_si128(zero)));
+		}
+#elif defined(NNUE_SSE41)
+		const __m128i zero = _mm_setzero_si128();
+		for (int i = 0; i < size; i += 16)
+		{
+			const __m128i a = _mm_loadu_si128(reinterpret_cast<const __m128i*>(values + i));
+			const __m128i b = _mm_loadu_si128(reinterpret_cast<const __m128i*>(values + i + 8));
+			_mm_storeu_si128(reinterpret_cast<__m128i*>(output + i), _mm_max_epi8(_mm_packs_epi16(a, b), zero));
+		}
+#else
+		for (int i = 0; i < size; ++i)
+		{
+			const int v = values[i];
+			output[i] = static_cast<unsigned char>(v < 0 ? 0 : v > NnueParameters::ActivationMax ? NnueParameters::ActivationMax : v);
+		}
+#endif
+	}
+
+	// Scales a hidden layer's sums back down and clamps them to 0..127
+	void ClipHidden(const int* values, int size, unsigned char* output)
+	{
+#if defined(NNUE_AVX2)
+		const __m256i zero = _mm256_setzero_si256();
+		const __m256i order = _mm256_setr_epi32(0, 4, 1, 5, 2, 6, 3, 7);
+		for (int i = 0; i < size; i += 32)
+		{
+			auto in = reinterpret_cast<const __m256i*>(values + i);
+			const __m256i a = _mm256_srai_epi32(_mm256_loadu_si256(in), NnueParameters::WeightShift);
+			const __m256i b = _mm256_srai_epi32(_mm256_loadu_si256(in + 1), NnueParameters::WeightShift);
+			const __m256i c = _mm256_srai_epi32(_mm256_loadu_si256(in + 2), NnueParameters::WeightShift);
+			const __m256i d = _mm256_srai_epi32(_mm256_loadu_si256(in + 3), NnueParameters::WeightShift);
+			const __m256i packed = _mm256_max_epi8(_mm256_packs_epi16(_mm256_packs_epi32(a, b), _mm256_packs_epi32(c, d)), zero);
+			_mm256_storeu_si256(reinterpret_cast<__m256i*>(output + i), _mm256_permutevar8x32_epi32(packed, order));
+		}
+#elif defined(NNUE_SSE41)
+		const __m128i zero = _mm_setzero_si128();
+		for (int i = 0; i < size; i += 16)
+		{
+			auto in = reinterpret_cast<const __m128i*>(values + i);
+			const __m128i a = _mm_srai_epi32(_mm_loadu_si128(in), NnueParameters::WeightShift);
+			const __m128i b = _mm_srai_epi32(_mm_loadu_si128(in + 1), NnueParameters::WeightShift);
+			const __m128i c = _mm_srai_epi32(_mm_loadu_si128(in + 2), NnueParameters::WeightShift);
+			const __m128i d = _mm_srai_epi32(_mm_loadu_si128(in + 3), NnueParameters::WeightShift);
+			const __m128i packed = _mm_packs_epi16(_mm_packs_epi32(a, b), _mm_packs_epi32(c, d));
+			_mm_storeu_si128(reinterpret_cast<__m128i*>(output + i), _mm_max_epi8(packed, zero));
+		}
+#else
+		for (int i = 0; i < size; ++i)
+		{
+			const int v = values[i] >> NnueParameters::WeightShift;
+			output[i] = static_cast<unsigned char>(v < 0 ? 0 : v > NnueParameters::ActivationMax ? NnueParameters::ActivationMax : v);
+		}
+#endif
+	}
+
+	// output = biases + weights * input, with the inputs 0..127 so the
+	// pairwise int16 sums can't saturate
+	void Affine(const unsigned char* input, int inputSize, const signed char* weights, const int* biases, int outputSize, int* output)
+	{
+#if defined(NNUE_AVX2)
+		const __m256i ones = _mm256_set1_epi16(1);
+		for (int i = 0; i < outputSize; ++i)
+		{
+			const signed char* row = weights + i * inputSize;
+			__m256i sum = _mm256_setzero_si256();
+			for (int j = 0; j < inputSize; j += 32)
+			{
+				const __m256i in = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(input + j));
+				const __m256i w = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(row + j));
+				sum = _mm256_add_epi32(sum, _mm256_madd_epi16(_mm256_maddubs_epi16(in, w), ones));
+			}
+			__m128i total = _mm_add_epi32(_mm256_castsi256_si128(sum), _mm256_extracti128_si256(sum, 1));
+			total = _mm_add_epi32(total, _mm_shuffle_epi32(total, 0x4e));
+			total = _mm_add_epi32(total, _mm_shuffle_epi32(total, 0xb1));
+			output[i] = biases[i] + _mm_cvtsi128_si32(total);
+		}
+#elif defined(NNUE_SSE41)
+		const __m128i ones = _mm_set1_epi16(1);
+		for (int i = 0; i < outputSize; ++i)
+		{
+			const signed char* row = weights + i * inputSize;
+			__m128i sum = _mm_setzero_si128();
+			for (int j = 0; j < inputSize; j += 16)
+			{
+				const __m128i in = _mm_loadu_si128(reinterpret_cast<const __m128i*>(input + j));
+				const __m128i w = _mm_loadu_si128(reinterpret_cast<const __m128i*>(row + j));
+				sum = _mm_add_epi32(sum, _mm_madd_epi16(_mm_maddubs_epi16(in, w), ones));
+			}
+			sum = _mm_add_epi32(sum, _mm_shuffle_epi32(sum, 0x4e));
+			sum = _mm_add_epi32(sum, _mm_shuffle_epi32(sum, 0xb1));
+			output[i] = biases[i] + _mm_cvtsi128_si32(sum);
+		}
+#else
+		for (int i = 0; i < outputSize; ++i)
+		{
+			const signed char* row = weights + i * inputSize;
+			int sum = biases[i];
+			for (int j = 0; j < inputSize; ++j)
+			{
+				sum += input[j] * row[j];
+			}
+			output[i] = sum;
+		}
+#endif
+	}
+}
+
+void NnueParameters::Resize(int accumulatorSize, int hidden1Size, int hidden2Size)
+{
+	AccumulatorSize = accumulatorSize;
+	Hidden1Size = hidden1Size;
+	Hidden2Size = hidden2Size;
+
+	FeatureBiases.assign(AccumulatorSize, 0);
+	FeatureWeights.assign(static_cast<size_t>(Inputs) * AccumulatorSize, 0);
+	Hidden1Biases.assign(Hidden1Size, 0);
+	Hidden1Weights.assign(Hidden1Size * 2 * AccumulatorSize, 0);
+	Hidden2Biases.assign(Hidden2Size, 0);
+	Hidden2Weights.assign(Hidden2Size * Hidden1Size, 0);
+	OutputBias = 0;
+	OutputWeights.assign(Hidden2Size, 0);
+}
+
+bool NnueParameters::Load(const char* path)
+{
+	std::ifstream input(path, std::ios::binary);
+	NetworkFileHeader header;
+	if (!input.read(reinterpret_cast<char*>(&header), sizeof(header))
+		|| memcmp(header.Magic, NetworkMagic, sizeof(header.Magic)) != 0
+		|| header.Version != NetworkVersion
+		|| header.Inputs != Inputs
+		|| header.AccumulatorSize == 0 || header.AccumulatorSize > MaxAccumulatorSize || header.AccumulatorSize % 16 != 0
+		|| header.Hidden1Size == 0 || header.Hidden1Size > MaxHiddenSize || header.Hidden1Size % 32 != 0
+		|| header.Hidden2Size == 0 || header.Hidden2Size > MaxHiddenSize || header.Hidden2Size % 32 != 0)
+	{
+		return false;
+	}
+
+	Resize(header.AccumulatorSize, header.Hidden1Size, header.Hidden2Size);
+	return Read(input, FeatureBiases)
+		&& Read(input, FeatureWeights)
+		&& Read(input, Hidden1Biases)
+		&& Read(input, Hidden1Weights)
+		&& Read(input, Hidden2Biases)
+		&& Read(input, Hidden2Weights)
+		&& input.read(reinterpret_cast<char*>(&OutputBias), sizeof(OutputBias))
+		&& Read(input, OutputWeights)
+		&& input.peek() == std::char_traits<char>::eof();
+}
+
+bool NnueParameters::Save(const char* path) const
+{
+	std::ofstream output(path, std::ios::binary);
+
+	NetworkFileHeader header;
+	memcpy(header.Magic, NetworkMagic, sizeof(header.Magic));
+	header.Version = NetworkVersion;
+	header.Inputs = Inputs;
+	header.AccumulatorSize = AccumulatorSize;
+	header.Hidden1Size = Hidden1Size;
+	header.Hidden2Size = Hidden2Size;
+	output.write(reinterpret_cast<const char*>(&header), sizeof(header));
+
+	Write(output, FeatureBiases);
+	Write(output, FeatureWeights);
+	Write(output, Hidden1Biases);
+	Write(output, Hidden1Weights);
+	Write(output, Hidden2Biases);
+	Write(output, Hidden2Weights);
+	output.write(reinterpret_cast<const char*>(&OutputBias), sizeof(OutputBias));
+	Write(output, OutputWeights);
+	return !output.fail();
+}
+
+bool NnueNetwork::Load(const char* path)
+{
+	NnueParameters parameters;
+	if (!parameters.Load(path))
+	{
+		return false;
+	}
+	m_parameters = std::move(parameters);
+	return true;
+}
+
+int NnueNetwork::FeatureIndex(SideType perspective, BoardLocation king, Piece piece, BoardLocation location)
+{
+	// Black sees the board upside down, with its own pieces as "ours"
+	const int flip = perspective == SideType::White ? 0 : 56;
+	const int pieceIndex = (static_cast<int>(piece.Type) - 1) * 2 + (piece.Side == perspective ? 0 : 1);
+	return ((king.Raw() ^ flip) * 10 + pieceIndex) * 64 + (location.Raw() ^ flip);
+}
+
+const char* NnueNetwork::SimdName()
+{
+#if defined(NNUE_AVX2)
+	return "AVX2";
+#elif defined(NNUE_SSE41)
+	return "SSE4.1";
+#else
+	return "scalar";
+#endif
+}
+
+int NnueNetwork::Evaluate(const BoardState& board) const
+{
+	NnueAccumulator accumulator;
+	Refresh(board, accumulator);
+	return Evaluate(accumulator, board.NextSide());
+}
+
+void NnueNetwork::Refresh(const BoardState& board, NnueAccumulator& accumulator) const
+{
+	RefreshSide(board, SideType::White, accumulator.Values[0]);
+	RefreshSide(board, SideType::Black, accumulator.Values[1]);
+}
+
+void NnueNetwork::RefreshSide(const BoardState& board, SideType perspective, std::vector<short>& values) const
+{
+	const int size = m_parameters.AccumulatorSize;
+	values = m_parameters.FeatureBiases;
+
+	const auto king = board.KingLocation(perspective);
+	for (auto loc : board)
+	{
+		const auto piece = board.Get(loc);
+		if (IsFeature(piece))
+		{
+			AddRow(values.data(), &m_parameters.FeatureWeights[static_cast<size_t>(FeatureIndex(perspective, king, piece, loc)) * size], size);
+		}
+	}
+}
+
+void NnueNetwork::Update(const BoardState& before, const NnueAccumulator& previous, const BoardState& after, NnueAccumulator& accumulator) const
+{
+	const int size = m_parameters.AccumulatorSize;
+	const auto beforeBoard = before.PackedBoard();
+	const auto afterBoard = after.PackedBoard();
+
+	for (int side = 0; side < 2; ++side)
+	{
+		const auto perspective = static_cast<SideType>(side);
+		const auto king = after.KingLocation(perspective);
+
+		// Every feature depends on the king's square, so when it moves they all change
+		if (before.KingLocation(perspective) != king)
+		{
+			RefreshSide(after, perspective, accumulator.Values[side]);
+			continue;
+		}
+
+		auto& values = accumulator.Values[side];
+		values = previous.Values[side];
+		for (int i = 0; i < 32; ++i)
+		{
+			if (beforeBoard[i] == afterBoard[i])
+			{
+				continue;
+			}
+			for (int square = i * 2; square < i * 2 + 2; ++square)
+			{
+				const BoardLocation loc(static_cast<byte>(square));
+				const auto removed = before.Get(loc);
+				const auto added = after.Get(loc);
+				if (removed == added)
+				{
+					continue;
+				}
+				if (IsFeature(removed))
+				{
+					SubtractRow(values.data(), &m_parameters.FeatureWeights[static_cast<size_t>(FeatureIndex(perspective, king, removed, loc)) * size], size);
+				}
+				if (IsFeature(added))
+				{
+					AddRow(values.data(), &m_parameters.FeatureWeights[static_cast<size_t>(FeatureIndex(perspective, king, added, loc)) * size], size);
+				}
+			}
+		}
+	}
+}
+
+int NnueNetwork::Evaluate(const NnueAccumulator& accumulator, SideType nextSide) const
+{
+	const int size = m_parameters.AccumulatorSize;
+	unsigned char transformed[2 * MaxAccumulatorSize];
+	int hidden1[MaxHiddenSize];
+	unsigned char hidden1Output[MaxHiddenSize];
+	int hidden2[MaxHiddenSize];
+	unsigned char hidden2Output[MaxHiddenSize];
+
+	// The side to move's half comes first, so the network knows whose turn it is
+	const int us = static_cast<int>(nextSide);
+	ClipAccumulator(accumulator.Values[us].data(), size, transformed);
+	ClipAccumulator(accumulator.Values[1 - us].data(), size, transformed + size);
+
+	Affine(transformed, 2 * size, m_parameters.Hidden1Weights.data(), m_parameters.Hidden1Biases.data(), m_parameters.Hidden1Size, hidden1);
+	ClipHidden(hidden1, m_parameters.Hidden1Size, hidden1Output);
+	Affine(hidden1Output, m_parameters.Hidden1Size, m_parameters.Hidden2Weights.data(), m_parameters.Hidden2Biases.data(), m_parameters.Hidden2Size, hidden2);
+	ClipHidden(hidden2, m_parameters.Hidden2Size, hidden2Output);
+
+	long long output = m_parameters.OutputBias;
+	for (int i = 0; i < m_parameters.Hidden2Size; ++i)
+	{
+		output += hidden2Output[i] * m_parameters.OutputWeights[i];
+	}
+
+	// Pawns are 1000 of the engine's units; keep clear of the scores for forced wins
+	long long score = output * 1000 / NnueParameters::OutputScale;
+	if (score >= WinThreshold) score = WinThreshold - 1;
+	if (score <= -WinThreshold) score = -(WinThreshold - 1);
+	return static_cast<int>(nextSide == SideType::White ? score : -score);
+}
+
+void NnueStack::Reset(const NnueNetwork* network, int plies)
+{
+	if (m_network == network && static_cast<int>(m_plies.size()) >= plies)
+	{
+		return;
+	}
+
+	m_network = network;
+	m_plies.resize(plies);
+	for (auto& ply : m_plies)
+	{
+		ply.Board = nullptr;
+		ply.Computed = false;
+		for (auto& values : ply.Accumulator.Values)
+		{
+			values.assign(network->Parameters().AccumulatorSize, 0);
+		}
+	}
+}
+
+int NnueStack::Evaluate(int ply)
+{
+	// Back to the nearest ply that has its accumulator, then forward again
+	int start = ply;
+	while (start > 0 && !m_plies[start].Computed)
+	{
+		--start;
+	}
+	if (!m_plies[start].Computed)
+	{
+		m_network->Refresh(*m_plies[start].Board, m_plies[start].Accumulator);
+		m_plies[start].Computed = true;
+	}
+	for (int i = start + 1; i <= ply; ++i)
+	{
+		m_network->Update(*m_plies[i - 1].Board, m_plies[i - 1].Accumulator, *m_plies[i].Board, m_plies[i].Accumulator);
+		m_plies[i].Computed = true;
+	}
+
+	return m_network->Evaluate(m_plies[ply].Accumulator, m_plies[ply].Board->NextSide());
+}
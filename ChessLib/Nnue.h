@@ -0,0 +1,138 @@
+#pragma once
+
+#include "BoardState.h"
+#include <vector>
+
+// An efficiently updatable neural network evaluation.
+//
+// The inputs are HalfKP features: for each side's point of view, every
+// piece other than the kings on its square, paired with that side's own
+// king square.  Black's point of view is flipped onto White's side of the
+// board, so one set of weights serves both.  The first layer sums the
+// weights of the features present into an accumulator per point of view,
+// which is cheap to update as pieces move since only a few features change.
+//
+//     accumulators (side to move first) -> clipped -> Hidden1 -> clipped
+//         -> Hidden2 -> clipped -> score
+//
+// Everything is integer: activations run from 0 to 127 (1.0 is 127), the
+// first layer's weights are int16 scaled by 127, the hidden layers' int8
+// scaled by 64, and the output's int16 scaled by 64.  The output layer's
+// sum is the score in pawns times 127 * 64.
+struct NnueParameters
+{
+	// King square (64) x piece (5 types x 2 sides) x square (64)
+	static const int Inputs = 64 * 10 * 64;
+
+	static const int ActivationMax = 127;
+	static const int WeightShift = 6;
+	static const int OutputScale = 127 << WeightShift;
+
+	NnueParameters()
+		: AccumulatorSize(0)
+		, Hidden1Size(0)
+		, Hidden2Size(0)
+		, OutputBias(0)
+	{}
+
+	// Sizes the vectors for these layer sizes, all weights zero.  The
+	// accumulator has to be a multiple of 16 and the hidden layers of 32.
+	void Resize(int accumulatorSize, int hidden1Size, int hidden2Size);
+
+	bool Load(const char* path);
+	bool Save(const char* path) const;
+
+	int AccumulatorSize;
+	int Hidden1Size;
+	int Hidden2Size;
+
+	std::vector<short> FeatureBiases;		// [AccumulatorSize]
+	std::vector<short> FeatureWeights;		// [Inputs][AccumulatorSize]
+	std::vector<int> Hidden1Biases;			// [Hidden1Size]
+	std::vector<signed char> Hidden1Weights;	// [Hidden1Size][2 * AccumulatorSize]
+	std::vector<int> Hidden2Biases;			// [Hidden2Size]
+	std::vector<signed char> Hidden2Weights;	// [Hidden2Size][Hidden1Size]
+	int OutputBias;
+	std::vector<short> OutputWeights;		// [Hidden2Size]
+};
+
+// The first layer's output for one position, from both points of view
+struct NnueAccumulator
+{
+	std::vector<short> Values[2];			// by SideType
+};
+
+class NnueNetwork
+{
+public:
+	bool Load(const char* path);
+
+	void SetParameters(const NnueParameters& parameters)
+	{
+		m_parameters = parameters;
+	}
+
+	const NnueParameters& Parameters() const
+	{
+		return m_parameters;
+	}
+
+	// Index of the feature for a piece on a square, seen from one side
+	static int FeatureIndex(SideType perspective, BoardLocation king, Piece piece, BoardLocation location);
+
+	// Which instructions the build uses: "AVX2", "SSE4.1" or "scalar"
+	static const char* SimdName();
+
+	// From White's side, in the engine's units, working out the
+	// accumulators from scratch
+	int Evaluate(const BoardState& board) const;
+
+	void Refresh(const BoardState& board, NnueAccumulator& accumulator) const;
+
+	// Works out a position's accumulator from the one for the position
+	// before it, changing only the features of the squares that differ
+	void Update(const BoardState& before, const NnueAccumulator& previous, const BoardState& after, NnueAccumulator& accumulator) const;
+
+	// From White's side, in the engine's units
+	int Evaluate(const NnueAccumulator& accumulator, SideType nextSide) const;
+
+private:
+	void RefreshSide(const BoardState& board, SideType perspective, std::vector<short>& values) const;
+
+	NnueParameters m_parameters;
+};
+
+// One search thread's accumulators, one per ply along the line being
+// searched.  The search copies boards rather than undoing moves, so each
+// ply keeps its board and the accumulator is worked out only when a
+// position is evaluated, from the nearest ply before it that has one.
+class NnueStack
+{
+public:
+	NnueStack()
+		: m_network(nullptr)
+	{}
+
+	void Reset(const NnueNetwork* network, int plies);
+
+	// The board has to stay put until the search leaves this ply
+	void Set(int ply, const BoardState& board)
+	{
+		m_plies[ply].Board = &board;
+		m_plies[ply].Computed = false;
+	}
+
+	// The position at ply, from White's side
+	int Evaluate(int ply);
+
+private:
+	struct Ply
+	{
+		const BoardState* Board;
+		bool Computed;
+		NnueAccumulator Accumulator;
+	};
+
+	const NnueNetwork* m_network;
+	std::vector<Ply> m_plies;
+};
@@ -0,0 +1,614 @@
+#include "stdafx.h"
+#include "NnueTrainer.h"
+#include <algorithm>
+#include <cmath>
+#include <random>
+#include <thread>
+
+namespace
+{
+	const double Ln10 = 2.302585092994046;
+
+	// Adam's defaults
+	const double Beta1 = 0.9;
+	const double Beta2 = 0.999;
+	const double Epsilon = 1e-8;
+
+	// How far each kind of weight can go before rounding it would overflow
+	const float FeatureLimit = 32767.f / NnueParameters::ActivationMax;
+	const float HiddenLimit = 127.f / (1 << NnueParameters::WeightShift);
+	const float OutputLimit = 32767.f / (1 << NnueParameters::WeightShift);
+	const float BiasLimit = 2e5f;
+
+	double Sigmoid(double centipawns, double scale)
+	{
+		return 1 / (1 + std::exp(-scale * centipawns * Ln10 / 400));
+	}
+
+	float Clip(float value)
+	{
+		return value < 0 ? 0 : value > 1 ? 1 : value;
+	}
+
+	template <typename T>
+	T Round(float value, float limit)
+	{
+		const float clamped = value < -limit ? -limit : value > limit ? limit : value;
+		return static_cast<T>(std::floor(clamped + 0.5f));
+	}
+
+	template <typename T>
+	void DequantizeInto(std::vector<float>& to, const std::vector<T>& from, float scale)
+	{
+		for (size_t i = 0; i < to.size(); ++i)
+		{
+			to[i] = from[i] / scale;
+		}
+	}
+
+	template <typename T>
+	void QuantizeInto(std::vector<T>& to, const std::vector<float>& from, float scale, float limit)
+	{
+		for (size_t i = 0; i < to.size(); ++i)
+		{
+			to[i] = Round<T>(from[i] * scale, limit * scale);
+		}
+	}
+
+	bool IsFeature(Piece piece)
+	{
+		return piece.Type != PieceType::Empty && piece.Type != PieceType::King;
+	}
+}
+
+void NnueTrainer::Weights::Resize(int accumulatorSize, int hidden1Size, int hidden2Size)
+{
+	FeatureBiases.assign(accumulatorSize, 0);
+	FeatureWeights.assign(static_cast<size_t>(NnueParameters::Inputs) * accumulatorSize, 0);
+	Hidden1Biases.assign(hidden1Size, 0);
+	Hidden1Weights.assign(hidden1Size * 2 * accumulatorSize, 0);
+	Hidden2Biases.assign(hidden2Size, 0);
+	Hidden2Weights.assign(hidden2Size * hidden1Size, 0);
+	OutputBias.assign(1, 0);
+	OutputWeights.assign(hidden2Size, 0);
+}
+
+// One thread's gradient for the batch, and its scratch space
+struct NnueTrainer::Worker
+{
+	Worker()
+		: Loss(0)
+		, Count(0)
+		, BatchCount(0)
+	{}
+
+	void Resize(const NnueTrainerOptions& options)
+	{
+		const int size = options.AccumulatorSize;
+		Gradient.Resize(size, options.Hidden1Size, options.Hidden2Size);
+
+		// The first layer's gradient is only kept for the rows that were used
+		Gradient.FeatureWeights.clear();
+		Gradient.FeatureWeights.shrink_to_fit();
+		RowOf.assign(NnueParameters::Inputs, -1);
+
+		for (int i = 0; i < 2; ++i)
+		{
+			Accumulator[i].resize(size);
+		}
+		Input.resize(2 * size);
+		InputDelta.resize(2 * size);
+		Hidden1.resize(options.Hidden1Size);
+		Hidden1Output.resize(options.Hidden1Size);
+		Hidden1Delta.resize(options.Hidden1Size);
+		Hidden2.resize(options.Hidden2Size);
+		Hidden2Output.resize(options.Hidden2Size);
+		Hidden2Delta.resize(options.Hidden2Size);
+	}
+
+	float* GradientRow(int feature, int size)
+	{
+		if (RowOf[feature] < 0)
+		{
+			RowOf[feature] = static_cast<int>(Touched.size());
+			Touched.push_back(feature);
+			Rows.resize(Rows.size() + size, 0);
+		}
+		return &Rows[static_cast<size_t>(RowOf[feature]) * size];
+	}
+
+	void ClearRows()
+	{
+		for (auto feature : Touched)
+		{
+			RowOf[feature] = -1;
+		}
+		Touched.clear();
+		Rows.clear();
+	}
+
+	Weights Gradient;
+	std::vector<int> RowOf;
+	std::vector<int> Touched;
+	std::vector<float> Rows;
+
+	std::vector<int> Features[2];			// side to move's first
+	std::vector<float> Accumulator[2];
+	std::vector<float> Input;
+	std::vector<float> InputDelta;
+	std::vector<float> Hidden1;
+	std::vector<float> Hidden1Output;
+	std::vector<float> Hidden1Delta;
+	std::vector<float> Hidden2;
+	std::vector<float> Hidden2Output;
+	std::vector<float> Hidden2Delta;
+
+	double Loss;
+	unsigned long long Count;
+	unsigned long long BatchCount;
+};
+
+NnueTrainer::NnueTrainer(const NnueTrainerOptions& options)
+	: m_options(options)
+	, m_step(0)
+{
+	m_weights.Resize(m_options.AccumulatorSize, m_options.Hidden1Size, m_options.Hidden2Size);
+	m_moment.Resize(m_options.AccumulatorSize, m_options.Hidden1Size, m_options.Hidden2Size);
+	m_velocity.Resize(m_options.AccumulatorSize, m_options.Hidden1Size, m_options.Hidden2Size);
+	m_lastUpdate.assign(NnueParameters::Inputs, 0);
+
+	// About 30 features are set from each side: start the accumulators and
+	// hidden layers in the middle of the range where they aren't clipped
+	std::mt19937 random(m_options.Seed);
+	auto fill = [&](std::vector<float>& values, double range)
+	{
+		std::uniform_real_distribution<float> distribution(static_cast<float>(-range), static_cast<float>(range));
+		for (auto& v : values)
+		{
+			v = distribution(random);
+		}
+	};
+	fill(m_weights.FeatureWeights, 0.1);
+	fill(m_weights.Hidden1Weights, 1 / std::sqrt(2. * m_options.AccumulatorSize));
+	fill(m_weights.Hidden2Weights, 1 / std::sqrt(1. * m_options.Hidden1Size));
+	fill(m_weights.OutputWeights, 1 / std::sqrt(1. * m_options.Hidden2Size));
+	std::fill(m_weights.FeatureBiases.begin(), m_weights.FeatureBiases.end(), 0.5f);
+	std::fill(m_weights.Hidden1Biases.begin(), m_weights.Hidden1Biases.end(), 0.5f);
+	std::fill(m_weights.Hidden2Biases.begin(), m_weights.Hidden2Biases.end(), 0.5f);
+}
+
+void NnueTrainer::Initialize(const NnueParameters& parameters)
+{
+	m_options.AccumulatorSize = parameters.AccumulatorSize;
+	m_options.Hidden1Size = parameters.Hidden1Size;
+	m_options.Hidden2Size = parameters.Hidden2Size;
+	m_weights.Resize(m_options.AccumulatorSize, m_options.Hidden1Size, m_options.Hidden2Size);
+	m_moment.Resize(m_options.AccumulatorSize, m_options.Hidden1Size, m_options.Hidden2Size);
+	m_velocity.Resize(m_options.AccumulatorSize, m_options.Hidden1Size, m_options.Hidden2Size);
+	m_step = 0;
+	std::fill(m_lastUpdate.begin(), m_lastUpdate.end(), 0);
+
+	const float activation = static_cast<float>(NnueParameters::ActivationMax);
+	const float weight = static_cast<float>(1 << NnueParameters::WeightShift);
+	DequantizeInto(m_weights.FeatureBiases, parameters.FeatureBiases, activation);
+	DequantizeInto(m_weights.FeatureWeights, parameters.FeatureWeights, activation);
+	DequantizeInto(m_weights.Hidden1Biases, parameters.Hidden1Biases, activation * weight);
+	DequantizeInto(m_weights.Hidden1Weights, parameters.Hidden1Weights, weight);
+	DequantizeInto(m_weights.Hidden2Biases, parameters.Hidden2Biases, activation * weight);
+	DequantizeInto(m_weights.Hidden2Weights, parameters.Hidden2Weights, weight);
+	m_weights.OutputBias[0] = parameters.OutputBias / (activation * weight);
+	DequantizeInto(m_weights.OutputWeights, parameters.OutputWeights, weight);
+}
+
+NnueParameters NnueTrainer::Quantize() const
+{
+	NnueParameters parameters;
+	parameters.Resize(m_options.AccumulatorSize, m_options.Hidden1Size, m_options.Hidden2Size);
+
+	const float activation = static_cast<float>(NnueParameters::ActivationMax);
+	const float weight = static_cast<float>(1 << NnueParameters::WeightShift);
+	QuantizeInto(parameters.FeatureBiases, m_weights.FeatureBiases, activation, FeatureLimit);
+	QuantizeInto(parameters.FeatureWeights, m_weights.FeatureWeights, activation, FeatureLimit);
+	QuantizeInto(parameters.Hidden1Biases, m_weights.Hidden1Biases, activation * weight, BiasLimit);
+	QuantizeInto(parameters.Hidden1Weights, m_weights.Hidden1Weights, weight, HiddenLimit);
+	QuantizeInto(parameters.Hidden2Biases, m_weights.Hidden2Biases, activation * weight, BiasLimit);
+	QuantizeInto(parameters.Hidden2Weights, m_weights.Hidden2Weights, weight, HiddenLimit);
+	parameters.OutputBias = Round<int>(m_weights.OutputBias[0] * activation * weight, BiasLimit * activation * weight);
+	QuantizeInto(parameters.OutputWeights, m_weights.OutputWeights, weight, OutputLimit);
+	return parameters;
+}
+
+bool NnueTrainer::Train(const char* path)
+{
+	std::vector<Worker> workers(ThreadCount());
+	for (auto& worker : workers)
+	{
+		worker.Resize(m_options);
+	}
+
+	for (int epoch = 1; epoch <= m_options.Epochs; ++epoch)
+	{
+		for (auto& worker : workers)
+		{
+			worker.Loss = 0;
+			worker.Count = 0;
+		}
+
+		auto work = [&](int thread, const TrainingPosition* positions, size_t count)
+		{
+			auto& worker = workers[thread];
+			for (size_t i = 0; i < count; ++i)
+			{
+				worker.Loss += Step(worker, positions[i], true);
+			}
+			worker.Count += count;
+			worker.BatchCount += count;
+		};
+
+		auto update = [&]()
+		{
+			unsigned long long count = 0;
+			for (auto& worker : workers)
+			{
+				count += worker.BatchCount;
+				worker.BatchCount = 0;
+			}
+			Update(workers, count);
+		};
+
+		if (!ForEachTrainingBatch(path, static_cast<int>(workers.size()), m_options.BatchSize, m_options.MaxPositions, work, update))
+		{
+			return false;
+		}
+
+		NnueTrainerProgress progress;
+		progress.Epoch = epoch;
+		progress.Positions = 0;
+		progress.Loss = 0;
+		for (auto& worker : workers)
+		{
+			progress.Positions += worker.Count;
+			progress.Loss += worker.Loss;
+		}
+		if (progress.Positions == 0)
+		{
+			return false;
+		}
+		progress.Loss /= progress.Positions;
+
+		if (m_progressCallback)
+		{
+			m_progressCallback(progress);
+		}
+	}
+	return true;
+}
+
+double NnueTrainer::Loss(const char* path)
+{
+	std::vector<Worker> workers(ThreadCount());
+	for (auto& worker : workers)
+	{
+		worker.Resize(m_options);
+	}
+
+	auto work = [&](int thread, const TrainingPosition* positions, size_t count)
+	{
+		auto& worker = workers[thread];
+		for (size_t i = 0; i < count; ++i)
+		{
+			worker.Loss += Step(worker, positions[i], false);
+		}
+		worker.Count += count;
+	};
+
+	if (!ForEachTrainingBatch(path, static_cast<int>(workers.size()), m_options.BatchSize, m_options.MaxPositions, work, [](){}))
+	{
+		return 0;
+	}
+
+	double loss = 0;
+	unsigned long long count = 0;
+	for (auto& worker : workers)
+	{
+		loss += worker.Loss;
+		count += worker.Count;
+	}
+	return count > 0 ? loss / count : 0;
+}
+
+double NnueTrainer::Evaluate(const BoardState& board) const
+{
+	Worker worker;
+	worker.Resize(m_options);
+	return Forward(worker, board);
+}
+
+double NnueTrainer::Forward(Worker& worker, const BoardState& board) const
+{
+	const int size = m_options.AccumulatorSize;
+	const int hidden1Size = m_options.Hidden1Size;
+	const int hidden2Size = m_options.Hidden2Size;
+	const SideType sides[] = { board.NextSide(), OtherSide(board.NextSide()) };
+
+	// The first layer only adds up the rows of the features that are set
+	for (int k = 0; k < 2; ++k)
+	{
+		auto& features = worker.Features[k];
+		features.clear();
+		const auto king = board.KingLocation(sides[k]);
+		for (auto loc : board)
+		{
+			const auto piece = board.Get(loc);
+			if (IsFeature(piece))
+			{
+				features.push_back(NnueNetwork::FeatureIndex(sides[k], king, piece, loc));
+			}
+		}
+
+		float* accumulator = worker.Accumulator[k].data();
+		std::copy(m_weights.FeatureBiases.begin(), m_weights.FeatureBiases.end(), accumulator);
+		for (auto feature : features)
+		{
+			const float* row = &m_weights.FeatureWeights[static_cast<size_t>(feature) * size];
+			for (int i = 0; i < size; ++i)
+			{
+				accumulator[i] += row[i];
+			}
+		}
+		for (int i = 0; i < size; ++i)
+		{
+			worker.Input[k * size + i] = Clip(accumulator[i]);
+		}
+	}
+
+	for (int j = 0; j < hidden1Size; ++j)
+	{
+		const float* row = &m_weights.Hidden1Weights[j * 2 * size];
+		float sum = m_weights.Hidden1Biases[j];
+		for (int i = 0; i < 2 * size; ++i)
+		{
+			sum += row[i] * worker.Input[i];
+		}
+		worker.Hidden1[j] = sum;
+		worker.Hidden1Output[j] = Clip(sum);
+	}
+
+	for (int j = 0; j < hidden2Size; ++j)
+	{
+		const float* row = &m_weights.Hidden2Weights[j * hidden1Size];
+		float sum = m_weights.Hidden2Biases[j];
+		for (int i = 0; i < hidden1Size; ++i)
+		{
+			sum += row[i] * worker.Hidden1Output[i];
+		}
+		worker.Hidden2[j] = sum;
+		worker.Hidden2Output[j] = Clip(sum);
+	}
+
+	double output = m_weights.OutputBias[0];
+	for (int i = 0; i < hidden2Size; ++i)
+	{
+		output += m_weights.OutputWeights[i] * worker.Hidden2Output[i];
+	}
+	return output;
+}
+
+double NnueTrainer::Step(Worker& worker, const TrainingPosition& position, bool backward) const
+{
+	const int size = m_options.AccumulatorSize;
+	const int hidden1Size = m_options.Hidden1Size;
+	const int hidden2Size = m_options.Hidden2Size;
+
+	const auto board = position.ToBoard();
+	const double output = Forward(worker, board);
+
+	// Positions are labelled from White's side, the network is from the side to move's
+	const int sign = board.NextSide() == SideType::White ? 1 : -1;
+	const double predicted = Sigmoid(output * 100, m_options.Scale);
+	const double result = (sign * position.Result + 1) / 2.;
+	const double target = m_options.ResultWeight * result + (1 - m_options.ResultWeight) * Sigmoid(sign * position.Score, m_options.Scale);
+	const double difference = predicted - target;
+	if (!backward)
+	{
+		return difference * difference;
+	}
+
+	auto& gradient = worker.Gradient;
+	const float outputDelta = static_cast<float>(2 * difference * predicted * (1 - predicted) * m_options.Scale * Ln10 / 4);
+	gradient.OutputBias[0] += outputDelta;
+	for (int i = 0; i < hidden2Size; ++i)
+	{
+		gradient.OutputWeights[i] += outputDelta * worker.Hidden2Output[i];
+		worker.Hidden2Delta[i] = worker.Hidden2[i] > 0 && worker.Hidden2[i] < 1 ? outputDelta * m_weights.OutputWeights[i] : 0;
+	}
+
+	std::fill(worker.Hidden1Delta.begin(), worker.Hidden1Delta.end(), 0.f);
+	for (int j = 0; j < hidden2Size; ++j)
+	{
+		const float delta = worker.Hidden2Delta[j];
+		if (delta == 0)
+		{
+			continue;
+		}
+		gradient.Hidden2Biases[j] += delta;
+		const float* row = &m_weights.Hidden2Weights[j * hidden1Size];
+		float* rowGradient = &gradient.Hidden2Weights[j * hidden1Size];
+		for (int i = 0; i < hidden1Size; ++i)
+		{
+			rowGradient[i] += delta * worker.Hidden1Output[i];
+			worker.Hidden1Delta[i] += delta * row[i];
+		}
+	}
+
+	std::fill(worker.InputDelta.begin(), worker.InputDelta.end(), 0.f);
+	for (int j = 0; j < hidden1Size; ++j)
+	{
+		const float delta = worker.Hidden1[j] > 0 && worker.Hidden1[j] < 1 ? worker.Hidden1Delta[j] : 0;
+		if (delta == 0)
+		{
+			continue;
+		}
+		gradient.Hidden1Biases[j] += delta;
+		const float* row = &m_weights.Hidden1Weights[j * 2 * size];
+		float* rowGradient = &gradient.Hidden1Weights[j * 2 * size];
+		for (int i = 0; i < 2 * size; ++i)
+		{
+			rowGradient[i] += delta * worker.Input[i];
+			worker.InputDelta[i] += delta * row[i];
+		}
+	}
+
+	for (int k = 0; k < 2; ++k)
+	{
+		float* delta = &worker.InputDelta[k * size];
+		const float* accumulator = worker.Accumulator[k].data();
+		for (int i = 0; i < size; ++i)
+		{
+			if (!(accumulator[i] > 0 && accumulator[i] < 1))
+			{
+				delta[i] = 0;
+			}
+			gradient.FeatureBiases[i] += delta[i];
+		}
+		for (auto feature : worker.Features[k])
+		{
+			float* row = worker.GradientRow(feature, size);
+			for (int i = 0; i < size; ++i)
+			{
+				row[i] += delta[i];
+			}
+		}
+	}
+	return difference * difference;
+}
+
+void NnueTrainer::Update(std::vector<Worker>& workers, unsigned long long count)
+{
+	if (count == 0)
+	{
+		return;
+	}
+
+	++m_step;
+	const double correction1 = 1 - std::pow(Beta1, m_step);
+	const double correction2 = 1 - std::pow(Beta2, m_step);
+	const double rate = m_options.LearningRate;
+	auto adam = [&](float& weight, float& moment, float& velocity, double gradient, float limit)
+	{
+		gradient /= count;
+		moment = static_cast<float>(Beta1 * moment + (1 - Beta1) * gradient);
+		velocity = static_cast<float>(Beta2 * velocity + (1 - Beta2) * gradient * gradient);
+		weight -= static_cast<float>(rate * (moment / correction1) / (std::sqrt(velocity / correction2) + Epsilon));
+		weight = weight < -limit ? -limit : weight > limit ? limit : weight;
+	};
+
+	// Everything but the first layer's weights is small enough to do whole
+	struct Dense
+	{
+		std::vector<float> Weights::* Member;
+		float Limit;
+	};
+	const Dense dense[] = {
+		{ &Weights::FeatureBiases, FeatureLimit },
+		{ &Weights::Hidden1Biases, BiasLimit },
+		{ &Weights::Hidden1Weights, HiddenLimit },
+		{ &Weights::Hidden2Biases, BiasLimit },
+		{ &Weights::Hidden2Weights, HiddenLimit },
+		{ &Weights::OutputBias, BiasLimit },
+		{ &Weights::OutputWeights, OutputLimit },
+	};
+	for (auto& part : dense)
+	{
+		auto& weights = m_weights.*part.Member;
+		auto& moment = m_moment.*part.Member;
+		auto& velocity = m_velocity.*part.Member;
+		for (size_t i = 0; i < weights.size(); ++i)
+		{
+			double gradient = 0;
+			for (auto& worker : workers)
+			{
+				gradient += (worker.Gradient.*part.Member)[i];
+				(worker.Gradient.*part.Member)[i] = 0;
+			}
+			adam(weights[i], moment[i], velocity[i], gradient, part.Limit);
+		}
+	}
+
+	// The rows any thread used, each once, shared out between the threads to
+	// update.  A row's gradient was zero for the steps since it was last
+	// used, so its moments are decayed for those steps before this one's
+	// update.  Its weights aren't moved for them, as in sparse Adam.
+	std::vector<int> rows;
+	std::vector<int> skipped;
+	for (auto& worker : workers)
+	{
+		for (auto feature : worker.Touched)
+		{
+			if (m_lastUpdate[feature] != m_step)
+			{
+				skipped.push_back(m_lastUpdate[feature] ? m_step - 1 - m_lastUpdate[feature] : 0);
+				m_lastUpdate[feature] = m_step;
+				rows.push_back(feature);
+			}
+		}
+	}
+
+	const int size = m_options.AccumulatorSize;
+	auto updateRows = [&](size_t first, size_t last)
+	{
+		for (size_t r = first; r < last; ++r)
+		{
+			const int feature = rows[r];
+			const size_t offset = static_cast<size_t>(feature) * size;
+			if (skipped[r] > 0)
+			{
+				const float decay1 = static_cast<float>(std::pow(Beta1, skipped[r]));
+				const float decay2 = static_cast<float>(std::pow(Beta2, skipped[r]));
+				for (int i = 0; i < size; ++i)
+				{
+					m_moment.FeatureWeights[offset + i] *= decay1;
+					m_velocity.FeatureWeights[offset + i] *= decay2;
+				}
+			}
+			for (int i = 0; i < size; ++i)
+			{
+				double gradient = 0;
+				for (auto& worker : workers)
+				{
+					if (worker.RowOf[feature] >= 0)
+					{
+						gradient += worker.Rows[static_cast<size_t>(worker.RowOf[feature]) * size + i];
+					}
+				}
+				adam(m_weights.FeatureWeights[offset + i], m_moment.FeatureWeights[offset + i], m_velocity.FeatureWeights[offset + i], gradient, FeatureLimit);
+			}
+		}
+	};
+
+	const size_t share = (rows.size() + workers.size() - 1) / workers.size();
+	std::vector<std::thread> threads;
+	for (size_t first = 0; first < rows.size(); first += share)
+	{
+		threads.emplace_back(updateRows, first, std::min(first + share, rows.size()));
+	}
+	for (auto& thread : threads)
+	{
+		thread.join();
+	}
+
+	for (auto& worker : workers)
+	{
+		worker.ClearRows();
+	}
+}
+
+int NnueTrainer::ThreadCount() const
+{
+	int threads = m_options.Threads;
+	if (threads <= 0)
+	{
+		threads = static_cast<int>(std::thread::hardware_concurrency());
+	}
+	return threads > 0 ? threads : 1;
+}
@@ -0,0 +1,124 @@
+#pragma once
+
+#include "Nnue.h"
+#include "TrainingData.h"
+#include <functional>
+#include <vector>
+
+struct NnueTrainerOptions
+{
+	NnueTrainerOptions()
+		: Threads(0)
+		, Epochs(10)
+		, BatchSize(16384)
+		, LearningRate(0.001)
+		, Scale(1.0)
+		, ResultWeight(0.5)
+		, MaxPositions(0)
+		, AccumulatorSize(256)
+		, Hidden1Size(32)
+		, Hidden2Size(32)
+		, Seed(1)
+	{}
+
+	int Threads;				// 0 for one per core
+	int Epochs;					// passes over the file
+	int BatchSize;				// positions per step
+	double LearningRate;		// Adam's step size
+	double Scale;				// K, as for TexelTuner
+	double ResultWeight;		// how much the target is the game's result rather than its recorded score
+	unsigned long long MaxPositions;	// read from the start of the file, 0 for all of it
+
+	// Layer sizes, as NnueParameters::Resize takes them
+	int AccumulatorSize;
+	int Hidden1Size;
+	int Hidden2Size;
+
+	unsigned Seed;				// for the starting weights
+};
+
+// After each epoch, with the loss measured while it ran
+struct NnueTrainerProgress
+{
+	int Epoch;
+	unsigned long long Positions;
+	double Loss;
+};
+
+// Trains an NnueNetwork on labelled positions, in floating point, then
+// rounds the weights into the engine's format.
+//
+// The network predicts the side to move's score in pawns, and is scored
+// like TexelTuner's weights: the squared difference between its predicted
+// result, 1 / (1 + 10 ^ (-K * centipawns / 400)), and the target.
+//
+// Batches are split across threads as with TexelTuner.  Only a few dozen
+// of the first layer's inputs are set in a position, so its forward pass
+// adds up just those rows, and each thread keeps gradients only for the
+// rows its positions used.  Adam then updates just the rows the batch used,
+// first decaying their moments for the steps they were left out of.
+class NnueTrainer
+{
+public:
+	explicit NnueTrainer(const NnueTrainerOptions& options);
+
+	// Carries on from a network rather than starting from random weights.
+	// Its layer sizes replace the ones in the options.
+	void Initialize(const NnueParameters& parameters);
+
+	typedef std::function<void(const NnueTrainerProgress&)> ProgressCallback;
+
+	void SetProgressCallback(ProgressCallback callback)
+	{
+		m_progressCallback = callback;
+	}
+
+	// False if the file can't be read
+	bool Train(const char* path);
+
+	// Mean loss over a file, e.g. one held back for validation
+	double Loss(const char* path);
+
+	// The side to move's score, in pawns, straight from the float weights
+	double Evaluate(const BoardState& board) const;
+
+	// The weights rounded to the engine's integers
+	NnueParameters Quantize() const;
+
+private:
+	struct Worker;
+
+	// Float versions of NnueParameters, laid out the same way
+	struct Weights
+	{
+		std::vector<float> FeatureBiases;
+		std::vector<float> FeatureWeights;
+		std::vector<float> Hidden1Biases;
+		std::vector<float> Hidden1Weights;
+		std::vector<float> Hidden2Biases;
+		std::vector<float> Hidden2Weights;
+		std::vector<float> OutputBias;
+		std::vector<float> OutputWeights;
+
+		void Resize(int accumulatorSize, int hidden1Size, int hidden2Size);
+	};
+
+	int ThreadCount() const;
+
+	// The network's output for a position, leaving each layer's values in the worker
+	double Forward(Worker& worker, const BoardState& board) const;
+
+	// Runs a position through the network and returns its loss, adding the
+	// gradient to the worker's if asked
+	double Step(Worker& worker, const TrainingPosition& position, bool backward) const;
+
+	void Update(std::vector<Worker>& workers, unsigned long long count);
+
+	NnueTrainerOptions m_options;
+	Weights m_weights;
+	Weights m_moment;
+	Weights m_velocity;
+	std::vector<int> m_lastUpdate;		// per feature row, the step it was last updated at, 0 for none
+	int m_step;
+	ProgressCallback m_progressCallback;
+};
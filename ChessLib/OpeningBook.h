@@ -0,0 +1,83 @@
+#pragma once
+
+#include "BoardState.h"
+#include "MappedFile.h"
+#include "Pgn.h"
+#include <map>
+#include <random>
+
+// A book move along with how often it should be picked
+struct BookMove
+{
+	ChessMove Move;
+	int Weight;
+};
+
+// Opening book in the Polyglot .bin format: a sorted array of 16 byte
+// big-endian entries (key, move, weight, learn).  The file is memory mapped
+// and probed with a binary search, so it can be shared by every GameAi.
+class OpeningBook
+{
+public:
+	enum class Selection
+	{
+		Weighted,	// random, in proportion to the weights
+		Best		// always the highest weight
+	};
+
+	bool Open(const char* path);
+
+	bool IsOpen() const
+	{
+		return m_file.IsOpen();
+	}
+
+	// Legal book moves for the position, highest weight first
+	std::vector<BookMove> Probe(const BoardState& board) const;
+
+	// InvalidChessMove if the position isn't in the book
+	ChessMove ChooseMove(const BoardState& board, Selection selection, std::default_random_engine& generator) const;
+
+	// Polyglot position key and move encoding
+	static PositionKey Key(const BoardState& board);
+	static unsigned short EncodeMove(const BoardState& board, ChessMove move);
+	static ChessMove DecodeMove(const BoardState& board, unsigned short move);
+
+	static const int EntrySize = 16;
+
+private:
+	MappedFile m_file;
+};
+
+// Builds a Polyglot book from PGN games.  Each move seen in the first
+// MaxPlies of a game gets 2 points if its side went on to win, 1 for a draw.
+class OpeningBookBuilder
+{
+public:
+	explicit OpeningBookBuilder(int maxPlies = 24)
+		: m_maxPlies(maxPlies)
+		, m_games(0)
+	{}
+
+	void AddGame(const PgnGame& game);
+
+	// Adds every game in the stream, returns how many were read
+	int AddPgn(std::istream& in);
+
+	bool Write(const char* path) const;
+
+	int GameCount() const
+	{
+		return m_games;
+	}
+
+	size_t PositionCount() const
+	{
+		return m_weights.size();
+	}
+
+private:
+	int m_maxPlies;
+	int m_games;
+	std::map<PositionKey, std::map<unsigned short, unsigned>> m_weights;
+};
@@ -0,0 +1,65 @@
+#include "stdafx.h"
+#include "Perft.h"
+#include "TaskPool.h"
+#include <atomic>
+
+namespace
+{
+	// Smaller subtrees cost less to count than to hand to another worker
+	const int SplitDepth = 3;
+
+	void CountSplit(TaskPool& pool, int worker, const BoardState& board, int depth, std::atomic<unsigned long long>& total)
+	{
+		if (depth < SplitDepth || (worker >= 0 && !pool.NeedsWork()))
+		{
+			total += Perft(board, depth);
+			return;
+		}
+
+		// Each child is a task of its own.  The boards have to outlive the
+		// tasks, so they're all made before any is spawned.
+		const auto moves = board.ValidMoves();
+		std::vector<BoardState> children(moves.size(), board);
+		TaskGroup group(pool);
+		for (size_t i = 0; i < moves.size(); ++i)
+		{
+			children[i].Move(moves[i].From, moves[i].To, true);
+			const BoardState* child = &children[i];
+			group.Spawn(worker, [&pool, child, depth, &total](int w)
+			{
+				CountSplit(pool, w, *child, depth - 1, total);
+			});
+		}
+		group.Wait(worker);
+	}
+}
+
+unsigned long long Perft(const BoardState& board, int depth)
+{
+	if (depth == 0)
+	{
+		return 1;
+	}
+
+	const auto moves = board.ValidMoves();
+	if (depth == 1)
+	{
+		return moves.size();
+	}
+
+	unsigned long long count = 0;
+	for (auto& m : moves)
+	{
+		auto next = board;
+		next.Move(m.From, m.To, true);
+		count += Perft(next, depth - 1);
+	}
+	return count;
+}
+
+unsigned long long ParallelPerft(TaskPool& pool, const BoardState& board, int depth)
+{
+	std::atomic<unsigned long long> total(0);
+	CountSplit(pool, -1, board, depth, total);
+	return total;
+}
@@ -0,0 +1,13 @@
+#pragma once
+
+#include "BoardState.h"
+
+class TaskPool;
+
+// Counts the positions reached after depth moves, as ValidMoves() gives
+// them, to check move generation against known counts and to time it
+unsigned long long Perft(const BoardState& board, int depth);
+
+// The same on a pool: the root's moves are counted in parallel, and their
+// subtrees are split again while the pool has workers waiting for work
+unsigned long long ParallelPerft(TaskPool& pool, const BoardState& board, int depth);
@@ -1,7 +1,15 @@
 #include "stdafx.h"
 #include "BoardState.h"
+#include "Pgn.h"
+#include <algorithm>
 
 bool BoardState::MovePgn(const char* pgn)
+{
+	auto move = ParsePgnMove(pgn);
+	return Move(move.From, move.To);
+}
+
+ChessMove BoardState::ParsePgnMove(const char* pgn) const
 {
 	int size = strlen(pgn);
 	const char* end = &pgn[size];
@@ -72,7 +80,7 @@ bool BoardState::MovePgn(const char* pgn)
 		}
 		else if (*end >= '1' && *end <= '8')
 		{
-			disambigRow = *end - '1';
+			disambigRow = 7 - (*end - '1');
 		}
 		else
 		{
@@ -80,7 +88,7 @@ bool BoardState::MovePgn(const char* pgn)
 			if (disambigPiece == PieceType::Invalid)
 			{
 				throw "char unexpected";
-				return false;
+				return InvalidChessMove;
 			}
 		}
 	}
@@ -99,7 +107,7 @@ bool BoardState::MovePgn(const char* pgn)
 			{
 				// Ambiguous!!!
 				throw "Needs more disambiguation";
-				return false;
+				return InvalidChessMove;
 			}
 			from = loc;
 		}
@@ -108,12 +116,112 @@ bool BoardState::MovePgn(const char* pgn)
 	if (from == InvalidBoardLocation || to == InvalidBoardLocation)
 	{
 		throw "Missed something";
-		return false;
+		return InvalidChessMove;
 	}
 
-	if (isTaking && Get(to).Type == PieceType::Empty)
+	const bool isEnPassant = disambigPiece == PieceType::Pawn && to.X() == m_enPassantCol;
+	if (isTaking && Get(to).Type == PieceType::Empty && !isEnPassant)
 	{
 		throw "No piece there";
 	}
-	return Move(from, to);
+	return ChessMove{ from, to, PieceType::Empty };
+}
+
+namespace
+{
+	bool IsResultToken(const std::string& token)
+	{
+		return token == "1-0" || token == "0-1" || token == "1/2-1/2" || token == "*";
+	}
+
+	// Skip a brace comment, or a (possibly nested) variation
+	void SkipUntil(std::istream& in, char open, char close)
+	{
+		int nesting = 1;
+		char c;
+		while (nesting > 0 && in.get(c))
+		{
+			if (c == open) ++nesting;
+			if (c == close) --nesting;
+		}
+	}
+}
+
+bool ReadPgnGame(std::istream& in, PgnGame& game)
+{
+	game = PgnGame();
+
+	char c;
+	while (in.get(c))
+	{
+		if (isspace(static_cast<unsigned char>(c)))
+		{
+			continue;
+		}
+
+		if (c == '[')
+		{
+			// Tag pair, e.g. [Result "1-0"]
+			std::string line;
+			std::getline(in, line, ']');
+			auto space = line.find(' ');
+			auto firstQuote = line.find('"');
+			auto lastQuote = line.rfind('"');
+			if (space != std::string::npos && firstQuote != lastQuote)
+			{
+				game.Tags[line.substr(0, space)] = line.substr(firstQuote + 1, lastQuote - firstQuote - 1);
+			}
+		}
+		else if (c == '{')
+		{
+			SkipUntil(in, '{', '}');
+		}
+		else if (c == '(')
+		{
+			SkipUntil(in, '(', ')');
+		}
+		else if (c == ';')
+		{
+			std::string ignored;
+			std::getline(in, ignored);
+		}
+		else
+		{
+			std::string token(1, c);
+			while (in.peek() != EOF && !isspace(in.peek()) && in.peek() != '{' && in.peek() != '(')
+			{
+				token += static_cast<char>(in.get());
+			}
+
+			if (IsResultToken(token))
+			{
+				game.Result = token;
+				return true;
+			}
+
+			// Some files write castling with zeros
+			if (token.compare(0, 3, "0-0") == 0)
+			{
+				std::replace(token.begin(), token.end(), '0', 'O');
+			}
+
+			// Drop move numbers ("12." or "12...") and NAGs ("$1")
+			auto dot = token.find_last_of('.');
+			if (dot != std::string::npos) token = token.substr(dot + 1);
+			if (token.empty() || token[0] == '$' || isdigit(static_cast<unsigned char>(token[0]))) continue;
+
+			// Annotations aren't part of the move; MovePgn copes with '+' but not the rest
+			while (!token.empty() && strchr("+#!?", token.back()))
+			{
+				token.pop_back();
+			}
+			if (!token.empty())
+			{
+				game.Moves.push_back(token);
+			}
+		}
+	}
+
+	// A game cut off without a result still counts if it had moves
+	return !game.Moves.empty();
 }
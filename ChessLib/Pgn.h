@@ -0,0 +1,18 @@
+#pragma once
+
+#include <istream>
+#include <map>
+#include <string>
+#include <vector>
+
+// One game from a PGN file: the tag pairs, the main line in SAN and the result
+struct PgnGame
+{
+	std::map<std::string, std::string> Tags;
+	std::vector<std::string> Moves;
+	std::string Result;
+};
+
+// Reads the next game from a PGN stream, skipping comments, variations and
+// NAGs.  Returns false once there are no more games.
+bool ReadPgnGame(std::istream& in, PgnGame& game);
@@ -0,0 +1,109 @@
+#include "stdafx.h"
+#include "SearchArena.h"
+
+namespace
+{
+	const size_t Alignment = 16;
+
+	size_t AlignUp(size_t bytes)
+	{
+		return (bytes + Alignment - 1) & ~(Alignment - 1);
+	}
+}
+
+SearchArena::SearchArena(size_t blockBytes)
+	: m_blockBytes(AlignUp(blockBytes))
+	, m_block(0)
+	, m_offset(0)
+	, m_bytesAllocated(0)
+	, m_peakBytes(0)
+	, m_heapAllocations(0)
+{
+}
+
+void* SearchArena::Allocate(size_t bytes)
+{
+	bytes = AlignUp(bytes);
+
+	// On to the next block when this one is full, taking a new one from the
+	// heap only when there's none left big enough.  What's left at the end
+	// of a block goes unused.
+	while (m_block >= m_blocks.size() || m_offset + bytes > m_blocks[m_block].Size)
+	{
+		if (m_block < m_blocks.size())
+		{
+			++m_block;
+			m_offset = 0;
+			continue;
+		}
+
+		Block block;
+		block.Size = bytes > m_blockBytes ? bytes : m_blockBytes;
+		block.Memory.reset(new char[block.Size + Alignment]);
+		m_blocks.push_back(std::move(block));
+		++m_heapAllocations;
+		m_offset = 0;
+	}
+
+	auto& block = m_blocks[m_block];
+	const auto base = reinterpret_cast<size_t>(block.Memory.get());
+	char* memory = block.Memory.get() + (AlignUp(base) - base) + m_offset;
+	m_offset += bytes;
+
+	m_bytesAllocated += bytes;
+	const size_t inUse = InUse();
+	if (inUse > m_peakBytes)
+	{
+		m_peakBytes = inUse;
+	}
+	return memory;
+}
+
+void SearchArena::Shrink(void* last, size_t bytes, size_t usedBytes)
+{
+	bytes = AlignUp(bytes);
+	usedBytes = AlignUp(usedBytes);
+	if (m_block >= m_blocks.size() || m_offset < bytes)
+	{
+		return;
+	}
+
+	// Only the last allocation can be shrunk, as it's at the top
+	auto& block = m_blocks[m_block];
+	const auto base = reinterpret_cast<size_t>(block.Memory.get());
+	char* top = block.Memory.get() + (AlignUp(base) - base) + m_offset;
+	if (static_cast<char*>(last) + bytes == top)
+	{
+		m_offset -= bytes - usedBytes;
+		m_bytesAllocated -= bytes - usedBytes;
+	}
+}
+
+void SearchArena::Reset()
+{
+	m_block = 0;
+	m_offset = 0;
+	m_bytesAllocated = 0;
+	m_peakBytes = 0;
+}
+
+size_t SearchArena::Capacity() const
+{
+	size_t capacity = 0;
+	for (auto& block : m_blocks)
+	{
+		capacity += block.Size;
+	}
+	return capacity;
+}
+
+// Counting the ends of blocks that were skipped, as they can't be used
+size_t SearchArena::InUse() const
+{
+	size_t inUse = m_offset;
+	for (size_t i = 0; i < m_block; ++i)
+	{
+		inUse += m_blocks[i].Size;
+	}
+	return inUse;
+}
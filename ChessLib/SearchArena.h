@@ -0,0 +1,195 @@
+#pragma once
+
+#include "BoardState.h"
+#include <memory>
+#include <new>
+#include <type_traits>
+#include <vector>
+
+// Scratch memory for one search thread, handed out by bumping a pointer
+// through blocks taken from the heap.  Memory is given back in the reverse
+// of the order it was taken, by going back to a Mark(), as a node of the
+// search does when it returns.  The blocks are kept from one search to the
+// next, so once the arena has grown to the deepest line searched the tree
+// costs no heap allocations at all.
+//
+// Only for types that need no destructor: nothing in the arena is ever
+// destroyed.
+class SearchArena
+{
+public:
+	struct Mark
+	{
+		size_t Block;
+		size_t Offset;
+	};
+
+	explicit SearchArena(size_t blockBytes = 64 * 1024);
+
+	SearchArena(const SearchArena&) = delete;
+	SearchArena& operator=(const SearchArena&) = delete;
+
+	// Aligned for anything the search keeps in it
+	void* Allocate(size_t bytes);
+
+	template <class T>
+	T* AllocateArray(size_t count)
+	{
+		static_assert(std::is_trivially_destructible<T>::value, "Arena memory is never destroyed");
+		T* items = static_cast<T*>(Allocate(count * sizeof(T)));
+		for (size_t i = 0; i < count; ++i)
+		{
+			new (items + i) T();
+		}
+		return items;
+	}
+
+	// For buffers written before they're read, such as the moves a
+	// generator fills in: nothing is constructed, so a node doesn't pay to
+	// clear a full MaxMoves of moves it then overwrites or gives back
+	template <class T>
+	T* AllocateUninitialized(size_t count)
+	{
+		static_assert(std::is_trivially_destructible<T>::value, "Arena memory is never destroyed");
+		return static_cast<T*>(Allocate(count * sizeof(T)));
+	}
+
+	// Gives back the end of the last allocation, when fewer bytes were
+	// used than were asked for
+	void Shrink(void* last, size_t bytes, size_t usedBytes);
+
+	Mark GetMark() const
+	{
+		Mark mark = { m_block, m_offset };
+		return mark;
+	}
+
+	// Frees everything allocated since the mark was taken
+	void Release(const Mark& mark)
+	{
+		m_block = mark.Block;
+		m_offset = mark.Offset;
+	}
+
+	// For a new search: frees everything, keeping the blocks, and starts
+	// the counts again
+	void Reset();
+
+	// Bytes handed out since Reset(), counting memory used over again as
+	// often as it was, and the most in use at once
+	unsigned long long BytesAllocated() const
+	{
+		return m_bytesAllocated;
+	}
+
+	size_t PeakBytes() const
+	{
+		return m_peakBytes;
+	}
+
+	// Blocks taken from the heap over the arena's life, which stops going
+	// up once it's big enough for the searches it's used for
+	unsigned long long HeapAllocations() const
+	{
+		return m_heapAllocations;
+	}
+
+	size_t Capacity() const;
+
+private:
+	struct Block
+	{
+		std::unique_ptr<char[]> Memory;
+		size_t Size;
+	};
+
+	size_t InUse() const;
+
+	std::vector<Block> m_blocks;
+	size_t m_blockBytes;
+	size_t m_block;		// the block being allocated from
+	size_t m_offset;	// into it
+	unsigned long long m_bytesAllocated;
+	size_t m_peakBytes;
+	unsigned long long m_heapAllocations;
+};
+
+// Releases what was allocated from the arena while it's in scope, so a
+// node's scratch memory goes when the node returns
+class ArenaScope
+{
+public:
+	explicit ArenaScope(SearchArena& arena)
+		: m_arena(arena)
+		, m_mark(arena.GetMark())
+	{}
+
+	~ArenaScope()
+	{
+		m_arena.Release(m_mark);
+	}
+
+	ArenaScope(const ArenaScope&) = delete;
+	ArenaScope& operator=(const ArenaScope&) = delete;
+
+private:
+	SearchArena& m_arena;
+	SearchArena::Mark m_mark;
+};
+
+// A position's moves, generated into an arena rather than a vector.  Valid
+// until the arena is released past them.
+class MoveList
+{
+public:
+	MoveList(SearchArena& arena, const BoardState& board)
+	{
+		m_moves = arena.AllocateUninitialized<ChessMove>(BoardState::MaxMoves);
+		m_count = board.ValidMoves(m_moves);
+		arena.Shrink(m_moves, BoardState::MaxMoves * sizeof(ChessMove), m_count * sizeof(ChessMove));
+	}
+
+	// With Side, the side to move, fixed when compiling
+	template <SideType Side>
+	static MoveList Generate(SearchArena& arena, const BoardState& board)
+	{
+		ChessMove* moves = arena.AllocateUninitialized<ChessMove>(BoardState::MaxMoves);
+		const int count = board.ValidMoves<Side>(moves);
+		arena.Shrink(moves, BoardState::MaxMoves * sizeof(ChessMove), count * sizeof(ChessMove));
+		return MoveList(moves, count);
+	}
+
+	ChessMove* begin() const
+	{
+		return m_moves;
+	}
+
+	ChessMove* end() const
+	{
+		return m_moves + m_count;
+	}
+
+	size_t size() const
+	{
+		return m_count;
+	}
+
+	bool empty() const
+	{
+		return m_count == 0;
+	}
+
+	ChessMove& operator[](size_t index) const
+	{
+		return m_moves[index];
+	}
+
+private:
+	MoveList(ChessMove* moves, size_t count)
+		: m_moves(moves)
+		, m_count(count)
+	{}
+
+	ChessMove* m_moves;
+	size_t m_count;
+};
@@ -0,0 +1,113 @@
+#include "stdafx.h"
+#include "SearchScheduler.h"
+
+namespace
+{
+	// For tasks that don't say when to stop
+	const int DefaultDepth = 6;
+}
+
+SearchScheduler::SearchScheduler(int threads, size_t megabytesPerThread)
+	: m_nextTask(0)
+	, m_pool(threads)
+{
+	for (int i = 0; i < m_pool.ThreadCount(); ++i)
+	{
+		m_ais.push_back(std::make_unique<GameAi>());
+		m_ais.back()->SetHashSize(megabytesPerThread);
+	}
+}
+
+SearchScheduler::~SearchScheduler()
+{
+	CancelAll();
+}
+
+int SearchScheduler::Submit(const SearchTask& task)
+{
+	auto cancel = std::make_shared<std::atomic<bool>>(false);
+	int id;
+	{
+		std::lock_guard<std::mutex> lock(m_lock);
+		id = ++m_nextTask;
+		m_cancel[id] = cancel;
+	}
+
+	auto run = std::make_shared<SearchTask>(task);
+	m_pool.Submit([this, id, run, cancel](int worker)
+	{
+		Run(worker, id, *run, *cancel);
+	}, task.Priority);
+	return id;
+}
+
+void SearchScheduler::Cancel(int task)
+{
+	std::lock_guard<std::mutex> lock(m_lock);
+	auto found = m_cancel.find(task);
+	if (found != m_cancel.end())
+	{
+		*found->second = true;
+	}
+}
+
+void SearchScheduler::CancelAll()
+{
+	std::lock_guard<std::mutex> lock(m_lock);
+	for (auto& cancel : m_cancel)
+	{
+		*cancel.second = true;
+	}
+}
+
+void SearchScheduler::Run(int worker, int id, const SearchTask& task, const std::atomic<bool>& cancel)
+{
+	SearchResult result;
+	result.Task = id;
+	if (cancel)
+	{
+		result.Cancelled = true;
+	}
+	else
+	{
+		// Searches that would otherwise only end when told to
+		auto limits = task.Limits;
+		limits.Infinite = false;
+		limits.Ponder = false;
+		if (!limits.Depth && !limits.Nodes && !limits.MoveTime && !limits.Time[0] && !limits.Time[1])
+		{
+			limits.Depth = DefaultDepth;
+		}
+
+		auto& ai = *m_ais[worker];
+		ai.SetMultiPv(task.MultiPv);
+		ai.SetInfoCallback(task.Progress);
+		ai.SetCancelFlag(&cancel);
+		ai.SetSharedTable(task.SharedTable);
+		if (!task.SharedTable)
+		{
+			ai.ClearHash();
+		}
+
+		int score = 0;
+		result.BestMove = ai.DecideMove(task.Board, task.History, limits, &score);
+		result.Cancelled = cancel;
+		result.Score = ai.GetScore();
+		result.Nodes = ai.GetNodes();
+		result.Time = ai.GetElapsedTime();
+		result.Lines = ai.GetLines();
+
+		ai.SetInfoCallback(nullptr);
+		ai.SetCancelFlag(nullptr);
+		ai.SetSharedTable(nullptr);
+	}
+
+	{
+		std::lock_guard<std::mutex> lock(m_lock);
+		m_cancel.erase(id);
+	}
+	if (task.Finished)
+	{
+		task.Finished(result);
+	}
+}
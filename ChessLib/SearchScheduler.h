@@ -0,0 +1,109 @@
+#pragma once
+
+#include "GameAi.h"
+#include "TaskPool.h"
+#include <atomic>
+#include <functional>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+struct SearchResult
+{
+	SearchResult()
+		: Task(0)
+		, Cancelled(false)
+		, BestMove(InvalidChessMove)
+		, Score(0)
+		, Nodes(0)
+		, Time(0)
+	{}
+
+	int Task;				// as returned by Submit()
+	bool Cancelled;			// before it started, or part way through
+	ChessMove BestMove;
+	int Score;				// from White's side
+	unsigned long long Nodes;
+	DWORD Time;
+	std::vector<SearchInfo> Lines;	// best first, as GameAi::GetLines()
+};
+
+// One search to run on a SearchScheduler.  The limits are its budget: a
+// search with no depth, node or time limit at all is given a depth.
+struct SearchTask
+{
+	SearchTask()
+		: Priority(0)
+		, MultiPv(1)
+		, SharedTable(nullptr)
+	{}
+
+	BoardState Board;
+	PositionHistory History;
+	SearchLimits Limits;
+	int Priority;			// higher starts first
+	int MultiPv;
+
+	// Searched with this table, which other tasks may be using at the same
+	// time, or with the worker's own table cleared first if nullptr
+	TranspositionTable* SharedTable;
+
+	// Both called on the worker running the search: after each iteration,
+	// and once at the end, also for tasks cancelled before they started
+	GameAi::InfoCallback Progress;
+	std::function<void(const SearchResult&)> Finished;
+};
+
+// Runs many independent searches at once on a fixed TaskPool, one search
+// per worker at a time.  Each worker keeps a GameAi for the searches it
+// runs, so a search costs no thread or table of its own.
+class SearchScheduler
+{
+public:
+	// Threads: 0 for one per core.  Each worker's table has megabytesPerThread.
+	SearchScheduler(int threads, size_t megabytesPerThread);
+
+	// Stops the running searches, and drops the tasks not started without
+	// reporting them
+	~SearchScheduler();
+
+	SearchScheduler(const SearchScheduler&) = delete;
+	SearchScheduler& operator=(const SearchScheduler&) = delete;
+
+	// Returns the task's id
+	int Submit(const SearchTask& task);
+
+	// A task not started yet finishes straight away, without searching; a
+	// running one stops with the best move found so far
+	void Cancel(int task);
+	void CancelAll();
+
+	// Blocks until every task submitted so far has finished
+	void WaitUntilIdle()
+	{
+		m_pool.WaitUntilIdle();
+	}
+
+	int ThreadCount() const
+	{
+		return m_pool.ThreadCount();
+	}
+
+	// Tasks waiting for a worker
+	size_t Queued() const
+	{
+		return m_pool.Queued();
+	}
+
+private:
+	void Run(int worker, int id, const SearchTask& task, const std::atomic<bool>& cancel);
+
+	std::vector<std::unique_ptr<GameAi>> m_ais;		// one per worker
+
+	std::mutex m_lock;
+	std::map<int, std::shared_ptr<std::atomic<bool>>> m_cancel;	// tasks not finished
+	int m_nextTask;
+
+	TaskPool m_pool;	// last, so it's stopped before the rest is torn down
+};
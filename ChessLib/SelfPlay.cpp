@@ -0,0 +1,180 @@
+#include "stdafx.h"
+#include "SelfPlay.h"
+#include "GameAi.h"
+#include "Tablebase.h"
+#include <atomic>
+#include <mutex>
+#include <random>
+#include <thread>
+
+namespace
+{
+	bool IsBareKings(const BoardState& board)
+	{
+		for (auto loc : board)
+		{
+			const auto type = board.Get(loc).Type;
+			if (type != PieceType::Empty && type != PieceType::King)
+			{
+				return false;
+			}
+		}
+		return true;
+	}
+}
+
+SelfPlay::SelfPlay(const SelfPlayOptions& options)
+	: m_options(options)
+{
+}
+
+SelfPlayStats SelfPlay::Run(TrainingWriter& writer)
+{
+	SelfPlayStats stats;
+	std::atomic<int> nextGame(0);
+	std::mutex statsLock;
+
+	auto work = [&]()
+	{
+		GameAi ai;
+		ai.SetHashSize(m_options.HashMegabytes);
+		ai.SetTablebases(m_options.EndgameTables);
+
+		std::vector<TrainingPosition> positions;
+		for (int game = nextGame++; game < m_options.Games; game = nextGame++)
+		{
+			// Games don't share anything, so they come out the same whichever thread plays them
+			const unsigned seed = m_options.Seed + game;
+			ai.ClearHash();
+			ai.SetRandomSeed(seed);
+
+			positions.clear();
+			bool adjudicated = false;
+			const int result = PlayGame(ai, seed, positions, &adjudicated);
+
+			std::lock_guard<std::mutex> lock(statsLock);
+			writer.Write(positions.data(), positions.size());
+			++stats.Games;
+			stats.Positions += positions.size();
+			if (adjudicated) ++stats.Adjudicated;
+			if (result > 0) ++stats.WhiteWins;
+			else if (result < 0) ++stats.BlackWins;
+			else ++stats.Draws;
+		}
+	};
+
+	int threads = m_options.Threads;
+	if (threads <= 0)
+	{
+		threads = static_cast<int>(std::thread::hardware_concurrency());
+	}
+	if (threads <= 0)
+	{
+		threads = 1;
+	}
+
+	std::vector<std::thread> workers;
+	for (int i = 0; i < threads; ++i)
+	{
+		workers.emplace_back(work);
+	}
+	for (auto& worker : workers)
+	{
+		worker.join();
+	}
+
+	writer.Flush();
+	return stats;
+}
+
+int SelfPlay::PlayGame(GameAi& ai, unsigned seed, std::vector<TrainingPosition>& positions, bool* adjudicated) const
+{
+	std::mt19937 random(seed);
+
+	BoardState board;
+	PositionHistory history;
+	history.Push(board.Key());
+
+	SearchLimits limits;
+	limits.Depth = m_options.Depth;
+	limits.Nodes = m_options.Nodes;
+
+	const size_t firstPosition = positions.size();
+	int result = 0;
+	int resignSign = 0;
+	int resignPlies = 0;
+	int drawPlies = 0;
+	*adjudicated = false;
+
+	for (int ply = 0; ; ++ply)
+	{
+		const auto moves = board.ValidMoves();
+		if (moves.empty())
+		{
+			result = !board.IsCheck() ? 0 : board.NextSide() == SideType::White ? -1 : 1;
+			break;
+		}
+		if (ply >= m_options.MaxPlies
+			|| history.IsThreefoldRepetition(board)
+			|| board.IsFiftyMoveDraw()
+			|| IsBareKings(board))
+		{
+			result = 0;
+			break;
+		}
+
+		ChessMove move;
+		if (ply < m_options.RandomPlies)
+		{
+			std::uniform_int_distribution<int> distribution(0, static_cast<int>(moves.size()) - 1);
+			move = moves[distribution(random)];
+		}
+		else
+		{
+			if (m_options.EndgameTables)
+			{
+				const auto wdl = m_options.EndgameTables->Probe(board);
+				if (wdl != Wdl::Unknown)
+				{
+					const int sign = board.NextSide() == SideType::White ? 1 : -1;
+					result = wdl == Wdl::Win ? sign : wdl == Wdl::Loss ? -sign : 0;
+					*adjudicated = true;
+					break;
+				}
+			}
+
+			int score = 0;
+			move = ai.DecideMove(board, history, limits, &score);
+			positions.push_back(TrainingPosition::FromBoard(board, score, ply));
+
+			// Both sides have to agree for a while before the game is called
+			const int sign = score >= m_options.ResignScore ? 1 : score <= -m_options.ResignScore ? -1 : 0;
+			resignPlies = sign != 0 && sign == resignSign ? resignPlies + 1 : 1;
+			resignSign = sign;
+			if (resignSign != 0 && resignPlies >= m_options.ResignPlies)
+			{
+				result = resignSign;
+				*adjudicated = true;
+				break;
+			}
+
+			const bool level = ply >= m_options.DrawMinPly && score <= m_options.DrawScore && score >= -m_options.DrawScore;
+			drawPlies = level ? drawPlies + 1 : 0;
+			if (drawPlies >= m_options.DrawPlies)
+			{
+				result = 0;
+				*adjudicated = true;
+				break;
+			}
+		}
+
+		board.Move(move.From, move.To, true);
+		history.Push(board.Key());
+	}
+
+	for (size_t i = firstPosition; i < positions.size(); ++i)
+	{
+		positions[i].Result = static_cast<signed char>(result);
+	}
+	return result;
+}
@@ -0,0 +1,86 @@
+#pragma once
+
+#include "TrainingData.h"
+#include <vector>
+
+class GameAi;
+class Tablebases;
+
+struct SelfPlayOptions
+{
+	SelfPlayOptions()
+		: Games(100)
+		, Threads(0)
+		, Depth(2)
+		, Nodes(0)
+		, RandomPlies(8)
+		, MaxPlies(400)
+		, ResignScore(6000)
+		, ResignPlies(8)
+		, DrawScore(200)
+		, DrawPlies(20)
+		, DrawMinPly(80)
+		, HashMegabytes(4)
+		, Seed(1)
+		, EndgameTables(nullptr)
+	{}
+
+	int Games;
+	int Threads;				// 0 for one per core
+	int Depth;					// per move, in plies
+	unsigned long long Nodes;	// per move, 0 for only the depth limit
+	int RandomPlies;			// played at random to start each game, and not recorded
+	int MaxPlies;				// the game is drawn after this many
+
+	// Adjudication, with scores in the engine's units.  A game is over once
+	// the score has stayed past ResignScore for ResignPlies plies in a row,
+	// or (after DrawMinPly) within DrawScore of zero for DrawPlies plies.
+	int ResignScore;
+	int ResignPlies;
+	int DrawScore;
+	int DrawPlies;
+	int DrawMinPly;
+
+	int HashMegabytes;			// for each thread's search
+	unsigned Seed;				// game n uses Seed + n, so runs can be repeated
+
+	// Positions found in the tables end the game with their result
+	const Tablebases* EndgameTables;
+};
+
+struct SelfPlayStats
+{
+	SelfPlayStats()
+		: Games(0)
+		, WhiteWins(0)
+		, Draws(0)
+		, BlackWins(0)
+		, Adjudicated(0)
+		, Positions(0)
+	{}
+
+	int Games;
+	int WhiteWins;
+	int Draws;
+	int BlackWins;
+	int Adjudicated;
+	unsigned long long Positions;
+};
+
+// Plays the engine against itself to produce labelled positions.  Each
+// thread plays whole games with its own GameAi, and a finished game's
+// positions are written in one go, labelled with its result.
+class SelfPlay
+{
+public:
+	explicit SelfPlay(const SelfPlayOptions& options);
+
+	SelfPlayStats Run(TrainingWriter& writer);
+
+	// Returns the result from White's side (1, 0 or -1), with each searched
+	// position appended to positions already labelled with it
+	int PlayGame(GameAi& ai, unsigned seed, std::vector<TrainingPosition>& positions, bool* adjudicated) const;
+
+private:
+	SelfPlayOptions m_options;
+};
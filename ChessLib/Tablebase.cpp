@@ -0,0 +1,263 @@
+#include "stdafx.h"
+#include "Tablebase.h"
+
+const char* Tablebases::FileExtension = ".cltb";
+
+namespace
+{
+	// Order pieces are listed in a material name
+	const char MaterialOrder[] = "KQRBNP";
+
+	// Squares of the a8-d8-d5 triangle (our rows count down from the 8th rank)
+	int TriangleIndex(int x, int y)
+	{
+		static const int index[4][4] =
+		{
+			{ 0, 1, 2, 3 },
+			{ -1, 4, 5, 6 },
+			{ -1, -1, 7, 8 },
+			{ -1, -1, -1, 9 },
+		};
+		return index[y][x];
+	}
+
+	std::string SideMaterial(const BoardState& board, SideType side)
+	{
+		std::string material;
+		for (const char* c = MaterialOrder; *c; ++c)
+		{
+			const Piece wanted(GetPieceType(*c), side);
+			for (auto loc : board)
+			{
+				if (board.Get(loc) == wanted) material += *c;
+			}
+		}
+		return material;
+	}
+
+	// Every "KXY" for up to 'extra' pieces besides the king, in material order
+	void EnumerateSides(std::string prefix, int start, int extra, std::vector<std::string>& out)
+	{
+		out.push_back(prefix);
+		if (extra == 0) return;
+		for (int i = start; MaterialOrder[i]; ++i)
+		{
+			EnumerateSides(prefix + MaterialOrder[i], i, extra - 1, out);
+		}
+	}
+}
+
+std::string MaterialName(const BoardState& board)
+{
+	return SideMaterial(board, SideType::White) + "v" + SideMaterial(board, SideType::Black);
+}
+
+TablebaseLayout::TablebaseLayout(const std::string& name)
+	: m_name(name)
+	, m_hasPawns(false)
+{
+	SideType side = SideType::White;
+	for (auto c : name)
+	{
+		if (c == 'v')
+		{
+			side = SideType::Black;
+			continue;
+		}
+		m_pieces.push_back(Piece(GetPieceType(c), side));
+		m_hasPawns |= (c == 'P');
+	}
+}
+
+size_t TablebaseLayout::EntryCount() const
+{
+	size_t count = m_hasPawns ? 32 : 10;
+	for (int i = 1; i < PieceCount(); ++i)
+	{
+		count *= 64;
+	}
+	return count * 2;
+}
+
+size_t TablebaseLayout::Index(const BoardLocation* squares, SideType nextSide) const
+{
+	int x = squares[0].X();
+	int y = squares[0].Y();
+
+	// Work out which reflections put White's king in its reduced set of squares
+	const bool flipX = x > 3;
+	const bool flipY = !m_hasPawns && y > 3;
+	if (flipX) x = 7 - x;
+	if (flipY) y = 7 - y;
+	const bool transpose = !m_hasPawns && y > x;
+
+	size_t index = m_hasPawns ? y * 4 + x : TriangleIndex(transpose ? y : x, transpose ? x : y);
+
+	for (int i = 1; i < PieceCount(); ++i)
+	{
+		int px = squares[i].X();
+		int py = squares[i].Y();
+		if (flipX) px = 7 - px;
+		if (flipY) py = 7 - py;
+		if (transpose) std::swap(px, py);
+		index = index * 64 + px + py * 8;
+	}
+
+	return index * 2 + static_cast<int>(nextSide);
+}
+
+int Tablebases::Init(const std::string& directory, int maxPieces)
+{
+	m_tables.clear();
+	m_maxPieces = 0;
+
+	std::vector<std::string> sides;
+	EnumerateSides("K", 1, maxPieces - 2, sides);
+
+	for (auto& white : sides)
+	{
+		for (auto& black : sides)
+		{
+			if (white.size() + black.size() > static_cast<size_t>(maxPieces)) continue;
+
+			const auto name = white + "v" + black;
+			std::unique_ptr<Table> table(new Table(name));
+
+			const auto path = directory + "/" + name + FileExtension;
+			if (!table->File.Open(path.c_str())) continue;
+
+			// Make sure the file really is the table we think it is
+			const auto header = reinterpret_cast<const TablebaseHeader*>(table->File.Data());
+			if (table->File.Size() < sizeof(TablebaseHeader)
+				|| strncmp(header->Magic, "CLTB", 4) != 0
+				|| header->EntryCount != table->Layout.EntryCount()
+				|| table->File.Size() != sizeof(TablebaseHeader) + header->EntryCount)
+			{
+				continue;
+			}
+
+			m_maxPieces = std::max(m_maxPieces, table->Layout.PieceCount());
+			m_tables[name] = std::move(table);
+		}
+	}
+
+	return TableCount();
+}
+
+Wdl Tablebases::Probe(const BoardState& board, int* distance) const
+{
+	// Tables are built without castling or en passant
+	if (board.EnPassantColumn() >= 0
+		|| board.HasCastlingRight(SideType::White, true) || board.HasCastlingRight(SideType::White, false)
+		|| board.HasCastlingRight(SideType::Black, true) || board.HasCastlingRight(SideType::Black, false))
+	{
+		return Wdl::Unknown;
+	}
+
+	int pieces = 0;
+	for (auto loc : board)
+	{
+		if (board.Get(loc).Type != PieceType::Empty && ++pieces > m_maxPieces) return Wdl::Unknown;
+	}
+
+	// Bare kings don't need a table
+	if (pieces == 2)
+	{
+		if (distance) *distance = 0;
+		return Wdl::Draw;
+	}
+
+	const auto white = SideMaterial(board, SideType::White);
+	const auto black = SideMaterial(board, SideType::Black);
+
+	// Tables only exist with the stronger side as White, so the position may
+	// need its colours swapped (and the board flipped top to bottom)
+	bool swapColors = false;
+	auto table = m_tables.find(white + "v" + black);
+	if (table == m_tables.end())
+	{
+		swapColors = true;
+		table = m_tables.find(black + "v" + white);
+		if (table == m_tables.end()) return Wdl::Unknown;
+	}
+
+	const auto& layout = table->second->Layout;
+
+	BoardLocation squares[8];
+	std::bitset<64> used;
+	for (int i = 0; i < layout.PieceCount(); ++i)
+	{
+		auto wanted = layout.GetPiece(i);
+		if (swapColors) wanted.Side = OtherSide(wanted.Side);
+
+		for (auto loc : board)
+		{
+			if (!used.test(loc.Raw()) && board.Get(loc) == wanted)
+			{
+				used.set(loc.Raw());
+				squares[i] = swapColors ? BoardLocation(loc.X(), 7 - loc.Y()) : loc;
+				break;
+			}
+		}
+	}
+
+	const auto nextSide = swapColors ? OtherSide(board.NextSide()) : board.NextSide();
+	const auto index = layout.Index(squares, nextSide);
+	const auto value = table->second->File.Data()[sizeof(TablebaseHeader) + index];
+
+	if (value == TablebaseIllegal) return Wdl::Unknown;
+
+	if (value == TablebaseDraw)
+	{
+		if (distance) *distance = 0;
+		return Wdl::Draw;
+	}
+	if (value < TablebaseLossBase)
+	{
+		if (distance) *distance = value;
+		return Wdl::Win;
+	}
+	if (distance) *distance = value - TablebaseLossBase;
+	return Wdl::Loss;
+}
+
+ChessMove Tablebases::ProbeRoot(const BoardState& board, Wdl* result) const
+{
+	auto best = InvalidChessMove;
+	auto bestResult = Wdl::Unknown;
+	int bestDistance = 0;
+
+	for (auto m : board.ValidMoves())
+	{
+		auto child = board;
+		child.Move(m.From, m.To, true);
+
+		int distance = 0;
+		const auto childResult = Probe(child, &distance);
+		if (childResult == Wdl::Unknown)
+		{
+			return InvalidChessMove;
+		}
+
+		// The reply's loss is our win and vice versa
+		const auto ourResult = childResult == Wdl::Loss ? Wdl::Win : (childResult == Wdl::Win ? Wdl::Loss : Wdl::Draw);
+
+		bool better = !best.IsValid() || ourResult > bestResult;
+		if (ourResult == bestResult)
+		{
+			// Win quickly, lose slowly
+			if (ourResult == Wdl::Win) better = distance < bestDistance;
+			if (ourResult == Wdl::Loss) better = distance > bestDistance;
+		}
+
+		if (better)
+		{
+			best = m;
+			bestResult = ourResult;
+			bestDistance = distance;
+		}
+	}
+
+	if (result) *result = bestResult;
+	return best;
+}
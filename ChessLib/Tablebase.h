@@ -0,0 +1,124 @@
+#pragma once
+
+#include "BoardState.h"
+#include "MappedFile.h"
+#include <map>
+#include <memory>
+#include <string>
+
+// Game theoretic value of a position, for the side to move
+enum class Wdl
+{
+	Loss,
+	Draw,
+	Win,
+	Unknown
+};
+
+// Where positions of one material set (e.g. "KQvK", first side is White)
+// live in its table.  Board symmetries are folded away using the first
+// piece, which is always White's king: pawnless tables reflect it into a
+// 10 square triangle, tables with pawns only mirror it onto files a-d.
+class TablebaseLayout
+{
+public:
+	explicit TablebaseLayout(const std::string& name);
+
+	const std::string& Name() const
+	{
+		return m_name;
+	}
+
+	int PieceCount() const
+	{
+		return static_cast<int>(m_pieces.size());
+	}
+
+	Piece GetPiece(int i) const
+	{
+		return m_pieces[i];
+	}
+
+	bool HasPawns() const
+	{
+		return m_hasPawns;
+	}
+
+	size_t EntryCount() const;
+
+	// squares[] holds one square per piece, in table order
+	size_t Index(const BoardLocation* squares, SideType nextSide) const;
+
+private:
+	std::string m_name;
+	std::vector<Piece> m_pieces;
+	bool m_hasPawns;
+};
+
+// Tablebase files: a TablebaseHeader followed by one byte per index.
+//   0         draw
+//   1..126    side to move mates in that many plies
+//   128..254  side to move is mated in (value - 128) plies
+//   255       not a legal position
+struct TablebaseHeader
+{
+	char Magic[4];
+	unsigned Version;
+	unsigned PieceCount;
+	unsigned HasPawns;
+	char Name[8];
+	unsigned long long EntryCount;
+};
+
+const byte TablebaseDraw = 0;
+const byte TablebaseMaxWin = 126;
+const byte TablebaseLossBase = 128;
+const byte TablebaseIllegal = 255;
+
+// All the tables found in a directory.  Files are memory mapped and never
+// written after Init, so one Tablebases can be probed from any thread.
+class Tablebases
+{
+public:
+	Tablebases()
+		: m_maxPieces(0) {}
+
+	// Looks for <directory>/<name>.cltb for every material set up to maxPieces.
+	// Returns how many tables were found.
+	int Init(const std::string& directory, int maxPieces = 5);
+
+	int MaxPieces() const
+	{
+		return m_maxPieces;
+	}
+
+	int TableCount() const
+	{
+		return static_cast<int>(m_tables.size());
+	}
+
+	// Win/draw/loss for the side to move; distance (optional) gets the plies to mate
+	Wdl Probe(const BoardState& board, int* distance = nullptr) const;
+
+	// Picks the move that wins fastest, holds the draw, or loses slowest.
+	// InvalidChessMove if some reply isn't covered by the tables.
+	ChessMove ProbeRoot(const BoardState& board, Wdl* result = nullptr) const;
+
+	static const char* FileExtension;
+
+private:
+	struct Table
+	{
+		Table(const std::string& name)
+			: Layout(name) {}
+
+		TablebaseLayout Layout;
+		MappedFile File;
+	};
+
+	std::map<std::string, std::unique_ptr<Table>> m_tables;
+	int m_maxPieces;
+};
+
+// Material set name for a position, e.g. "KRvKN"
+std::string MaterialName(const BoardState& board);
@@ -0,0 +1,512 @@
+#include "stdafx.h"
+#include "TablebaseGenerator.h"
+#include "Geometry.h"
+#include <algorithm>
+#include <fstream>
+#include <thread>
+
+namespace
+{
+	// Not decided yet.  Losses are capped below it, so it never clashes with a real value.
+	const byte Unresolved = 254;
+	const int MaxDistance = 125;
+	const byte NoWin = 255;
+
+	// Inverse of the triangle used by TablebaseLayout: { x, y } for each index
+	const int TriangleSquares[10][2] =
+	{
+		{ 0, 0 }, { 1, 0 }, { 2, 0 }, { 3, 0 },
+		{ 1, 1 }, { 2, 1 }, { 3, 1 },
+		{ 2, 2 }, { 3, 2 },
+		{ 3, 3 },
+	};
+
+	const int KingSteps[8][2] = { { 1, 0 }, { 1, 1 }, { 0, 1 }, { -1, 1 }, { -1, 0 }, { -1, -1 }, { 0, -1 }, { 1, -1 } };
+	const int KnightSteps[8][2] = { { 1, 2 }, { 2, 1 }, { 2, -1 }, { 1, -2 }, { -1, -2 }, { -2, -1 }, { -2, 1 }, { -1, 2 } };
+
+	bool IsWin(byte value) { return value >= 1 && value <= TablebaseMaxWin; }
+	bool IsLoss(byte value) { return value >= TablebaseLossBase && value < Unresolved; }
+	int Distance(byte value) { return IsLoss(value) ? value - TablebaseLossBase : value; }
+}
+
+TablebaseGenerator::TablebaseGenerator(const std::string& name, const Tablebases* smaller, int threads)
+	: m_layout(name)
+	, m_smaller(smaller)
+	, m_threads(threads > 0 ? threads : std::max(1u, std::thread::hardware_concurrency()))
+	, m_longestMate(0)
+{
+	assert(m_layout.PieceCount() <= MaxPieces);
+}
+
+int TablebaseGenerator::PieceAt(const Position& position, int square)
+{
+	for (int i = 0; i < position.Count; ++i)
+	{
+		if (position.Squares[i] == square) return i;
+	}
+	return -1;
+}
+
+int TablebaseGenerator::KingSquare(const Position& position, SideType side)
+{
+	for (int i = 0; i < position.Count; ++i)
+	{
+		if (position.Pieces[i] == Piece(PieceType::King, side)) return position.Squares[i];
+	}
+	assert(false);
+	return -1;
+}
+
+bool TablebaseGenerator::IsAttacked(const Position& position, int square, SideType bySide)
+{
+	SquareSet occupied = 0;
+	for (int i = 0; i < position.Count; ++i)
+	{
+		if (position.Squares[i] >= 0) occupied |= SquareSet(1) << position.Squares[i];
+	}
+
+	const SquareSet target = SquareSet(1) << square;
+	for (int i = 0; i < position.Count; ++i)
+	{
+		const int from = position.Squares[i];
+		if (from < 0 || position.Pieces[i].Side != bySide) continue;
+
+		SquareSet reach = 0;
+		switch (position.Pieces[i].Type)
+		{
+		case PieceType::King:
+			if (Geometry::Distance[from][square] <= 1) return true;
+			continue;
+		case PieceType::Knight:
+			if (Geometry::KnightTargets[from] & target) return true;
+			continue;
+		case PieceType::Pawn:
+			if (Geometry::PawnAttacks[static_cast<int>(bySide)][from] & target) return true;
+			continue;
+		case PieceType::Bishop: reach = Geometry::BishopRays[from]; break;
+		case PieceType::Rook: reach = Geometry::RookRays[from]; break;
+		case PieceType::Queen: reach = Geometry::BishopRays[from] | Geometry::RookRays[from]; break;
+		default: continue;
+		}
+
+		// Sliders also need a clear path
+		if ((reach & target) && !(Geometry::Between[from][square] & occupied)) return true;
+	}
+	return false;
+}
+
+bool TablebaseGenerator::Decode(size_t index, Position& position) const
+{
+	position.Count = m_layout.PieceCount();
+	position.NextSide = static_cast<SideType>(index % 2);
+	index /= 2;
+
+	for (int i = position.Count - 1; i >= 0; --i)
+	{
+		position.Pieces[i] = m_layout.GetPiece(i);
+		if (i > 0)
+		{
+			position.Squares[i] = static_cast<int>(index % 64);
+			index /= 64;
+		}
+	}
+
+	if (m_layout.HasPawns())
+	{
+		position.Squares[0] = static_cast<int>(index % 4 + (index / 4) * 8);
+	}
+	else
+	{
+		position.Squares[0] = TriangleSquares[index][0] + TriangleSquares[index][1] * 8;
+	}
+
+	for (int i = 0; i < position.Count; ++i)
+	{
+		for (int j = 0; j < i; ++j)
+		{
+			if (position.Squares[i] == position.Squares[j]) return false;
+		}
+
+		// Pawns are never on the first or last row
+		const int row = position.Squares[i] / 8;
+		if (position.Pieces[i].Type == PieceType::Pawn && (row == 0 || row == 7)) return false;
+	}
+
+	// The side that just moved can't have left its king in check
+	return !IsAttacked(position, KingSquare(position, OtherSide(position.NextSide)), position.NextSide);
+}
+
+size_t TablebaseGenerator::Encode(const Position& position) const
+{
+	BoardLocation squares[MaxPieces];
+	for (int i = 0; i < position.Count; ++i)
+	{
+		squares[i] = BoardLocation(static_cast<byte>(position.Squares[i]));
+	}
+	return m_layout.Index(squares, position.NextSide);
+}
+
+bool TablebaseGenerator::GenerateMoves(const Position& position, Moves& moves, bool withOutside) const
+{
+	moves.Inside.clear();
+	moves.Outside.clear();
+
+	const auto side = position.NextSide;
+
+	for (int i = 0; i < position.Count; ++i)
+	{
+		if (position.Pieces[i].Side != side) continue;
+
+		const int from = position.Squares[i];
+		const int x = from % 8;
+		const int y = from / 8;
+
+		int targets[32];
+		int targetCount = 0;
+
+		auto addStep = [&](int dx, int dy, bool slide)
+		{
+			for (int tx = x + dx, ty = y + dy; tx >= 0 && tx < 8 && ty >= 0 && ty < 8; tx += dx, ty += dy)
+			{
+				const int to = tx + ty * 8;
+				const int occupant = PieceAt(position, to);
+				if (occupant < 0 || position.Pieces[occupant].Side != side) targets[targetCount++] = to;
+				if (occupant >= 0 || !slide) break;
+			}
+		};
+
+		switch (position.Pieces[i].Type)
+		{
+		case PieceType::King:
+			for (auto& step : KingSteps) addStep(step[0], step[1], false);
+			break;
+		case PieceType::Knight:
+			for (auto& step : KnightSteps) addStep(step[0], step[1], false);
+			break;
+		case PieceType::Bishop:
+			for (int d = 1; d < 8; d += 2) addStep(KingSteps[d][0], KingSteps[d][1], true);
+			break;
+		case PieceType::Rook:
+			for (int d = 0; d < 8; d += 2) addStep(KingSteps[d][0], KingSteps[d][1], true);
+			break;
+		case PieceType::Queen:
+			for (auto& step : KingSteps) addStep(step[0], step[1], true);
+			break;
+		case PieceType::Pawn:
+			{
+				const int dir = side == SideType::White ? -1 : 1;
+				const int startRow = side == SideType::White ? 6 : 1;
+				const int ahead = from + dir * 8;
+				if (PieceAt(position, ahead) < 0)
+				{
+					targets[targetCount++] = ahead;
+					if (y == startRow && PieceAt(position, ahead + dir * 8) < 0) targets[targetCount++] = ahead + dir * 8;
+				}
+				for (int dx = -1; dx <= 1; dx += 2)
+				{
+					if (x + dx < 0 || x + dx > 7) continue;
+					const int occupant = PieceAt(position, ahead + dx);
+					if (occupant >= 0 && position.Pieces[occupant].Side != side) targets[targetCount++] = ahead + dx;
+				}
+				break;
+			}
+		default:
+			assert(false);
+		}
+
+		for (int t = 0; t < targetCount; ++t)
+		{
+			const int to = targets[t];
+
+			Position child = position;
+			child.NextSide = OtherSide(side);
+
+			bool leavesTable = false;
+			const int captured = PieceAt(position, to);
+			if (captured >= 0)
+			{
+				child.Squares[captured] = -1;
+				leavesTable = true;
+			}
+			child.Squares[i] = to;
+			// Only to a queen, as that's all BoardState plays
+			if (child.Pieces[i].Type == PieceType::Pawn && (to / 8 == 0 || to / 8 == 7))
+			{
+				child.Pieces[i] = Piece(PieceType::Queen, side);
+				leavesTable = true;
+			}
+
+			if (IsAttacked(child, KingSquare(child, side), child.NextSide)) continue;
+
+			if (!leavesTable)
+			{
+				moves.Inside.push_back(Encode(child));
+			}
+			else if (withOutside)
+			{
+				const byte value = ProbeSmaller(child);
+				if (value == TablebaseIllegal) return false;
+				moves.Outside.push_back(value);
+			}
+			else
+			{
+				// Still a legal move, just one that was dealt with up front
+				moves.Outside.push_back(TablebaseIllegal);
+			}
+		}
+	}
+
+	return true;
+}
+
+byte TablebaseGenerator::ProbeSmaller(const Position& position) const
+{
+	char board[65];
+	memset(board, ' ', 64);
+	board[64] = '\0';
+
+	int minors = 0;
+	int others = 0;
+	for (int i = 0; i < position.Count; ++i)
+	{
+		if (position.Squares[i] < 0) continue;
+
+		const auto p = position.Pieces[i];
+		board[position.Squares[i]] = p.GetCharWithSide();
+		if (p.Type == PieceType::Bishop || p.Type == PieceType::Knight) ++minors;
+		else if (p.Type != PieceType::King) ++others;
+	}
+
+	// A lone minor piece (or nothing) can't mate
+	if (others == 0 && minors <= 1)
+	{
+		return TablebaseDraw;
+	}
+
+	BoardState b(board, position.NextSide);
+	b.RemoveCastlingRights();
+
+	int distance = 0;
+	const auto result = m_smaller ? m_smaller->Probe(b, &distance) : Wdl::Unknown;
+	switch (result)
+	{
+	case Wdl::Win: return static_cast<byte>(distance);
+	case Wdl::Loss: return static_cast<byte>(TablebaseLossBase + distance);
+	case Wdl::Draw: return TablebaseDraw;
+	default: return TablebaseIllegal;
+	}
+}
+
+size_t TablebaseGenerator::Initialize(int, size_t begin, size_t end)
+{
+	size_t missing = 0;
+	Position position;
+	Moves moves;
+
+	for (size_t index = begin; index < end; ++index)
+	{
+		if (!Decode(index, position))
+		{
+			SetValue(index, TablebaseIllegal);
+			continue;
+		}
+
+		if (!GenerateMoves(position, moves, true))
+		{
+			++missing;
+			continue;
+		}
+
+		if (moves.Inside.empty() && moves.Outside.empty())
+		{
+			const bool inCheck = IsAttacked(position, KingSquare(position, position.NextSide), OtherSide(position.NextSide));
+			SetValue(index, inCheck ? TablebaseLossBase : TablebaseDraw);
+			continue;
+		}
+
+		// Results of the other side after a capture or promotion
+		byte win = NoWin;
+		byte loss = 0;
+		for (auto value : moves.Outside)
+		{
+			if (IsLoss(value)) win = std::min(win, static_cast<byte>(Distance(value) + 1));
+			else if (IsWin(value) && loss != TablebaseIllegal) loss = std::max(loss, static_cast<byte>(Distance(value) + 1));
+			else loss = TablebaseIllegal;
+		}
+		m_outsideWin[index] = win;
+		m_outsideLoss[index] = loss;
+	}
+
+	return missing;
+}
+
+size_t TablebaseGenerator::Pass(int ply, size_t begin, size_t end)
+{
+	size_t resolved = 0;
+	Position position;
+	Moves moves;
+
+	for (size_t index = begin; index < end; ++index)
+	{
+		// Skip whole blocks that are already done
+		if (index % 64 == 0 && m_resolved[index / 64] == ~0ull)
+		{
+			index += 63;
+			continue;
+		}
+		if (IsResolved(index)) continue;
+
+		if (!Decode(index, position)) continue;
+		GenerateMoves(position, moves, false);
+
+		int win = m_outsideWin[index];
+		int loss = m_outsideLoss[index];
+		bool allLose = loss != TablebaseIllegal;
+
+		// Only read last pass's values, so every thread sees the same thing
+		for (auto child : moves.Inside)
+		{
+			const byte value = m_previous[child];
+			if (IsLoss(value)) win = std::min(win, Distance(value) + 1);
+			else if (IsWin(value)) loss = std::max(loss, Distance(value) + 1);
+			else allLose = false;
+		}
+
+		if (win <= ply)
+		{
+			SetValue(index, static_cast<byte>(win));
+			++resolved;
+		}
+		else if (allLose && loss <= ply)
+		{
+			SetValue(index, static_cast<byte>(TablebaseLossBase + loss));
+			++resolved;
+		}
+	}
+
+	return resolved;
+}
+
+// Copies over just the entries resolved since last time, found by comparing
+// the bitmaps a word at a time, rather than the whole table every pass
+void TablebaseGenerator::UpdatePrevious()
+{
+	for (size_t word = 0; word < m_resolved.size(); ++word)
+	{
+		const unsigned long long changed = m_resolved[word] & ~m_previousResolved[word];
+		if (changed == 0) continue;
+
+		for (int bit = 0; bit < 64; ++bit)
+		{
+			if ((changed >> bit) & 1)
+			{
+				m_previous[word * 64 + bit] = m_values[word * 64 + bit];
+			}
+		}
+		m_previousResolved[word] = m_resolved[word];
+	}
+}
+
+size_t TablebaseGenerator::RunParallel(size_t (TablebaseGenerator::*work)(int, size_t, size_t), int ply)
+{
+	const size_t count = m_values.size();
+	const size_t blocks = (count + 63) / 64;
+	const size_t blocksPerThread = (blocks + m_threads - 1) / m_threads;
+
+	std::vector<size_t> results(m_threads, 0);
+	std::vector<std::thread> threads;
+	for (int t = 0; t < m_threads; ++t)
+	{
+		const size_t begin = std::min(count, t * blocksPerThread * 64);
+		const size_t end = std::min(count, (t + 1) * blocksPerThread * 64);
+		threads.push_back(std::thread([=, &results]() { results[t] = (this->*work)(ply, begin, end); }));
+	}
+
+	size_t total = 0;
+	for (int t = 0; t < m_threads; ++t)
+	{
+		threads[t].join();
+		total += results[t];
+	}
+	return total;
+}
+
+bool TablebaseGenerator::Generate()
+{
+	const size_t count = m_layout.EntryCount();
+	m_values.assign(count, Unresolved);
+	m_resolved.assign((count + 63) / 64, 0);
+	m_outsideWin.assign(count, NoWin);
+	m_outsideLoss.assign(count, 0);
+
+	if (RunParallel(&TablebaseGenerator::Initialize, 0) > 0)
+	{
+		return false;
+	}
+
+	// Captures and promotions can resolve positions at any distance, keep
+	// going at least until those have been reached
+	int lastOutside = 0;
+	for (size_t i = 0; i < count; ++i)
+	{
+		if (m_outsideWin[i] != NoWin) lastOutside = std::max<int>(lastOutside, m_outsideWin[i]);
+		if (m_outsideLoss[i] != TablebaseIllegal) lastOutside = std::max<int>(lastOutside, m_outsideLoss[i]);
+	}
+
+	m_previous = m_values;
+	m_previousResolved = m_resolved;
+	for (int ply = 1; ply <= MaxDistance; ++ply)
+	{
+		const size_t resolved = RunParallel(&TablebaseGenerator::Pass, ply);
+		if (resolved == 0 && ply > lastOutside)
+		{
+			break;
+		}
+		UpdatePrevious();
+	}
+
+	m_longestMate = 0;
+	for (auto& value : m_values)
+	{
+		if (value == Unresolved) value = TablebaseDraw;
+		if (IsWin(value) || IsLoss(value)) m_longestMate = std::max(m_longestMate, Distance(value));
+	}
+
+	m_previous.clear();
+	m_previousResolved.clear();
+	m_outsideWin.clear();
+	m_outsideLoss.clear();
+	return true;
+}
+
+size_t TablebaseGenerator::CountEntries(Wdl result) const
+{
+	size_t count = 0;
+	for (auto value : m_values)
+	{
+		switch (result)
+		{
+		case Wdl::Win: count += IsWin(value); break;
+		case Wdl::Loss: count += IsLoss(value); break;
+		case Wdl::Draw: count += value == TablebaseDraw; break;
+		default: count += value == TablebaseIllegal; break;
+		}
+	}
+	return count;
+}
+
+bool TablebaseGenerator::Write(const std::string& directory) const
+{
+	TablebaseHeader header = {};
+	memcpy(header.Magic, "CLTB", 4);
+	header.Version = 1;
+	header.PieceCount = m_layout.PieceCount();
+	header.HasPawns = m_layout.HasPawns();
+	memcpy(header.Name, m_layout.Name().c_str(), std::min(sizeof(header.Name), m_layout.Name().size()));
+	header.EntryCount = m_values.size();
+
+	std::ofstream out(directory + "/" + m_layout.Name() + Tablebases::FileExtension, std::ios::binary);
+	out.write(reinterpret_cast<const char*>(&header), sizeof(header));
+	out.write(reinterpret_cast<const char*>(m_values.data()), m_values.size());
+	return out.good();
+}
@@ -0,0 +1,107 @@
+#pragma once
+
+#include "Tablebase.h"
+#include <string>
+#include <vector>
+
+// Builds the table for one material set (e.g. "KBNvK") by retrograde
+// analysis.  Checkmates and stalemates are found first, then each pass
+// resolves the positions one more ply from mate until nothing changes;
+// anything left over is a draw.  Passes are split across threads, and a
+// bitmap of resolved positions lets them skip over finished ones quickly.
+//
+// Captures and promotions leave the table, so those positions are looked up
+// in the smaller tables, which need to be built first (KQvK before KPvK).
+// Pawns only promote to queens, as BoardState has them do, so the values
+// are what the engine can reach: a position only an underpromotion would
+// win counts as the draw the engine gets.  A lone bishop or knight against
+// a bare king needs no table, as it's always a draw.
+class TablebaseGenerator
+{
+public:
+	TablebaseGenerator(const std::string& name, const Tablebases* smaller = nullptr, int threads = 0);
+
+	// False if a smaller table this one depends on is missing
+	bool Generate();
+
+	// Writes <directory>/<name>.cltb
+	bool Write(const std::string& directory) const;
+
+	const TablebaseLayout& Layout() const
+	{
+		return m_layout;
+	}
+
+	// Longest forced mate in the table, in plies
+	int LongestMate() const
+	{
+		return m_longestMate;
+	}
+
+	size_t CountEntries(Wdl result) const;
+
+	static const int MaxPieces = 5;
+
+private:
+	struct Position
+	{
+		int Count;
+		Piece Pieces[MaxPieces];
+		int Squares[MaxPieces];
+		SideType NextSide;
+	};
+
+	// Every legal move from a position, sorted into ones that stay in this table
+	// (as indexes) and ones that capture or promote (as results from smaller tables)
+	struct Moves
+	{
+		std::vector<size_t> Inside;
+		std::vector<byte> Outside;
+	};
+
+	static int PieceAt(const Position& position, int square);
+	static bool IsAttacked(const Position& position, int square, SideType bySide);
+	static int KingSquare(const Position& position, SideType side);
+
+	bool Decode(size_t index, Position& position) const;
+	size_t Encode(const Position& position) const;
+	bool GenerateMoves(const Position& position, Moves& moves, bool withOutside) const;
+	byte ProbeSmaller(const Position& position) const;
+
+	// Each returns how many positions it resolved (Initialize: how many needed a missing table)
+	size_t Initialize(int ply, size_t begin, size_t end);
+	size_t Pass(int ply, size_t begin, size_t end);
+	size_t RunParallel(size_t (TablebaseGenerator::*work)(int, size_t, size_t), int ply);
+	void UpdatePrevious();
+
+	bool IsResolved(size_t index) const
+	{
+		return (m_resolved[index / 64] >> (index % 64)) & 1;
+	}
+
+	// Threads work on whole 64 entry blocks, so each word of the bitmap has one writer
+	void SetValue(size_t index, byte value)
+	{
+		m_values[index] = value;
+		m_resolved[index / 64] |= 1ull << (index % 64);
+	}
+
+	TablebaseLayout m_layout;
+	const Tablebases* m_smaller;
+	int m_threads;
+
+	std::vector<byte> m_values;
+	std::vector<unsigned long long> m_resolved;
+
+	// What Pass() reads: the values as they were when the pass started, so
+	// every thread sees the same thing
+	std::vector<byte> m_previous;
+	std::vector<unsigned long long> m_previousResolved;
+
+	// Best results through captures/promotions: quickest win, and slowest loss
+	// if every such move loses (TablebaseIllegal when one of them doesn't)
+	std::vector<byte> m_outsideWin;
+	std::vector<byte> m_outsideLoss;
+
+	int m_longestMate;
+};
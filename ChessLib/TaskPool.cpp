@@ -0,0 +1,227 @@
+#include "stdafx.h"
+#include "TaskPool.h"
+
+TaskPool::TaskPool(int threads)
+	: m_queued(0)
+	, m_running(0)
+	, m_shutdown(false)
+{
+	if (threads <= 0)
+	{
+		threads = static_cast<int>(std::thread::hardware_concurrency());
+	}
+	if (threads <= 0)
+	{
+		threads = 1;
+	}
+
+	for (int i = 0; i < threads; ++i)
+	{
+		m_workers.push_back(std::make_unique<Worker>());
+	}
+
+	// Only started once they're all there, as they steal from each other
+	for (int i = 0; i < threads; ++i)
+	{
+		m_workers[i]->Thread = std::thread([this, i] { WorkerLoop(i); });
+	}
+}
+
+TaskPool::~TaskPool()
+{
+	{
+		std::lock_guard<std::mutex> lock(m_lock);
+		m_shutdown = true;
+	}
+	m_wake.notify_all();
+
+	for (auto& worker : m_workers)
+	{
+		worker->Thread.join();
+	}
+}
+
+void TaskPool::Submit(Task task, int priority)
+{
+	{
+		std::lock_guard<std::mutex> lock(m_lock);
+		m_submitted[priority].push_back(task);
+		++m_queued;
+	}
+	m_wake.notify_one();
+}
+
+void TaskPool::Spawn(int worker, Task task)
+{
+	{
+		std::lock_guard<std::mutex> lock(m_workers[worker]->Lock);
+		m_workers[worker]->Tasks.push_back(task);
+	}
+	{
+		std::lock_guard<std::mutex> lock(m_lock);
+		++m_queued;
+	}
+	m_wake.notify_one();
+}
+
+void TaskPool::WaitUntilIdle()
+{
+	std::unique_lock<std::mutex> lock(m_lock);
+	m_idle.wait(lock, [this] { return m_queued == 0 && m_running == 0; });
+}
+
+void TaskPool::WorkerLoop(int index)
+{
+	for (;;)
+	{
+		// Claim one of the queued tasks before looking for it, so every
+		// worker that wakes is sure to find one
+		{
+			std::unique_lock<std::mutex> lock(m_lock);
+			m_wake.wait(lock, [this] { return m_shutdown || m_queued > 0; });
+			if (m_shutdown)
+			{
+				return;
+			}
+			--m_queued;
+			++m_running;
+		}
+		RunClaimed(index);
+	}
+}
+
+bool TaskPool::RunPending(int worker)
+{
+	// Taken under the lock along with its claim, so a worker that has
+	// claimed a task but not yet found it still finds one
+	Task task;
+	{
+		std::lock_guard<std::mutex> lock(m_lock);
+		if (m_queued == 0 || !TakeTask(worker, &task, true))
+		{
+			return false;
+		}
+		--m_queued;
+		++m_running;
+	}
+	Run(worker, task);
+	return true;
+}
+
+void TaskPool::RunClaimed(int index)
+{
+	// Other workers may take the tasks we look at first, but as many
+	// tasks as were claimed are still there somewhere
+	Task task;
+	while (!TakeTask(index, &task, false))
+	{
+		std::this_thread::yield();
+	}
+	Run(index, task);
+}
+
+void TaskPool::Run(int index, Task& task)
+{
+	task(index);
+
+	bool idle;
+	{
+		std::lock_guard<std::mutex> lock(m_lock);
+		--m_running;
+		idle = m_queued == 0 && m_running == 0;
+	}
+	if (idle)
+	{
+		m_idle.notify_all();
+	}
+}
+
+bool TaskPool::TakeTask(int index, Task* task, bool spawnedOnly)
+{
+	{
+		auto& own = *m_workers[index];
+		std::lock_guard<std::mutex> lock(own.Lock);
+		if (!own.Tasks.empty())
+		{
+			*task = std::move(own.Tasks.back());
+			own.Tasks.pop_back();
+			return true;
+		}
+	}
+
+	if (!spawnedOnly)
+	{
+		std::lock_guard<std::mutex> lock(m_lock);
+		if (!m_submitted.empty())
+		{
+			auto highest = m_submitted.begin();
+			*task = std::move(highest->second.front());
+			highest->second.pop_front();
+			if (highest->second.empty())
+			{
+				m_submitted.erase(highest);
+			}
+			return true;
+		}
+	}
+
+	const int count = static_cast<int>(m_workers.size());
+	for (int i = 1; i < count; ++i)
+	{
+		auto& victim = *m_workers[(index + i) % count];
+		std::lock_guard<std::mutex> lock(victim.Lock);
+		if (!victim.Tasks.empty())
+		{
+			*task = std::move(victim.Tasks.front());
+			victim.Tasks.pop_front();
+			return true;
+		}
+	}
+	return false;
+}
+
+void TaskGroup::Spawn(int worker, TaskPool::Task task)
+{
+	++m_pending;
+	auto counted = [this, task](int w)
+	{
+		task(w);
+
+		// Under the lock, so the group can't be gone before it's let go
+		std::lock_guard<std::mutex> lock(m_lock);
+		if (--m_pending == 0)
+		{
+			m_done.notify_all();
+		}
+	};
+
+	if (worker >= 0)
+	{
+		m_pool.Spawn(worker, counted);
+	}
+	else
+	{
+		m_pool.Submit(counted);
+	}
+}
+
+void TaskGroup::Wait(int worker)
+{
+	if (worker < 0)
+	{
+		std::unique_lock<std::mutex> lock(m_lock);
+		m_done.wait(lock, [this] { return m_pending == 0; });
+		return;
+	}
+
+	while (m_pending > 0)
+	{
+		if (!m_pool.RunPending(worker))
+		{
+			std::this_thread::yield();
+		}
+	}
+
+	// The last task may still hold the lock
+	std::lock_guard<std::mutex> lock(m_lock);
+}
@@ -0,0 +1,126 @@
+#pragma once
+
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// A fixed set of worker threads that tasks are multiplexed onto, so many
+// pieces of work can be under way without a thread for each.
+//
+// Tasks submitted from outside wait in one queue, highest priority first
+// and in order of submission within a priority.  Tasks a worker spawns go
+// on its own deque: it runs the newest of those first, and a worker with
+// nothing to do takes the oldest from another's, which tends to be the
+// largest piece of work left.  Tasks aren't preempted, so a high priority
+// task waits for a worker to finish what it's doing.
+class TaskPool
+{
+public:
+	// Each task is given the index of the worker running it, from 0
+	typedef std::function<void(int worker)> Task;
+
+	// 0 for one thread per core
+	explicit TaskPool(int threads);
+
+	// Waits for the running tasks, and drops the ones not started
+	~TaskPool();
+
+	TaskPool(const TaskPool&) = delete;
+	TaskPool& operator=(const TaskPool&) = delete;
+
+	void Submit(Task task, int priority = 0);
+
+	// From a task, onto the deque of the worker running it
+	void Spawn(int worker, Task task);
+
+	// Blocks until every task submitted or spawned so far has run
+	void WaitUntilIdle();
+
+	int ThreadCount() const
+	{
+		return static_cast<int>(m_workers.size());
+	}
+
+	// Tasks waiting for a worker
+	size_t Queued() const
+	{
+		return m_queued;
+	}
+
+	// Fewer tasks are waiting than there are workers, so one spawned now
+	// would likely be picked up straight away.  Recursive work splits only
+	// while this is so, and runs on by itself otherwise.
+	bool NeedsWork() const
+	{
+		return m_queued < m_workers.size();
+	}
+
+	// Runs one waiting spawned task on the worker, if there is one, for a
+	// task that's waiting for others to finish.  Submitted tasks are left
+	// for idle workers: one may be a whole search, which the waiting task
+	// would then be held up behind.
+	bool RunPending(int worker);
+
+private:
+	struct Worker
+	{
+		std::mutex Lock;
+		std::deque<Task> Tasks;
+		std::thread Thread;
+	};
+
+	void WorkerLoop(int index);
+
+	// Runs a task claimed from m_queued
+	void RunClaimed(int index);
+	void Run(int index, Task& task);
+
+	// Own deque first, then the submitted tasks unless spawnedOnly, then the
+	// others' deques.  With spawnedOnly the caller holds m_lock.
+	bool TakeTask(int index, Task* task, bool spawnedOnly);
+
+	std::vector<std::unique_ptr<Worker>> m_workers;
+
+	mutable std::mutex m_lock;
+	std::condition_variable m_wake;
+	std::condition_variable m_idle;
+	std::map<int, std::deque<Task>, std::greater<int>> m_submitted;
+	std::atomic<size_t> m_queued;		// tasks in m_submitted and the workers' deques, changed under m_lock
+	size_t m_running;
+	bool m_shutdown;
+};
+
+// Tasks spawned together, that can be waited for as a group, as in
+// fork-join: spawn the parts of a piece of work, then wait for them all.
+class TaskGroup
+{
+public:
+	explicit TaskGroup(TaskPool& pool)
+		: m_pool(pool)
+		, m_pending(0)
+	{}
+
+	TaskGroup(const TaskGroup&) = delete;
+	TaskGroup& operator=(const TaskGroup&) = delete;
+
+	// Worker is the caller's, onto whose deque the task goes, or -1 from
+	// outside the pool to submit it
+	void Spawn(int worker, TaskPool::Task task);
+
+	// A worker runs waiting spawned tasks, its own group's or any other,
+	// until the group is done, so waiting seldom leaves it idle.  Outside
+	// the pool the caller blocks.  The pool mustn't be destroyed with the group waiting.
+	void Wait(int worker);
+
+private:
+	TaskPool& m_pool;
+	std::atomic<int> m_pending;
+	std::mutex m_lock;
+	std::condition_variable m_done;
+};
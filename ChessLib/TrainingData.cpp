@@ -0,0 +1,427 @@
+#include "stdafx.h"
+#include "TrainingData.h"
+#include <algorithm>
+#include <climits>
+#include <cstdio>
+#include <fstream>
+#include <memory>
+#include <random>
+#include <thread>
+
+namespace
+{
+	const char TrainingMagic[4] = { 'C', 'L', 'T', 'Z' };
+	const unsigned TrainingVersion = 1;
+
+	// Zero runs and literal runs are each up to 128 bytes, told apart by the
+	// top bit of the byte in front of them
+	const int MaxRun = 128;
+
+	void EncodeBlock(const TrainingPosition* positions, size_t count, std::vector<unsigned char>& encoded)
+	{
+		std::vector<unsigned char> delta(count * sizeof(TrainingPosition));
+		const auto bytes = reinterpret_cast<const unsigned char*>(positions);
+		for (size_t i = 0; i < delta.size(); ++i)
+		{
+			delta[i] = i < sizeof(TrainingPosition) ? bytes[i] : bytes[i] ^ bytes[i - sizeof(TrainingPosition)];
+		}
+
+		encoded.clear();
+		size_t i = 0;
+		while (i < delta.size())
+		{
+			size_t run = 0;
+			while (i + run < delta.size() && delta[i + run] == 0 && run < MaxRun)
+			{
+				++run;
+			}
+			if (run > 0)
+			{
+				encoded.push_back(static_cast<unsigned char>(0x80 | (run - 1)));
+				i += run;
+				continue;
+			}
+
+			// Literals up to the next pair of zeros, a lone zero is cheaper left in
+			while (i + run < delta.size() && run < MaxRun
+				&& !(delta[i + run] == 0 && (i + run + 1 == delta.size() || delta[i + run + 1] == 0)))
+			{
+				++run;
+			}
+			encoded.push_back(static_cast<unsigned char>(run - 1));
+			encoded.insert(encoded.end(), delta.begin() + i, delta.begin() + i + run);
+			i += run;
+		}
+	}
+
+	bool DecodeBlock(const std::vector<unsigned char>& encoded, std::vector<TrainingPosition>& positions)
+	{
+		const size_t size = positions.size() * sizeof(TrainingPosition);
+		const auto bytes = reinterpret_cast<unsigned char*>(positions.data());
+
+		size_t out = 0;
+		size_t in = 0;
+		while (in < encoded.size())
+		{
+			const unsigned char control = encoded[in++];
+			const size_t run = (control & 0x7f) + 1;
+			if (out + run > size)
+			{
+				return false;
+			}
+			if (control & 0x80)
+			{
+				memset(bytes + out, 0, run);
+			}
+			else
+			{
+				if (in + run > encoded.size())
+				{
+					return false;
+				}
+				memcpy(bytes + out, &encoded[in], run);
+				in += run;
+			}
+			out += run;
+		}
+		if (out != size)
+		{
+			return false;
+		}
+
+		for (size_t i = sizeof(TrainingPosition); i < size; ++i)
+		{
+			bytes[i] ^= bytes[i - sizeof(TrainingPosition)];
+		}
+		return true;
+	}
+
+	unsigned long long CountRecords(const char* path)
+	{
+		std::ifstream input(path, std::ios::binary);
+		TrainingStreamReader reader(input);
+		std::vector<TrainingPosition> chunk(4096);
+		unsigned long long count = 0;
+		for (size_t read; (read = reader.Read(chunk.data(), chunk.size())) > 0;)
+		{
+			count += read;
+		}
+		return count;
+	}
+}
+
+TrainingPosition TrainingPosition::FromBoard(const BoardState& board, int score, int ply)
+{
+	TrainingPosition position;
+	memcpy(position.Board, board.PackedBoard(), sizeof(position.Board));
+	position.Flags = static_cast<byte>((board.NextSide() == SideType::Black ? 1 : 0) | (board.CastlingState() << 1));
+	position.EnPassant = static_cast<signed char>(board.EnPassantColumn());
+
+	const int centipawns = score / 10;
+	position.Score = static_cast<short>(centipawns > MaxScore ? MaxScore : centipawns < -MaxScore ? -MaxScore : centipawns);
+
+	position.Result = 0;
+	position.HalfmoveClock = static_cast<byte>(board.HalfmoveClock());
+	position.Ply = static_cast<unsigned short>(ply);
+	return position;
+}
+
+BoardState TrainingPosition::ToBoard() const
+{
+	return BoardState::FromPacked(Board, NextSide(), static_cast<byte>((Flags >> 1) & 0x3f), EnPassant, HalfmoveClock);
+}
+
+TrainingWriter::TrainingWriter(std::ostream& output, size_t bufferedRecords, TrainingCompression compression)
+	: m_output(output)
+	, m_bufferedRecords(bufferedRecords ? bufferedRecords : 1)
+	, m_compression(compression)
+	, m_count(0)
+{
+	m_buffer.reserve(m_bufferedRecords);
+
+	if (m_compression == TrainingCompression::Block)
+	{
+		TrainingFileHeader header;
+		memcpy(header.Magic, TrainingMagic, sizeof(header.Magic));
+		header.Version = TrainingVersion;
+		header.RecordSize = sizeof(TrainingPosition);
+		header.BlockRecords = static_cast<unsigned>(m_bufferedRecords);
+		m_output.write(reinterpret_cast<const char*>(&header), sizeof(header));
+	}
+}
+
+TrainingWriter::~TrainingWriter()
+{
+	Flush();
+}
+
+void TrainingWriter::Write(const TrainingPosition& position)
+{
+	m_buffer.push_back(position);
+	++m_count;
+	if (m_buffer.size() >= m_bufferedRecords)
+	{
+		Flush();
+	}
+}
+
+void TrainingWriter::Write(const TrainingPosition* positions, size_t count)
+{
+	for (size_t i = 0; i < count; ++i)
+	{
+		Write(positions[i]);
+	}
+}
+
+bool TrainingWriter::Flush()
+{
+	if (!m_buffer.empty() && m_compression == TrainingCompression::Block)
+	{
+		EncodeBlock(m_buffer.data(), m_buffer.size(), m_encoded);
+
+		TrainingBlockHeader block;
+		block.Records = static_cast<unsigned>(m_buffer.size());
+		block.EncodedSize = static_cast<unsigned>(m_encoded.size());
+		m_output.write(reinterpret_cast<const char*>(&block), sizeof(block));
+		m_output.write(reinterpret_cast<const char*>(m_encoded.data()), m_encoded.size());
+		m_buffer.clear();
+	}
+	else if (!m_buffer.empty())
+	{
+		m_output.write(reinterpret_cast<const char*>(m_buffer.data()), m_buffer.size() * sizeof(TrainingPosition));
+		m_buffer.clear();
+	}
+	m_output.flush();
+	return !m_output.fail();
+}
+
+bool TrainingReader::Open(const char* path)
+{
+	if (!m_file.Open(path))
+	{
+		return false;
+	}
+
+	// Compressed files can only be streamed
+	if (m_file.Size() % sizeof(TrainingPosition) != 0
+		|| (m_file.Size() >= sizeof(TrainingMagic) && memcmp(m_file.Data(), TrainingMagic, sizeof(TrainingMagic)) == 0))
+	{
+		m_file.Close();
+		return false;
+	}
+	return true;
+}
+
+TrainingStreamReader::TrainingStreamReader(std::istream& input)
+	: m_input(input)
+	, m_compression(TrainingCompression::None)
+	, m_next(0)
+{
+	// Plain files have no header, so put back whatever was read if it isn't one
+	const auto start = m_input.tellg();
+	TrainingFileHeader header;
+	if (m_input.read(reinterpret_cast<char*>(&header), sizeof(header))
+		&& memcmp(header.Magic, TrainingMagic, sizeof(header.Magic)) == 0
+		&& header.RecordSize == sizeof(TrainingPosition))
+	{
+		m_compression = TrainingCompression::Block;
+	}
+	else
+	{
+		m_input.clear();
+		m_input.seekg(start);
+	}
+}
+
+size_t TrainingStreamReader::Read(TrainingPosition* positions, size_t count)
+{
+	if (m_compression == TrainingCompression::None)
+	{
+		m_input.read(reinterpret_cast<char*>(positions), count * sizeof(TrainingPosition));
+		return static_cast<size_t>(m_input.gcount()) / sizeof(TrainingPosition);
+	}
+
+	size_t read = 0;
+	while (read < count)
+	{
+		if (m_next == m_block.size() && !ReadBlock())
+		{
+			break;
+		}
+		const size_t take = std::min(count - read, m_block.size() - m_next);
+		std::copy(m_block.begin() + m_next, m_block.begin() + m_next + take, positions + read);
+		m_next += take;
+		read += take;
+	}
+	return read;
+}
+
+bool TrainingStreamReader::ReadBlock()
+{
+	TrainingBlockHeader block;
+	if (!m_input.read(reinterpret_cast<char*>(&block), sizeof(block)) || block.Records == 0)
+	{
+		return false;
+	}
+
+	m_encoded.resize(block.EncodedSize);
+	if (!m_input.read(reinterpret_cast<char*>(m_encoded.data()), m_encoded.size()))
+	{
+		return false;
+	}
+
+	m_block.resize(block.Records);
+	m_next = 0;
+	if (!DecodeBlock(m_encoded, m_block))
+	{
+		m_block.clear();
+		return false;
+	}
+	return true;
+}
+
+bool ShardTrainingFile(const char* input, const std::vector<std::string>& outputs, unsigned seed, TrainingCompression compression)
+{
+	std::ifstream in(input, std::ios::binary);
+	if (!in || outputs.empty())
+	{
+		return false;
+	}
+
+	std::vector<std::unique_ptr<std::ofstream>> files;
+	std::vector<std::unique_ptr<TrainingWriter>> writers;
+	for (auto& name : outputs)
+	{
+		files.push_back(std::make_unique<std::ofstream>(name, std::ios::binary));
+		if (!*files.back())
+		{
+			return false;
+		}
+		writers.push_back(std::make_unique<TrainingWriter>(*files.back(), 4096, compression));
+	}
+
+	std::mt19937 random(seed);
+	std::uniform_int_distribution<size_t> pick(0, outputs.size() - 1);
+
+	TrainingStreamReader reader(in);
+	std::vector<TrainingPosition> chunk(4096);
+	for (size_t read; (read = reader.Read(chunk.data(), chunk.size())) > 0;)
+	{
+		for (size_t i = 0; i < read; ++i)
+		{
+			writers[pick(random)]->Write(chunk[i]);
+		}
+	}
+
+	bool ok = true;
+	for (auto& writer : writers)
+	{
+		ok = writer->Flush() && ok;
+	}
+	return ok;
+}
+
+bool ShuffleTrainingFile(const char* input, const char* output, unsigned seed, size_t memoryRecords, TrainingCompression compression)
+{
+	std::mt19937 random(seed);
+
+	// Too big to hold at once: split it at random into pieces that will fit
+	// (with room to spare, as the split isn't exactly even)
+	std::vector<std::string> pieces;
+	const auto count = CountRecords(input);
+	if (count > memoryRecords)
+	{
+		const size_t shards = static_cast<size_t>(2 * count / (memoryRecords ? memoryRecords : 1) + 1);
+		for (size_t i = 0; i < shards; ++i)
+		{
+			pieces.push_back(std::string(output) + ".shard" + std::to_string(i));
+		}
+		if (!ShardTrainingFile(input, pieces, random()))
+		{
+			return false;
+		}
+	}
+	else
+	{
+		pieces.push_back(input);
+	}
+
+	std::ofstream out(output, std::ios::binary);
+	if (!out)
+	{
+		return false;
+	}
+	TrainingWriter writer(out, 4096, compression);
+
+	std::vector<TrainingPosition> records;
+	std::vector<TrainingPosition> chunk(4096);
+	for (auto& piece : pieces)
+	{
+		{
+			std::ifstream in(piece, std::ios::binary);
+			TrainingStreamReader reader(in);
+			records.clear();
+			for (size_t read; (read = reader.Read(chunk.data(), chunk.size())) > 0;)
+			{
+				records.insert(records.end(), chunk.begin(), chunk.begin() + read);
+			}
+		}
+		if (pieces.size() > 1)
+		{
+			std::remove(piece.c_str());
+		}
+
+		std::shuffle(records.begin(), records.end(), random);
+		writer.Write(records.data(), records.size());
+	}
+	return writer.Flush();
+}
+
+bool ForEachTrainingBatch(const char* path, int threads, size_t batchSize, unsigned long long maxPositions, const TrainingBatchWork& work, const std::function<void()>& batchDone)
+{
+	std::ifstream input(path, std::ios::binary);
+	if (!input)
+	{
+		return false;
+	}
+	TrainingStreamReader reader(input);
+
+	if (threads < 1) threads = 1;
+	if (batchSize < 1) batchSize = 1;
+	unsigned long long remaining = maxPositions > 0 ? maxPositions : ULLONG_MAX;
+	auto read = [&](std::vector<TrainingPosition>& batch)
+	{
+		const size_t count = reader.Read(batch.data(), static_cast<size_t>(std::min<unsigned long long>(batchSize, remaining)));
+		remaining -= count;
+		return count;
+	};
+
+	std::vector<TrainingPosition> batch(batchSize);
+	std::vector<TrainingPosition> next(batchSize);
+	size_t count = read(batch);
+	while (count > 0)
+	{
+		const size_t share = (count + threads - 1) / threads;
+		std::vector<std::thread> workers;
+		for (int i = 0; i < threads && i * share < count; ++i)
+		{
+			const size_t first = i * share;
+			const size_t length = std::min(share, count - first);
+			workers.emplace_back([&, i, first, length]()
+			{
+				work(i, batch.data() + first, length);
+			});
+		}
+
+		const size_t nextCount = read(next);
+		for (auto& worker : workers)
+		{
+			worker.join();
+		}
+		batchDone();
+
+		batch.swap(next);
+		count = nextCount;
+	}
+	return true;
+}
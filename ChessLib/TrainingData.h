@@ -0,0 +1,172 @@
+#pragma once
+
+#include "BoardState.h"
+#include "MappedFile.h"
+#include <functional>
+#include <istream>
+#include <ostream>
+#include <string>
+#include <vector>
+
+// One labelled position for training the evaluation, 40 bytes on disk.  A
+// plain file of them is just the records back to back in the machine's
+// (little endian) byte order, so the nth record is at n * 40 and the file
+// can be mapped and indexed directly.
+//
+// Files can also be block compressed: a TrainingFileHeader, then blocks of
+// records, each XORed with the record before it (consecutive positions of a
+// game differ in a few bytes) and then with runs of zero bytes packed.
+// Those can only be read in order, with TrainingStreamReader.
+struct TrainingPosition
+{
+	unsigned char Board[32];	// BoardState's nibble board
+	byte Flags;					// bit 0: Black to move, bits 1-6: BoardState::CastlingState
+	signed char EnPassant;		// column, or -1
+	short Score;				// search score from White's side, in centipawns
+	signed char Result;			// from White's side: 1 won, 0 drawn, -1 lost
+	byte HalfmoveClock;
+	unsigned short Ply;			// since the start of the game
+
+	static const short MaxScore = 32000;
+
+	// Score is in the engine's units (GetBoardScore); anything past MaxScore
+	// centipawns, mates included, is clamped to it
+	static TrainingPosition FromBoard(const BoardState& board, int score, int ply);
+
+	BoardState ToBoard() const;
+
+	SideType NextSide() const
+	{
+		return (Flags & 1) ? SideType::Black : SideType::White;
+	}
+};
+
+static_assert(sizeof(TrainingPosition) == 40, "TrainingPosition is written to disk as is");
+
+enum class TrainingCompression
+{
+	None,
+	Block
+};
+
+struct TrainingFileHeader
+{
+	char Magic[4];				// "CLTZ"
+	unsigned Version;
+	unsigned RecordSize;
+	unsigned BlockRecords;		// most records in one block
+};
+
+// Each block starts with this, followed by EncodedSize bytes
+struct TrainingBlockHeader
+{
+	unsigned Records;
+	unsigned EncodedSize;
+};
+
+// Collects records and writes them out in large blocks, compressed if asked
+class TrainingWriter
+{
+public:
+	explicit TrainingWriter(std::ostream& output, size_t bufferedRecords = 4096, TrainingCompression compression = TrainingCompression::None);
+	~TrainingWriter();
+
+	TrainingWriter(const TrainingWriter&) = delete;
+	TrainingWriter& operator=(const TrainingWriter&) = delete;
+
+	void Write(const TrainingPosition& position);
+	void Write(const TrainingPosition* positions, size_t count);
+
+	// False once the stream has failed
+	bool Flush();
+
+	unsigned long long Count() const
+	{
+		return m_count;
+	}
+
+private:
+	std::ostream& m_output;
+	std::vector<TrainingPosition> m_buffer;
+	std::vector<unsigned char> m_encoded;
+	size_t m_bufferedRecords;
+	TrainingCompression m_compression;
+	unsigned long long m_count;
+};
+
+// Random access to a plain (uncompressed) file through a memory mapping, so
+// any number of threads can read it without it being loaded
+class TrainingReader
+{
+public:
+	bool Open(const char* path);
+
+	size_t Count() const
+	{
+		return m_file.Size() / sizeof(TrainingPosition);
+	}
+
+	const TrainingPosition& operator[](size_t index) const
+	{
+		return begin()[index];
+	}
+
+	const TrainingPosition* begin() const
+	{
+		return reinterpret_cast<const TrainingPosition*>(m_file.Data());
+	}
+
+	const TrainingPosition* end() const
+	{
+		return begin() + Count();
+	}
+
+private:
+	MappedFile m_file;
+};
+
+// Reads plain or compressed files from start to end
+class TrainingStreamReader
+{
+public:
+	explicit TrainingStreamReader(std::istream& input);
+
+	// Fills up to count records, returning how many; 0 at the end or on bad data
+	size_t Read(TrainingPosition* positions, size_t count);
+
+	bool Read(TrainingPosition& position)
+	{
+		return Read(&position, 1) == 1;
+	}
+
+	bool IsCompressed() const
+	{
+		return m_compression == TrainingCompression::Block;
+	}
+
+private:
+	bool ReadBlock();
+
+	std::istream& m_input;
+	TrainingCompression m_compression;
+	std::vector<TrainingPosition> m_block;
+	std::vector<unsigned char> m_encoded;
+	size_t m_next;
+};
+
+// Sends each record of the input to one of the outputs at random, so the
+// shards are of about the same size and each is a fair sample of the input
+bool ShardTrainingFile(const char* input, const std::vector<std::string>& outputs, unsigned seed, TrainingCompression compression = TrainingCompression::None);
+
+// Shuffles the records of a file.  Up to memoryRecords it's done in memory;
+// bigger files are sharded into temporary files next to the output first,
+// and each of those shuffled in turn.
+bool ShuffleTrainingFile(const char* input, const char* output, unsigned seed, size_t memoryRecords = 1 << 24, TrainingCompression compression = TrainingCompression::None);
+
+// Reads a file a batch at a time and splits each batch between threads,
+// reading the next batch while they work on it.  work(thread, positions,
+// count) is called on the threads, batchDone() on the caller's once they
+// have all finished, so it can use what they worked out.  maxPositions
+// limits how much of the file is read, 0 for all of it.
+typedef std::function<void(int, const TrainingPosition*, size_t)> TrainingBatchWork;
+bool ForEachTrainingBatch(const char* path, int threads, size_t batchSize, unsigned long long maxPositions, const TrainingBatchWork& work, const std::function<void()>& batchDone);
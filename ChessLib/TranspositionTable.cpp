@@ -0,0 +1,141 @@
+#include "stdafx.h"
+#include "TranspositionTable.h"
+#include <new>
+
+// Layout of a slot's data word:
+//   bits  0-31  score
+//   bits 32-37  from square
+//   bits 38-43  to square
+//   bit     44  has a move
+//   bits 45-52  depth
+//   bits 53-54  bound
+//   bits 56-62  generation
+
+TranspositionTable::TranspositionTable(size_t megabytes)
+	: m_slots(nullptr)
+	, m_slotCount(0)
+	, m_bucketMask(0)
+	, m_generation(0)
+{
+	Resize(megabytes);
+}
+
+void TranspositionTable::Resize(size_t megabytes)
+{
+	// Round down to a power of two number of buckets so a mask picks one
+	const size_t bytes = (megabytes ? megabytes : 1) * 1024 * 1024;
+	size_t buckets = 1;
+	while (buckets * 2 * BucketSize * sizeof(Slot) <= bytes)
+	{
+		buckets *= 2;
+	}
+
+	// Zeroed, which is an empty slot.  Without the memory the old table stays.
+	if (!m_memory.Allocate(buckets * BucketSize * sizeof(Slot)))
+	{
+		throw std::bad_alloc();
+	}
+	m_slots = static_cast<Slot*>(m_memory.Data());
+	m_slotCount = buckets * BucketSize;
+	m_bucketMask = buckets - 1;
+	m_generation = 0;
+}
+
+void TranspositionTable::Clear()
+{
+	m_memory.Zero();
+	m_generation = 0;
+}
+
+unsigned long long TranspositionTable::Pack(int score, int depth, Bound bound, ChessMove move, unsigned generation)
+{
+	unsigned long long data = static_cast<unsigned>(score);
+	if (move.IsValid())
+	{
+		data |= static_cast<unsigned long long>(move.From.Raw()) << 32;
+		data |= static_cast<unsigned long long>(move.To.Raw()) << 38;
+		data |= 1ull << 44;
+	}
+	data |= static_cast<unsigned long long>(depth < 0 ? 0 : depth > 255 ? 255 : depth) << 45;
+	data |= static_cast<unsigned long long>(bound) << 53;
+	data |= static_cast<unsigned long long>(generation & GenerationMask) << 56;
+	return data;
+}
+
+bool TranspositionTable::Probe(PositionKey key, TableEntry* entry) const
+{
+	const Slot* bucket = &m_slots[(key & m_bucketMask) * BucketSize];
+	for (int i = 0; i < BucketSize; ++i)
+	{
+		const auto data = bucket[i].Data;
+		if ((bucket[i].KeyXorData ^ data) != key || data == 0)
+		{
+			continue;
+		}
+
+		entry->Score = static_cast<int>(static_cast<unsigned>(data));
+		entry->Depth = Depth(data);
+		entry->Type = static_cast<Bound>((data >> 53) & 0x3);
+		entry->Move = InvalidChessMove;
+		if (data & (1ull << 44))
+		{
+			entry->Move.From = BoardLocation(static_cast<byte>((data >> 32) & 0x3f));
+			entry->Move.To = BoardLocation(static_cast<byte>((data >> 38) & 0x3f));
+		}
+		return true;
+	}
+	return false;
+}
+
+void TranspositionTable::Store(PositionKey key, int score, int depth, Bound bound, ChessMove move)
+{
+	Slot* bucket = &m_slots[(key & m_bucketMask) * BucketSize];
+
+	// Take the slot already holding this position, otherwise the one that's
+	// least worth keeping: shallow entries left over from old searches first
+	Slot* victim = nullptr;
+	int victimWorth = 0;
+	for (int i = 0; i < BucketSize; ++i)
+	{
+		const auto data = bucket[i].Data;
+		if ((bucket[i].KeyXorData ^ data) == key && data != 0)
+		{
+			victim = &bucket[i];
+
+			// Keep the best move we know about if this result didn't find one
+			if (!move.IsValid() && (data & (1ull << 44)))
+			{
+				move.From = BoardLocation(static_cast<byte>((data >> 32) & 0x3f));
+				move.To = BoardLocation(static_cast<byte>((data >> 38) & 0x3f));
+			}
+			break;
+		}
+
+		const int age = (m_generation - Generation(data)) & GenerationMask;
+		const int worth = data == 0 ? -1000 : Depth(data) - 8 * age;
+		if (!victim || worth < victimWorth)
+		{
+			victim = &bucket[i];
+			victimWorth = worth;
+		}
+	}
+
+	const auto data = Pack(score, depth, bound, move, m_generation);
+	victim->Data = data;
+	victim->KeyXorData = key ^ data;
+}
+
+int TranspositionTable::Hashfull() const
+{
+	const size_t sample = m_slotCount < 1000 ? m_slotCount : 1000;
+	int used = 0;
+	for (size_t i = 0; i < sample; ++i)
+	{
+		const auto data = m_slots[i].Data;
+		if (data != 0 && Generation(data) == m_generation)
+		{
+			++used;
+		}
+	}
+	return static_cast<int>(used * 1000 / sample);
+}
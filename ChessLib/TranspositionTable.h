@@ -0,0 +1,119 @@
+#pragma once
+
+#include "BoardState.h"
+#include "LargePages.h"
+#include <atomic>
+
+// Prefetching is only a hint, so where there's no way to give it (ARM
+// builds with MSVC) it does nothing
+#if defined(_M_IX86) || defined(_M_X64) || defined(__i386__) || defined(__x86_64__)
+#include <xmmintrin.h>
+#define TT_PREFETCH(address) _mm_prefetch(reinterpret_cast<const char*>(address), _MM_HINT_T0)
+#elif defined(__GNUC__)
+#define TT_PREFETCH(address) __builtin_prefetch(address)
+#else
+#define TT_PREFETCH(address) ((void)(address))
+#endif
+
+enum class Bound : byte
+{
+	None,
+	Upper,	// the score is at most this, every move failed low
+	Lower,	// the score is at least this, a move failed high
+	Exact
+};
+
+struct TableEntry
+{
+	int Score;
+	int Depth;
+	Bound Type;
+	ChessMove Move;
+};
+
+// Hash table of search results keyed by Zobrist key, shared by all the
+// search threads without locking.  Each slot stores its key XORed with its
+// data, so a slot torn by two threads writing at once doesn't match any key
+// and is just treated as a miss.
+//
+// The slots live in a LargePageBuffer, as probes land all over the table.
+class TranspositionTable
+{
+public:
+	explicit TranspositionTable(size_t megabytes = 16);
+
+	TranspositionTable(const TranspositionTable&) = delete;
+	TranspositionTable& operator=(const TranspositionTable&) = delete;
+
+	// Drops everything stored so far.  Throws std::bad_alloc if there isn't
+	// the memory, leaving the table as it was.
+	void Resize(size_t megabytes);
+	void Clear();
+
+	// Entries from earlier searches are replaced first.  A table shared by
+	// searches running at once is aged by its owner, not by each search.
+	void NewSearch()
+	{
+		m_generation = (m_generation + 1) & GenerationMask;
+	}
+
+	bool Probe(PositionKey key, TableEntry* entry) const;
+
+	// Starts loading the key's bucket into the cache, for a probe that
+	// comes a little later.  The search calls it as soon as a move is made,
+	// so the load overlaps with the work done before the child's probe.
+	void Prefetch(PositionKey key) const
+	{
+		TT_PREFETCH(&m_slots[(key & m_bucketMask) * BucketSize]);
+	}
+	void Store(PositionKey key, int score, int depth, Bound bound, ChessMove move);
+
+	// Permille of the table used by the current search, sampled like UCI's hashfull
+	int Hashfull() const;
+
+	size_t SizeInMegabytes() const
+	{
+		return m_slotCount * sizeof(Slot) / (1024 * 1024);
+	}
+
+	// Of the pages holding the table, in bytes, and what kind they are, as
+	// LargePageBuffer has them
+	size_t PageSize() const
+	{
+		return m_memory.PageSize();
+	}
+
+	const char* PageKind() const
+	{
+		return m_memory.PageKind();
+	}
+
+	// Four 16 byte slots, a cache line, which the table's page aligned
+	// memory keeps each bucket within
+	static const int BucketSize = 4;
+
+private:
+	struct Slot
+	{
+		unsigned long long KeyXorData;
+		unsigned long long Data;
+	};
+
+	static const unsigned GenerationMask = 0x7f;
+
+	static unsigned long long Pack(int score, int depth, Bound bound, ChessMove move, unsigned generation);
+	static unsigned Generation(unsigned long long data)
+	{
+		return static_cast<unsigned>(data >> 56) & GenerationMask;
+	}
+	static int Depth(unsigned long long data)
+	{
+		return static_cast<int>((data >> 45) & 0xff);
+	}
+
+	LargePageBuffer m_memory;
+	Slot* m_slots;
+	size_t m_slotCount;
+	size_t m_bucketMask;
+	std::atomic<unsigned> m_generation;
+};
@@ -0,0 +1,326 @@
+#include "stdafx.h"
+#include "Tuner.h"
+#include <algorithm>
+#include <cmath>
+#include <thread>
+
+namespace
+{
+	const double Ln10 = 2.302585092994046;
+
+	// Scores are in tenths of a centipawn, hence 4000 rather than 400
+	double Predict(double score, double scale)
+	{
+		return 1 / (1 + std::exp(-scale * score * Ln10 / 4000));
+	}
+
+	// The values of K FitScale tries
+	const double ScaleStep = 0.05;
+	const int ScaleSteps = 60;
+
+	// Adam's defaults
+	const double Beta1 = 0.9;
+	const double Beta2 = 0.999;
+	const double Epsilon = 1e-8;
+}
+
+// One thread's share of each batch, and what it adds up over an epoch
+struct TexelTuner::Worker
+{
+	Worker()
+		: Error(0)
+		, Count(0)
+		, BatchCount(0)
+	{}
+
+	// The positions as sparse rows: position i has Features[Rows[i]] up to
+	// Features[Rows[i + 1]]
+	std::vector<EvalWeights::Feature> Features;
+	std::vector<size_t> Rows;
+	std::vector<double> Scores;
+	std::vector<double> Factors;
+	std::vector<EvalWeights::Feature> PositionFeatures;
+
+	std::vector<double> Gradient;
+	std::vector<double> ScaleErrors;
+	double Error;
+	unsigned long long Count;
+	unsigned long long BatchCount;
+
+	void Build(const TrainingPosition* positions, size_t count)
+	{
+		Features.clear();
+		Rows.resize(count + 1);
+		for (size_t i = 0; i < count; ++i)
+		{
+			Rows[i] = Features.size();
+			const auto board = positions[i].ToBoard();
+			EvalWeights::GetFeatures(board, static_cast<int>(board.ValidMoves().size()), PositionFeatures);
+			Features.insert(Features.end(), PositionFeatures.begin(), PositionFeatures.end());
+		}
+		Rows[count] = Features.size();
+	}
+
+	// Kings are left out, both sides always having one
+	void Score(const std::vector<double>& weights)
+	{
+		const size_t count = Rows.size() - 1;
+		Scores.resize(count);
+		for (size_t i = 0; i < count; ++i)
+		{
+			double score = 0;
+			for (size_t j = Rows[i]; j < Rows[i + 1]; ++j)
+			{
+				score += weights[Features[j].Index] * Features[j].Value;
+			}
+			Scores[i] = score;
+		}
+	}
+};
+
+TexelTuner::TexelTuner(const TunerOptions& options)
+	: m_options(options)
+{
+}
+
+bool TexelTuner::Tune(const char* path, EvalWeights& weights)
+{
+	const double scale = m_options.Scale > 0 ? m_options.Scale : FitScale(path, weights);
+	if (scale <= 0)
+	{
+		return false;
+	}
+
+	const int size = weights.Size();
+	std::vector<double> values(size);
+	std::vector<double> moment(size);
+	std::vector<double> velocity(size);
+	for (int i = 0; i < size; ++i)
+	{
+		values[i] = weights[i];
+	}
+
+	std::vector<Worker> workers(ThreadCount());
+	for (auto& worker : workers)
+	{
+		worker.Gradient.assign(size, 0);
+	}
+
+	int step = 0;
+	for (int epoch = 1; epoch <= m_options.Epochs; ++epoch)
+	{
+		for (auto& worker : workers)
+		{
+			worker.Error = 0;
+			worker.Count = 0;
+		}
+
+		auto work = [&](Worker& worker, const TrainingPosition* positions, size_t count)
+		{
+			worker.Build(positions, count);
+			worker.Score(values);
+
+			// d(error)/d(score) for each position, then spread over its features
+			worker.Factors.resize(count);
+			for (size_t i = 0; i < count; ++i)
+			{
+				const double p = Predict(worker.Scores[i], scale);
+				const double difference = p - Target(positions[i], scale);
+				worker.Error += difference * difference;
+				worker.Factors[i] = 2 * difference * p * (1 - p) * scale * Ln10 / 4000;
+			}
+			for (size_t i = 0; i < count; ++i)
+			{
+				for (size_t j = worker.Rows[i]; j < worker.Rows[i + 1]; ++j)
+				{
+					worker.Gradient[worker.Features[j].Index] += worker.Factors[i] * worker.Features[j].Value;
+				}
+			}
+			worker.Count += count;
+			worker.BatchCount += count;
+		};
+
+		auto update = [&]()
+		{
+			++step;
+			unsigned long long batchCount = 0;
+			for (auto& worker : workers)
+			{
+				batchCount += worker.BatchCount;
+				worker.BatchCount = 0;
+			}
+
+			const double correction1 = 1 - std::pow(Beta1, step);
+			const double correction2 = 1 - std::pow(Beta2, step);
+			for (int i = 0; i < size; ++i)
+			{
+				double gradient = 0;
+				for (auto& worker : workers)
+				{
+					gradient += worker.Gradient[i];
+					worker.Gradient[i] = 0;
+				}
+				gradient /= batchCount;
+
+				moment[i] = Beta1 * moment[i] + (1 - Beta1) * gradient;
+				velocity[i] = Beta2 * velocity[i] + (1 - Beta2) * gradient * gradient;
+				values[i] -= m_options.LearningRate * (moment[i] / correction1) / (std::sqrt(velocity[i] / correction2) + Epsilon);
+			}
+		};
+
+		if (!ForEachBatch(path, workers, work, update))
+		{
+			return false;
+		}
+
+		TunerProgress progress;
+		progress.Epoch = epoch;
+		progress.Positions = 0;
+		progress.Error = 0;
+		progress.Scale = scale;
+		for (auto& worker : workers)
+		{
+			progress.Positions += worker.Count;
+			progress.Error += worker.Error;
+		}
+		if (progress.Positions == 0)
+		{
+			return false;
+		}
+		progress.Error /= progress.Positions;
+
+		for (int i = 0; i < size; ++i)
+		{
+			weights[i] = static_cast<int>(std::floor(values[i] + 0.5));
+		}
+		if (m_progressCallback)
+		{
+			m_progressCallback(progress);
+		}
+	}
+	return true;
+}
+
+double TexelTuner::FitScale(const char* path, const EvalWeights& weights)
+{
+	std::vector<double> values(weights.Size());
+	for (int i = 0; i < weights.Size(); ++i)
+	{
+		values[i] = weights[i];
+	}
+
+	// Every candidate is tried on each position, so one pass is enough
+	std::vector<Worker> workers(ThreadCount());
+	for (auto& worker : workers)
+	{
+		worker.ScaleErrors.assign(ScaleSteps, 0);
+	}
+
+	auto work = [&](Worker& worker, const TrainingPosition* positions, size_t count)
+	{
+		worker.Build(positions, count);
+		worker.Score(values);
+		for (size_t i = 0; i < count; ++i)
+		{
+			for (int k = 0; k < ScaleSteps; ++k)
+			{
+				const double scale = (k + 1) * ScaleStep;
+				const double difference = Predict(worker.Scores[i], scale) - Target(positions[i], scale);
+				worker.ScaleErrors[k] += difference * difference;
+			}
+		}
+		worker.Count += count;
+	};
+
+	if (!ForEachBatch(path, workers, work, [](){}))
+	{
+		return 0;
+	}
+
+	int best = -1;
+	double bestError = 0;
+	for (int k = 0; k < ScaleSteps; ++k)
+	{
+		double error = 0;
+		unsigned long long count = 0;
+		for (auto& worker : workers)
+		{
+			error += worker.ScaleErrors[k];
+			count += worker.Count;
+		}
+		if (count > 0 && (best < 0 || error < bestError))
+		{
+			best = k;
+			bestError = error;
+		}
+	}
+	return best < 0 ? 0 : (best + 1) * ScaleStep;
+}
+
+double TexelTuner::Error(const char* path, const EvalWeights& weights, double scale)
+{
+	std::vector<double> values(weights.Size());
+	for (int i = 0; i < weights.Size(); ++i)
+	{
+		values[i] = weights[i];
+	}
+
+	std::vector<Worker> workers(ThreadCount());
+	auto work = [&](Worker& worker, const TrainingPosition* positions, size_t count)
+	{
+		worker.Build(positions, count);
+		worker.Score(values);
+		for (size_t i = 0; i < count; ++i)
+		{
+			const double difference = Predict(worker.Scores[i], scale) - Target(positions[i], scale);
+			worker.Error += difference * difference;
+		}
+		worker.Count += count;
+	};
+
+	if (!ForEachBatch(path, workers, work, [](){}))
+	{
+		return 0;
+	}
+
+	double error = 0;
+	unsigned long long count = 0;
+	for (auto& worker : workers)
+	{
+		error += worker.Error;
+		count += worker.Count;
+	}
+	return count > 0 ? error / count : 0;
+}
+
+bool TexelTuner::ForEachBatch(const char* path, std::vector<Worker>& workers, BatchWork work, const std::function<void()>& batchDone)
+{
+	return ForEachTrainingBatch(path, static_cast<int>(workers.size()), m_options.BatchSize, m_options.MaxPositions,
+		[&](int thread, const TrainingPosition* positions, size_t count)
+		{
+			work(workers[thread], positions, count);
+		},
+		batchDone);
+}
+
+int TexelTuner::ThreadCount() const
+{
+	int threads = m_options.Threads;
+	if (threads <= 0)
+	{
+		threads = static_cast<int>(std::thread::hardware_concurrency());
+	}
+	return threads > 0 ? threads : 1;
+}
+
+// What the prediction is measured against: the game's result, blended with
+// the score the search gave the position if ResultWeight is below 1
+double TexelTuner::Target(const TrainingPosition& position, double scale) const
+{
+	const double result = (position.Result + 1) / 2.;
+	if (m_options.ResultWeight >= 1)
+	{
+		return result;
+	}
+	return m_options.ResultWeight * result + (1 - m_options.ResultWeight) * Predict(position.Score * 10., scale);
+}
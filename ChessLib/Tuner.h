@@ -0,0 +1,83 @@
+#pragma once
+
+#include "Evaluation.h"
+#include "TrainingData.h"
+#include <functional>
+#include <vector>
+
+struct TunerOptions
+{
+	TunerOptions()
+		: Threads(0)
+		, Epochs(10)
+		, BatchSize(16384)
+		, LearningRate(1.0)
+		, Scale(0)
+		, ResultWeight(1.0)
+		, MaxPositions(0)
+	{}
+
+	int Threads;				// 0 for one per core
+	int Epochs;					// passes over the file
+	int BatchSize;				// positions per step
+	double LearningRate;		// about the most a weight moves in one step
+	double Scale;				// K, see TexelTuner; 0 to fit it before tuning
+	double ResultWeight;		// how much the target is the game's result rather than its recorded score
+	unsigned long long MaxPositions;	// read from the start of the file, 0 for all of it
+};
+
+// After each epoch, with the error measured while it ran
+struct TunerProgress
+{
+	int Epoch;
+	unsigned long long Positions;
+	double Error;
+	double Scale;
+};
+
+// Fits EvalWeights to game results, as in Texel's tuning method.  The
+// evaluation s (from White's side) predicts White's result as
+//
+//     p = 1 / (1 + 10 ^ (-K * s / 4000))
+//
+// and the weights are moved by gradient descent (Adam) to bring the mean
+// squared difference between p and the result down.
+//
+// The file is read a batch at a time, once per epoch, so it can be as large
+// as the disk allows.  Each batch is split across the threads, which turn
+// their share into sparse feature rows and work out the gradient from those,
+// while the next batch is read.
+class TexelTuner
+{
+public:
+	explicit TexelTuner(const TunerOptions& options);
+
+	typedef std::function<void(const TunerProgress&)> ProgressCallback;
+
+	void SetProgressCallback(ProgressCallback callback)
+	{
+		m_progressCallback = callback;
+	}
+
+	// Tunes the weights in place; false if the file can't be read
+	bool Tune(const char* path, EvalWeights& weights);
+
+	// The K that best fits the weights as they are, which is worth doing
+	// once before tuning so the weights don't have to make up for it
+	double FitScale(const char* path, const EvalWeights& weights);
+
+	// Mean squared error of the weights' predictions over the file
+	double Error(const char* path, const EvalWeights& weights, double scale);
+
+private:
+	struct Worker;
+
+	typedef std::function<void(Worker&, const TrainingPosition*, size_t)> BatchWork;
+	bool ForEachBatch(const char* path, std::vector<Worker>& workers, BatchWork work, const std::function<void()>& batchDone);
+
+	int ThreadCount() const;
+	double Target(const TrainingPosition& position, double scale) const;
+
+	TunerOptions m_options;
+	ProgressCallback m_progressCallback;
+};
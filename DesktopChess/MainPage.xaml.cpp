@@ -26,10 +26,15 @@ using namespace Windows::UI::Xaml::Shapes;
 // The Blank Page item template is documented at http://go.microsoft.com/fwlink/?LinkId=234238
 
 MainPage::MainPage()
-	: m_selected(InvalidBoardLocation)
+	: m_gameAi(std::make_unique<GameAi>())
+	, m_ponderMove(InvalidChessMove)
+	, m_ponderHit(false)
+	, m_selected(InvalidBoardLocation)
 {
 	InitializeComponent();
 
+	m_history.Push(m_boardState.Key());
+
 	SetupBoard();
 }
 
@@ -82,22 +87,23 @@ void MainPage::ResetSquareColors()
 	}
 }
 
+static const wchar_t* pieceStrings[] =
+{
+	L"",
+	L"\u265F",
+	L"\u265D",
+	L"\u265E",
+	L"\u265C",
+	L"\u265B",
+	L"\u265A"
+};
+
 void MainPage::ArrangePieces()
 {
 	SolidColorBrush^ pieceBrushes[] {
 		CreateColoredBrush(255, 255, 255),
 		CreateColoredBrush(0, 0, 0)
 	};
-	static const wchar_t* pieceStrings[] =
-	{
-		L"",
-		L"\u265F",
-		L"\u265D",
-		L"\u265E",
-		L"\u265C",
-		L"\u265B",
-		L"\u265A"
-	};
 	
 
 	for (int x = 0; x < 8; ++x)
@@ -176,7 +182,9 @@ void MainPage::MakeMove(ChessMove move)
 		}
 		else if (from == InvalidBoardLocation)
 		{
-			// Piece is new
+			// Piece is new (a promotion), the text block already moved there
+			auto pieceTb = m_pieceTextBlocks[to.Raw()];
+			pieceTb->Text = ref new Platform::String(pieceStrings[(byte)m_boardState.Get(to).Type]);
 		}
 		else
 		{
@@ -196,11 +204,23 @@ void MainPage::MakeMove(ChessMove move)
 		}
 	});	
 
+	m_history.Push(m_boardState.Key());
+
 	if (m_boardState.IsCheckmate())
 	{
 		auto msg = ref new Windows::UI::Popups::MessageDialog(L"Wow, that's a checkmate!");
 		msg->ShowAsync();
 	}
+	else if (m_history.IsThreefoldRepetition(m_boardState))
+	{
+		auto msg = ref new Windows::UI::Popups::MessageDialog(L"Draw by threefold repetition.");
+		msg->ShowAsync();
+	}
+	else if (m_boardState.IsFiftyMoveDraw())
+	{
+		auto msg = ref new Windows::UI::Popups::MessageDialog(L"Draw by the fifty-move rule.");
+		msg->ShowAsync();
+	}
 }
 
 void MainPage::OnTapped(Platform::Object ^sender, Windows::UI::Xaml::Input::TappedRoutedEventArgs ^e)
@@ -215,6 +235,7 @@ void MainPage::OnTapped(Platform::Object ^sender, Windows::UI::Xaml::Input::Tapp
 
 	if (m_boardState.CanMove(m_selected, tappedLoc))
 	{
+		OnOpponentMove({ m_selected, tappedLoc });
 		MakeMove({ m_selected, tappedLoc });
 		m_selected = InvalidBoardLocation;
 	}
@@ -245,10 +266,19 @@ void MainPage::OnTapped(Platform::Object ^sender, Windows::UI::Xaml::Input::Tapp
 }
 
 
+// The same GameAi is kept for the whole game, so what it learned searching
+// earlier moves (and pondering) is still in its transposition table
 void DesktopChess::MainPage::Button_Click(Platform::Object^ sender, Windows::UI::Xaml::RoutedEventArgs^ e)
 {
-	m_gameAi = std::make_unique<GameAi>();
-	m_gameAi->StartDecideMove(m_boardState);
+	// Asked to move for the side we were pondering for
+	OnOpponentMove(InvalidChessMove);
+
+	// After a ponder hit the search for this position is already running
+	if (!m_ponderHit)
+	{
+		m_gameAi->StartDecideMove(m_boardState, m_history);
+	}
+	m_ponderHit = false;
 
 	if (m_aiTimer)
 	{
@@ -268,12 +298,63 @@ void DesktopChess::MainPage::OnTick(Platform::Object ^sender, Platform::Object ^
 	if (m_gameAi->IsFinished())
 	{
 		
-		this->MoveInfoText->Text = MakeString(L"Time: %0.3f", m_gameAi->GetElapsedTime() / 1000.);
+		// The line the computer expects, e.g. "e2e4 e7e5 g1f3"
+		std::wstring line;
+		for (auto move : m_gameAi->GetPrincipalVariation())
+		{
+			const auto text = move.From.ToString() + move.To.ToString();
+			line += (line.empty() ? L"" : L" ") + std::wstring(text.begin(), text.end());
+		}
+		this->MoveInfoText->Text = MakeString(L"Time: %0.3f  Line: ", m_gameAi->GetElapsedTime() / 1000.) + ref new Platform::String(line.c_str());
 
 		MakeMove(m_gameAi->GetMove());
 		
-		m_gameAi = nullptr;
 		m_aiTimer->Stop();
 		m_aiTimer = nullptr;
+
+		StartPondering();
+	}
+}
+
+// Search the position after the reply we expect.  The search stops at its
+// usual depth and waits there for the player's move.
+void DesktopChess::MainPage::StartPondering()
+{
+	m_ponderMove = m_gameAi->GetPonderMove();
+	if (!m_ponderMove.IsValid())
+	{
+		return;
+	}
+
+	auto board = m_boardState;
+	auto history = m_history;
+	board.Move(m_ponderMove.From, m_ponderMove.To, true);
+	history.Push(board.Key());
+
+	SearchLimits limits;
+	limits.Depth = 3;
+	limits.Ponder = true;
+	m_gameAi->StartSearch(board, history, limits);
+}
+
+// On a hit the ponder search simply carries on as the real one, otherwise
+// it's stopped; either way the table keeps what it found
+void DesktopChess::MainPage::OnOpponentMove(ChessMove move)
+{
+	if (!m_ponderMove.IsValid())
+	{
+		return;
+	}
+
+	if (move.IsValid() && move.From == m_ponderMove.From && move.To == m_ponderMove.To)
+	{
+		m_gameAi->PonderHit();
+		m_ponderHit = true;
+	}
+	else
+	{
+		m_gameAi->Stop();
+		m_gameAi->WaitUntilFinished();
 	}
+	m_ponderMove = InvalidChessMove;
 }
@@ -25,9 +25,12 @@ namespace DesktopChess
 		void ResetSquareColors();
 		void ArrangePieces();
 		void MakeMove(ChessMove move);
+		void StartPondering();
+		void OnOpponentMove(ChessMove move);
 
 	private:
 		BoardState m_boardState;
+		PositionHistory m_history;
 		void OnTapped(Platform::Object ^sender, Windows::UI::Xaml::Input::TappedRoutedEventArgs ^e);
 
 		Windows::UI::Xaml::Shapes::Rectangle^ m_squares[64];
@@ -36,6 +39,10 @@ namespace DesktopChess
 		Windows::UI::Xaml::DispatcherTimer^ m_aiTimer;
 		std::unique_ptr<GameAi> m_gameAi;
 
+		// While the player thinks, the AI searches the reply it expects
+		ChessMove m_ponderMove;
+		bool m_ponderHit;
+
 		BoardLocation m_selected;
 		void Button_Click(Platform::Object^ sender, Windows::UI::Xaml::RoutedEventArgs^ e);
 		void OnTick(Platform::Object ^sender, Platform::Object ^args);
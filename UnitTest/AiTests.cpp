@@ -1,7 +1,12 @@
 #include "stdafx.h"
 #include "CppUnitTest.h"
+#include "AnalysisPool.h"
 #include "BoardState.h"
 #include "GameAi.h"
+#include "TaskPool.h"
+#include "TestHelpers.h"
+#include <mutex>
+#include <new>
 
 using namespace Microsoft::VisualStudio::CppUnitTestFramework;
 
@@ -106,7 +111,492 @@ namespace UnitTest
 			Assert::AreEqual(BoardLocation("h8"), m1.To);
 			Assert::AreEqual(BoardLocation("h6"), m1.From);
 		}
-		
 
+		TEST_METHOD(RepetitionIsADraw)
+		{
+			BoardState b(
+				"k       "
+				"        "
+				"        "
+				"    n   "
+				"       Q"
+				"        "
+				"        "
+				" N     K"
+				, SideType::Black);
+
+			// Shuffle the knights back and forth once, so Nc6 would repeat
+			PositionHistory history;
+			history.Push(b.Key());
+			Assert::IsTrue(b.Move("e5", "c6"));
+			history.Push(b.Key());
+			Assert::IsTrue(b.Move("b1", "c3"));
+			history.Push(b.Key());
+			Assert::IsTrue(b.Move("c6", "e5"));
+			history.Push(b.Key());
+			Assert::IsTrue(b.Move("c3", "b1"));
+			history.Push(b.Key());
+
+			GameAi ai;
+			ai.SetHistory(history);
+			int score = 0;
+			auto move = ai.DecideMoveImpl(b, 0, &score);
+
+			// Down a queen, Black takes the draw
+			Assert::AreEqual(0, score);
+			Assert::AreEqual(BoardLocation("e5"), move.From);
+			Assert::AreEqual(BoardLocation("c6"), move.To);
+		}
+
+		TEST_METHOD(SearchReportsEachDepth)
+		{
+			BoardState b;
+			std::vector<int> depths;
+
+			GameAi ai;
+			ai.SetInfoCallback([&](const SearchInfo& info)
+			{
+				// Called on the search thread, so just note what came back
+				depths.push_back(info.BestMove.IsValid() ? info.Depth : -1);
+			});
+
+			SearchLimits limits;
+			limits.Depth = 3;
+			PositionHistory history;
+			ai.StartSearch(b, history, limits);
+			ai.WaitUntilFinished();
+
+			Assert::IsTrue(ai.GetMove().IsValid());
+			Assert::AreEqual(3, static_cast<int>(depths.size()));
+			Assert::AreEqual(3, depths.back());
+			Assert::IsTrue(ai.GetNodes() > 0);
+		}
+
+		TEST_METHOD(SearchStopsWhenAsked)
+		{
+			BoardState b;
+
+			GameAi ai;
+			ai.SetThreads(2);
+			SearchLimits limits;
+			limits.Infinite = true;
+			PositionHistory history;
+			ai.StartSearch(b, history, limits);
+
+			::Sleep(50);
+			Assert::IsFalse(ai.IsFinished());
+
+			ai.Stop();
+			ai.WaitUntilFinished();
+			Assert::IsTrue(ai.GetMove().IsValid());
+		}
+
+		TEST_METHOD(TranspositionTableKeepsEntries)
+		{
+			TranspositionTable table(1);
+			BoardState b;
+			ChessMove move = { BoardLocation("e2"), BoardLocation("e4") };
+
+			TableEntry entry;
+			Assert::IsFalse(table.Probe(b.Key(), &entry));
+
+			table.Store(b.Key(), -1234, 5, Bound::Lower, move);
+			Assert::IsTrue(table.Probe(b.Key(), &entry));
+			Assert::AreEqual(-1234, entry.Score);
+			Assert::AreEqual(5, entry.Depth);
+			Assert::IsTrue(entry.Type == Bound::Lower);
+			Assert::AreEqual(move.From, entry.Move.From);
+			Assert::AreEqual(move.To, entry.Move.To);
+
+			// A result without a move keeps the one we had
+			table.Store(b.Key(), 10, 6, Bound::Upper, InvalidChessMove);
+			Assert::IsTrue(table.Probe(b.Key(), &entry));
+			Assert::AreEqual(move.To, entry.Move.To);
+			Assert::IsTrue(table.Hashfull() >= 0);
+
+			table.Clear();
+			Assert::IsFalse(table.Probe(b.Key(), &entry));
+
+			// Big enough to be cleared by several threads, whatever the pages
+			TranspositionTable big(128);
+			Assert::IsTrue(big.PageSize() >= 4096);
+			big.Store(b.Key(), 1, 1, Bound::Exact, move);
+			big.Clear();
+			Assert::IsFalse(big.Probe(b.Key(), &entry));
+
+			// Asking for far more memory than there is leaves the table as it was.
+			// A 32-bit process may get the gigabyte asked for there.
+			big.Store(b.Key(), 7, 3, Bound::Exact, move);
+			bool failed = false;
+			try
+			{
+				big.Resize(static_cast<size_t>(1) << (sizeof(size_t) * 8 - 22));
+			}
+			catch (const std::bad_alloc&)
+			{
+				failed = true;
+			}
+			Assert::IsTrue(failed || sizeof(size_t) < 8);
+			if (failed)
+			{
+				Assert::AreEqual(static_cast<size_t>(128), big.SizeInMegabytes());
+				Assert::IsTrue(big.Probe(b.Key(), &entry));
+				Assert::AreEqual(7, entry.Score);
+			}
+		}
+
+		TEST_METHOD(EvalCacheKeepsScores)
+		{
+			EvalCache cache(1);
+			BoardState b;
+			int score = 1;
+			Assert::IsFalse(cache.Probe(b.Key(), &score));
+
+			// Zero is a score like any other
+			cache.Store(b.Key(), 0);
+			Assert::IsTrue(cache.Probe(b.Key(), &score));
+			Assert::AreEqual(0, score);
+			cache.Store(b.Key(), -4321);
+			Assert::IsTrue(cache.Probe(b.Key(), &score));
+			Assert::AreEqual(-4321, score);
+
+			cache.Clear();
+			Assert::IsFalse(cache.Probe(b.Key(), &score));
+		}
+
+		TEST_METHOD(SearchUsesEvalCache)
+		{
+			const auto b = BoardState::FromFen("r1bqkb1r/pppp1ppp/2n2n2/4p3/2B1P3/5N2/PPPP1PPP/RNBQK2R w KQkq - 4 4");
+			SearchLimits limits;
+			limits.Depth = 4;
+
+			GameAi ai;
+			int score = 0;
+			ai.DecideMove(b, PositionHistory(), limits, &score);
+			Assert::IsTrue(ai.GetEvalCacheMisses() > 0);
+
+			// With the transposition table dropped, a second search reaches
+			// the same leaves and finds them in the cache
+			ai.SetHashSize(1);
+			int again = 0;
+			ai.DecideMove(b, PositionHistory(), limits, &again);
+			Assert::IsTrue(ai.GetEvalCacheHits() > 0);
+			Assert::AreEqual(score, again);
+			Assert::AreEqual(ai.GetBoardScore(b), ai.GetBoardScore(b));
+		}
+
+		TEST_METHOD(SelectiveSearchPrunes)
+		{
+			const auto b = BoardState::FromFen("r2q1rk1/pp2bppp/2n1pn2/3p4/3P4/2NBPN2/PP3PPP/R2Q1RK1 w - - 0 10");
+			SearchLimits limits;
+			limits.Depth = 4;
+
+			SearchOptions off;
+			off.NullMove = false;
+			off.LateMoveReductions = false;
+			off.Futility = false;
+			off.ReverseFutility = false;
+			off.CheckExtensions = false;
+
+			GameAi full;
+			full.SetSearchOptions(off);
+			int score = 0;
+			full.DecideMove(b, PositionHistory(), limits, &score);
+
+			// Extensions add nodes rather than saving them
+			SearchOptions pruning;
+			pruning.CheckExtensions = false;
+			GameAi selective;
+			selective.SetSearchOptions(pruning);
+			selective.DecideMove(b, PositionHistory(), limits, &score);
+			Assert::IsTrue(selective.GetNodes() < full.GetNodes());
+		}
+
+		TEST_METHOD(SelectiveSearchKeepsMates)
+		{
+			// Morphy's mate in two, 1. Ra6, which starts with a quiet move that
+			// reductions and pruning mustn't lose
+			const auto b = BoardState::FromFen("kbK5/pp6/1P6/8/8/8/8/R7 w - - 0 1");
+			SearchLimits limits;
+			limits.Depth = 4;
+
+			bool SearchOptions::* techniques[] = {
+				&SearchOptions::NullMove, &SearchOptions::LateMoveReductions, &SearchOptions::Futility,
+				&SearchOptions::ReverseFutility, &SearchOptions::CheckExtensions };
+			for (auto technique : techniques)
+			{
+				// Each on its own, then all together
+				SearchOptions options;
+				options.NullMove = options.LateMoveReductions = options.Futility = options.ReverseFutility = options.CheckExtensions = false;
+				options.*technique = true;
+
+				for (int all = 0; all < 2; ++all)
+				{
+					GameAi ai;
+					ai.SetSearchOptions(all ? SearchOptions() : options);
+					int score = 0;
+					const auto move = ai.DecideMove(b, PositionHistory(), limits, &score);
+					Assert::IsTrue(score >= WinThreshold);
+					Assert::AreEqual(BoardLocation("a1"), move.From);
+					Assert::AreEqual(BoardLocation("a6"), move.To);
+				}
+			}
+		}
+
+		TEST_METHOD(SearchReportsLine)
+		{
+			const auto b = BoardState::FromFen("r1bqkb1r/pppp1ppp/2n2n2/4p3/2B1P3/5N2/PPPP1PPP/RNBQK2R w KQkq - 4 4");
+			std::vector<SearchInfo> infos;
+
+			GameAi ai;
+			ai.SetInfoCallback([&](const SearchInfo& info)
+			{
+				infos.push_back(info);
+			});
+
+			SearchLimits limits;
+			limits.Depth = 5;
+			PositionHistory history;
+			ai.StartSearch(b, history, limits);
+			ai.WaitUntilFinished();
+
+			// Each iteration's line starts with its best move and can be played out
+			Assert::AreEqual(5, static_cast<int>(infos.size()));
+			for (auto& info : infos)
+			{
+				Assert::IsTrue(!info.Pv.empty() && static_cast<int>(info.Pv.size()) <= info.Depth);
+				Assert::AreEqual(info.BestMove.From, info.Pv[0].From);
+				Assert::AreEqual(info.BestMove.To, info.Pv[0].To);
+
+				auto board = b;
+				for (auto move : info.Pv)
+				{
+					Assert::IsTrue(board.Move(move.From, move.To));
+				}
+			}
+
+			const auto line = ai.GetPrincipalVariation();
+			Assert::IsTrue(line.size() >= 2);
+			Assert::AreEqual(ai.GetMove().To, line[0].To);
+			Assert::AreEqual(line[1].To, ai.GetPonderMove().To);
+		}
+
+		TEST_METHOD(MultiPvFindsBestMoves)
+		{
+			// Taking the queen, then the rook, then the knight
+			const auto b = BoardState::FromFen("4k3/8/8/3q1r2/4P1n1/5P2/8/4K3 w - - 0 1");
+			std::vector<SearchInfo> infos;
+
+			GameAi ai;
+			ai.SetMultiPv(3);
+			ai.SetInfoCallback([&](const SearchInfo& info)
+			{
+				infos.push_back(info);
+			});
+
+			SearchLimits limits;
+			limits.Depth = 4;
+			PositionHistory history;
+			ai.StartSearch(b, history, limits);
+			ai.WaitUntilFinished();
+
+			// Every line of every iteration is reported as it's found
+			Assert::AreEqual(12, static_cast<int>(infos.size()));
+			for (size_t i = 0; i < infos.size(); ++i)
+			{
+				Assert::AreEqual(static_cast<int>(i % 3) + 1, infos[i].MultiPv);
+				Assert::AreEqual(infos[i].BestMove.To, infos[i].Pv[0].To);
+			}
+
+			const auto lines = ai.GetLines();
+			Assert::AreEqual(3, static_cast<int>(lines.size()));
+			Assert::AreEqual(BoardLocation("d5"), lines[0].BestMove.To);
+			Assert::AreEqual(BoardLocation("f5"), lines[1].BestMove.To);
+			Assert::AreEqual(BoardLocation("g4"), lines[2].BestMove.To);
+			Assert::IsTrue(lines[0].Score > lines[1].Score && lines[1].Score > lines[2].Score);
+			Assert::AreEqual(lines[0].BestMove.To, ai.GetMove().To);
+			Assert::AreEqual(lines[0].Score, ai.GetScore());
+		}
+
+		TEST_METHOD(PonderWaitsForHit)
+		{
+			BoardState b;
+
+			GameAi ai;
+			SearchLimits limits;
+			limits.Depth = 2;
+			limits.Ponder = true;
+			PositionHistory history;
+			ai.StartSearch(b, history, limits);
+
+			// Done with depth 2, but still waiting to hear what the opponent played
+			::Sleep(200);
+			Assert::IsFalse(ai.IsFinished());
+
+			ai.PonderHit();
+			ai.WaitUntilFinished();
+			Assert::IsTrue(ai.GetMove().IsValid());
+
+			// The expected reply comes from the table and is legal after our move
+			auto ponder = ai.GetPonderMove();
+			Assert::IsTrue(ponder.IsValid());
+			auto next = b;
+			Assert::IsTrue(next.Move(ai.GetMove().From, ai.GetMove().To));
+			Assert::IsTrue(next.Move(ponder.From, ponder.To));
+		}
+
+		TEST_METHOD(RootSplitSearch)
+		{
+			TaskPool pool(3);
+			SearchLimits limits;
+			limits.Depth = 4;
+
+			// The same moves are found with the root's moves split across workers
+			const char* fens[] = { "4k3/8/8/3q1r2/4P1n1/5P2/8/4K3 w - - 0 1", "kbK5/pp6/1P6/8/8/8/8/R7 w - - 0 1" };
+			const char* expected[] = { "d5", "a6" };
+			for (int i = 0; i < 2; ++i)
+			{
+				GameAi ai;
+				ai.SetTaskPool(&pool);
+				int score = 0;
+				const auto move = ai.DecideMove(BoardState::FromFen(fens[i]), PositionHistory(), limits, &score);
+				Assert::AreEqual(BoardLocation(expected[i]), move.To);
+				Assert::AreEqual(move.To, ai.GetPrincipalVariation()[0].To);
+			}
+
+			// And a node budget still holds with the main thread waiting
+			GameAi ai;
+			ai.SetTaskPool(&pool);
+			limits.Depth = MaxSearchDepth;
+			limits.Nodes = 5000;
+			int score = 0;
+			ai.DecideMove(BoardState(), PositionHistory(), limits, &score);
+			Assert::IsTrue(ai.GetNodes() < 10000);
+		}
+
+		TEST_METHOD(SearchArenaIsReused)
+		{
+			// Released memory is handed out again, and a shrunk allocation
+			// gives its end back
+			SearchArena arena(1024);
+			const auto mark = arena.GetMark();
+			void* first = arena.Allocate(100);
+			arena.Release(mark);
+			Assert::IsTrue(first == arena.Allocate(100));
+			const MoveList moves(arena, BoardState());
+			Assert::AreEqual(static_cast<size_t>(20), moves.size());
+			Assert::IsTrue(static_cast<ChessMove*>(arena.Allocate(16)) < moves.begin() + BoardState::MaxMoves);
+			Assert::AreEqual(1ull, arena.HeapAllocations());
+
+			// Once the arenas have grown, searching again takes nothing more from
+			// the heap for them, and with the threads and the root's bookkeeping
+			// kept as well, the search takes nothing at all
+			GameAi ai;
+			SearchLimits limits;
+			limits.Depth = 5;
+			int score = 0;
+			const auto board = BoardState::FromFen("r1bqkb1r/pppp1ppp/2n2n2/4p3/2B1P3/5N2/PPPP1PPP/RNBQK2R w KQkq - 4 4");
+			ai.DecideMove(board, PositionHistory(), limits, &score);
+			const auto heapAllocations = ai.GetArenaHeapAllocations();
+			Assert::IsTrue(heapAllocations > 0);
+
+			ai.ClearHash();
+			const auto before = HeapAllocations();
+			ai.DecideMove(board, PositionHistory(), limits, &score);
+			const auto allocations = HeapAllocations() - before;
+			Assert::AreEqual(heapAllocations, ai.GetArenaHeapAllocations());
+			Assert::IsTrue(ai.GetArenaBytes() > ai.GetNodes());
+			Assert::AreEqual(0ull, allocations);
+		}
+
+		TEST_METHOD(AnalysisPoolReportsEachPosition)
+		{
+			const char* fens[] = {
+				"rnbqkbnr/pppppppp/8/8/8/8/PPPPPPPP/RNBQKBNR w KQkq - 0 1",
+				"4k3/8/8/3q1r2/4P1n1/5P2/8/4K3 w - - 0 1",
+				"kbK5/pp6/1P6/8/8/8/8/R7 w - - 0 1",
+				"r1bqkb1r/pppp1ppp/2n2n2/4p3/2B1P3/5N2/PPPP1PPP/RNBQK2R w KQkq - 4 4",
+			};
+			AnalysisRequest request;
+			for (auto fen : fens)
+			{
+				request.Positions.push_back(BoardState::FromFen(fen));
+			}
+			request.Limits.Depth = 3;
+			request.MultiPv = 2;
+
+			std::mutex lock;
+			std::vector<AnalysisResult> results;
+			AnalysisPool pool(2, 1, 1);
+			const int id = pool.Submit(request, [&](const AnalysisResult& result)
+			{
+				std::lock_guard<std::mutex> guard(lock);
+				results.push_back(result);
+			});
+			pool.WaitUntilIdle();
+
+			// Once each, in any order, with the last one marked
+			Assert::AreEqual(4, static_cast<int>(results.size()));
+			int seen = 0;
+			for (size_t i = 0; i < results.size(); ++i)
+			{
+				auto& result = results[i];
+				Assert::AreEqual(id, result.Request);
+				Assert::AreEqual(i + 1 == results.size(), result.Last);
+				Assert::IsFalse(result.Cancelled);
+				seen |= 1 << result.Index;
+
+				Assert::IsTrue(request.Positions[result.Index].CanMove(result.BestMove.From, result.BestMove.To));
+				Assert::AreEqual(2, static_cast<int>(result.Lines.size()));
+				Assert::AreEqual(result.BestMove.To, result.Lines[0].BestMove.To);
+			}
+			Assert::AreEqual(15, seen);
+
+			// The queen is taken, and the mate found
+			for (auto& result : results)
+			{
+				if (result.Index == 1) Assert::AreEqual(BoardLocation("d5"), result.BestMove.To);
+				if (result.Index == 2) Assert::AreEqual(BoardLocation("a6"), result.BestMove.To);
+			}
+		}
+
+		TEST_METHOD(AnalysisPoolIsolatesAndCancels)
+		{
+			AnalysisPool pool(2, 1, 1);
+			std::mutex lock;
+			std::vector<AnalysisResult> results;
+			auto collect = [&](const AnalysisResult& result)
+			{
+				std::lock_guard<std::mutex> guard(lock);
+				results.push_back(result);
+			};
+
+			// With tables of their own, the same search comes out the same
+			// whatever was searched before it
+			AnalysisRequest request;
+			request.Positions.push_back(BoardState());
+			request.Limits.Depth = 3;
+			request.SharedTable = false;
+			pool.Submit(request, collect);
+			pool.WaitUntilIdle();
+			pool.Submit(request, collect);
+			pool.WaitUntilIdle();
+			Assert::AreEqual(2, static_cast<int>(results.size()));
+			Assert::AreEqual(results[0].Nodes, results[1].Nodes);
+			Assert::AreEqual(results[0].Score, results[1].Score);
+
+			// A cancelled request still reports every position, straight away
+			results.clear();
+			request.Positions.assign(6, BoardState());
+			request.Limits.Depth = MaxSearchDepth;
+			const int id = pool.Submit(request, collect);
+			pool.Cancel(id);
+			pool.WaitUntilIdle();
+			Assert::AreEqual(6, static_cast<int>(results.size()));
+			for (auto& result : results)
+			{
+				Assert::IsTrue(result.Cancelled);
+			}
+		}
 	};
-}
\ No newline at end of file
+}
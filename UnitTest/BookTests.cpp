@@ -0,0 +1,142 @@
+#include "stdafx.h"
+#include "CppUnitTest.h"
+#include "BoardState.h"
+#include "OpeningBook.h"
+#include "TestHelpers.h"
+#include <fstream>
+#include <sstream>
+
+using namespace Microsoft::VisualStudio::CppUnitTestFramework;
+
+namespace UnitTest
+{
+	const char* TestGames =
+		"[Event \"Test\"]\n"
+		"[Result \"1-0\"]\n"
+		"\n"
+		"1. e4 e5 2. Nf3 {a comment} Nc6 (2... d6 3. d4) 3. Bb5 $1 a6 1-0\n"
+		"\n"
+		"[Result \"0-1\"]\n"
+		"1. e4 c5 2. Nf3 d6 0-1\n"
+		"\n"
+		"[Result \"1/2-1/2\"]\n"
+		"1. d4 d5 2. c4 e6 1/2-1/2\n";
+
+	TEST_CLASS(BookTests)
+	{
+	public:
+
+		TEST_METHOD(ReadPgn)
+		{
+			std::istringstream in(TestGames);
+			PgnGame game;
+
+			Assert::IsTrue(ReadPgnGame(in, game));
+			Assert::AreEqual(std::string("Test"), game.Tags["Event"]);
+			Assert::AreEqual(std::string("1-0"), game.Result);
+			Assert::AreEqual(6, static_cast<int>(game.Moves.size()));
+			Assert::AreEqual(std::string("Bb5"), game.Moves[4]);
+
+			Assert::IsTrue(ReadPgnGame(in, game));
+			Assert::AreEqual(std::string("0-1"), game.Result);
+			Assert::IsTrue(ReadPgnGame(in, game));
+			Assert::IsFalse(ReadPgnGame(in, game));
+		}
+
+		// Keys from the Polyglot format's own examples
+		TEST_METHOD(PolyglotKeys)
+		{
+			BoardState b;
+			Assert::AreEqual(0x463b96181691fc9cull, OpeningBook::Key(b));
+
+			Assert::IsTrue(b.MovePgn("e4"));
+			Assert::AreEqual(0x823c9b50fd114196ull, OpeningBook::Key(b));
+			Assert::IsTrue(b.MovePgn("d5"));
+			Assert::AreEqual(0x0756b94461c50fb0ull, OpeningBook::Key(b));
+			Assert::IsTrue(b.MovePgn("e5"));
+			Assert::AreEqual(0x662fafb965db29d4ull, OpeningBook::Key(b));
+
+			// En passant is possible, so counts
+			Assert::IsTrue(b.MovePgn("f5"));
+			Assert::AreEqual(0x22a48b5a8e47ff78ull, OpeningBook::Key(b));
+
+			// Castling rights go
+			Assert::IsTrue(b.MovePgn("Ke2"));
+			Assert::AreEqual(0x652a607ca3f242c1ull, OpeningBook::Key(b));
+			Assert::IsTrue(b.MovePgn("Kf7"));
+			Assert::AreEqual(0x00fdd303c946bdd9ull, OpeningBook::Key(b));
+		}
+
+		TEST_METHOD(CastlingMoveEncoding)
+		{
+			BoardState b(
+				"k       "
+				"p       "
+				"        "
+				"        "
+				"        "
+				"        "
+				"        "
+				"R   K  R"
+				, SideType::White);
+
+			ChessMove castle{ BoardLocation("e1"), BoardLocation("g1"), PieceType::Empty };
+			auto encoded = OpeningBook::EncodeMove(b, castle);
+
+			// Polyglot writes e1h1
+			Assert::AreEqual(7 | (4 << 6), static_cast<int>(encoded));
+
+			auto decoded = OpeningBook::DecodeMove(b, encoded);
+			Assert::AreEqual(castle.From, decoded.From);
+			Assert::AreEqual(castle.To, decoded.To);
+		}
+
+		TEST_METHOD(BuildAndProbe)
+		{
+			std::istringstream in(TestGames);
+			OpeningBookBuilder builder;
+			Assert::AreEqual(3, builder.AddPgn(in));
+			TempFile file("BookTests.bin");
+			Assert::IsTrue(builder.Write(file.Path()));
+
+			OpeningBook book;
+			Assert::IsTrue(book.Open(file.Path()));
+
+			BoardState b;
+			auto moves = book.Probe(b);
+			Assert::AreEqual(2, static_cast<int>(moves.size()));
+			Assert::AreEqual(BoardLocation("e2"), moves[0].Move.From);
+			Assert::AreEqual(BoardLocation("e4"), moves[0].Move.To);
+			Assert::AreEqual(2, moves[0].Weight);
+			Assert::AreEqual(BoardLocation("d4"), moves[1].Move.To);
+
+			std::default_random_engine generator;
+			auto best = book.ChooseMove(b, OpeningBook::Selection::Best, generator);
+			Assert::AreEqual(BoardLocation("e4"), best.To);
+
+			// Black lost after 1...e5, so only 1...c5 is in the book
+			Assert::IsTrue(b.MovePgn("e4"));
+			moves = book.Probe(b);
+			Assert::AreEqual(1, static_cast<int>(moves.size()));
+			Assert::AreEqual(BoardLocation("c5"), moves[0].Move.To);
+
+			// Out of book
+			Assert::IsTrue(b.MovePgn("h5"));
+			Assert::IsFalse(book.ChooseMove(b, OpeningBook::Selection::Weighted, generator).IsValid());
+		}
+
+		TEST_METHOD(PartialBookIsRejected)
+		{
+			TempFile file("BookTests.bin");
+			{
+				std::ofstream out(file.Path(), std::ios::binary);
+				out.write("not a whole entry", OpeningBook::EntrySize + 1);
+			}
+
+			OpeningBook book;
+			Assert::IsFalse(book.Open(file.Path()));
+			Assert::IsFalse(book.IsOpen());
+			Assert::IsTrue(book.Probe(BoardState()).empty());
+		}
+	};
+}
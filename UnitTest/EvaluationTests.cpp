@@ -0,0 +1,235 @@
+#include "stdafx.h"
+#include "CppUnitTest.h"
+#include "BoardState.h"
+#include "Evaluation.h"
+#include "GameAi.h"
+#include "TestHelpers.h"
+#include "Tuner.h"
+#include <cstdio>
+#include <fstream>
+#include <random>
+
+using namespace Microsoft::VisualStudio::CppUnitTestFramework;
+
+namespace UnitTest
+{
+	TEST_CLASS(EvaluationTests)
+	{
+	public:
+
+		TEST_METHOD(DefaultsAreMaterialAndMobility)
+		{
+			EvalWeights weights;
+			BoardState b;
+			Assert::AreEqual(20, weights.Evaluate(b, static_cast<int>(b.ValidMoves().size())));
+
+			Assert::IsTrue(b.MovePgn("e4"));
+			Assert::IsTrue(b.MovePgn("d5"));
+			Assert::IsTrue(b.MovePgn("exd5"));
+			// A pawn up but with two on the d file, less Black's moves
+			const int moves = static_cast<int>(b.ValidMoves().size());
+			const int expected = 1000 + weights[EvalWeights::DoubledPawn] - moves;
+			Assert::AreEqual(expected, weights.Evaluate(b, moves));
+
+			GameAi ai;
+			Assert::AreEqual(expected, ai.GetBoardScore(b));
+		}
+
+		TEST_METHOD(PawnStructureTerms)
+		{
+			// White: passed d6 and a4, with a4 and a2 doubled and isolated.
+			// Black: b3 is held back by a2 and c2, and is isolated too.
+			const auto b = BoardState::FromFen("4k3/8/3P4/8/P7/1p6/P1P5/4K3 w - - 0 1");
+			const PawnStructure pawns(b);
+
+			const int passed = EvalWeights::PassedPawn;
+			Assert::AreEqual(1, pawns.Counts[4]);		// sixth rank
+			Assert::AreEqual(1, pawns.Counts[2]);		// fourth rank
+			Assert::AreEqual(2, pawns.Counts[0] + pawns.Counts[1] + pawns.Counts[2] + pawns.Counts[3] + pawns.Counts[4] + pawns.Counts[5]);
+			Assert::AreEqual(1, pawns.Counts[EvalWeights::DoubledPawn - passed]);
+			Assert::AreEqual(2 - 1, pawns.Counts[EvalWeights::IsolatedPawn - passed]);
+			Assert::IsTrue(pawns.Passed[0] == ((1ull << BoardLocation("d6").Raw()) | (1ull << BoardLocation("a4").Raw())));
+			Assert::IsTrue(pawns.Passed[1] == 0);
+
+			// And the same from Black's side
+			const auto mirrored = BoardState::FromFen("4k3/p1p5/1P6/p7/8/3p4/8/4K3 w - - 0 1");
+			const PawnStructure black(mirrored);
+			for (int i = 0; i < EvalWeights::PawnTerms; ++i)
+			{
+				Assert::AreEqual(-pawns.Counts[i], black.Counts[i]);
+			}
+
+			EvalWeights weights;
+			int expected = 0;
+			for (int i = 0; i < EvalWeights::PawnTerms; ++i)
+			{
+				expected += weights[passed + i] * pawns.Counts[i];
+			}
+			Assert::AreEqual(expected, weights.EvaluatePawns(b));
+		}
+
+		TEST_METHOD(PawnKeyAndTable)
+		{
+			// The pawn key follows the pawns and nothing else
+			BoardState b;
+			const auto start = b.PawnKey();
+			Assert::IsTrue(b.MovePgn("Nf3"));
+			Assert::IsTrue(b.PawnKey() == start);
+			Assert::IsTrue(b.MovePgn("e5"));
+			Assert::IsTrue(b.PawnKey() != start);
+			Assert::IsTrue(b.MovePgn("Nxe5"));
+			Assert::IsTrue(b.PawnKey() == BoardState::FromFen(b.ToFen().c_str()).PawnKey());
+
+			EvalWeights weights;
+			PawnTable table;
+			const int moves = static_cast<int>(b.ValidMoves().size());
+			Assert::AreEqual(weights.Evaluate(b, moves), weights.Evaluate(b, moves, &table));
+			Assert::AreEqual(weights.Evaluate(b, moves), weights.Evaluate(b, moves, &table));
+			Assert::IsTrue(table.Misses() == 1);
+			Assert::IsTrue(table.Hits() == 1);
+
+			table.Clear();
+			Assert::IsTrue(table.Hits() == 0);
+			Assert::AreEqual(weights.EvaluatePawns(b), table.Probe(weights, b).Score);
+		}
+
+		TEST_METHOD(FeaturesMatchEvaluate)
+		{
+			EvalWeights weights;
+			std::mt19937 random(3);
+			for (int i = 0; i < weights.Size(); ++i)
+			{
+				weights[i] = static_cast<int>(random() % 2001) - 1000;
+			}
+
+			BoardState b;
+			std::vector<EvalWeights::Feature> features;
+			for (int ply = 0; ply < 30; ++ply)
+			{
+				const auto moves = b.ValidMoves();
+				if (moves.empty())
+				{
+					break;
+				}
+
+				EvalWeights::GetFeatures(b, static_cast<int>(moves.size()), features);
+				int sum = 0;
+				for (auto& f : features)
+				{
+					sum += weights[f.Index] * f.Value;
+				}
+				Assert::AreEqual(weights.Evaluate(b, static_cast<int>(moves.size())), sum);
+
+				const auto& move = moves[random() % moves.size()];
+				b.Move(move.From, move.To, true);
+			}
+		}
+
+		TEST_METHOD(WeightsSaveAndLoad)
+		{
+			const char* path = "weights_test.txt";
+			EvalWeights weights;
+			weights[EvalWeights::Material + 2] = 3210;
+			weights[EvalWeights::PieceSquare + 64 * 5 + 62] = -7;
+			Assert::IsTrue(weights.Save(path));
+
+			EvalWeights loaded;
+			Assert::IsTrue(loaded.Load(path));
+			for (int i = 0; i < weights.Size(); ++i)
+			{
+				Assert::AreEqual(weights[i], loaded[i]);
+			}
+			Assert::AreEqual(std::string("PieceSquare.King.g1"), EvalWeights::Name(EvalWeights::PieceSquare + 64 * 5 + 62));
+
+			{
+				std::ofstream bad(path);
+				bad << "Material.Dragon 5\n";
+			}
+			Assert::IsFalse(loaded.Load(path));
+			std::remove(path);
+		}
+
+		TEST_METHOD(BatchMatchesEvaluate)
+		{
+			std::mt19937 random(3);
+			EvalWeights weights;
+			for (int i = 0; i < weights.Size(); ++i)
+			{
+				weights[i] += static_cast<int>(random() % 201) - 100;
+			}
+
+			// Enough positions that the batch has to grow, and not a whole
+			// number of vectors
+			std::vector<BoardState> boards;
+			std::vector<int> moveCounts;
+			while (boards.size() < 300)
+			{
+				BoardState b;
+				for (int ply = 0; ply < 60 && boards.size() < 300; ++ply)
+				{
+					const auto moves = b.ValidMoves();
+					boards.push_back(b);
+					moveCounts.push_back(static_cast<int>(moves.size()));
+					if (moves.empty())
+					{
+						break;
+					}
+					const auto& move = moves[random() % moves.size()];
+					b.Move(move.From, move.To, true);
+				}
+			}
+
+			EvalBatch batch;
+			for (size_t i = 0; i < boards.size(); ++i)
+			{
+				batch.Add(boards[i], moveCounts[i]);
+			}
+			Assert::AreEqual(boards.size(), batch.Size());
+
+			std::vector<int> scores;
+			batch.Evaluate(weights, scores);
+			Assert::AreEqual(boards.size(), scores.size());
+			for (size_t i = 0; i < boards.size(); ++i)
+			{
+				Assert::AreEqual(weights.Evaluate(boards[i], moveCounts[i]), scores[i]);
+			}
+
+			// Reused after clearing, counting the moves itself
+			batch.Clear();
+			batch.Add(boards[7]);
+			batch.Evaluate(weights, scores);
+			Assert::AreEqual(static_cast<size_t>(1), scores.size());
+			Assert::AreEqual(weights.Evaluate(boards[7], moveCounts[7]), scores[0]);
+		}
+
+		TEST_METHOD(TunerLowersError)
+		{
+			const char* path = "tuner_test.bin";
+			WriteSelfPlayGames(path, 4, 80);
+
+			TunerOptions options;
+			options.Threads = 2;
+			options.Epochs = 5;
+			options.BatchSize = 32;
+			options.LearningRate = 20;
+			options.Scale = 1;
+
+			EvalWeights weights;
+			TexelTuner tuner(options);
+			const double before = tuner.Error(path, weights, options.Scale);
+
+			int epochs = 0;
+			tuner.SetProgressCallback([&](const TunerProgress& progress)
+			{
+				epochs = progress.Epoch;
+			});
+			Assert::IsTrue(tuner.Tune(path, weights));
+			Assert::AreEqual(options.Epochs, epochs);
+
+			const double after = tuner.Error(path, weights, options.Scale);
+			Assert::IsTrue(after < before);
+			Assert::IsTrue(tuner.FitScale(path, weights) > 0);
+			std::remove(path);
+		}
+	};
+}
@@ -0,0 +1,316 @@
+#include "stdafx.h"
+#include "CppUnitTest.h"
+#include "BoardState.h"
+#include "GameAi.h"
+#include "Nnue.h"
+#include "NnueTrainer.h"
+#include "TestHelpers.h"
+#include <cmath>
+#include <cstdio>
+#include <fstream>
+#include <random>
+
+using namespace Microsoft::VisualStudio::CppUnitTestFramework;
+
+namespace
+{
+	NnueParameters RandomParameters(unsigned seed, int accumulatorSize = 32)
+	{
+		std::mt19937 random(seed);
+		auto between = [&](int low, int high) { return low + static_cast<int>(random() % (high - low + 1)); };
+
+		NnueParameters parameters;
+		parameters.Resize(accumulatorSize, 32, 32);
+		for (auto& w : parameters.FeatureBiases) w = static_cast<short>(between(-40, 80));
+		for (auto& w : parameters.FeatureWeights) w = static_cast<short>(between(-60, 60));
+		for (auto& w : parameters.Hidden1Biases) w = between(-2000, 2000);
+		for (auto& w : parameters.Hidden1Weights) w = static_cast<signed char>(between(-127, 127));
+		for (auto& w : parameters.Hidden2Biases) w = between(-2000, 2000);
+		for (auto& w : parameters.Hidden2Weights) w = static_cast<signed char>(between(-127, 127));
+		for (auto& w : parameters.OutputWeights) w = static_cast<short>(between(-3000, 3000));
+		parameters.OutputBias = between(-20000, 20000);
+		return parameters;
+	}
+
+	int Clip(int value)
+	{
+		return value < 0 ? 0 : value > 127 ? 127 : value;
+	}
+
+	// The network worked through the slow way, to check the fast one against
+	int ReferenceEvaluate(const NnueParameters& p, const BoardState& board)
+	{
+		std::vector<int> input;
+		const SideType order[] = { board.NextSide(), OtherSide(board.NextSide()) };
+		for (auto perspective : order)
+		{
+			std::vector<int> accumulator(p.FeatureBiases.begin(), p.FeatureBiases.end());
+			for (auto loc : board)
+			{
+				const auto piece = board.Get(loc);
+				if (piece.Type == PieceType::Empty || piece.Type == PieceType::King)
+				{
+					continue;
+				}
+				const int feature = NnueNetwork::FeatureIndex(perspective, board.KingLocation(perspective), piece, loc);
+				for (int i = 0; i < p.AccumulatorSize; ++i)
+				{
+					accumulator[i] += p.FeatureWeights[feature * p.AccumulatorSize + i];
+				}
+			}
+			for (auto a : accumulator)
+			{
+				input.push_back(Clip(a));
+			}
+		}
+
+		std::vector<int> hidden1(p.Hidden1Size);
+		for (int i = 0; i < p.Hidden1Size; ++i)
+		{
+			int sum = p.Hidden1Biases[i];
+			for (size_t j = 0; j < input.size(); ++j)
+			{
+				sum += p.Hidden1Weights[i * input.size() + j] * input[j];
+			}
+			hidden1[i] = Clip(sum >> NnueParameters::WeightShift);
+		}
+
+		std::vector<int> hidden2(p.Hidden2Size);
+		for (int i = 0; i < p.Hidden2Size; ++i)
+		{
+			int sum = p.Hidden2Biases[i];
+			for (int j = 0; j < p.Hidden1Size; ++j)
+			{
+				sum += p.Hidden2Weights[i * p.Hidden1Size + j] * hidden1[j];
+			}
+			hidden2[i] = Clip(sum >> NnueParameters::WeightShift);
+		}
+
+		long long output = p.OutputBias;
+		for (int i = 0; i < p.Hidden2Size; ++i)
+		{
+			output += p.OutputWeights[i] * hidden2[i];
+		}
+		const int score = static_cast<int>(output * 1000 / NnueParameters::OutputScale);
+		return board.NextSide() == SideType::White ? score : -score;
+	}
+}
+
+namespace UnitTest
+{
+	TEST_CLASS(NnueTests)
+	{
+	public:
+
+		TEST_METHOD(NetworkSaveAndLoad)
+		{
+			const char* path = "nnue_test.bin";
+			const auto parameters = RandomParameters(1);
+			Assert::IsTrue(parameters.Save(path));
+
+			NnueNetwork network;
+			Assert::IsTrue(network.Load(path));
+			Assert::AreEqual(32, network.Parameters().AccumulatorSize);
+			Assert::IsTrue(network.Parameters().FeatureWeights == parameters.FeatureWeights);
+			Assert::IsTrue(network.Parameters().Hidden2Weights == parameters.Hidden2Weights);
+			Assert::AreEqual(parameters.OutputBias, network.Parameters().OutputBias);
+
+			// Anything but a whole network is turned down
+			{
+				std::ofstream file(path, std::ios::binary | std::ios::app);
+				file.put(0);
+			}
+			Assert::IsFalse(network.Load(path));
+			std::remove(path);
+		}
+
+		TEST_METHOD(NetworkMatchesReference)
+		{
+			NnueNetwork network;
+			network.SetParameters(RandomParameters(2));
+
+			std::mt19937 random(5);
+			BoardState b;
+			for (int ply = 0; ply < 40; ++ply)
+			{
+				Assert::AreEqual(ReferenceEvaluate(network.Parameters(), b), network.Evaluate(b));
+
+				const auto moves = b.ValidMoves();
+				if (moves.empty())
+				{
+					break;
+				}
+				const auto& move = moves[random() % moves.size()];
+				b.Move(move.From, move.To, true);
+			}
+		}
+
+		// Sizes only have to be multiples of 16, so the vector code has to
+		// handle half a step of 32 at the end
+		TEST_METHOD(OddAccumulatorSizeMatchesReference)
+		{
+			NnueNetwork network;
+			network.SetParameters(RandomParameters(3, 48));
+
+			std::mt19937 random(7);
+			BoardState b;
+			for (int ply = 0; ply < 20; ++ply)
+			{
+				Assert::AreEqual(ReferenceEvaluate(network.Parameters(), b), network.Evaluate(b));
+
+				const auto moves = b.ValidMoves();
+				if (moves.empty())
+				{
+					break;
+				}
+				const auto& move = moves[random() % moves.size()];
+				b.Move(move.From, move.To, true);
+			}
+		}
+
+		TEST_METHOD(AccumulatorUpdatesMatchRefresh)
+		{
+			NnueNetwork network;
+			network.SetParameters(RandomParameters(3));
+
+			// Castling, en passant and promotion as well as plain moves
+			const char* fens[] = {
+				"r3k2r/pppq1ppp/2n2n2/3pp3/3PP3/2N2N2/PPPQ1PPP/R3K2R w KQkq d6 0 8",
+				"4k3/1P6/8/3pP3/8/8/6p1/4K3 w - d6 0 1",
+				"4k3/1P6/8/8/8/8/6p1/4K2R b - - 0 1",
+			};
+			for (auto fen : fens)
+			{
+				const auto board = BoardState::FromFen(fen);
+				NnueAccumulator before;
+				network.Refresh(board, before);
+
+				for (auto& m : board.ValidMoves())
+				{
+					auto next = board;
+					next.Move(m.From, m.To, true);
+
+					NnueAccumulator updated;
+					NnueAccumulator refreshed;
+					network.Update(board, before, next, updated);
+					network.Refresh(next, refreshed);
+					Assert::IsTrue(updated.Values[0] == refreshed.Values[0]);
+					Assert::IsTrue(updated.Values[1] == refreshed.Values[1]);
+				}
+			}
+		}
+
+		TEST_METHOD(StackEvaluatesAlongLine)
+		{
+			NnueNetwork network;
+			network.SetParameters(RandomParameters(4));
+
+			std::mt19937 random(9);
+			std::vector<BoardState> line(1);
+			NnueStack stack;
+			stack.Reset(&network, 32);
+			line.reserve(32);
+			stack.Set(0, line[0]);
+			for (int ply = 1; ply < 32; ++ply)
+			{
+				const auto moves = line.back().ValidMoves();
+				const auto& move = moves[random() % moves.size()];
+				line.push_back(line.back());
+				line.back().Move(move.From, move.To, true);
+				stack.Set(ply, line.back());
+
+				// Only every few plies, so some updates go more than one move
+				if (ply % 3 == 0)
+				{
+					Assert::AreEqual(network.Evaluate(line.back()), stack.Evaluate(ply));
+				}
+			}
+		}
+
+		TEST_METHOD(SearchUsesNetwork)
+		{
+			NnueNetwork network;
+			network.SetParameters(RandomParameters(6));
+
+			GameAi ai;
+			ai.SetNetwork(&network);
+			BoardState b;
+			Assert::AreEqual(network.Evaluate(b), ai.GetBoardScore(b));
+
+			SearchLimits limits;
+			limits.Depth = 3;
+			int score = 0;
+			const auto move = ai.DecideMove(b, PositionHistory(), limits, &score);
+			Assert::IsTrue(b.CanMove(move.From, move.To));
+		}
+
+		TEST_METHOD(TrainerLowersLoss)
+		{
+			const char* path = "nnue_trainer_test.bin";
+			WriteSelfPlayGames(path, 4, 80);
+
+			NnueTrainerOptions options;
+			options.Threads = 2;
+			options.Epochs = 5;
+			options.BatchSize = 32;
+			options.AccumulatorSize = 32;
+			options.Hidden1Size = 32;
+			options.Hidden2Size = 32;
+
+			NnueTrainer trainer(options);
+			const double before = trainer.Loss(path);
+
+			int epochs = 0;
+			trainer.SetProgressCallback([&](const NnueTrainerProgress& progress)
+			{
+				epochs = progress.Epoch;
+			});
+			Assert::IsTrue(trainer.Train(path));
+			Assert::AreEqual(options.Epochs, epochs);
+			Assert::IsTrue(trainer.Loss(path) < before);
+			Assert::IsFalse(trainer.Train("no_such_file.bin"));
+			std::remove(path);
+		}
+
+		TEST_METHOD(TrainerQuantizesToNetwork)
+		{
+			NnueTrainerOptions options;
+			options.AccumulatorSize = 32;
+			options.Hidden1Size = 32;
+			options.Hidden2Size = 32;
+			NnueTrainer trainer(options);
+
+			NnueNetwork network;
+			network.SetParameters(trainer.Quantize());
+
+			// Rounding costs a little, but the engine's network should agree
+			// with the float one to within a fraction of a pawn
+			std::mt19937 random(11);
+			BoardState b;
+			for (int ply = 0; ply < 40; ++ply)
+			{
+				const double expected = trainer.Evaluate(b) * 1000 * (b.NextSide() == SideType::White ? 1 : -1);
+				Assert::IsTrue(std::abs(network.Evaluate(b) - expected) < 100);
+
+				const auto moves = b.ValidMoves();
+				if (moves.empty())
+				{
+					break;
+				}
+				const auto& move = moves[random() % moves.size()];
+				b.Move(move.From, move.To, true);
+			}
+
+			// Starting from a network gives back the same integers
+			NnueTrainer copy(options);
+			copy.Initialize(RandomParameters(12));
+			const auto parameters = copy.Quantize();
+			const auto original = RandomParameters(12);
+			Assert::IsTrue(parameters.FeatureWeights == original.FeatureWeights);
+			Assert::IsTrue(parameters.Hidden1Weights == original.Hidden1Weights);
+			Assert::IsTrue(parameters.Hidden2Biases == original.Hidden2Biases);
+			Assert::IsTrue(parameters.OutputWeights == original.OutputWeights);
+			Assert::AreEqual(original.OutputBias, parameters.OutputBias);
+		}
+	};
+}
@@ -0,0 +1,177 @@
+#include "stdafx.h"
+#include "CppUnitTest.h"
+#include "Perft.h"
+#include "SearchScheduler.h"
+#include "TaskPool.h"
+#include <atomic>
+#include <chrono>
+#include <mutex>
+
+using namespace Microsoft::VisualStudio::CppUnitTestFramework;
+
+namespace UnitTest
+{
+	TEST_CLASS(SchedulerTests)
+	{
+	public:
+
+		TEST_METHOD(TaskPoolRunsByPriority)
+		{
+			TaskPool pool(1);
+			std::atomic<bool> release(false);
+			std::mutex lock;
+			std::vector<int> order;
+
+			// Keep the only worker busy until everything is queued
+			pool.Submit([&](int) { while (!release) std::this_thread::yield(); });
+			const int priorities[] = { 0, 2, 1, 2, 0 };
+			for (int i = 0; i < 5; ++i)
+			{
+				pool.Submit([&, i](int)
+				{
+					std::lock_guard<std::mutex> guard(lock);
+					order.push_back(i);
+				}, priorities[i]);
+			}
+			release = true;
+			pool.WaitUntilIdle();
+
+			// Highest first, then in the order they came
+			const int expected[] = { 1, 3, 2, 0, 4 };
+			Assert::AreEqual(5, static_cast<int>(order.size()));
+			for (int i = 0; i < 5; ++i)
+			{
+				Assert::AreEqual(expected[i], order[i]);
+			}
+		}
+
+		TEST_METHOD(TaskPoolRunsSpawnedTasks)
+		{
+			TaskPool pool(4);
+			std::atomic<int> sum(0);
+
+			// A tree of tasks, each spawning two more, all run once
+			std::function<void(int, int)> spread = [&](int worker, int level)
+			{
+				sum += 1;
+				if (level > 0)
+				{
+					pool.Spawn(worker, [&, level](int w) { spread(w, level - 1); });
+					pool.Spawn(worker, [&, level](int w) { spread(w, level - 1); });
+				}
+			};
+			pool.Submit([&](int worker) { spread(worker, 9); });
+			pool.WaitUntilIdle();
+
+			Assert::AreEqual(1023, sum.load());
+			Assert::AreEqual(size_t(0), pool.Queued());
+		}
+
+		TEST_METHOD(TaskGroupWaitLeavesSubmittedTasks)
+		{
+			TaskPool pool(2);
+			std::atomic<bool> started(false);
+			std::atomic<int> waiter(-1);
+			std::atomic<bool> ranWhileWaiting(false);
+
+			pool.Submit([&](int worker)
+			{
+				// The other worker takes the part and holds on to it, so the
+				// wait below has nothing of its group to run
+				TaskGroup group(pool);
+				group.Spawn(worker, [&](int)
+				{
+					started = true;
+					std::this_thread::sleep_for(std::chrono::milliseconds(50));
+				});
+				while (!started)
+				{
+					std::this_thread::yield();
+				}
+
+				// Something unrelated, which mustn't hold up the wait
+				pool.Submit([&](int w)
+				{
+					if (w == waiter)
+					{
+						ranWhileWaiting = true;
+					}
+				});
+				waiter = worker;
+				group.Wait(worker);
+				waiter = -1;
+			});
+			pool.WaitUntilIdle();
+
+			Assert::IsFalse(ranWhileWaiting);
+		}
+
+		TEST_METHOD(ParallelPerftMatchesSerial)
+		{
+			BoardState b;
+			Assert::AreEqual(20ull, Perft(b, 1));
+			Assert::AreEqual(400ull, Perft(b, 2));
+			Assert::AreEqual(8902ull, Perft(b, 3));
+
+			// Split at the root, and below it while workers are free
+			TaskPool pool(3);
+			Assert::AreEqual(8902ull, ParallelPerft(pool, b, 3));
+			Assert::AreEqual(197281ull, ParallelPerft(pool, b, 4));
+
+			const auto endgame = BoardState::FromFen("8/2p5/3p4/KP5r/1R3p1k/8/4P1P1/8 w - - 0 1");
+			Assert::AreEqual(Perft(endgame, 4), ParallelPerft(pool, endgame, 4));
+		}
+
+		TEST_METHOD(SchedulerReportsAndCancels)
+		{
+			SearchScheduler scheduler(1, 1);
+			std::mutex lock;
+			std::vector<SearchResult> results;
+			int iterations = 0;
+
+			SearchTask task;
+			task.Board = BoardState::FromFen("4k3/8/8/3q1r2/4P1n1/5P2/8/4K3 w - - 0 1");
+			task.Limits.Depth = 3;
+			task.Progress = [&](const SearchInfo&)
+			{
+				++iterations;
+			};
+			task.Finished = [&](const SearchResult& result)
+			{
+				std::lock_guard<std::mutex> guard(lock);
+				results.push_back(result);
+			};
+			const int first = scheduler.Submit(task);
+			scheduler.WaitUntilIdle();
+
+			Assert::AreEqual(1, static_cast<int>(results.size()));
+			Assert::AreEqual(first, results[0].Task);
+			Assert::IsFalse(results[0].Cancelled);
+			Assert::AreEqual(BoardLocation("d5"), results[0].BestMove.To);
+			Assert::AreEqual(3, iterations);
+
+			// A node budget ends a search that would otherwise go on and on
+			results.clear();
+			task.Limits = SearchLimits();
+			task.Limits.Depth = MaxSearchDepth;
+			task.Limits.Nodes = 2000;
+			task.Progress = nullptr;
+			scheduler.Submit(task);
+			scheduler.WaitUntilIdle();
+			Assert::AreEqual(1, static_cast<int>(results.size()));
+			Assert::IsTrue(results[0].Nodes < 4000);
+
+			// Cancelled while running, and before starting, both still finish
+			results.clear();
+			task.Limits.Nodes = 0;
+			const int running = scheduler.Submit(task);
+			const int waiting = scheduler.Submit(task);
+			scheduler.Cancel(waiting);
+			scheduler.Cancel(running);
+			scheduler.WaitUntilIdle();
+			Assert::AreEqual(2, static_cast<int>(results.size()));
+			Assert::IsTrue(results[0].Cancelled && results[1].Cancelled);
+		}
+
+	};
+}
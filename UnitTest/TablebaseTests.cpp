@@ -0,0 +1,251 @@
+#include "stdafx.h"
+#include "CppUnitTest.h"
+#include "BoardState.h"
+#include "GameAi.h"
+#include "Tablebase.h"
+#include "TablebaseGenerator.h"
+#include "TestHelpers.h"
+#include <fstream>
+
+using namespace Microsoft::VisualStudio::CppUnitTestFramework;
+
+namespace UnitTest
+{
+	TEST_CLASS(TablebaseTests)
+	{
+	public:
+
+		// Every position White mates in 1 with White to move, Black is mated in 2 otherwise
+		static void WriteFakeTable(TempDirectory& directory, const char* name)
+		{
+			TablebaseLayout layout(name);
+			TablebaseHeader header = { { 'C', 'L', 'T', 'B' }, 1, static_cast<unsigned>(layout.PieceCount()), 0, {}, layout.EntryCount() };
+
+			std::ofstream out(directory.File(std::string(name) + Tablebases::FileExtension), std::ios::binary);
+			out.write(reinterpret_cast<const char*>(&header), sizeof(header));
+			for (size_t i = 0; i < layout.EntryCount(); ++i)
+			{
+				out.put(static_cast<char>(i % 2 == 0 ? 1 : TablebaseLossBase + 2));
+			}
+		}
+
+		TEST_METHOD(LayoutFoldsSymmetries)
+		{
+			TablebaseLayout layout("KQvK");
+			Assert::AreEqual(static_cast<size_t>(10 * 64 * 64 * 2), layout.EntryCount());
+
+			BoardLocation squares[] = { BoardLocation("b1"), BoardLocation("c7"), BoardLocation("h8") };
+			BoardLocation mirrored[] = { BoardLocation("g1"), BoardLocation("f7"), BoardLocation("a8") };
+			BoardLocation flipped[] = { BoardLocation("b8"), BoardLocation("c2"), BoardLocation("h1") };
+			BoardLocation transposed[] = { BoardLocation("a2"), BoardLocation("g3"), BoardLocation("h8") };
+
+			auto index = layout.Index(squares, SideType::White);
+			Assert::AreEqual(index, layout.Index(mirrored, SideType::White));
+			Assert::AreEqual(index, layout.Index(flipped, SideType::White));
+			Assert::AreEqual(index, layout.Index(transposed, SideType::White));
+			Assert::AreNotEqual(index, layout.Index(squares, SideType::Black));
+
+			// Pawns only allow a left/right mirror
+			TablebaseLayout pawns("KPvK");
+			Assert::AreEqual(static_cast<size_t>(32 * 64 * 64 * 2), pawns.EntryCount());
+			Assert::AreEqual(pawns.Index(squares, SideType::White), pawns.Index(mirrored, SideType::White));
+			Assert::AreNotEqual(pawns.Index(squares, SideType::White), pawns.Index(flipped, SideType::White));
+		}
+
+		TEST_METHOD(ProbeSwapsColors)
+		{
+			TempDirectory directory("ProbeSwapsColors");
+			WriteFakeTable(directory, "KQvK");
+
+			Tablebases tablebases;
+			Assert::AreEqual(1, tablebases.Init(directory.Path(), 3));
+
+			BoardState whiteQueen(
+				"k       "
+				"        "
+				"        "
+				"        "
+				"   Q    "
+				"        "
+				"        "
+				"       K"
+				, SideType::White);
+			int distance = 0;
+			Assert::IsTrue(Wdl::Win == tablebases.Probe(whiteQueen, &distance));
+			Assert::AreEqual(1, distance);
+
+			// Same thing with colours swapped
+			BoardState blackQueen(
+				"k       "
+				"        "
+				"        "
+				"        "
+				"   q    "
+				"        "
+				"        "
+				"       K"
+				, SideType::Black);
+			Assert::IsTrue(Wdl::Win == tablebases.Probe(blackQueen, &distance));
+			BoardState blackQueenWhiteToMove(
+				"k       "
+				"        "
+				"        "
+				"        "
+				"   q    "
+				"        "
+				"        "
+				"       K"
+				, SideType::White);
+			Assert::IsTrue(Wdl::Loss == tablebases.Probe(blackQueenWhiteToMove, &distance));
+			Assert::AreEqual(2, distance);
+
+			// Bare kings are always a draw, and material without a table is unknown
+			BoardState kings(
+				"k      K"
+				"        "
+				"        "
+				"        "
+				"        "
+				"        "
+				"        "
+				"        "
+				, SideType::White);
+			Assert::IsTrue(Wdl::Draw == tablebases.Probe(kings));
+			BoardState rook(
+				"k     RK"
+				"        "
+				"        "
+				"        "
+				"        "
+				"        "
+				"        "
+				"        "
+				, SideType::White);
+			Assert::IsTrue(Wdl::Unknown == tablebases.Probe(rook));
+		}
+
+		TEST_METHOD(SearchUsesTablebase)
+		{
+			TempDirectory directory("SearchUsesTablebase");
+			WriteFakeTable(directory, "KQvK");
+
+			Tablebases tablebases;
+			tablebases.Init(directory.Path(), 3);
+
+			// Taking the queen leaves bare kings, anything else leaves Black lost
+			BoardState b(
+				"        "
+				"        "
+				"        "
+				"        "
+				"        "
+				"        "
+				"kQ      "
+				"       K"
+				, SideType::Black);
+
+			GameAi ai;
+			ai.SetTablebases(&tablebases);
+			int score = 0;
+			auto move = ai.DecideMoveImpl(b, 0, &score);
+
+			Assert::AreEqual(0, score);
+			Assert::AreEqual(BoardLocation("b2"), move.To);
+
+			Wdl result;
+			auto root = tablebases.ProbeRoot(b, &result);
+			Assert::IsTrue(Wdl::Draw == result);
+			Assert::AreEqual(BoardLocation("b2"), root.To);
+		}
+
+		TEST_METHOD(GenerateKQvK)
+		{
+			TempDirectory directory("GenerateKQvK");
+			directory.File(std::string("KQvK") + Tablebases::FileExtension);
+
+			TablebaseGenerator generator("KQvK");
+			Assert::IsTrue(generator.Generate());
+			Assert::IsTrue(generator.Write(directory.Path()));
+
+			// Mate in 10 moves with White to move, so Black to move loses in 20 plies
+			Assert::AreEqual(20, generator.LongestMate());
+			Assert::IsTrue(generator.CountEntries(Wdl::Draw) > 0);
+
+			Tablebases tablebases;
+			Assert::AreEqual(1, tablebases.Init(directory.Path(), 3));
+
+			BoardState b(
+				"k       "
+				"       Q"
+				" K      "
+				"        "
+				"        "
+				"        "
+				"        "
+				"        "
+				, SideType::White);
+			int distance = 0;
+			Assert::IsTrue(Wdl::Win == tablebases.Probe(b, &distance));
+			Assert::AreEqual(1, distance);
+
+			Wdl result;
+			auto move = tablebases.ProbeRoot(b, &result);
+			Assert::IsTrue(Wdl::Win == result);
+			Assert::IsTrue(b.Move(move.From, move.To));
+			Assert::IsTrue(b.IsCheckmate());
+
+			// Stalemate
+			BoardState stalemate(
+				"k       "
+				"  Q     "
+				" K      "
+				"        "
+				"        "
+				"        "
+				"        "
+				"        "
+				, SideType::Black);
+			Assert::IsTrue(Wdl::Draw == tablebases.Probe(stalemate));
+		}
+
+		TEST_METHOD(GenerateNeedsSmallerTables)
+		{
+			// Promotions lead to KQvK, which isn't available
+			Tablebases none;
+			TablebaseGenerator generator("KPvK", &none);
+			Assert::IsFalse(generator.Generate());
+		}
+
+		TEST_METHOD(GenerateQueenPromotionsOnly)
+		{
+			TempDirectory directory("GenerateQueenPromotionsOnly");
+			const char* names[] = { "KQvK", "KPvK" };
+			Tablebases tablebases;
+			for (auto name : names)
+			{
+				directory.File(std::string(name) + Tablebases::FileExtension);
+				TablebaseGenerator generator(name, &tablebases);
+				Assert::IsTrue(generator.Generate());
+				Assert::IsTrue(generator.Write(directory.Path()));
+				tablebases.Init(directory.Path(), 3);
+			}
+
+			// c8=R would win, but the board only makes queens, and c8=Q is stalemate
+			BoardState b(
+				"        "
+				"k P     "
+				"        "
+				"K       "
+				"        "
+				"        "
+				"        "
+				"        "
+				, SideType::White);
+			Assert::IsTrue(Wdl::Draw == tablebases.Probe(b));
+
+			Wdl result;
+			tablebases.ProbeRoot(b, &result);
+			Assert::IsTrue(Wdl::Draw == result);
+		}
+	};
+}
@@ -0,0 +1,117 @@
+#include "stdafx.h"
+#include "TestHelpers.h"
+#include "TrainingData.h"
+#include <atomic>
+#include <cstdio>
+#include <cstdlib>
+#include <fstream>
+#include <new>
+
+#ifdef _WIN32
+#include <windows.h>
+#include <direct.h>
+#else
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+namespace
+{
+	std::atomic<unsigned long long> g_heapAllocations(0);
+}
+
+void* operator new(size_t size)
+{
+	++g_heapAllocations;
+	if (void* block = std::malloc(size ? size : 1))
+	{
+		return block;
+	}
+	throw std::bad_alloc();
+}
+
+void operator delete(void* block) noexcept
+{
+	std::free(block);
+}
+
+namespace UnitTest
+{
+	unsigned long long HeapAllocations()
+	{
+		return g_heapAllocations;
+	}
+
+	SelfPlayOptions QuickSelfPlay(int games, int maxPlies)
+	{
+		SelfPlayOptions options;
+		options.Games = games;
+		options.Threads = 2;
+		options.Depth = 1;
+		options.MaxPlies = maxPlies;
+		return options;
+	}
+
+	void WriteSelfPlayGames(const char* path, int games, int maxPlies)
+	{
+		std::ofstream file(path, std::ios::binary);
+		TrainingWriter writer(file);
+		SelfPlay(QuickSelfPlay(games, maxPlies)).Run(writer);
+	}
+
+	namespace
+	{
+		std::string TempRoot()
+		{
+#ifdef _WIN32
+			char directory[MAX_PATH + 1];
+			const DWORD length = ::GetTempPathA(sizeof(directory), directory);
+			return length > 0 && length <= MAX_PATH ? std::string(directory, length) : std::string(".\\");
+#else
+			const char* directory = getenv("TMPDIR");
+			return std::string(directory && *directory ? directory : "/tmp") + "/";
+#endif
+		}
+	}
+
+	TempFile::TempFile(const char* name)
+		: m_path(TempRoot() + name)
+	{
+		std::remove(m_path.c_str());
+	}
+
+	TempFile::~TempFile()
+	{
+		std::remove(m_path.c_str());
+	}
+
+	TempDirectory::TempDirectory(const char* name)
+		: m_path(TempRoot() + name)
+	{
+#ifdef _WIN32
+		_mkdir(m_path.c_str());
+#else
+		mkdir(m_path.c_str(), 0700);
+#endif
+	}
+
+	TempDirectory::~TempDirectory()
+	{
+		for (const auto& file : m_files)
+		{
+			std::remove(file.c_str());
+		}
+#ifdef _WIN32
+		_rmdir(m_path.c_str());
+#else
+		rmdir(m_path.c_str());
+#endif
+	}
+
+	std::string TempDirectory::File(const std::string& name)
+	{
+		m_files.push_back(m_path + "/" + name);
+		std::remove(m_files.back().c_str());
+		return m_files.back();
+	}
+}
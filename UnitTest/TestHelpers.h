@@ -0,0 +1,63 @@
+#pragma once
+
+#include "SelfPlay.h"
+#include <string>
+#include <vector>
+
+namespace UnitTest
+{
+	// Blocks taken from the heap with operator new so far, by any thread.
+	// The tests replace the global operator new to count them.
+	unsigned long long HeapAllocations();
+
+	// Self-play quick enough for a test: a ply deep, on two threads, with
+	// games drawn after maxPlies
+	SelfPlayOptions QuickSelfPlay(int games, int maxPlies);
+
+	// Plays that many quick games into path, as training positions
+	void WriteSelfPlayGames(const char* path, int games, int maxPlies);
+
+	// A file for one test in the temp directory, deleted when it goes out of
+	// scope, so a failing test doesn't leave it behind either
+	class TempFile
+	{
+	public:
+		explicit TempFile(const char* name);
+		~TempFile();
+
+		TempFile(const TempFile&) = delete;
+		TempFile& operator=(const TempFile&) = delete;
+
+		const char* Path() const
+		{
+			return m_path.c_str();
+		}
+
+	private:
+		std::string m_path;
+	};
+
+	// A fresh directory in the temp directory.  Files the test puts there are
+	// named with File() first, so they can be removed along with it.
+	class TempDirectory
+	{
+	public:
+		explicit TempDirectory(const char* name);
+		~TempDirectory();
+
+		TempDirectory(const TempDirectory&) = delete;
+		TempDirectory& operator=(const TempDirectory&) = delete;
+
+		const std::string& Path() const
+		{
+			return m_path;
+		}
+
+		// The full path of a file in the directory
+		std::string File(const std::string& name);
+
+	private:
+		std::string m_path;
+		std::vector<std::string> m_files;
+	};
+}
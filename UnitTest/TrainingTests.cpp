@@ -0,0 +1,167 @@
+#include "stdafx.h"
+#include "CppUnitTest.h"
+#include "BoardState.h"
+#include "GameAi.h"
+#include "SelfPlay.h"
+#include "TestHelpers.h"
+#include "TrainingData.h"
+#include <algorithm>
+#include <cstdio>
+#include <fstream>
+#include <sstream>
+
+using namespace Microsoft::VisualStudio::CppUnitTestFramework;
+
+namespace UnitTest
+{
+	TEST_CLASS(TrainingTests)
+	{
+	public:
+
+		TEST_METHOD(PositionRoundTrip)
+		{
+			BoardState b;
+			Assert::IsTrue(b.MovePgn("e4"));
+			Assert::IsTrue(b.MovePgn("Nf6"));
+			Assert::IsTrue(b.MovePgn("Ke2"));
+			Assert::IsTrue(b.MovePgn("d5"));
+
+			auto position = TrainingPosition::FromBoard(b, 1234, 4);
+			Assert::AreEqual(123, static_cast<int>(position.Score));
+			Assert::AreEqual(3, static_cast<int>(position.EnPassant));
+			Assert::IsTrue(position.NextSide() == SideType::White);
+
+			auto restored = position.ToBoard();
+			Assert::IsTrue(restored.Key() == b.Key());
+			Assert::AreEqual(b.ToFen(), restored.ToFen());
+		}
+
+		TEST_METHOD(ScoresAreClamped)
+		{
+			BoardState b;
+			Assert::AreEqual(TrainingPosition::MaxScore, TrainingPosition::FromBoard(b, MateScore, 0).Score);
+			Assert::AreEqual(static_cast<short>(-TrainingPosition::MaxScore), TrainingPosition::FromBoard(b, -MateScore, 0).Score);
+		}
+
+		TEST_METHOD(WriterBuffers)
+		{
+			std::ostringstream output;
+			BoardState b;
+			{
+				TrainingWriter writer(output, 3);
+				for (int i = 0; i < 5; ++i)
+				{
+					writer.Write(TrainingPosition::FromBoard(b, i * 10, i));
+				}
+				Assert::AreEqual(3 * sizeof(TrainingPosition), output.str().size());
+				Assert::IsTrue(writer.Flush());
+				Assert::AreEqual(5ull, writer.Count());
+			}
+
+			const auto data = output.str();
+			Assert::AreEqual(5 * sizeof(TrainingPosition), data.size());
+			auto last = reinterpret_cast<const TrainingPosition*>(data.data()) + 4;
+			Assert::AreEqual(4, static_cast<int>(last->Ply));
+		}
+
+		TEST_METHOD(CompressedRoundTrip)
+		{
+			const auto options = QuickSelfPlay(1, 60);
+			SelfPlay selfPlay(options);
+			GameAi ai;
+			std::vector<TrainingPosition> positions;
+			bool adjudicated = false;
+			selfPlay.PlayGame(ai, 3, positions, &adjudicated);
+
+			std::stringstream data;
+			{
+				TrainingWriter writer(data, 16, TrainingCompression::Block);
+				writer.Write(positions.data(), positions.size());
+			}
+			Assert::IsTrue(data.str().size() < positions.size() * sizeof(TrainingPosition));
+
+			TrainingStreamReader reader(data);
+			Assert::IsTrue(reader.IsCompressed());
+			std::vector<TrainingPosition> read(positions.size() + 1);
+			Assert::AreEqual(positions.size(), reader.Read(read.data(), read.size()));
+			Assert::IsTrue(memcmp(positions.data(), read.data(), positions.size() * sizeof(TrainingPosition)) == 0);
+		}
+
+		TEST_METHOD(ShuffleKeepsRecords)
+		{
+			const char* input = "training_input.bin";
+			const char* output = "training_output.bin";
+
+			BoardState b;
+			{
+				std::ofstream file(input, std::ios::binary);
+				TrainingWriter writer(file);
+				for (int i = 0; i < 100; ++i)
+				{
+					writer.Write(TrainingPosition::FromBoard(b, 0, i));
+				}
+			}
+
+			// Small enough a memory limit that it has to go through shards
+			Assert::IsTrue(ShuffleTrainingFile(input, output, 5, 30));
+
+			TrainingReader reader;
+			Assert::IsTrue(reader.Open(output));
+			Assert::AreEqual(size_t(100), reader.Count());
+			std::vector<int> plies;
+			for (auto& p : reader)
+			{
+				plies.push_back(p.Ply);
+			}
+			Assert::IsFalse(std::is_sorted(plies.begin(), plies.end()));
+			std::sort(plies.begin(), plies.end());
+			for (int i = 0; i < 100; ++i)
+			{
+				Assert::AreEqual(i, plies[i]);
+			}
+
+			std::remove(input);
+			std::remove(output);
+		}
+
+		TEST_METHOD(SelfPlayLabelsPositions)
+		{
+			const auto options = QuickSelfPlay(1, 40);
+
+			SelfPlay selfPlay(options);
+			GameAi ai;
+			std::vector<TrainingPosition> positions;
+			bool adjudicated = false;
+			const int result = selfPlay.PlayGame(ai, 7, positions, &adjudicated);
+
+			// The random opening isn't recorded, everything after it is
+			Assert::IsFalse(positions.empty());
+			Assert::AreEqual(options.RandomPlies, static_cast<int>(positions.front().Ply));
+			for (auto& p : positions)
+			{
+				Assert::AreEqual(result, static_cast<int>(p.Result));
+			}
+
+			// Same seed, same game
+			GameAi again;
+			std::vector<TrainingPosition> replay;
+			selfPlay.PlayGame(again, 7, replay, &adjudicated);
+			Assert::AreEqual(positions.size(), replay.size());
+			Assert::IsTrue(memcmp(positions.data(), replay.data(), positions.size() * sizeof(TrainingPosition)) == 0);
+		}
+
+		TEST_METHOD(SelfPlayRunsGames)
+		{
+			const auto options = QuickSelfPlay(3, 30);
+
+			std::ostringstream output;
+			TrainingWriter writer(output);
+			SelfPlay selfPlay(options);
+			const auto stats = selfPlay.Run(writer);
+
+			Assert::AreEqual(3, stats.Games);
+			Assert::AreEqual(3, stats.WhiteWins + stats.Draws + stats.BlackWins);
+			Assert::AreEqual(stats.Positions * sizeof(TrainingPosition), static_cast<unsigned long long>(output.str().size()));
+		}
+	};
+}
@@ -342,5 +342,151 @@ namespace UnitTest
 
 			Assert::IsFalse(b.Move("a7", "a5"));
 		}
+
+		TEST_METHOD(RegressPawnNearLastRank)
+		{
+			// The double step from here would be off the board
+			BoardState b(
+				"k       "
+				"        "
+				"        "
+				"        "
+				"        "
+				"        "
+				"   p    "
+				"       K"
+				, SideType::Black);
+
+			auto moves = b.ValidMoves();
+			Assert::AreEqual(4, static_cast<int>(moves.size()));
+		}
+
+		TEST_METHOD(PawnPromotesToQueen)
+		{
+			BoardState b(
+				"        "
+				"      P "
+				"k       "
+				"        "
+				"        "
+				"        "
+				"       p"
+				"K       "
+				, SideType::White);
+
+			Assert::IsTrue(b.Move("g7", "g8"));
+			Assert::AreEqual(Piece(PieceType::Queen, SideType::White), b.Get("g8"));
+			Assert::IsTrue(b.Move("h2", "h1"));
+			Assert::AreEqual(Piece(PieceType::Queen, SideType::Black), b.Get("h1"));
+		}
+
+		TEST_METHOD(KeyFollowsPosition)
+		{
+			BoardState start;
+			BoardState b;
+			Assert::IsTrue(b.MovePgn("Nf3"));
+			Assert::IsTrue(b.Key() != start.Key());
+			Assert::IsTrue(b.MovePgn("Nf6"));
+			Assert::IsTrue(b.MovePgn("Ng1"));
+			Assert::IsTrue(b.MovePgn("Ng8"));
+			Assert::IsTrue(b.Key() == start.Key());
+
+			// Same pieces, different side to move
+			const char* kings =
+				"k      K"
+				"        "
+				"        "
+				"        "
+				"        "
+				"        "
+				"        "
+				"        ";
+			BoardState white(kings, SideType::White);
+			BoardState black(kings, SideType::Black);
+			Assert::IsTrue(white.Key() != black.Key());
+
+			// Incremental key matches one built from scratch
+			BoardState e4;
+			Assert::IsTrue(e4.MovePgn("e4"));
+			Assert::IsTrue(e4.MovePgn("e5"));
+			Assert::IsTrue(e4.MovePgn("Nf3"));
+			Assert::IsTrue(e4.MovePgn("Nc6"));
+			BoardState e4Copy(
+				"r bqkbnr"
+				"pppp ppp"
+				"  n     "
+				"    p   "
+				"    P   "
+				"     N  "
+				"PPPP PPP"
+				"RNBQKB R"
+				, SideType::White);
+			Assert::IsTrue(e4.Key() == e4Copy.Key());
+		}
+
+		TEST_METHOD(HalfmoveClock)
+		{
+			BoardState b;
+			Assert::IsTrue(b.MovePgn("Nf3"));
+			Assert::IsTrue(b.MovePgn("Nf6"));
+			Assert::AreEqual(2, b.HalfmoveClock());
+			Assert::IsTrue(b.MovePgn("e4"));
+			Assert::AreEqual(0, b.HalfmoveClock());
+			Assert::IsTrue(b.MovePgn("Nxe4"));
+			Assert::AreEqual(0, b.HalfmoveClock());
+			Assert::IsTrue(b.MovePgn("Nc3"));
+			Assert::AreEqual(1, b.HalfmoveClock());
+			Assert::IsFalse(b.IsFiftyMoveDraw());
+		}
+
+		TEST_METHOD(ThreefoldRepetition)
+		{
+			BoardState b;
+			PositionHistory history;
+			history.Push(b.Key());
+
+			const char* moves[] = { "Nf3", "Nf6", "Ng1", "Ng8" };
+			for (int round = 0; round < 2; ++round)
+			{
+				Assert::IsFalse(history.IsThreefoldRepetition(b));
+				for (auto m : moves)
+				{
+					Assert::IsTrue(b.MovePgn(m));
+					history.Push(b.Key());
+				}
+			}
+
+			Assert::AreEqual(2, history.CountRepetitions(b));
+			Assert::IsTrue(history.IsThreefoldRepetition(b));
+
+			// A pawn move means nothing earlier can repeat
+			Assert::IsTrue(b.MovePgn("e4"));
+			history.Push(b.Key());
+			Assert::IsFalse(history.IsRepetition(b));
+		}
+
+		TEST_METHOD(FenMatchesMoves)
+		{
+			BoardState b;
+			Assert::IsTrue(b.MovePgn("e4"));
+
+			const char* fen = "rnbqkbnr/pppppppp/8/8/4P3/8/PPPP1PPP/RNBQKBNR b KQkq e3 0 1";
+			auto fromFen = BoardState::FromFen(fen);
+			Assert::IsTrue(b.Key() == fromFen.Key());
+			Assert::AreEqual(std::string(fen), fromFen.ToFen());
+			Assert::AreEqual(std::string(fen), b.ToFen());
+		}
+
+		TEST_METHOD(FenCastlingRights)
+		{
+			auto b = BoardState::FromFen("r3k2r/8/8/8/8/8/8/R3K2R w Kq - 12 40");
+			Assert::IsTrue(b.HasCastlingRight(SideType::White, true));
+			Assert::IsFalse(b.HasCastlingRight(SideType::White, false));
+			Assert::IsFalse(b.HasCastlingRight(SideType::Black, true));
+			Assert::IsTrue(b.HasCastlingRight(SideType::Black, false));
+			Assert::AreEqual(12, b.HalfmoveClock());
+			Assert::IsTrue(b.CanMove("e1", "g1"));
+			Assert::IsFalse(b.CanMove("e1", "c1"));
+		}
 	};
 }
\ No newline at end of file